@@ -3,23 +3,499 @@
 #include <string>
 #include <algorithm>
 #include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <optional>
+#include <array>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <functional>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <malloc.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 
 using namespace std;
 
+// Wall-clock milliseconds; comparable across processes.
+static int64_t nowMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Little-endian fields of the binary formats (ingest frames, log records, snapshots)
+static void putLE16(string& out, uint16_t v) {
+    out += static_cast<char>(v & 0xFF);
+    out += static_cast<char>(v >> 8);
+}
+
+static void putLE32(string& out, uint32_t v) {
+    for (int i = 0; i < 4; i++) out += static_cast<char>((v >> (8 * i)) & 0xFF);
+}
+
+static uint16_t readLE16(const char* p) {
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint16_t>(b[0] | (b[1] << 8));
+}
+
+static uint32_t readLE32(const char* p) {
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+           (static_cast<uint32_t>(b[2]) << 16) | (static_cast<uint32_t>(b[3]) << 24);
+}
+
+static void putLE64(string& out, uint64_t v) {
+    for (int i = 0; i < 8; i++) out += static_cast<char>((v >> (8 * i)) & 0xFF);
+}
+
+static uint64_t readLE64(const char* p) {
+    return static_cast<uint64_t>(readLE32(p)) | (static_cast<uint64_t>(readLE32(p + 4)) << 32);
+}
+
+// Length-prefixed strings; u16 lengths truncate longer values.
+static void putString16(string& out, string_view s) {
+    s = s.substr(0, UINT16_MAX);
+    putLE16(out, static_cast<uint16_t>(s.size()));
+    out += s;
+}
+
+static void putString32(string& out, string_view s) {
+    putLE32(out, static_cast<uint32_t>(s.size()));
+    out += s;
+}
+
+static bool readString(string_view in, size_t& pos, size_t lengthBytes, string& out) {
+    if (in.size() - pos < lengthBytes) return false;
+    size_t n = lengthBytes == 2 ? readLE16(in.data() + pos) : readLE32(in.data() + pos);
+    pos += lengthBytes;
+    if (in.size() - pos < n) return false;
+    out.assign(in.substr(pos, n));
+    pos += n;
+    return true;
+}
+
+static bool readU8(string_view in, size_t& pos, uint8_t& v) {
+    if (in.size() - pos < 1) return false;
+    v = static_cast<uint8_t>(in[pos++]);
+    return true;
+}
+
+static bool readU32(string_view in, size_t& pos, uint32_t& v) {
+    if (in.size() - pos < 4) return false;
+    v = readLE32(in.data() + pos);
+    pos += 4;
+    return true;
+}
+
+static bool readU64(string_view in, size_t& pos, uint64_t& v) {
+    if (in.size() - pos < 8) return false;
+    v = readLE64(in.data() + pos);
+    pos += 8;
+    return true;
+}
+
+// Under overload low-priority traffic is shed first and high-priority last.
+enum class NotificationPriority : uint8_t {
+    Low = 0,
+    Normal = 1,
+    High = 2
+};
+
+// Routing metadata carried alongside the content
+struct NotificationMeta {
+    string id;
+    string type;
+    string userId;
+    vector<string> mutedChannels;
+    string tenantId;
+    NotificationPriority priority = NotificationPriority::Normal;
+    int64_t expiresAtMs = 0; // wall clock (nowMs), 0 never expires
+    string locale; // BCP 47 tag such as "pt-BR"; empty uses the default formats
+    string signature; // hex HMAC-SHA256 of the content, set by SigningStrategy
+    string templateName; // template the content was rendered from, if any
+    uint64_t historySeq = 0; // history record number + 1 in this process, once recorded; not persisted
+
+    bool isMuted(string_view channel) const {
+        for (auto& c : mutedChannels) if (c == channel) return true;
+        return false;
+    }
+
+    bool isExpired(int64_t now) const {
+        return expiresAtMs != 0 && now >= expiresAtMs;
+    }
+
+    // priority u8 | expiresAtMs u64 | id, type, userId, tenantId, locale, signature, templateName (u16 strings) |
+    // muted u16 + u16 strings
+    void saveState(string& out) const {
+        out += static_cast<char>(priority);
+        putLE64(out, static_cast<uint64_t>(expiresAtMs));
+        for (const string* f : {&id, &type, &userId, &tenantId, &locale, &signature, &templateName}) putString16(out, *f);
+        size_t muted = min<size_t>(mutedChannels.size(), UINT16_MAX);
+        putLE16(out, static_cast<uint16_t>(muted));
+        for (size_t i = 0; i < muted; i++) putString16(out, mutedChannels[i]);
+    }
+
+    bool loadState(string_view in, size_t& pos) {
+        uint8_t p;
+        uint64_t expires;
+        if (!readU8(in, pos, p) || !readU64(in, pos, expires)) return false;
+        priority = static_cast<NotificationPriority>(p);
+        expiresAtMs = static_cast<int64_t>(expires);
+        for (string* f : {&id, &type, &userId, &tenantId, &locale, &signature, &templateName})
+            if (!readString(in, pos, 2, *f)) return false;
+        if (in.size() - pos < 2) return false;
+        mutedChannels.resize(readLE16(in.data() + pos));
+        pos += 2;
+        for (auto& c : mutedChannels)
+            if (!readString(in, pos, 2, c)) return false;
+        return true;
+    }
+};
+
 class INotification {
 public:
     virtual string getContent() const = 0;
+    // Rendered size in bytes; used to account queued memory without rendering.
+    virtual size_t contentSize() const {
+        return getContent().size();
+    }
+    virtual const NotificationMeta& getMeta() const {
+        static const NotificationMeta empty;
+        return empty;
+    }
+    // Renders into a caller-owned buffer so its capacity can be reused.
+    virtual void renderTo(string& out) const {
+        out = getContent();
+    }
+    // Lets the service stamp its history record number before dispatch; null without metadata.
+    virtual NotificationMeta* mutableMeta() {
+        return nullptr;
+    }
     virtual ~INotification() = default;
 };
 
 class SimpleNotification : public INotification {
 private:
     string text;
+    NotificationMeta meta;
 public:
     SimpleNotification(const string& msg) : text(msg) {}
+    SimpleNotification(string msg, NotificationMeta meta)
+        : text(std::move(msg)), meta(std::move(meta)) {}
     string getContent() const override {
         return text;
     }
+    size_t contentSize() const override {
+        return text.size();
+    }
+    const NotificationMeta& getMeta() const override {
+        return meta;
+    }
+    NotificationMeta* mutableMeta() override {
+        return &meta;
+    }
+};
+
+// Conventions of one locale. Date patterns use %Y %m %d %H %I %M %S %p %b;
+// numbers are grouped by `grouping` digits, then `secondaryGrouping` (e.g.
+// 12,34,567 for hi-IN) when it is non-zero.
+struct LocaleSpec {
+    string datePattern = "%Y-%m-%d %H:%M:%S";
+    string decimalSeparator = ".";
+    string groupSeparator = ",";
+    uint8_t grouping = 3;
+    uint8_t secondaryGrouping = 0;
+    array<string, 12> monthNames{"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    array<string, 2> dayPeriods{"AM", "PM"};
+};
+
+// A LocaleSpec compiled for formatting: the date pattern is parsed once into
+// ops, and every format writes into a caller-supplied buffer. Times are UTC.
+class LocaleFormatter {
+public:
+    static constexpr size_t kMaxFormatted = 96; // buffer size for one format call
+
+private:
+    enum class DateField : uint8_t { Literal, Year, Month, Day, Hour24, Hour12, Minute, Second, DayPeriod, MonthName };
+    struct DateOp {
+        DateField field;
+        string literal;
+    };
+
+    string locale;
+    LocaleSpec spec;
+    vector<DateOp> dateOps;
+
+    static size_t putPadded(char* p, int value, int width) {
+        char digits[12];
+        size_t n = 0;
+        do {
+            digits[n++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value > 0);
+        size_t len = 0;
+        for (int pad = width - static_cast<int>(n); pad > 0; pad--) p[len++] = '0';
+        while (n > 0) p[len++] = digits[--n];
+        return len;
+    }
+
+    static size_t put(char* p, size_t len, string_view s) {
+        size_t n = min(s.size(), kMaxFormatted - len);
+        memcpy(p + len, s.data(), n);
+        return len + n;
+    }
+
+public:
+    LocaleFormatter(string locale, LocaleSpec s) : locale(std::move(locale)), spec(std::move(s)) {
+        string_view pattern = spec.datePattern;
+        for (size_t i = 0; i < pattern.size(); i++) {
+            DateField field = DateField::Literal;
+            if (pattern[i] == '%' && i + 1 < pattern.size()) {
+                switch (pattern[i + 1]) {
+                case 'Y': field = DateField::Year; break;
+                case 'm': field = DateField::Month; break;
+                case 'd': field = DateField::Day; break;
+                case 'H': field = DateField::Hour24; break;
+                case 'I': field = DateField::Hour12; break;
+                case 'M': field = DateField::Minute; break;
+                case 'S': field = DateField::Second; break;
+                case 'p': field = DateField::DayPeriod; break;
+                case 'b': field = DateField::MonthName; break;
+                default: break;
+                }
+            }
+            if (field != DateField::Literal) {
+                dateOps.push_back({field, {}});
+                i++;
+            } else if (!dateOps.empty() && dateOps.back().field == DateField::Literal) {
+                dateOps.back().literal += pattern[i];
+            } else {
+                dateOps.push_back({DateField::Literal, string(1, pattern[i])});
+            }
+        }
+    }
+
+    const string& getLocale() const { return locale; }
+
+    // Writes at most kMaxFormatted bytes to p and returns the length.
+    size_t formatTimestamp(int64_t ms, char* p) const {
+        // Civil date from days since the epoch (Hinnant's algorithm); gmtime_r
+        // costs more than the rest of the formatting together.
+        int64_t seconds = ms / 1000 - (ms % 1000 < 0);
+        int64_t days = seconds / 86400 - (seconds % 86400 < 0);
+        int64_t secondOfDay = seconds - days * 86400;
+        int64_t z = days + 719468;
+        int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+        int64_t doe = z - era * 146097;
+        int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        int64_t mp = (5 * doy + 2) / 153;
+        tm t{};
+        t.tm_mday = static_cast<int>(doy - (153 * mp + 2) / 5 + 1);
+        t.tm_mon = static_cast<int>(mp < 10 ? mp + 2 : mp - 10);
+        t.tm_year = static_cast<int>(yoe + era * 400 + (t.tm_mon <= 1) - 1900);
+        t.tm_hour = static_cast<int>(secondOfDay / 3600);
+        t.tm_min = static_cast<int>(secondOfDay / 60 % 60);
+        t.tm_sec = static_cast<int>(secondOfDay % 60);
+        size_t len = 0;
+        for (auto& op : dateOps) {
+            if (len + 8 > kMaxFormatted) break;
+            switch (op.field) {
+            case DateField::Literal: len = put(p, len, op.literal); break;
+            case DateField::Year: len += putPadded(p + len, t.tm_year + 1900, 4); break;
+            case DateField::Month: len += putPadded(p + len, t.tm_mon + 1, 2); break;
+            case DateField::Day: len += putPadded(p + len, t.tm_mday, 2); break;
+            case DateField::Hour24: len += putPadded(p + len, t.tm_hour, 2); break;
+            case DateField::Hour12: len += putPadded(p + len, t.tm_hour % 12 == 0 ? 12 : t.tm_hour % 12, 2); break;
+            case DateField::Minute: len += putPadded(p + len, t.tm_min, 2); break;
+            case DateField::Second: len += putPadded(p + len, t.tm_sec, 2); break;
+            case DateField::DayPeriod: len = put(p, len, spec.dayPeriods[t.tm_hour < 12 ? 0 : 1]); break;
+            case DateField::MonthName: len = put(p, len, spec.monthNames[t.tm_mon]); break;
+            }
+        }
+        return len;
+    }
+
+    // Regroups a plain decimal ("-1234567.5") with this locale's separators.
+    // Anything else is copied unchanged (truncated to kMaxFormatted).
+    size_t formatNumber(string_view value, char* p) const {
+        string_view v = value;
+        bool negative = !v.empty() && v[0] == '-';
+        if (negative) v.remove_prefix(1);
+        size_t point = v.find('.');
+        string_view whole = v.substr(0, point);
+        string_view fraction = point == string_view::npos ? string_view() : v.substr(point + 1);
+        bool numeric = !whole.empty() && whole.size() <= 30 && fraction.size() <= 20 &&
+                       (point == string_view::npos || !fraction.empty());
+        for (char c : whole) numeric = numeric && c >= '0' && c <= '9';
+        for (char c : fraction) numeric = numeric && c >= '0' && c <= '9';
+        if (!numeric) return put(p, 0, value);
+
+        size_t len = negative ? put(p, 0, "-") : 0;
+        // A separator goes before a digit with `first`, `first + rest`, ... digits from it to the point.
+        size_t first = spec.grouping ? spec.grouping : whole.size();
+        size_t rest = spec.secondaryGrouping ? spec.secondaryGrouping : first;
+        for (size_t i = 0; i < whole.size(); i++) {
+            size_t right = whole.size() - i;
+            if (i > 0 && right >= first && (right - first) % rest == 0) len = put(p, len, spec.groupSeparator);
+            if (len < kMaxFormatted) p[len++] = whole[i];
+        }
+        if (!fraction.empty()) {
+            len = put(p, len, spec.decimalSeparator);
+            len = put(p, len, fraction);
+        }
+        return len;
+    }
+};
+
+// Compiled formatters by locale. Lookups resolve "de-AT" -> "de" -> default
+// once and remember the answer, so switching locale per message is a single
+// hash lookup; formatters are never freed, so references stay valid.
+class LocaleRegistry {
+private:
+    static constexpr size_t kMaxAliases = 1024; // unknown tags are cached up to this many
+
+    // Readers use an immutable table; writers copy it, edit the copy and
+    // publish it under a new version.
+    struct Table {
+        unordered_map<string, shared_ptr<const LocaleFormatter>> formatters; // includes aliases
+        size_t aliases = 0;
+    };
+
+    mutable mutex lock; // serializes writers and guards `current`
+    mutable shared_ptr<const Table> current = make_shared<const Table>();
+    mutable atomic<uint64_t> version{1};
+    vector<shared_ptr<const LocaleFormatter>> retired; // replaced by define(), may still be referenced
+
+    // Caller holds `lock`.
+    void publish(shared_ptr<const Table> table) const {
+        current = std::move(table);
+        version.fetch_add(1, memory_order_release);
+    }
+
+    LocaleRegistry() {
+        define("", LocaleSpec());
+        LocaleSpec us;
+        us.datePattern = "%b %d, %Y %I:%M %p";
+        define("en-US", us);
+        LocaleSpec gb;
+        gb.datePattern = "%d/%m/%Y %H:%M";
+        define("en-GB", gb);
+        LocaleSpec de;
+        de.datePattern = "%d.%m.%Y %H:%M";
+        de.decimalSeparator = ",";
+        de.groupSeparator = ".";
+        define("de", de);
+        LocaleSpec fr;
+        fr.datePattern = "%d/%m/%Y %H:%M";
+        fr.decimalSeparator = ",";
+        fr.groupSeparator = "\xe2\x80\xaf"; // narrow no-break space
+        define("fr", fr);
+        LocaleSpec es = de;
+        es.datePattern = "%d/%m/%Y %H:%M";
+        define("es", es);
+        define("pt", es);
+        LocaleSpec ja;
+        ja.datePattern = "%Y/%m/%d %H:%M";
+        define("ja", ja);
+        LocaleSpec hi;
+        hi.datePattern = "%d/%m/%Y %I:%M %p";
+        hi.secondaryGrouping = 2;
+        define("hi", hi);
+    }
+
+public:
+    static LocaleRegistry& getInstance() {
+        static LocaleRegistry instance;
+        return instance;
+    }
+
+    LocaleRegistry(const LocaleRegistry&) = delete;
+    LocaleRegistry& operator=(const LocaleRegistry&) = delete;
+
+    // Adds or replaces a locale; cached fallbacks are re-resolved.
+    void define(const string& locale, LocaleSpec spec) {
+        auto formatter = make_shared<const LocaleFormatter>(locale, std::move(spec));
+        lock_guard<mutex> guard(lock);
+        auto table = make_shared<Table>();
+        for (auto& entry : current->formatters) {
+            if (entry.first == entry.second->getLocale() && entry.first != locale) table->formatters.insert(entry);
+        }
+        auto old = current->formatters.find(locale);
+        if (old != current->formatters.end() && old->second->getLocale() == locale) retired.push_back(old->second);
+        table->formatters.emplace(locale, std::move(formatter));
+        publish(std::move(table));
+    }
+
+    // Lock-free unless the table changed since this thread last looked, or
+    // the tag is new and gets cached as an alias.
+    const LocaleFormatter& find(string_view locale) const {
+        thread_local shared_ptr<const Table> seen;
+        thread_local uint64_t seenVersion = 0;
+        thread_local string key;
+        if (version.load(memory_order_acquire) != seenVersion) {
+            lock_guard<mutex> guard(lock);
+            seen = current;
+            seenVersion = version.load(memory_order_relaxed);
+        }
+        key.assign(locale);
+        auto it = seen->formatters.find(key);
+        if (it != seen->formatters.end()) return *it->second;
+        string_view tag = locale;
+        shared_ptr<const LocaleFormatter> resolved;
+        while (!resolved) {
+            size_t dash = tag.find('-');
+            tag = dash == string_view::npos ? string_view() : tag.substr(0, dash);
+            auto fallback = seen->formatters.find(string(tag));
+            if (fallback != seen->formatters.end()) resolved = fallback->second;
+        }
+        if (seen->aliases >= kMaxAliases) return *resolved;
+        lock_guard<mutex> guard(lock);
+        // Skipped if a writer got in first; the next call resolves against its table.
+        if (current == seen) {
+            auto table = make_shared<Table>(*current);
+            table->aliases++;
+            table->formatters.emplace(key, resolved);
+            publish(std::move(table));
+        }
+        return *resolved;
+    }
 };
 
 class INotificationDecorator : public INotification {
@@ -28,15 +504,34 @@ protected:
 public:
     INotificationDecorator(unique_ptr<INotification> n)
         : notification(std::move(n)) {}
+
+    const NotificationMeta& getMeta() const override {
+        return notification->getMeta();
+    }
+    NotificationMeta* mutableMeta() override {
+        return notification->mutableMeta();
+    }
 };
 
+// Prefixes the creation time, formatted for the recipient's locale
 class TimestampDecorator : public INotificationDecorator {
+private:
+    int64_t createdAtMs;
 public:
-    TimestampDecorator(unique_ptr<INotification> n)
-        : INotificationDecorator(std::move(n)) {}
+    TimestampDecorator(unique_ptr<INotification> n, int64_t createdAtMs = nowMs())
+        : INotificationDecorator(std::move(n)), createdAtMs(createdAtMs) {}
 
     string getContent() const override {
-        return "[2025-10-26 10:45:00] " + notification->getContent();
+        char stamp[LocaleFormatter::kMaxFormatted];
+        size_t len = LocaleRegistry::getInstance().find(getMeta().locale).formatTimestamp(createdAtMs, stamp);
+        string content = notification->getContent();
+        string out;
+        out.reserve(len + 3 + content.size());
+        out += '[';
+        out.append(stamp, len);
+        out += "] ";
+        out += content;
+        return out;
     }
 };
 
@@ -52,10 +547,244 @@ public:
     }
 };
 
+static string_view trim(string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+// Template variables as (name, value) pairs; templates have few variables, so
+// a linear scan beats hashing.
+using TemplateVars = vector<pair<string, string>>;
+
+// A template such as "{{actor}} liked your post", parsed once into literal and
+// variable ops. "{{count:number}}" and "{{sentAt:datetime}}" (epoch ms) are
+// formatted for the recipient's locale. Rendering appends the pieces to a
+// reused buffer, so once it has grown to fit nothing is allocated.
+class CompiledTemplate {
+public:
+    static constexpr size_t kMaxVariables = 32;
+
+private:
+    enum class OpKind : uint8_t { Literal, Text, Number, DateTime };
+    struct Op {
+        OpKind kind;
+        uint32_t offset; // into `literals`, or the variable slot
+        uint32_t length; // literals only
+    };
+
+    string name;
+    string locale;
+    uint64_t version;
+    string literals;
+    vector<string> variables; // slot -> name
+    vector<Op> ops;
+
+    // Slot -> value for this render, or nullptr when vars lacks it.
+    void bind(const TemplateVars& vars, array<const string*, kMaxVariables>& values) const {
+        for (size_t slot = 0; slot < variables.size(); slot++) {
+            values[slot] = nullptr;
+            for (auto& v : vars) {
+                if (v.first == variables[slot]) {
+                    values[slot] = &v.second;
+                    break;
+                }
+            }
+        }
+    }
+
+    static bool parseEpochMs(string_view s, int64_t& ms) {
+        if (s.empty() || s.size() > 15) return false;
+        ms = 0;
+        for (char c : s) {
+            if (c < '0' || c > '9') return false;
+            ms = ms * 10 + (c - '0');
+        }
+        return true;
+    }
+
+    // One op's bytes: a view of the template or the value, or formatted into scratch.
+    string_view piece(const Op& op, const array<const string*, kMaxVariables>& values,
+                      const LocaleFormatter& formatter, char* scratch) const {
+        if (op.kind == OpKind::Literal) return string_view(literals.data() + op.offset, op.length);
+        const string* value = values[op.offset];
+        if (!value) return {};
+        int64_t ms;
+        switch (op.kind) {
+        case OpKind::Number: return string_view(scratch, formatter.formatNumber(*value, scratch));
+        case OpKind::DateTime:
+            if (parseEpochMs(*value, ms)) return string_view(scratch, formatter.formatTimestamp(ms, scratch));
+            return *value;
+        default: return *value;
+        }
+    }
+
+public:
+    // Throws invalid_argument for an unterminated or empty "{{...}}" or an unknown format.
+    CompiledTemplate(string name, string locale, uint64_t version, string_view source)
+        : name(std::move(name)), locale(std::move(locale)), version(version) {
+        literals.reserve(source.size());
+        size_t pos = 0;
+        while (pos < source.size()) {
+            size_t open = source.find("{{", pos);
+            size_t end = open == string_view::npos ? source.size() : open;
+            if (end > pos) {
+                ops.push_back({OpKind::Literal, static_cast<uint32_t>(literals.size()), static_cast<uint32_t>(end - pos)});
+                literals.append(source.substr(pos, end - pos));
+            }
+            if (open == string_view::npos) break;
+            size_t close = source.find("}}", open + 2);
+            if (close == string_view::npos)
+                throw invalid_argument("unterminated {{ at offset " + to_string(open));
+            string_view var = trim(source.substr(open + 2, close - open - 2));
+            OpKind kind = OpKind::Text;
+            size_t colon = var.find(':');
+            if (colon != string_view::npos) {
+                string_view format = trim(var.substr(colon + 1));
+                if (format == "number") kind = OpKind::Number;
+                else if (format == "datetime") kind = OpKind::DateTime;
+                else throw invalid_argument("unknown format '" + string(format) + "' at offset " + to_string(open));
+                var = trim(var.substr(0, colon));
+            }
+            if (var.empty()) throw invalid_argument("empty variable at offset " + to_string(open));
+            auto it = find(variables.begin(), variables.end(), var);
+            if (it == variables.end()) {
+                if (variables.size() == kMaxVariables) throw invalid_argument("too many variables");
+                it = variables.emplace(variables.end(), var);
+            }
+            ops.push_back({kind, static_cast<uint32_t>(it - variables.begin()), 0});
+            pos = close + 2;
+        }
+    }
+
+    const string& getName() const { return name; }
+    const string& getLocale() const { return locale; }
+    uint64_t getVersion() const { return version; }
+    const vector<string>& getVariables() const { return variables; }
+
+    // First variable vars has no value for, or empty if all are bound.
+    string_view missingVariable(const TemplateVars& vars) const {
+        array<const string*, kMaxVariables> values;
+        bind(vars, values);
+        for (size_t slot = 0; slot < variables.size(); slot++) {
+            if (!values[slot]) return variables[slot];
+        }
+        return {};
+    }
+
+    size_t renderedSize(const TemplateVars& vars, const LocaleFormatter& formatter) const {
+        array<const string*, kMaxVariables> values;
+        bind(vars, values);
+        char scratch[LocaleFormatter::kMaxFormatted];
+        size_t size = 0;
+        for (auto& op : ops) size += piece(op, values, formatter, scratch).size();
+        return size;
+    }
+
+    // Replaces out with the rendering; unbound variables render empty.
+    void render(const TemplateVars& vars, const LocaleFormatter& formatter, string& out) const {
+        array<const string*, kMaxVariables> values;
+        bind(vars, values);
+        char scratch[LocaleFormatter::kMaxFormatted];
+        out.clear();
+        for (auto& op : ops) out.append(piece(op, values, formatter, scratch));
+    }
+};
+
+// Notification rendered from a template on demand, formatted for meta.locale.
+// It keeps the compiled version it was created with, so a reload does not
+// change queued messages.
+class TemplateNotification : public INotification {
+private:
+    shared_ptr<const CompiledTemplate> compiled;
+    shared_ptr<const TemplateVars> vars; // shared by every recipient of a send
+    NotificationMeta meta;
+    const LocaleFormatter& formatter;
+public:
+    TemplateNotification(shared_ptr<const CompiledTemplate> compiled, shared_ptr<const TemplateVars> vars,
+                         NotificationMeta meta)
+        : compiled(std::move(compiled)), vars(std::move(vars)), meta(std::move(meta)),
+          formatter(LocaleRegistry::getInstance().find(this->meta.locale)) {}
+
+    string getContent() const override {
+        string out;
+        compiled->render(*vars, formatter, out);
+        return out;
+    }
+    void renderTo(string& out) const override {
+        compiled->render(*vars, formatter, out);
+    }
+    size_t contentSize() const override {
+        return compiled->renderedSize(*vars, formatter);
+    }
+    const NotificationMeta& getMeta() const override {
+        return meta;
+    }
+    NotificationMeta* mutableMeta() override {
+        return &meta;
+    }
+};
+
+// Compiled templates by (name, locale). publish() compiles before taking the
+// lock and swaps the entry in, so a hot reload never stalls rendering and a
+// bad edit leaves the previous version serving.
+class TemplateRegistry {
+private:
+    mutable mutex lock;
+    unordered_map<string, shared_ptr<const CompiledTemplate>> templates; // "name\0locale"
+
+    static void makeKey(string& key, string_view name, string_view locale) {
+        key.assign(name);
+        key += '\0';
+        key.append(locale);
+    }
+
+public:
+    // Returns the new version; throws invalid_argument if source does not compile.
+    uint64_t publish(const string& name, const string& locale, string_view source) {
+        string key;
+        makeKey(key, name, locale);
+        uint64_t version;
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = templates.find(key);
+            version = it == templates.end() ? 1 : it->second->getVersion() + 1;
+        }
+        auto compiled = make_shared<const CompiledTemplate>(name, locale, version, source);
+        lock_guard<mutex> guard(lock);
+        auto& slot = templates[key];
+        // A concurrent publish of the same template may have won the race.
+        if (slot && slot->getVersion() >= version) return slot->getVersion();
+        slot = std::move(compiled);
+        return version;
+    }
+
+    // Exact locale, then its language ("pt-BR" -> "pt"), then the default ("").
+    shared_ptr<const CompiledTemplate> find(string_view name, string_view locale = {}) const {
+        thread_local string key;
+        lock_guard<mutex> guard(lock);
+        while (true) {
+            makeKey(key, name, locale);
+            auto it = templates.find(key);
+            if (it != templates.end()) return it->second;
+            if (locale.empty()) return nullptr;
+            size_t dash = locale.find('-');
+            locale = dash == string_view::npos ? string_view() : locale.substr(0, dash);
+        }
+    }
+
+    size_t size() const {
+        lock_guard<mutex> guard(lock);
+        return templates.size();
+    }
+};
+
 // Observer Interfaces
 class IObserver {
 public:
     virtual void update() = 0;
+    // Called after the last update of a batch, so observers can flush once per batch.
+    virtual void batchEnd() {}
     virtual ~IObserver() = default;
 };
 
@@ -104,6 +833,14 @@ public:
         notifyObservers();
     }
 
+    void endBatch() {
+        for (auto &w : observers) {
+            if (auto obs = w.lock()) {
+                obs->batchEnd();
+            }
+        }
+    }
+
     shared_ptr<INotification> getNotification() {
         return currentNotification;
     }
@@ -113,112 +850,10202 @@ public:
     }
 };
 
-// Singleton NotificationService
-class NotificationService {
+// User profile (Users table in the README)
+struct UserProfile {
+    string id;
+    string name;
+    bool emailEnabled = true;
+    bool pushEnabled = true;
+};
+
+// Scheduling share of one tenant: `weight` notifications per round, plus
+// `burst` extra on the first round after the tenant has been idle.
+struct TenantPolicy {
+    uint32_t weight = 1;
+    uint32_t burst = 0;
+};
+
+// Deficit round-robin over per-tenant FIFOs, so one tenant's blast cannot
+// starve the others. Every notification costs one credit.
+class TenantFairQueue {
 private:
-    NotificationObservable observable;
-    vector<shared_ptr<INotification>> notifications;
+    struct Tenant {
+        deque<shared_ptr<INotification>> items;
+        TenantPolicy policy;
+        bool customPolicy = false;
+        int64_t deficit = 0;
+        bool burstAvailable = true;
+    };
 
-    NotificationService() = default;
+    unordered_map<string, Tenant> tenants;
+    deque<Tenant*> active; // tenants with queued items, in service order
+    TenantPolicy defaults;
+    size_t count = 0;
 
 public:
-    static NotificationService& getInstance() {
-        static NotificationService instance;
-        return instance;
+    void setDefaultPolicy(TenantPolicy policy) {
+        defaults = policy;
+        for (auto& t : tenants) {
+            if (!t.second.customPolicy) t.second.policy = policy;
+        }
     }
 
-    NotificationObservable* getObservable() {
-        return &observable;
+    void setPolicy(const string& tenantId, TenantPolicy policy) {
+        Tenant& t = tenants[tenantId];
+        t.policy = policy;
+        t.customPolicy = true;
     }
 
-    void sendNotification(shared_ptr<INotification> notification) {
-        notifications.push_back(notification);
-        observable.setNotification(notification);
+    void push(shared_ptr<INotification> notification) {
+        const string& tenantId = notification->getMeta().tenantId;
+        auto it = tenants.find(tenantId);
+        if (it == tenants.end()) {
+            it = tenants.emplace(tenantId, Tenant()).first;
+            it->second.policy = defaults;
+        }
+        Tenant& t = it->second;
+        if (t.items.empty()) active.push_back(&t);
+        t.items.push_back(std::move(notification));
+        count++;
     }
-};
 
-// Logger
-class Logger : public IObserver, public enable_shared_from_this<Logger> {
-private:
-    NotificationObservable* observable;
-
-public:
-    Logger() {
-        observable = &NotificationService::getInstance().getObservable()[0];
+    shared_ptr<INotification> pop() {
+        if (active.empty()) return nullptr;
+        Tenant* t = active.front();
+        if (t->deficit <= 0) {
+            t->deficit += max<uint32_t>(1, t->policy.weight);
+            if (t->burstAvailable) t->deficit += t->policy.burst;
+            t->burstAvailable = false;
+        }
+        auto item = std::move(t->items.front());
+        t->items.pop_front();
+        t->deficit--;
+        count--;
+        if (t->items.empty()) {
+            // Idle tenants keep no credit but earn their burst back, which is
+            // also what a new entry starts with; so drop the entry unless it
+            // carries a policy, or every tenant id ever seen would stay mapped.
+            t->deficit = 0;
+            t->burstAvailable = true;
+            active.pop_front();
+            if (!t->customPolicy) tenants.erase(item->getMeta().tenantId);
+        } else if (t->deficit <= 0) {
+            active.pop_front();
+            active.push_back(t);
+        }
+        return item;
     }
 
-    void subscribe() {
-        observable->addObserver(shared_from_this());
+    size_t size() const {
+        return count;
     }
 
-    void update() override {
-        cout << "\n[Logger] New Notification Logged:\n"
-             << observable->getNotificationContent();
+    size_t depth(const string& tenantId) const {
+        auto it = tenants.find(tenantId);
+        return it == tenants.end() ? 0 : it->second.items.size();
     }
-};
 
-// Strategy Interface
-class INotificationStrategy {
-public:
-    virtual void sendNotification(const string& content) = 0;
-    virtual ~INotificationStrategy() = default;
-};
+    // Tenants with queued items or an explicit policy.
+    size_t tenantCount() const {
+        return tenants.size();
+    }
 
-class EmailStrategy : public INotificationStrategy {
-private:
-    string emailId;
-public:
-    EmailStrategy(string emailId) : emailId(std::move(emailId)) {}
+    // Queued items in service order, rendered:
+    //   tenants u32 + (tenantId u16 string | deficit u64 | burstAvailable u8 | items u32 + (meta | content u32 string))
+    // Policies are configuration and are not saved.
+    void saveState(string& out) const {
+        putLE32(out, static_cast<uint32_t>(active.size()));
+        string content;
+        for (const Tenant* t : active) {
+            putString16(out, t->items.front()->getMeta().tenantId);
+            putLE64(out, static_cast<uint64_t>(t->deficit));
+            out += static_cast<char>(t->burstAvailable);
+            putLE32(out, static_cast<uint32_t>(t->items.size()));
+            for (auto& item : t->items) {
+                item->getMeta().saveState(out);
+                item->renderTo(content);
+                putString32(out, content);
+            }
+        }
+    }
 
-    void sendNotification(const string& content) override {
-        cout << "\n[Email] Sent to " << emailId << ":\n" << content;
+    // Queues the saved items again, in their old order and with their tenants'
+    // credit; `restored` receives them for the caller's accounting.
+    bool loadState(string_view in, size_t& pos, vector<shared_ptr<INotification>>& restored) {
+        uint32_t tenantCount;
+        if (!readU32(in, pos, tenantCount)) return false;
+        string tenantId;
+        string content;
+        for (uint32_t i = 0; i < tenantCount; i++) {
+            uint64_t deficit;
+            uint8_t burstAvailable;
+            uint32_t itemCount;
+            if (!readString(in, pos, 2, tenantId) || !readU64(in, pos, deficit) || !readU8(in, pos, burstAvailable) ||
+                !readU32(in, pos, itemCount))
+                return false;
+            for (uint32_t j = 0; j < itemCount; j++) {
+                NotificationMeta meta;
+                if (!meta.loadState(in, pos) || !readString(in, pos, 4, content)) return false;
+                auto item = make_shared<SimpleNotification>(std::move(content), std::move(meta));
+                push(item);
+                restored.push_back(std::move(item));
+            }
+            auto it = tenants.find(tenantId);
+            if (it == tenants.end()) continue;
+            it->second.deficit = static_cast<int64_t>(deficit);
+            it->second.burstAvailable = burstAvailable != 0;
+        }
+        return true;
     }
 };
 
-class SMSStrategy : public INotificationStrategy {
-private:
-    string mobileNumber;
-public:
-    SMSStrategy(string mobileNumber) : mobileNumber(std::move(mobileNumber)) {}
+// Limits on queued work; 0 disables a limit.
+struct AdmissionLimits {
+    size_t maxPending = 0;       // queued notifications
+    size_t maxPendingBytes = 0;  // estimated memory held by queued notifications
+    size_t maxHeapBytes = 0;     // heap in use per the allocator: queue, history, tenant state and the rest
+    int64_t maxQueueDelayMs = 0; // queue depth over the measured drain rate
+};
 
-    void sendNotification(const string& content) override {
-        cout << "\n[SMS] Sent to " << mobileNumber << ":\n" << content;
-    }
+struct AdmissionDecision {
+    bool admitted = true;
+    int64_t retryAfterMs = 0;
+    const char* reason = "";
 };
 
-class PopUpStrategy : public INotificationStrategy {
-public:
-    void sendNotification(const string& content) override {
-        cout << "\n[Popup] Notification displayed:\n" << content;
-    }
+struct AdmissionStats {
+    size_t pending;
+    size_t pendingBytes;
+    size_t heapBytes; // last allocator sample, 0 without a heap limit
+    double drainPerSecond;
+    uint64_t admitted;
+    array<uint64_t, 3> shed; // indexed by NotificationPriority
 };
 
-// Engine
-class NotificationEngine : public IObserver, public enable_shared_from_this<NotificationEngine> {
+// Admission control in front of the queue. Every limit is scaled by the
+// priority's share, so as the backlog grows low-priority traffic is refused
+// first (half of each limit), then normal traffic, and high-priority traffic
+// only once the queue is full. A refusal carries a retry-after: the time the
+// measured drain rate needs to work off the excess.
+class AdmissionController {
 private:
-    NotificationObservable* observable;
-    vector<unique_ptr<INotificationStrategy>> strategies;
+    static constexpr array<double, 3> kShare = {0.5, 0.85, 1.0};
+    static constexpr size_t kItemOverhead = 192; // control block, object, meta strings, queue slot
+    static constexpr int64_t kRateWindowMs = 250;
+    static constexpr int64_t kUnknownRateRetryMs = 1000;
+    static constexpr int64_t kMaxRetryMs = 60000;
+    static constexpr int64_t kHeapSampleMs = 100;
 
-public:
-    NotificationEngine() {
-        observable = NotificationService::getInstance().getObservable();
+    AdmissionLimits limits;
+    size_t pendingItems = 0;
+    size_t pendingBytes = 0;
+    size_t heapBytes = 0;
+    int64_t heapSampledMs = 0;
+    double drainRate = 0; // notifications per second while backlogged
+    int64_t windowStartMs = 0;
+    uint64_t windowDrained = 0;
+    uint64_t admitted = 0;
+    array<uint64_t, 3> shed{};
+
+    static int64_t steadyMs() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
     }
 
-    void subscribe() {
-        observable->addObserver(shared_from_this());
+    // Bytes the allocator has handed out and not had back, mmapped chunks
+    // included. Unlike RSS this falls again once memory is freed. Without
+    // mallinfo2 (glibc before 2.33, other libcs) it falls back to resident
+    // pages not backed by a file, which only approximates the heap.
+    static size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+        struct mallinfo2 info = mallinfo2();
+        return info.uordblks + info.hblkhd;
+#else
+        int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return 0;
+        char text[128];
+        ssize_t n = read(fd, text, sizeof(text));
+        close(fd);
+        if (n <= 0) return 0;
+        // Fields: size resident shared ..., in pages.
+        string fields(text, n);
+        size_t first = fields.find(' '), second = fields.find(' ', first + 1);
+        if (second == string::npos) return 0;
+        size_t resident = stoull(fields.substr(first + 1)), shared = stoull(fields.substr(second + 1));
+        return resident > shared ? (resident - shared) * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#endif
     }
 
-    void addNotificationStrategy(unique_ptr<INotificationStrategy> ns) {
-        strategies.push_back(std::move(ns));
+public:
+    static size_t footprint(const INotification& notification) {
+        const NotificationMeta& meta = notification.getMeta();
+        size_t bytes = kItemOverhead + notification.contentSize() + meta.id.size() + meta.type.size() +
+                       meta.userId.size() + meta.tenantId.size();
+        for (auto& c : meta.mutedChannels) bytes += sizeof(string) + c.size();
+        return bytes;
     }
 
-    void update() override {
-        string content = observable->getNotificationContent();
-        for (auto &s : strategies) s->sendNotification(content);
+    void setLimits(AdmissionLimits l) {
+        limits = l;
+    }
+
+    // Decides whether `items` more notifications totalling `bytes` fit.
+    AdmissionDecision admit(NotificationPriority priority, size_t items, size_t bytes) {
+        size_t p = static_cast<size_t>(priority);
+        double share = kShare[p];
+        double excess = 0; // queued notifications that must drain before the batch fits
+        AdmissionDecision decision;
+
+        double depth = static_cast<double>(pendingItems + items);
+        if (limits.maxPending && depth > limits.maxPending * share) {
+            excess = depth - limits.maxPending * share;
+            decision.reason = "queue depth";
+        }
+        if (limits.maxPendingBytes && pendingBytes + bytes > limits.maxPendingBytes * share) {
+            double perItem = pendingItems ? static_cast<double>(pendingBytes) / pendingItems
+                                          : static_cast<double>(bytes) / max<size_t>(1, items);
+            double over = (pendingBytes + bytes - limits.maxPendingBytes * share) / perItem;
+            if (over > excess) {
+                excess = over;
+                decision.reason = "queue memory";
+            }
+        }
+        if (limits.maxHeapBytes) {
+            int64_t now = steadyMs();
+            if (now - heapSampledMs >= kHeapSampleMs) {
+                heapBytes = heapInUse();
+                heapSampledMs = now;
+            }
+            if (heapBytes + bytes > limits.maxHeapBytes * share) {
+                double perItem = pendingItems ? static_cast<double>(pendingBytes) / pendingItems
+                                              : static_cast<double>(bytes) / max<size_t>(1, items);
+                double over = (heapBytes + bytes - limits.maxHeapBytes * share) / perItem;
+                if (over > excess) {
+                    excess = over;
+                    decision.reason = "process memory";
+                }
+            }
+        }
+        if (limits.maxQueueDelayMs && drainRate > 0) {
+            double over = depth - drainRate * limits.maxQueueDelayMs * share / 1000;
+            if (over > excess) {
+                excess = over;
+                decision.reason = "queue delay";
+            }
+        }
+
+        if (excess <= 0) {
+            admitted += items;
+            return decision;
+        }
+        shed[p] += items;
+        decision.admitted = false;
+        decision.retryAfterMs = drainRate > 0
+            ? min(kMaxRetryMs, max<int64_t>(1, static_cast<int64_t>(excess * 1000 / drainRate) + 1))
+            : kUnknownRateRetryMs;
+        return decision;
+    }
+
+    void onEnqueued(size_t items, size_t bytes) {
+        // Only backlogged time says anything about drain capacity.
+        if (pendingItems == 0) {
+            windowStartMs = steadyMs();
+            windowDrained = 0;
+        }
+        pendingItems += items;
+        pendingBytes += bytes;
+    }
+
+    void onDrained(size_t items, size_t bytes) {
+        pendingItems -= items;
+        pendingBytes -= bytes;
+        windowDrained += items;
+        int64_t now = steadyMs();
+        if (now - windowStartMs >= kRateWindowMs) {
+            double rate = windowDrained * 1000.0 / static_cast<double>(now - windowStartMs);
+            drainRate = drainRate > 0 ? 0.7 * drainRate + 0.3 * rate : rate;
+            windowStartMs = now;
+            windowDrained = 0;
+        }
+    }
+
+    AdmissionStats stats() const {
+        return {pendingItems, pendingBytes, heapBytes, drainRate, admitted, shed};
+    }
+};
+
+// 128-bit content hash in the style of XXH3: inputs over 128 bytes fold into
+// eight 64-bit lanes 64 bytes at a time with 32x32->64 multiplies (two lanes
+// per SSE2 register), shorter ones mix 16 bytes at a time from both ends. The
+// key material is derived at startup, so values are not XXH3-compatible and are
+// only meant for in-process deduplication.
+struct BodyHash {
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    bool operator==(const BodyHash& o) const { return low == o.low && high == o.high; }
+};
+
+class ContentHash {
+private:
+    static constexpr uint64_t kPrime32_1 = 0x9E3779B1ULL;
+    static constexpr uint64_t kPrime32_2 = 0x85EBCA77ULL;
+    static constexpr uint64_t kPrime32_3 = 0xC2B2AE3DULL;
+    static constexpr uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+    static constexpr size_t kStripe = 64;
+    static constexpr size_t kSecretSize = 192;
+    // Each stripe of a block uses key material 8 bytes further along.
+    static constexpr size_t kStripesPerBlock = (kSecretSize - kStripe) / 8;
+
+    struct Secret {
+        uint8_t bytes[kSecretSize];
+    };
+
+    static const uint8_t* secret() {
+        static const Secret key = [] {
+            Secret s{};
+            uint64_t x = kPrime64_1;
+            for (size_t i = 0; i < kSecretSize; i += 8) {
+                x += 0x9E3779B97F4A7C15ULL;
+                uint64_t z = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                z ^= z >> 31;
+                memcpy(s.bytes + i, &z, 8);
+            }
+            return s;
+        }();
+        return key.bytes;
+    }
+
+    static uint64_t read64(const uint8_t* p) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+    }
+
+    // Folds the 128-bit product into 64 bits.
+    static uint64_t fold64(uint64_t a, uint64_t b) {
+        unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
+
+    static uint64_t avalanche(uint64_t h) {
+        h ^= h >> 37;
+        h *= 0x165667919E3779F9ULL;
+        return h ^ (h >> 32);
+    }
+
+    static uint64_t mix16(const uint8_t* p, const uint8_t* key) {
+        return fold64(read64(p) ^ read64(key), read64(p + 8) ^ read64(key + 8));
+    }
+
+    // acc[i] += lo32(x) * hi32(x) with x = data[i] ^ key[i], and acc[i ^ 1] += data[i].
+    static void accumulate(uint64_t* acc, const uint8_t* in, const uint8_t* key) {
+#ifdef __SSE2__
+        for (int i = 0; i < 4; i++) {
+            __m128i* lanes = reinterpret_cast<__m128i*>(acc) + i;
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in) + i);
+            __m128i mixed = _mm_xor_si128(data, _mm_loadu_si128(reinterpret_cast<const __m128i*>(key) + i));
+            __m128i product = _mm_mul_epu32(mixed, _mm_shuffle_epi32(mixed, _MM_SHUFFLE(2, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            _mm_store_si128(lanes, _mm_add_epi64(_mm_load_si128(lanes), _mm_add_epi64(product, swapped)));
+        }
+#else
+        for (int i = 0; i < 8; i++) {
+            uint64_t data = read64(in + 8 * i);
+            uint64_t mixed = data ^ read64(key + 8 * i);
+            acc[i ^ 1] += data;
+            acc[i] += (mixed & 0xFFFFFFFFULL) * (mixed >> 32);
+        }
+#endif
+    }
+
+    // Keeps the lanes from saturating between blocks.
+    static void scramble(uint64_t* acc, const uint8_t* key) {
+#ifdef __SSE2__
+        const __m128i prime = _mm_set1_epi32(static_cast<int>(kPrime32_1));
+        for (int i = 0; i < 4; i++) {
+            __m128i* lanes = reinterpret_cast<__m128i*>(acc) + i;
+            __m128i a = _mm_load_si128(lanes);
+            a = _mm_xor_si128(_mm_xor_si128(a, _mm_srli_epi64(a, 47)),
+                              _mm_loadu_si128(reinterpret_cast<const __m128i*>(key) + i));
+            // SSE2 has no 64-bit multiply; build it from the two 32-bit halves.
+            __m128i low = _mm_mul_epu32(a, prime);
+            __m128i high = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)), prime);
+            _mm_store_si128(lanes, _mm_add_epi64(low, _mm_slli_epi64(high, 32)));
+        }
+#else
+        for (int i = 0; i < 8; i++) {
+            uint64_t a = acc[i];
+            a = (a ^ (a >> 47) ^ read64(key + 8 * i)) * kPrime32_1;
+            acc[i] = a;
+        }
+#endif
+    }
+
+    static uint64_t merge(const uint64_t* acc, const uint8_t* key, uint64_t start) {
+        uint64_t h = start;
+        for (int i = 0; i < 4; i++) h += fold64(acc[2 * i] ^ read64(key + 16 * i), acc[2 * i + 1] ^ read64(key + 16 * i + 8));
+        return avalanche(h);
+    }
+
+    static BodyHash hashLong(const uint8_t* p, size_t len) {
+        const uint8_t* key = secret();
+        alignas(16) uint64_t acc[8] = {kPrime32_3, kPrime64_1, kPrime64_2, kPrime64_3,
+                                       kPrime64_4, kPrime32_2, kPrime64_5, kPrime32_1};
+        size_t stripes = (len - 1) / kStripe;
+        size_t blockSize = kStripe * kStripesPerBlock;
+        size_t blocks = (len - 1) / blockSize;
+        for (size_t b = 0; b < blocks; b++) {
+            for (size_t s = 0; s < kStripesPerBlock; s++) accumulate(acc, p + b * blockSize + s * kStripe, key + 8 * s);
+            scramble(acc, key + kSecretSize - kStripe);
+        }
+        // The last stripe always ends at the end of the input, overlapping the one before.
+        size_t tail = stripes - blocks * kStripesPerBlock;
+        for (size_t s = 0; s < tail; s++) accumulate(acc, p + blocks * blockSize + s * kStripe, key + 8 * s);
+        accumulate(acc, p + len - kStripe, key + kSecretSize - kStripe - 7);
+        BodyHash h;
+        h.low = merge(acc, key + 11, len * kPrime64_1);
+        h.high = merge(acc, key + kSecretSize - kStripe - 11, ~(len * kPrime64_2));
+        return h;
+    }
+
+public:
+    static BodyHash hash(string_view input) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(input.data());
+        size_t len = input.size();
+        if (len > 128) return hashLong(p, len);
+        const uint8_t* key = secret();
+        uint64_t low = len * kPrime64_1;
+        uint64_t high = 0;
+        if (len <= 16) {
+            uint8_t block[16] = {};
+            if (len) memcpy(block, p, len);
+            low += fold64(read64(block) ^ read64(key), read64(block + 8) ^ read64(key + 8));
+            high += fold64(read64(block) ^ read64(key + 16), read64(block + 8) ^ read64(key + 24));
+        } else {
+            // Chunks taken from the front and from the back meet in the middle.
+            size_t rounds = (len + 31) / 32;
+            for (size_t i = 0; i < rounds; i++) {
+                low += mix16(p + 16 * i, key + 32 * i);
+                high += mix16(p + len - 16 * (i + 1), key + 32 * i + 16);
+            }
+        }
+        BodyHash h;
+        h.low = avalanche(low + high);
+        h.high = avalanche(low * kPrime64_4 + high * kPrime64_3 + (len ^ kPrime64_5));
+        return h;
+    }
+};
+
+// Content-addressed store for rendered bodies. A campaign renders the same body
+// for thousands of recipients; every record keeps a reference to the one stored
+// copy, looked up by its hash. A body lives while some record references it, and
+// entries of released bodies are swept once the table doubles.
+class BodyStore {
+public:
+    struct Stats {
+        size_t bodies = 0;      // distinct bodies held
+        size_t storedBytes = 0; // bytes those bodies take
+        uint64_t interned = 0;
+        uint64_t internedBytes = 0; // bytes the records would hold without sharing
+        uint64_t deduplicated = 0;  // interns answered with a stored body
+    };
+
+private:
+    struct HashOf {
+        size_t operator()(const BodyHash& h) const { return static_cast<size_t>(h.low); }
+    };
+
+    mutable mutex lock;
+    unordered_map<BodyHash, weak_ptr<const string>, HashOf> bodies;
+    size_t sweepAt = 1024;
+    uint64_t interned = 0;
+    uint64_t internedBytes = 0;
+    uint64_t deduplicated = 0;
+
+    void sweep() {
+        for (auto it = bodies.begin(); it != bodies.end();) {
+            if (it->second.expired()) it = bodies.erase(it);
+            else ++it;
+        }
+        sweepAt = max<size_t>(1024, 2 * bodies.size());
+    }
+
+public:
+    shared_ptr<const string> intern(string_view body) {
+        BodyHash hash = ContentHash::hash(body);
+        lock_guard<mutex> guard(lock);
+        interned++;
+        internedBytes += body.size();
+        weak_ptr<const string>& slot = bodies[hash];
+        if (auto stored = slot.lock()) {
+            // A 128-bit collision is not expected, but a record must never get another's body.
+            if (*stored == body) {
+                deduplicated++;
+                return stored;
+            }
+            return make_shared<const string>(body);
+        }
+        auto stored = make_shared<const string>(body);
+        slot = stored;
+        if (bodies.size() >= sweepAt) sweep();
+        return stored;
+    }
+
+    Stats stats() const {
+        lock_guard<mutex> guard(lock);
+        Stats s;
+        for (auto& entry : bodies) {
+            if (auto body = entry.second.lock()) {
+                s.bodies++;
+                s.storedBytes += body->size();
+            }
+        }
+        s.interned = interned;
+        s.internedBytes = internedBytes;
+        s.deduplicated = deduplicated;
+        return s;
+    }
+};
+
+// Bodies a snapshot refers to. Each is written once, and history records and
+// mailbox items that share a body refer to it by the same index.
+class SnapshotBodies {
+private:
+    unordered_map<const string*, uint32_t> indexes;
+    vector<const string*> bodies;
+    deque<string> owned; // bodies rendered for the snapshot alone
+
+public:
+    uint32_t indexOf(const shared_ptr<const string>& body) {
+        auto added = indexes.emplace(body.get(), static_cast<uint32_t>(bodies.size()));
+        if (added.second) bodies.push_back(body.get());
+        return added.first->second;
+    }
+
+    // A body no store holds yet; kept until the snapshot is written.
+    uint32_t add(string body) {
+        owned.push_back(std::move(body));
+        bodies.push_back(&owned.back());
+        return static_cast<uint32_t>(bodies.size() - 1);
+    }
+
+    // count u32 | u32 strings
+    void saveState(string& out) const {
+        putLE32(out, static_cast<uint32_t>(bodies.size()));
+        for (const string* body : bodies) putString32(out, *body);
+    }
+
+    // Interns every body again, so the restored records share them as before.
+    static bool loadState(string_view in, size_t& pos, BodyStore& store, vector<shared_ptr<const string>>& out) {
+        uint32_t count;
+        if (!readU32(in, pos, count)) return false;
+        out.reserve(count);
+        for (uint32_t i = 0; i < count; i++) {
+            if (in.size() - pos < 4) return false;
+            size_t n = readLE32(in.data() + pos);
+            pos += 4;
+            if (in.size() - pos < n) return false;
+            out.push_back(store.intern(in.substr(pos, n)));
+            pos += n;
+        }
+        return true;
+    }
+};
+
+// One sent notification as history keeps it. The body is interned off the
+// send path; until then the record holds the notification itself, so a
+// compressed one stays compressed.
+struct HistoryRecord {
+    NotificationMeta meta;
+    shared_ptr<const string> body; // null until NotificationService interns it
+    shared_ptr<const INotification> source; // dropped once the body is interned
+    uint64_t mailboxSeq = 0; // the recipient's mailbox item, once the mailbox has it
+};
+
+// Singleton NotificationService
+class NotificationService {
+private:
+    NotificationObservable observable;
+    vector<HistoryRecord> history;
+    size_t historyLimit = 1000000; // newest records kept; 0 keeps everything
+    uint64_t historyDropped = 0;
+    size_t internedUpTo = 0; // every record before this one has its body
+    shared_ptr<BodyStore> bodies = make_shared<BodyStore>();
+    string rendered;
+    unordered_map<string, UserProfile> users;
+    TenantFairQueue pending;
+    AdmissionController admission;
+    uint64_t expired = 0;
+
+    NotificationService() = default;
+
+    // History keeps the metadata and a reference to the shared body, not the
+    // notification itself, so identical campaign bodies are held once.
+    void record(const shared_ptr<INotification>& notification) {
+        // The number travels with the notification, so the mailbox can report back which item it became.
+        if (NotificationMeta* meta = notification->mutableMeta()) meta->historySeq = historyDropped + history.size() + 1;
+        history.push_back({notification->getMeta(), nullptr, notification});
+        // Trimmed in chunks of an eighth, so the shift is amortised.
+        if (historyLimit && history.size() >= historyLimit + max<size_t>(1, historyLimit / 8)) trimHistory();
+    }
+
+    void intern(HistoryRecord& record) {
+        try {
+            record.source->renderTo(rendered);
+        } catch (...) {
+            rendered.clear(); // it failed to render for delivery too
+        }
+        record.body = bodies->intern(rendered);
+        record.source.reset();
+    }
+
+    void trimHistory() {
+        if (!historyLimit || history.size() <= historyLimit) return;
+        size_t drop = history.size() - historyLimit;
+        history.erase(history.begin(), history.begin() + static_cast<ptrdiff_t>(drop));
+        historyDropped += drop;
+        internedUpTo -= min(internedUpTo, drop);
+    }
+
+public:
+    static NotificationService& getInstance() {
+        static NotificationService instance;
+        return instance;
+    }
+
+    NotificationObservable* getObservable() {
+        return &observable;
+    }
+
+    void sendNotification(shared_ptr<INotification> notification) {
+        record(notification);
+        observable.setNotification(notification);
+        observable.endBatch();
+    }
+
+    // Batches come off queues, so stale entries are dropped here.
+    void sendBatch(const vector<shared_ptr<INotification>>& batch) {
+        for (auto& notification : batch) {
+            if (notification->getMeta().isExpired(nowMs())) {
+                expired++;
+                continue;
+            }
+            record(notification);
+            observable.setNotification(notification);
+        }
+        observable.endBatch();
+    }
+
+    // Like sendBatch, but the batch is not kept in history: for bulk paths
+    // (campaign imports) whose input would otherwise all stay in memory.
+    void publishBatch(const vector<shared_ptr<INotification>>& batch) {
+        for (auto& notification : batch) {
+            if (notification->getMeta().isExpired(nowMs())) {
+                expired++;
+                continue;
+            }
+            observable.setNotification(notification);
+        }
+        observable.endBatch();
+    }
+
+    // Bodies of recent records may still be null; read them through historyBody().
+    const vector<HistoryRecord>& getHistory() const {
+        return history;
+    }
+
+    // Renders and interns up to maxRecords bodies, oldest first; returns how
+    // many are still waiting. Call between sends.
+    size_t internHistory(size_t maxRecords = SIZE_MAX) {
+        for (; internedUpTo < history.size() && maxRecords > 0; internedUpTo++) {
+            HistoryRecord& record = history[internedUpTo];
+            if (record.body) continue;
+            maxRecords--;
+            intern(record);
+        }
+        return history.size() - internedUpTo;
+    }
+
+    // Body of getHistory()[index], interning just that record if the pass above has not reached it.
+    const string& historyBody(size_t index) {
+        HistoryRecord& record = history[index];
+        if (!record.body) intern(record);
+        return *record.body;
+    }
+
+    // Body of getHistory()[index] without interning it; rendered into
+    // `buffer` when the record has not been interned yet.
+    string_view peekHistoryBody(size_t index, string& buffer) const {
+        const HistoryRecord& record = history[index];
+        if (record.body) return *record.body;
+        try {
+            record.source->renderTo(buffer);
+        } catch (...) {
+            buffer.clear();
+        }
+        return buffer;
+    }
+
+    size_t uninternedCount() const {
+        return history.size() - internedUpTo;
+    }
+
+    // Keeps about the newest `limit` records; 0 keeps everything.
+    void setHistoryLimit(size_t limit) {
+        historyLimit = limit;
+        trimHistory();
+    }
+
+    // Links a record (by its NotificationMeta::historySeq) to the mailbox item
+    // it was published as; records trimmed since are ignored.
+    void setMailboxSeq(uint64_t historySeq, uint64_t seq) {
+        if (historySeq <= historyDropped || historySeq - historyDropped > history.size()) return;
+        history[historySeq - historyDropped - 1].mailboxSeq = seq;
+    }
+
+    // Records trimmed off the front, so getHistory()[i] is record number historyOffset() + i.
+    uint64_t historyOffset() const {
+        return historyDropped;
+    }
+
+    // Shared with other per-user stores (the in-app mailbox) so they hold the same copies.
+    const shared_ptr<BodyStore>& getBodyStore() const {
+        return bodies;
+    }
+
+    // Queued intake: notifications wait per tenant until drain() sends them.
+    // The batch is admitted or refused as a whole, at the first item's priority.
+    AdmissionDecision enqueue(const vector<shared_ptr<INotification>>& batch) {
+        if (batch.empty()) return {};
+        size_t bytes = 0;
+        for (auto& n : batch) bytes += AdmissionController::footprint(*n);
+        AdmissionDecision decision = admission.admit(batch.front()->getMeta().priority, batch.size(), bytes);
+        if (!decision.admitted) return decision;
+        for (auto& n : batch) pending.push(n);
+        admission.onEnqueued(batch.size(), bytes);
+        return decision;
+    }
+
+    AdmissionDecision enqueue(shared_ptr<INotification> notification) {
+        return enqueue(vector<shared_ptr<INotification>>{std::move(notification)});
+    }
+
+    // Sends up to maxItems queued notifications in fair order; returns how many.
+    // Expired ones are dropped as they reach the head, so expiry never scans the queue.
+    size_t drain(size_t maxItems) {
+        size_t sent = 0;
+        size_t popped = 0;
+        size_t bytes = 0;
+        while (sent < maxItems) {
+            auto notification = pending.pop();
+            if (!notification) break;
+            popped++;
+            bytes += AdmissionController::footprint(*notification);
+            if (notification->getMeta().isExpired(nowMs())) {
+                expired++;
+                continue;
+            }
+            record(notification);
+            observable.setNotification(std::move(notification));
+            sent++;
+        }
+        if (sent) observable.endBatch();
+        if (popped) admission.onDrained(popped, bytes);
+        return sent;
+    }
+
+    // Notifications dropped at dequeue because their TTL ran out.
+    uint64_t expiredCount() const {
+        return expired;
+    }
+
+    void setAdmissionLimits(AdmissionLimits limits) {
+        admission.setLimits(limits);
+    }
+
+    AdmissionStats admissionStats() const {
+        return admission.stats();
+    }
+
+    size_t pendingCount() const {
+        return pending.size();
+    }
+
+    void setTenantPolicy(const string& tenantId, TenantPolicy policy) {
+        pending.setPolicy(tenantId, policy);
+    }
+
+    void setDefaultTenantPolicy(TenantPolicy policy) {
+        pending.setDefaultPolicy(policy);
+    }
+
+    void upsertUser(UserProfile profile) {
+        string id = profile.id;
+        users[id] = std::move(profile);
+    }
+
+    const UserProfile* findUser(const string& id) const {
+        auto it = users.find(id);
+        return it == users.end() ? nullptr : &it->second;
+    }
+
+    // users u32 + (id, name u16 strings | emailEnabled u8 | pushEnabled u8) |
+    // history u64 + (meta | body u32 | mailboxSeq u64) | queued notifications | expired u64
+    void saveState(string& out, SnapshotBodies& bodies) const {
+        putLE32(out, static_cast<uint32_t>(users.size()));
+        for (auto& entry : users) {
+            putString16(out, entry.second.id);
+            putString16(out, entry.second.name);
+            out += static_cast<char>(entry.second.emailEnabled);
+            out += static_cast<char>(entry.second.pushEnabled);
+        }
+        putLE64(out, history.size());
+        for (auto& record : history) {
+            record.meta.saveState(out);
+            if (record.body) {
+                putLE32(out, bodies.indexOf(record.body));
+            } else {
+                string text;
+                try {
+                    record.source->renderTo(text);
+                } catch (...) {
+                    text.clear();
+                }
+                putLE32(out, bodies.add(std::move(text)));
+            }
+            putLE64(out, record.mailboxSeq);
+        }
+        pending.saveState(out);
+        putLE64(out, expired);
+    }
+
+    bool loadState(string_view in, size_t& pos, const vector<shared_ptr<const string>>& bodies) {
+        uint32_t userCount;
+        if (!readU32(in, pos, userCount)) return false;
+        for (uint32_t i = 0; i < userCount; i++) {
+            UserProfile user;
+            uint8_t email, push;
+            if (!readString(in, pos, 2, user.id) || !readString(in, pos, 2, user.name) || !readU8(in, pos, email) ||
+                !readU8(in, pos, push))
+                return false;
+            user.emailEnabled = email != 0;
+            user.pushEnabled = push != 0;
+            upsertUser(std::move(user));
+        }
+        uint64_t recordCount;
+        if (!readU64(in, pos, recordCount)) return false;
+        history.reserve(history.size() + min<uint64_t>(recordCount, in.size()));
+        for (uint64_t i = 0; i < recordCount; i++) {
+            HistoryRecord& record = history.emplace_back();
+            uint32_t body;
+            if (!record.meta.loadState(in, pos) || !readU32(in, pos, body) || body >= bodies.size() ||
+                !readU64(in, pos, record.mailboxSeq)) {
+                history.pop_back();
+                return false;
+            }
+            record.body = bodies[body];
+        }
+        trimHistory();
+        vector<shared_ptr<INotification>> restored;
+        if (!pending.loadState(in, pos, restored)) return false;
+        size_t bytes = 0;
+        for (auto& n : restored) bytes += AdmissionController::footprint(*n);
+        admission.onEnqueued(restored.size(), bytes);
+        return readU64(in, pos, expired);
+    }
+};
+
+// Logger
+class Logger : public IObserver, public enable_shared_from_this<Logger> {
+private:
+    NotificationObservable* observable;
+
+public:
+    Logger() {
+        observable = &NotificationService::getInstance().getObservable()[0];
+    }
+
+    void subscribe() {
+        observable->addObserver(shared_from_this());
+    }
+
+    void update() override {
+        cout << "\n[Logger] New Notification Logged:\n"
+             << observable->getNotificationContent();
+    }
+};
+
+// Strategy Interface
+// One rendered send handed to INotificationStrategy::prepareBatch; deliver()
+// is later called with *content and *meta.
+struct PreparedSend {
+    shared_ptr<const string> content;
+    const NotificationMeta* meta;
+};
+
+class INotificationStrategy {
+public:
+    virtual void sendNotification(const string& content) = 0;
+    virtual string_view getChannel() const { return "custom"; }
+
+    // Channels that route per recipient override this; the default ignores the metadata.
+    virtual void deliver(const string& content, const NotificationMeta&) {
+        sendNotification(content);
+    }
+
+    // Strategies with per-batch work to do up front (signing) return true. The
+    // engine then holds a batch until batchEnd(), renders it, and hands this
+    // channel's sends to prepareBatch() before the deliver() calls.
+    virtual bool preparesBatches() const { return false; }
+    virtual void prepareBatch(const vector<PreparedSend>&) {}
+
+    // Channels that finish a send on their own thread return true and override
+    // deliverAsync(). `done` runs exactly once, from whichever thread completes
+    // the send, with null on success or the failure.
+    virtual bool deliversAsync() const { return false; }
+    virtual void deliverAsync(const string& content, const NotificationMeta& meta,
+                              function<void(exception_ptr)> done) {
+        try {
+            deliver(content, meta);
+        } catch (...) {
+            done(current_exception());
+            return;
+        }
+        done(nullptr);
+    }
+
+    virtual ~INotificationStrategy() = default;
+};
+
+class EmailStrategy : public INotificationStrategy {
+private:
+    string emailId;
+public:
+    EmailStrategy(string emailId) : emailId(std::move(emailId)) {}
+
+    string_view getChannel() const override { return "email"; }
+
+    void sendNotification(const string& content) override {
+        cout << "\n[Email] Sent to " << emailId << ":\n" << content;
+    }
+};
+
+class SMSStrategy : public INotificationStrategy {
+private:
+    string mobileNumber;
+public:
+    SMSStrategy(string mobileNumber) : mobileNumber(std::move(mobileNumber)) {}
+
+    string_view getChannel() const override { return "sms"; }
+
+    void sendNotification(const string& content) override {
+        cout << "\n[SMS] Sent to " << mobileNumber << ":\n" << content;
+    }
+};
+
+// Sink for in-app messages addressed to a user's live sessions
+class IInAppPublisher {
+public:
+    virtual void publish(const string& userId, const string& content) = 0;
+    // With the notification's metadata, for sinks that link back to its history record.
+    virtual void publish(const string& userId, const string& content, const NotificationMeta&) {
+        publish(userId, content);
+    }
+    virtual ~IInAppPublisher() = default;
+};
+
+class PopUpStrategy : public INotificationStrategy {
+private:
+    shared_ptr<IInAppPublisher> publisher;
+public:
+    PopUpStrategy() = default;
+    explicit PopUpStrategy(shared_ptr<IInAppPublisher> publisher) : publisher(std::move(publisher)) {}
+
+    string_view getChannel() const override { return "popup"; }
+
+    void sendNotification(const string& content) override {
+        cout << "\n[Popup] Notification displayed:\n" << content;
+    }
+
+    void deliver(const string& content, const NotificationMeta& meta) override {
+        if (publisher && !meta.userId.empty()) publisher->publish(meta.userId, content, meta);
+        else sendNotification(content);
+    }
+};
+
+// One provider call that failed, kept for the dead-letter record
+struct DeliveryAttempt {
+    string provider;
+    int64_t atMs;
+    string error;
+};
+
+// Thrown by a strategy that has given up on a send, with what the provider
+// said and every attempt it made.
+class DeliveryFailure : public runtime_error {
+public:
+    string providerResponse;
+    vector<DeliveryAttempt> attempts;
+
+    DeliveryFailure(const string& reason, string providerResponse, vector<DeliveryAttempt> attempts)
+        : runtime_error(reason), providerResponse(std::move(providerResponse)), attempts(std::move(attempts)) {}
+};
+
+static string describeError(const exception_ptr& error) {
+    try {
+        rethrow_exception(error);
+    } catch (const exception& e) {
+        return e.what();
+    } catch (...) {
+        return "unknown error";
+    }
+}
+
+// Status a client's I/O thread hands back to the send blocked on it. Held by
+// shared_ptr, since the callback can still fire after the wait timed out.
+class StatusWaiter {
+private:
+    mutex lock;
+    condition_variable settled;
+    optional<int> status;
+
+public:
+    void set(int value) {
+        lock_guard<mutex> guard(lock);
+        status = value;
+        settled.notify_all();
+    }
+
+    // nullopt if the timeout passed first.
+    optional<int> wait(chrono::milliseconds timeout) {
+        unique_lock<mutex> guard(lock);
+        settled.wait_for(guard, timeout, [&] { return status.has_value(); });
+        return status;
+    }
+};
+
+// Composite over redundant providers of one channel (e.g. two SMS vendors).
+// The primary is picked by smooth weighted round-robin and the others are
+// tried in turn if it throws. Once a provider has enough samples, a send that
+// outlives its p95 latency is hedged to the next provider and the first
+// success wins; a late second success is only counted as a duplicate. Both
+// attempts carry the same notification id, which providers can use as an
+// idempotency key.
+//
+// Every provider has its own workers, so a provider that hangs only ties up
+// its own threads. An attempt with no answer within the attempt timeout counts
+// as failed and the send moves on; attempts still queued when their send has
+// settled (a hedge loser, or one left behind by a timeout) are dropped unrun.
+class FailoverStrategy : public INotificationStrategy {
+public:
+    struct ProviderStats {
+        string_view channel;
+        int weight;
+        uint64_t sent;
+        uint64_t failed;
+        uint64_t timedOut;    // attempts given up on after the attempt timeout
+        uint64_t hedged;      // times this provider was the hedge target
+        uint64_t duplicates;  // successes that arrived after another provider won
+        uint64_t cancelled;   // queued attempts dropped because their send had settled
+        int64_t p95Us;
+    };
+
+private:
+    static constexpr size_t kLatencyWindow = 256;
+    static constexpr size_t kMinSamplesToHedge = 20;
+
+    struct Provider {
+        unique_ptr<INotificationStrategy> strategy;
+        string name; // channel#index
+        int weight;
+        int currentWeight = 0;
+        mutex lock;
+        vector<int64_t> latencies;
+        size_t cursor = 0;
+        size_t sinceRecompute = 0;
+        int64_t p95Us = 0;
+        atomic<uint64_t> sent{0};
+        atomic<uint64_t> failed{0};
+        atomic<uint64_t> timedOut{0};
+        atomic<uint64_t> hedged{0};
+        atomic<uint64_t> duplicates{0};
+        atomic<uint64_t> cancelled{0};
+
+        mutex poolLock;
+        condition_variable poolReady;
+        deque<function<void()>> tasks;
+        vector<thread> workers;
+        bool stopping = false;
+
+        void recordLatency(int64_t us) {
+            lock_guard<mutex> guard(lock);
+            if (latencies.size() < kLatencyWindow) latencies.push_back(us);
+            else latencies[cursor++ % kLatencyWindow] = us;
+            if (++sinceRecompute >= 16 || latencies.size() == kMinSamplesToHedge) {
+                sinceRecompute = 0;
+                vector<int64_t> sorted = latencies;
+                size_t k = sorted.size() * 95 / 100;
+                nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+                p95Us = sorted[k];
+            }
+        }
+
+        // -1 until the window holds enough samples to trust.
+        int64_t hedgeAfterUs() {
+            lock_guard<mutex> guard(lock);
+            return latencies.size() >= kMinSamplesToHedge ? p95Us : -1;
+        }
+
+        void work() {
+            while (true) {
+                function<void()> task;
+                {
+                    unique_lock<mutex> guard(poolLock);
+                    poolReady.wait(guard, [&] { return stopping || !tasks.empty(); });
+                    if (tasks.empty()) return;
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+    };
+
+    struct Message {
+        string content;
+        NotificationMeta meta;
+    };
+
+    struct Attempt {
+        mutex lock;
+        condition_variable changed;
+        vector<size_t> pending;  // providers launched in the current round and not yet answered
+        uint32_t round = 0;      // bumped when a timeout abandons the attempts in flight
+        bool delivered = false;
+        bool finished = false;   // deliver() has returned or thrown
+        vector<DeliveryAttempt> failures;
+        string providerResponse; // latest one any provider reported
+    };
+
+    vector<unique_ptr<Provider>> providers;
+    mutex routeLock;
+    size_t threadsPerProvider;
+    chrono::milliseconds attemptTimeout;
+    atomic<uint64_t> expired{0};
+
+    size_t pickPrimary() {
+        lock_guard<mutex> guard(routeLock);
+        int total = 0;
+        size_t best = 0;
+        for (size_t i = 0; i < providers.size(); i++) {
+            providers[i]->currentWeight += providers[i]->weight;
+            total += providers[i]->weight;
+            if (providers[i]->currentWeight > providers[best]->currentWeight) best = i;
+        }
+        providers[best]->currentWeight -= total;
+        return best;
+    }
+
+    // Caller holds attempt->lock.
+    void launch(const shared_ptr<Attempt>& attempt, size_t index, const shared_ptr<const Message>& message) {
+        attempt->pending.push_back(index);
+        Provider* provider = providers[index].get();
+        uint32_t round = attempt->round;
+        // Only the current round's entry is still listed; a timeout clears the rest.
+        auto answered = [attempt, index, round] {
+            if (attempt->round != round) return false;
+            auto& pending = attempt->pending;
+            pending.erase(find(pending.begin(), pending.end(), index));
+            return true;
+        };
+        {
+            lock_guard<mutex> guard(provider->poolLock);
+            provider->tasks.push_back([attempt, provider, message, round, answered] {
+                {
+                    lock_guard<mutex> guard(attempt->lock);
+                    // A timed-out round was already recorded as failed, so its queued sends are dropped too.
+                    if (attempt->delivered || attempt->finished || attempt->round != round) {
+                        provider->cancelled++;
+                        answered();
+                        return;
+                    }
+                }
+                auto start = chrono::steady_clock::now();
+                bool ok = true;
+                exception_ptr error;
+                string response;
+                try {
+                    provider->strategy->deliver(message->content, message->meta);
+                } catch (const DeliveryFailure& e) {
+                    ok = false;
+                    error = current_exception();
+                    response = e.providerResponse;
+                } catch (...) {
+                    ok = false;
+                    error = current_exception();
+                }
+                if (ok) {
+                    provider->recordLatency(chrono::duration_cast<chrono::microseconds>(
+                        chrono::steady_clock::now() - start).count());
+                }
+
+                lock_guard<mutex> guard(attempt->lock);
+                // A timed-out attempt was already recorded as a failure; only a late success still counts.
+                bool current = answered();
+                if (!ok) {
+                    provider->failed++;
+                    if (current) {
+                        attempt->failures.push_back({provider->name, nowMs(), describeError(error)});
+                        if (!response.empty()) attempt->providerResponse = std::move(response);
+                    }
+                } else if (attempt->delivered || attempt->finished) {
+                    provider->duplicates++;
+                } else {
+                    attempt->delivered = true;
+                    provider->sent++;
+                }
+                attempt->changed.notify_all();
+            });
+        }
+        provider->poolReady.notify_one();
+    }
+
+    // Caller holds attempt.lock.
+    [[noreturn]] static void giveUp(Attempt& attempt, const string& why) {
+        string reason = why + ": " + attempt.failures.back().error;
+        throw DeliveryFailure(reason, std::move(attempt.providerResponse), std::move(attempt.failures));
+    }
+
+public:
+    // Each provider gets `threadsPerProvider` workers (at least two, so a
+    // hedge can run beside a stalled send) and each attempt `attemptTimeout`.
+    explicit FailoverStrategy(size_t threadsPerProvider = 2, chrono::milliseconds attemptTimeout = chrono::seconds(10))
+        : threadsPerProvider(max<size_t>(2, threadsPerProvider)), attemptTimeout(attemptTimeout) {}
+
+    // Workers hung in a provider call are waited for.
+    ~FailoverStrategy() override {
+        for (auto& p : providers) {
+            {
+                lock_guard<mutex> guard(p->poolLock);
+                p->stopping = true;
+            }
+            p->poolReady.notify_all();
+        }
+        for (auto& p : providers) {
+            for (auto& worker : p->workers) worker.join();
+        }
+    }
+
+    // Register providers before notifications start flowing.
+    void addProvider(unique_ptr<INotificationStrategy> strategy, int weight = 1) {
+        auto provider = make_unique<Provider>();
+        provider->strategy = std::move(strategy);
+        provider->name = string(provider->strategy->getChannel()) + "#" + to_string(providers.size());
+        provider->weight = max(1, weight);
+        for (size_t i = 0; i < threadsPerProvider; i++) {
+            provider->workers.emplace_back([p = provider.get()] { p->work(); });
+        }
+        providers.push_back(std::move(provider));
+    }
+
+    string_view getChannel() const override {
+        return providers.empty() ? "custom" : providers.front()->strategy->getChannel();
+    }
+
+    void sendNotification(const string& content) override {
+        deliver(content, NotificationMeta());
+    }
+
+    // Blocks until one provider succeeds; throws DeliveryFailure with every
+    // attempt if all fail or time out.
+    void deliver(const string& content, const NotificationMeta& meta) override {
+        if (providers.empty()) throw runtime_error("failover strategy has no providers");
+        size_t primary = pickPrimary();
+        vector<size_t> order{primary};
+        for (size_t i = 0; i < providers.size(); i++) {
+            if (i != primary) order.push_back(i);
+        }
+
+        auto message = make_shared<const Message>(Message{content, meta});
+        auto attempt = make_shared<Attempt>();
+        unique_lock<mutex> guard(attempt->lock);
+        // Destroyed before `guard`, so the flag is set under the lock on every exit.
+        struct Finish {
+            Attempt& attempt;
+            ~Finish() { attempt.finished = true; }
+        } finish{*attempt};
+        auto start = chrono::steady_clock::now();
+        auto deadline = start + attemptTimeout;
+        size_t next = 0;
+        launch(attempt, order[next++], message);
+
+        auto settled = [&] { return attempt->delivered || attempt->pending.empty(); };
+        while (true) {
+            int64_t hedgeUs = next == 1 && next < order.size() ? providers[primary]->hedgeAfterUs() : -1;
+            auto hedgeAt = start + chrono::microseconds(hedgeUs);
+            bool inTime;
+            if (hedgeUs >= 0 && hedgeAt < deadline) {
+                inTime = attempt->changed.wait_until(guard, hedgeAt, settled);
+                // Hedging a stale notification would only add load.
+                if (!inTime && !meta.isExpired(nowMs())) {
+                    providers[order[next]]->hedged++;
+                    launch(attempt, order[next++], message);
+                    deadline = chrono::steady_clock::now() + attemptTimeout;
+                    continue;
+                }
+                if (!inTime) inTime = attempt->changed.wait_until(guard, deadline, settled);
+            } else {
+                inTime = attempt->changed.wait_until(guard, deadline, settled);
+            }
+
+            if (attempt->delivered) return;
+            if (!inTime) {
+                // Whatever is still running is abandoned; a late success may still win below.
+                for (size_t index : attempt->pending) {
+                    providers[index]->timedOut++;
+                    attempt->failures.push_back({providers[index]->name, nowMs(),
+                                                 "no answer within " + to_string(attemptTimeout.count()) + "ms"});
+                }
+                attempt->round++;
+                attempt->pending.clear();
+            }
+            if (next == order.size()) giveUp(*attempt, "all providers failed");
+            // No point failing over once the notification has gone stale.
+            if (meta.isExpired(nowMs())) {
+                expired++;
+                giveUp(*attempt, "expired during failover");
+            }
+            launch(attempt, order[next++], message);
+            deadline = chrono::steady_clock::now() + attemptTimeout;
+        }
+    }
+
+    // Deliveries that stopped failing over because the notification expired.
+    uint64_t expiredCount() const {
+        return expired;
+    }
+
+    vector<ProviderStats> stats() const {
+        vector<ProviderStats> out;
+        for (auto& p : providers) {
+            out.push_back({p->strategy->getChannel(), p->weight, p->sent, p->failed, p->timedOut, p->hedged,
+                           p->duplicates, p->cancelled, p->hedgeAfterUs()});
+        }
+        return out;
+    }
+};
+
+// FNV-1a, so every process and component maps a key to the same partition.
+static uint64_t fnv1a(string_view key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (char c : key) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Parallel dispatch that keeps per-key order: keys (recipients) hash onto
+// partitions, and each partition runs its tasks one at a time in submission
+// order. Partitions are spread over workers, each with its own lock, so no
+// lock is shared across workers. More partitions than workers keeps a slow
+// recipient from holding up the rest of its worker's users for long.
+class OrderedDispatcher {
+public:
+    struct PartitionStats {
+        uint32_t partition;
+        uint64_t dispatched;
+        size_t depth;
+        size_t maxDepth;
+    };
+
+private:
+    struct Partition {
+        deque<function<void()>> tasks;
+        uint64_t dispatched = 0;
+        size_t maxDepth = 0;
+    };
+
+    struct Worker {
+        mutex lock;
+        condition_variable ready;
+        condition_variable idle;
+        vector<Partition> partitions; // partition p lives at p / workers
+        size_t outstanding = 0;       // queued plus running
+        size_t cursor = 0;
+        bool stopping = false;
+        thread runner;
+    };
+
+    uint32_t partitionCount;
+    vector<unique_ptr<Worker>> workers;
+
+    void work(Worker& w) {
+        unique_lock<mutex> guard(w.lock);
+        while (true) {
+            w.ready.wait(guard, [&] { return w.stopping || w.outstanding > 0; });
+            if (w.outstanding == 0) return;
+            // One task per partition per pass, round-robin across the worker's partitions.
+            Partition* next = nullptr;
+            for (size_t i = 0; i < w.partitions.size() && !next; i++) {
+                Partition& p = w.partitions[(w.cursor + i) % w.partitions.size()];
+                if (!p.tasks.empty()) {
+                    next = &p;
+                    w.cursor = (w.cursor + i + 1) % w.partitions.size();
+                }
+            }
+            if (!next) continue;
+            function<void()> task = std::move(next->tasks.front());
+            next->tasks.pop_front();
+            guard.unlock();
+            // A throwing task must not take the worker, and the process, down with it.
+            try {
+                task();
+            } catch (const exception& e) {
+                cerr << "[Dispatcher] task failed: " << e.what() << endl;
+            } catch (...) {
+                cerr << "[Dispatcher] task failed" << endl;
+            }
+            guard.lock();
+            next->dispatched++;
+            if (--w.outstanding == 0) w.idle.notify_all();
+        }
+    }
+
+public:
+    explicit OrderedDispatcher(uint32_t partitions = 64, size_t threads = max(1u, thread::hardware_concurrency()))
+        : partitionCount(max<uint32_t>(1, partitions)) {
+        size_t count = min<size_t>(max<size_t>(1, threads), partitionCount);
+        for (size_t i = 0; i < count; i++) {
+            auto w = make_unique<Worker>();
+            w->partitions.resize((partitionCount - i + count - 1) / count);
+            workers.push_back(std::move(w));
+        }
+        for (auto& w : workers) w->runner = thread([this, worker = w.get()] { work(*worker); });
+    }
+
+    // Runs whatever is still queued, then stops the workers.
+    ~OrderedDispatcher() {
+        for (auto& w : workers) {
+            {
+                lock_guard<mutex> guard(w->lock);
+                w->stopping = true;
+            }
+            w->ready.notify_all();
+        }
+        for (auto& w : workers) w->runner.join();
+    }
+
+    OrderedDispatcher(const OrderedDispatcher&) = delete;
+    OrderedDispatcher& operator=(const OrderedDispatcher&) = delete;
+
+    uint32_t partitionFor(string_view key) const {
+        return static_cast<uint32_t>(fnv1a(key) % partitionCount);
+    }
+
+    void submit(string_view key, function<void()> task) {
+        uint32_t p = partitionFor(key);
+        Worker& w = *workers[p % workers.size()];
+        {
+            lock_guard<mutex> guard(w.lock);
+            Partition& partition = w.partitions[p / workers.size()];
+            partition.tasks.push_back(std::move(task));
+            partition.maxDepth = max(partition.maxDepth, partition.tasks.size());
+            w.outstanding++;
+        }
+        w.ready.notify_one();
+    }
+
+    // Blocks until every task submitted so far has run.
+    void waitIdle() {
+        for (auto& w : workers) {
+            unique_lock<mutex> guard(w->lock);
+            w->idle.wait(guard, [&] { return w->outstanding == 0; });
+        }
+    }
+
+    vector<PartitionStats> stats() {
+        vector<PartitionStats> out(partitionCount);
+        for (size_t i = 0; i < workers.size(); i++) {
+            lock_guard<mutex> guard(workers[i]->lock);
+            for (size_t j = 0; j < workers[i]->partitions.size(); j++) {
+                const Partition& p = workers[i]->partitions[j];
+                uint32_t id = static_cast<uint32_t>(j * workers.size() + i);
+                out[id] = {id, p.dispatched, p.tasks.size(), p.maxDepth};
+            }
+        }
+        return out;
+    }
+
+    // Partitions that dispatched more than `factor` times the mean, busiest first.
+    vector<PartitionStats> hotPartitions(double factor = 4.0) {
+        vector<PartitionStats> all = stats();
+        uint64_t total = 0;
+        for (auto& p : all) total += p.dispatched;
+        double threshold = factor * static_cast<double>(total) / all.size();
+        vector<PartitionStats> hot;
+        for (auto& p : all) {
+            if (p.dispatched > 0 && p.dispatched > threshold) hot.push_back(p);
+        }
+        sort(hot.begin(), hot.end(),
+             [](const PartitionStats& a, const PartitionStats& b) { return a.dispatched > b.dispatched; });
+        return hot;
+    }
+};
+
+// Delivery state of one (notification, recipient, channel):
+// Attempting -> Delivered | Failed, and Failed -> Attempting on a retry.
+enum class DeliveryState : uint8_t {
+    Attempting = 1,
+    Delivered = 2,
+    Failed = 3
+};
+
+// Remembers delivery outcomes so a replay can skip sends already confirmed
+class IDeliveryTracker {
+public:
+    virtual bool isDelivered(const NotificationMeta& meta, string_view channel) = 0;
+    virtual void record(const NotificationMeta& meta, string_view channel, DeliveryState state) = 0;
+    virtual ~IDeliveryTracker() = default;
+};
+
+// A send that failed for good, with everything needed to inspect and re-drive it
+struct DeadLetter {
+    int64_t failedAtMs = 0;
+    string channel;
+    NotificationMeta meta;
+    string content;
+    string reason;
+    string providerResponse;
+    vector<DeliveryAttempt> attempts;
+};
+
+class IDeadLetterSink {
+public:
+    virtual void deadLetter(const DeadLetter& letter) = 0;
+    virtual ~IDeadLetterSink() = default;
+};
+
+// Streaming delivery analytics in fixed memory. Every sketch merges with the
+// same sketch from another shard, so per-process snapshots combine into one
+// dashboard view.
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// HyperLogLog over 2^12 one-byte registers, about 1.6% standard error
+class HyperLogLog {
+private:
+    static constexpr int kPrecision = 12;
+    static constexpr size_t kRegisters = size_t(1) << kPrecision;
+    array<uint8_t, kRegisters> registers{};
+
+public:
+    void add(uint64_t hash) {
+        size_t index = hash >> (64 - kPrecision);
+        uint64_t rest = hash << kPrecision;
+        uint8_t rank = static_cast<uint8_t>(rest ? __builtin_clzll(rest) + 1 : 64 - kPrecision + 1);
+        registers[index] = max(registers[index], rank);
+    }
+
+    void merge(const HyperLogLog& other) {
+        for (size_t i = 0; i < kRegisters; i++) registers[i] = max(registers[i], other.registers[i]);
+    }
+
+    void clear() {
+        registers.fill(0);
+    }
+
+    double estimate() const {
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t r : registers) {
+            sum += ldexp(1.0, -r);
+            zeros += r == 0;
+        }
+        double m = kRegisters;
+        double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        // Linear counting is more accurate while many registers are still empty.
+        if (e <= 2.5 * m && zeros) e = m * log(m / zeros);
+        return e;
+    }
+
+    // The registers, one byte each
+    void saveState(string& out) const {
+        out.append(reinterpret_cast<const char*>(registers.data()), kRegisters);
+    }
+
+    bool loadState(string_view in, size_t& pos) {
+        if (in.size() - pos < kRegisters) return false;
+        memcpy(registers.data(), in.data() + pos, kRegisters);
+        pos += kRegisters;
+        return true;
+    }
+};
+
+// Count-Min sketch: 4 rows of 2048 counters; estimates never undercount.
+class CountMinSketch {
+private:
+    static constexpr size_t kDepth = 4;
+    static constexpr size_t kWidth = 2048;
+    vector<uint32_t> counts = vector<uint32_t>(kDepth * kWidth, 0);
+
+    static size_t cell(uint64_t hash, size_t row) {
+        uint64_t step = mix64(hash ^ 0x9E3779B97F4A7C15ULL) | 1;
+        return row * kWidth + (hash + row * step) % kWidth;
+    }
+
+public:
+    // Adds n and returns the new estimate.
+    uint64_t add(uint64_t hash, uint32_t n = 1) {
+        uint64_t estimate = UINT64_MAX;
+        for (size_t row = 0; row < kDepth; row++) {
+            uint32_t& c = counts[cell(hash, row)];
+            c += n;
+            estimate = min<uint64_t>(estimate, c);
+        }
+        return estimate;
+    }
+
+    uint64_t estimate(uint64_t hash) const {
+        uint64_t estimate = UINT64_MAX;
+        for (size_t row = 0; row < kDepth; row++) estimate = min<uint64_t>(estimate, counts[cell(hash, row)]);
+        return estimate;
+    }
+
+    void merge(const CountMinSketch& other) {
+        for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+    }
+
+    // The counters row by row, u32 each
+    void saveState(string& out) const {
+        for (uint32_t c : counts) putLE32(out, c);
+    }
+
+    bool loadState(string_view in, size_t& pos) {
+        if (in.size() - pos < 4 * counts.size()) return false;
+        for (auto& c : counts) {
+            c = readLE32(in.data() + pos);
+            pos += 4;
+        }
+        return true;
+    }
+};
+
+// Top keys by Count-Min estimate; only the tracked candidates keep their names.
+class HeavyHitters {
+private:
+    static constexpr size_t kTracked = 32;
+    CountMinSketch sketch;
+    vector<pair<string, uint64_t>> tracked;
+
+public:
+    void add(string_view key) {
+        uint64_t estimate = sketch.add(mix64(fnv1a(key)));
+        size_t smallest = 0;
+        for (size_t i = 0; i < tracked.size(); i++) {
+            if (tracked[i].first == key) {
+                tracked[i].second = estimate;
+                return;
+            }
+            if (tracked[i].second < tracked[smallest].second) smallest = i;
+        }
+        if (tracked.size() < kTracked) tracked.emplace_back(string(key), estimate);
+        else if (estimate > tracked[smallest].second) tracked[smallest] = {string(key), estimate};
+    }
+
+    void merge(const HeavyHitters& other) {
+        sketch.merge(other.sketch);
+        for (auto& candidate : other.tracked) {
+            auto same = [&](const pair<string, uint64_t>& t) { return t.first == candidate.first; };
+            if (find_if(tracked.begin(), tracked.end(), same) == tracked.end()) tracked.push_back(candidate);
+        }
+        for (auto& t : tracked) t.second = sketch.estimate(mix64(fnv1a(t.first)));
+        sort(tracked.begin(), tracked.end(), [](auto& a, auto& b) { return a.second > b.second; });
+        if (tracked.size() > kTracked) tracked.resize(kTracked);
+    }
+
+    vector<pair<string, uint64_t>> top(size_t n) const {
+        auto out = tracked;
+        sort(out.begin(), out.end(), [](auto& a, auto& b) { return a.second > b.second; });
+        if (out.size() > n) out.resize(n);
+        return out;
+    }
+
+    // sketch | tracked u16 + (key u16 string | estimate u64)
+    void saveState(string& out) const {
+        sketch.saveState(out);
+        putLE16(out, static_cast<uint16_t>(tracked.size()));
+        for (auto& t : tracked) {
+            putString16(out, t.first);
+            putLE64(out, t.second);
+        }
+    }
+
+    bool loadState(string_view in, size_t& pos) {
+        if (!sketch.loadState(in, pos) || in.size() - pos < 2) return false;
+        tracked.resize(readLE16(in.data() + pos));
+        pos += 2;
+        for (auto& t : tracked)
+            if (!readString(in, pos, 2, t.first) || !readU64(in, pos, t.second)) return false;
+        return true;
+    }
+};
+
+// Ring of per-slot HyperLogLogs, one per hour of the last day
+class HourlyUniques {
+private:
+    static constexpr size_t kHours = 24;
+    static constexpr int64_t kHourMs = 3600 * 1000;
+    array<int64_t, kHours> hours{};
+    vector<HyperLogLog> sketches = vector<HyperLogLog>(kHours);
+
+public:
+    void add(uint64_t hash, int64_t now) {
+        int64_t hour = now / kHourMs;
+        size_t slot = static_cast<size_t>(hour % kHours);
+        if (hours[slot] != hour) {
+            hours[slot] = hour;
+            sketches[slot].clear();
+        }
+        sketches[slot].add(hash);
+    }
+
+    // Distinct keys over the last `span` hours, the current one included.
+    double estimate(int64_t now, size_t span) const {
+        int64_t hour = now / kHourMs;
+        HyperLogLog merged;
+        for (size_t slot = 0; slot < kHours; slot++) {
+            if (hours[slot] > hour - static_cast<int64_t>(min(span, kHours)) && hours[slot] <= hour)
+                merged.merge(sketches[slot]);
+        }
+        return merged.estimate();
+    }
+
+    void merge(const HourlyUniques& other) {
+        for (size_t slot = 0; slot < kHours; slot++) {
+            if (other.hours[slot] > hours[slot]) {
+                hours[slot] = other.hours[slot];
+                sketches[slot] = other.sketches[slot];
+            } else if (other.hours[slot] == hours[slot]) {
+                sketches[slot].merge(other.sketches[slot]);
+            }
+        }
+    }
+
+    // Per slot: hour u64 | registers
+    void saveState(string& out) const {
+        for (size_t slot = 0; slot < kHours; slot++) {
+            putLE64(out, static_cast<uint64_t>(hours[slot]));
+            sketches[slot].saveState(out);
+        }
+    }
+
+    bool loadState(string_view in, size_t& pos) {
+        for (size_t slot = 0; slot < kHours; slot++) {
+            uint64_t hour;
+            if (!readU64(in, pos, hour) || !sketches[slot].loadState(in, pos)) return false;
+            hours[slot] = static_cast<int64_t>(hour);
+        }
+        return true;
+    }
+};
+
+// Per-key counts in one-minute buckets over the last hour
+class WindowedCounter {
+private:
+    static constexpr size_t kBuckets = 60;
+    static constexpr int64_t kBucketMs = 60 * 1000;
+
+    struct Series {
+        array<int64_t, kBuckets> minute{};
+        array<uint64_t, kBuckets> count{};
+    };
+
+    unordered_map<string, Series> series; // one per channel
+
+public:
+    void add(string_view key, int64_t now, uint64_t n = 1) {
+        Series& s = series[string(key)];
+        int64_t minute = now / kBucketMs;
+        size_t slot = static_cast<size_t>(minute % kBuckets);
+        if (s.minute[slot] != minute) {
+            s.minute[slot] = minute;
+            s.count[slot] = 0;
+        }
+        s.count[slot] += n;
+    }
+
+    uint64_t total(const string& key, int64_t now, size_t minutes) const {
+        auto it = series.find(key);
+        if (it == series.end()) return 0;
+        int64_t minute = now / kBucketMs;
+        uint64_t sum = 0;
+        for (size_t slot = 0; slot < kBuckets; slot++) {
+            int64_t m = it->second.minute[slot];
+            if (m > minute - static_cast<int64_t>(minutes) && m <= minute) sum += it->second.count[slot];
+        }
+        return sum;
+    }
+
+    vector<string> keys() const {
+        vector<string> out;
+        for (auto& entry : series) out.push_back(entry.first);
+        sort(out.begin(), out.end());
+        return out;
+    }
+
+    void merge(const WindowedCounter& other) {
+        for (auto& entry : other.series) {
+            Series& s = series[entry.first];
+            for (size_t slot = 0; slot < kBuckets; slot++) {
+                if (entry.second.minute[slot] > s.minute[slot]) {
+                    s.minute[slot] = entry.second.minute[slot];
+                    s.count[slot] = entry.second.count[slot];
+                } else if (entry.second.minute[slot] == s.minute[slot]) {
+                    s.count[slot] += entry.second.count[slot];
+                }
+            }
+        }
+    }
+
+    // keys u32 + (key u16 string | per bucket: minute u64 | count u64)
+    void saveState(string& out) const {
+        putLE32(out, static_cast<uint32_t>(series.size()));
+        for (auto& entry : series) {
+            putString16(out, entry.first);
+            for (size_t slot = 0; slot < kBuckets; slot++) {
+                putLE64(out, static_cast<uint64_t>(entry.second.minute[slot]));
+                putLE64(out, entry.second.count[slot]);
+            }
+        }
+    }
+
+    bool loadState(string_view in, size_t& pos) {
+        uint32_t keyCount;
+        if (!readU32(in, pos, keyCount)) return false;
+        string key;
+        for (uint32_t i = 0; i < keyCount; i++) {
+            if (!readString(in, pos, 2, key)) return false;
+            Series& s = series[key];
+            for (size_t slot = 0; slot < kBuckets; slot++) {
+                uint64_t minute;
+                if (!readU64(in, pos, minute) || !readU64(in, pos, s.count[slot])) return false;
+                s.minute[slot] = static_cast<int64_t>(minute);
+            }
+        }
+        return true;
+    }
+};
+
+// Point-in-time copy of one shard's sketches; snapshots from shards merge.
+struct AnalyticsSnapshot {
+    HourlyUniques recipients;
+    HeavyHitters types;
+    HeavyHitters senders; // by tenant
+    WindowedCounter channelSends;
+
+    void merge(const AnalyticsSnapshot& other) {
+        recipients.merge(other.recipients);
+        types.merge(other.types);
+        senders.merge(other.senders);
+        channelSends.merge(other.channelSends);
+    }
+
+    void saveState(string& out) const {
+        recipients.saveState(out);
+        types.saveState(out);
+        senders.saveState(out);
+        channelSends.saveState(out);
+    }
+
+    bool loadState(string_view in, size_t& pos) {
+        return recipients.loadState(in, pos) && types.loadState(in, pos) && senders.loadState(in, pos) &&
+               channelSends.loadState(in, pos);
+    }
+};
+
+// Observes every notification for recipients, types and senders; the engine
+// reports each successful channel send for the volume counters.
+class DeliveryAnalytics : public IObserver, public enable_shared_from_this<DeliveryAnalytics> {
+private:
+    NotificationObservable* observable;
+    mutable mutex lock;
+    AnalyticsSnapshot state;
+
+public:
+    DeliveryAnalytics() {
+        observable = NotificationService::getInstance().getObservable();
+    }
+
+    void subscribe() {
+        observable->addObserver(shared_from_this());
+    }
+
+    void update() override {
+        const NotificationMeta& meta = observable->getNotification()->getMeta();
+        int64_t now = nowMs();
+        lock_guard<mutex> guard(lock);
+        if (!meta.userId.empty()) state.recipients.add(mix64(fnv1a(meta.userId)), now);
+        if (!meta.type.empty()) state.types.add(meta.type);
+        if (!meta.tenantId.empty()) state.senders.add(meta.tenantId);
+    }
+
+    void recordSend(string_view channel) {
+        int64_t now = nowMs();
+        lock_guard<mutex> guard(lock);
+        state.channelSends.add(channel, now);
+    }
+
+    AnalyticsSnapshot snapshot() const {
+        lock_guard<mutex> guard(lock);
+        return state;
+    }
+
+    // Replaces the sketches, e.g. with those saved before a restart.
+    void restore(AnalyticsSnapshot saved) {
+        lock_guard<mutex> guard(lock);
+        state = std::move(saved);
+    }
+};
+
+// Engine
+class NotificationEngine : public IObserver, public enable_shared_from_this<NotificationEngine> {
+private:
+    NotificationObservable* observable;
+    vector<unique_ptr<INotificationStrategy>> strategies;
+    shared_ptr<OrderedDispatcher> dispatcher;
+    shared_ptr<IDeliveryTracker> tracker;
+    shared_ptr<IDeadLetterSink> deadLetters;
+    shared_ptr<DeliveryAnalytics> analytics;
+    atomic<uint64_t> expired{0};
+    atomic<uint64_t> skippedDelivered{0};
+    atomic<uint64_t> deadLettered{0};
+    atomic<uint64_t> undelivered{0};
+    bool preparing = false; // some strategy prepares batches
+    vector<shared_ptr<INotification>> pending; // held until batchEnd() while preparing
+    mutex asyncLock;
+    condition_variable asyncIdle;
+    size_t asyncInFlight = 0; // asynchronous sends not yet completed
+
+    // Settles a send that completed asynchronously; runs on the channel's thread.
+    void finishAsync(const shared_ptr<INotification>& notification, string_view channel, IDeliveryTracker* t,
+                     const exception_ptr& error) {
+        const NotificationMeta& meta = notification->getMeta();
+        if (!error) {
+            if (t) t->record(meta, channel, DeliveryState::Delivered);
+            if (analytics) analytics->recordSend(channel);
+        } else {
+            if (t) t->record(meta, channel, DeliveryState::Failed);
+            if (deadLetters) {
+                // Rendered again rather than kept for every send in flight.
+                string content;
+                try {
+                    notification->renderTo(content);
+                } catch (...) {
+                    content.clear();
+                }
+                deadLetter(error, channel, content, meta);
+            } else {
+                undelivered++;
+                cerr << "[Engine] notification " << meta.id << " not delivered on " << channel << ": "
+                     << describeError(error) << endl;
+            }
+        }
+        lock_guard<mutex> guard(asyncLock);
+        if (--asyncInFlight == 0) asyncIdle.notify_all();
+    }
+
+    // `rendered` is the content batchEnd() already rendered, if it could.
+    void deliverAll(const shared_ptr<INotification>& shared, const string* rendered = nullptr) {
+        const INotification& notification = *shared;
+        const NotificationMeta& meta = notification.getMeta();
+        if (meta.isExpired(nowMs())) {
+            expired++;
+            return;
+        }
+        // Without an id there is nothing to key the delivery state on.
+        IDeliveryTracker* t = meta.id.empty() ? nullptr : tracker.get();
+        // Reused per worker thread, so rendering does not allocate once warm.
+        thread_local string scratch;
+        try {
+            if (!rendered) notification.renderTo(scratch);
+        } catch (...) {
+            // Nothing can be sent, so every channel that still owes a send fails.
+            exception_ptr error = current_exception();
+            for (auto &s : strategies) {
+                string_view channel = s->getChannel();
+                if (meta.isMuted(channel) || (t && t->isDelivered(meta, channel))) continue;
+                if (t) t->record(meta, channel, DeliveryState::Failed);
+                if (deadLetters) deadLetter(error, channel, "", meta);
+            }
+            if (!deadLetters) throw;
+            return;
+        }
+        const string& content = rendered ? *rendered : scratch;
+        for (auto &s : strategies) {
+            string_view channel = s->getChannel();
+            if (meta.isMuted(channel)) continue;
+            if (t && t->isDelivered(meta, channel)) {
+                skippedDelivered++;
+                continue;
+            }
+            // Earlier channels may have been slow; re-check before each send.
+            if (meta.isExpired(nowMs())) {
+                expired++;
+                return;
+            }
+            if (t) t->record(meta, channel, DeliveryState::Attempting);
+            if (s->deliversAsync()) {
+                {
+                    lock_guard<mutex> guard(asyncLock);
+                    asyncInFlight++;
+                }
+                s->deliverAsync(content, meta, [this, shared, channel, t](exception_ptr error) {
+                    finishAsync(shared, channel, t, error);
+                });
+                continue;
+            }
+            try {
+                s->deliver(content, meta);
+            } catch (...) {
+                if (t) t->record(meta, channel, DeliveryState::Failed);
+                if (!deadLetters) throw;
+                // The other channels still get their chance.
+                deadLetter(current_exception(), channel, content, meta);
+                continue;
+            }
+            if (t) t->record(meta, channel, DeliveryState::Delivered);
+            if (analytics) analytics->recordSend(channel);
+        }
+    }
+
+    void deadLetter(const exception_ptr& error, string_view channel, const string& content,
+                    const NotificationMeta& meta) {
+        DeadLetter letter;
+        letter.failedAtMs = nowMs();
+        letter.channel.assign(channel);
+        letter.meta = meta;
+        letter.content = content;
+        try {
+            rethrow_exception(error);
+        } catch (const DeliveryFailure& e) {
+            letter.reason = e.what();
+            letter.providerResponse = e.providerResponse;
+            letter.attempts = e.attempts;
+        } catch (...) {
+            letter.reason = describeError(error);
+            letter.attempts.push_back({letter.channel, letter.failedAtMs, letter.reason});
+        }
+        deadLettered++;
+        deadLetters->deadLetter(letter);
+    }
+
+    void dispatch(shared_ptr<INotification> notification, shared_ptr<const string> rendered) {
+        if (!dispatcher) {
+            deliverAll(notification, rendered.get());
+            return;
+        }
+        const string& userId = notification->getMeta().userId;
+        dispatcher->submit(userId, [this, notification = std::move(notification), rendered = std::move(rendered)] {
+            try {
+                deliverAll(notification, rendered.get());
+            } catch (const exception& e) {
+                undelivered++;
+                cerr << "[Engine] notification " << notification->getMeta().id << " not delivered: " << e.what() << endl;
+            } catch (...) {
+                undelivered++;
+                cerr << "[Engine] notification " << notification->getMeta().id << " not delivered" << endl;
+            }
+        });
+    }
+
+public:
+    NotificationEngine() {
+        observable = NotificationService::getInstance().getObservable();
+    }
+
+    ~NotificationEngine() override {
+        waitIdle();
+    }
+
+    // Returns once every dispatched delivery, asynchronous sends included, has settled.
+    void waitIdle() {
+        if (dispatcher) dispatcher->waitIdle();
+        unique_lock<mutex> guard(asyncLock);
+        asyncIdle.wait(guard, [&] { return asyncInFlight == 0; });
+    }
+
+    // Deliveries then run on the dispatcher, in order per recipient.
+    void setDispatcher(shared_ptr<OrderedDispatcher> d) {
+        dispatcher = std::move(d);
+    }
+
+    // Sends already confirmed are skipped, e.g. when a queue is replayed after a crash.
+    void setDeliveryTracker(shared_ptr<IDeliveryTracker> t) {
+        tracker = std::move(t);
+    }
+
+    // Failed sends, render failures included, go to the sink. Without one a
+    // failure propagates out of update() when delivering inline; on a
+    // dispatcher there is no caller to take it, so it is counted and logged.
+    void setDeadLetterSink(shared_ptr<IDeadLetterSink> sink) {
+        deadLetters = std::move(sink);
+    }
+
+    // Successful sends are counted per channel.
+    void setAnalytics(shared_ptr<DeliveryAnalytics> a) {
+        analytics = std::move(a);
+    }
+
+    uint64_t deadLetteredCount() const {
+        return deadLettered;
+    }
+
+    // Dispatched notifications whose failure had no dead-letter sink to go to.
+    uint64_t undeliveredCount() const {
+        return undelivered;
+    }
+
+    // Notifications whose TTL ran out before one of their sends.
+    uint64_t expiredCount() const {
+        return expired;
+    }
+
+    // Sends skipped because the tracker had them as delivered.
+    uint64_t skippedDeliveredCount() const {
+        return skippedDelivered;
+    }
+
+    void subscribe() {
+        observable->addObserver(shared_from_this());
+    }
+
+    void addNotificationStrategy(unique_ptr<INotificationStrategy> ns) {
+        preparing = preparing || ns->preparesBatches();
+        strategies.push_back(std::move(ns));
+    }
+
+    void update() override {
+        auto notification = observable->getNotification();
+        if (preparing) pending.push_back(std::move(notification));
+        else dispatch(std::move(notification), nullptr);
+    }
+
+    void batchEnd() override {
+        if (pending.empty()) return;
+        vector<shared_ptr<INotification>> batch;
+        batch.swap(pending);
+        // Rendered here rather than on the workers, since preparing needs the whole batch.
+        auto contents = make_shared<vector<string>>(batch.size());
+        vector<shared_ptr<const string>> rendered(batch.size());
+        for (size_t i = 0; i < batch.size(); i++) {
+            try {
+                batch[i]->renderTo((*contents)[i]);
+                rendered[i] = shared_ptr<const string>(contents, &(*contents)[i]);
+            } catch (...) {
+                // deliverAll renders again and takes the failure path.
+            }
+        }
+        vector<PreparedSend> sends;
+        for (auto& s : strategies) {
+            if (!s->preparesBatches()) continue;
+            string_view channel = s->getChannel();
+            sends.clear();
+            for (size_t i = 0; i < batch.size(); i++) {
+                const NotificationMeta& meta = batch[i]->getMeta();
+                if (!rendered[i] || meta.isMuted(channel)) continue;
+                if (tracker && !meta.id.empty() && tracker->isDelivered(meta, channel)) continue;
+                sends.push_back({rendered[i], &meta});
+            }
+            if (!sends.empty()) s->prepareBatch(sends);
+        }
+        for (size_t i = 0; i < batch.size(); i++) dispatch(std::move(batch[i]), std::move(rendered[i]));
+    }
+
+};
+
+// Networking helpers
+static int listenTcp(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw runtime_error(string("socket: ") + strerror(errno));
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        string err = strerror(errno);
+        close(fd);
+        throw runtime_error("listen on port " + to_string(port) + ": " + err);
+    }
+    return fd;
+}
+
+// Blocking connection with Nagle off, for clients and the local benchmarks.
+static int connectTcp(const string& host, uint16_t port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) throw runtime_error("bad address: " + host);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        string err = strerror(errno);
+        if (fd >= 0) close(fd);
+        throw runtime_error("connect to " + host + ":" + to_string(port) + ": " + err);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static sockaddr_un unixAddress(const string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw runtime_error("socket path too long: " + path);
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+static int listenUnix(const string& path) {
+    sockaddr_un addr = unixAddress(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw runtime_error(string("socket: ") + strerror(errno));
+    unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        string err = strerror(errno);
+        close(fd);
+        throw runtime_error("listen on " + path + ": " + err);
+    }
+    return fd;
+}
+
+static bool iequals(string_view a, string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (tolower(static_cast<unsigned char>(a[i])) != tolower(static_cast<unsigned char>(b[i]))) return false;
+    }
+    return true;
+}
+
+static void appendJsonString(string& out, string_view s) {
+    out += '"';
+    for (char c : s) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+// HTTP/1.1 request parsing (views into the connection buffer, nothing is copied)
+struct HttpRequest {
+    string_view method;
+    string_view path;
+    string_view query;
+    string_view headers;
+    string_view body;
+    bool keepAlive = true;
+};
+
+static string_view queryParam(string_view query, string_view key) {
+    while (!query.empty()) {
+        size_t amp = query.find('&');
+        string_view pair = query.substr(0, amp);
+        size_t eq = pair.find('=');
+        if (pair.substr(0, eq) == key) return eq == string_view::npos ? string_view() : pair.substr(eq + 1);
+        if (amp == string_view::npos) break;
+        query.remove_prefix(amp + 1);
+    }
+    return {};
+}
+
+// Returns the number of bytes consumed, 0 if the request is incomplete, -1 if malformed.
+static long parseHttpRequest(string_view buf, HttpRequest& req) {
+    constexpr size_t kMaxHeaderBytes = 16 * 1024;
+    constexpr size_t kMaxBodyBytes = 1024 * 1024;
+
+    size_t headerEnd = buf.find("\r\n\r\n");
+    if (headerEnd == string_view::npos) return buf.size() > kMaxHeaderBytes ? -1 : 0;
+    string_view head = buf.substr(0, headerEnd);
+
+    size_t lineEnd = head.find("\r\n");
+    string_view line = head.substr(0, lineEnd);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.rfind(' ');
+    if (sp1 == string_view::npos || sp2 <= sp1) return -1;
+
+    req.method = line.substr(0, sp1);
+    string_view target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    string_view version = line.substr(sp2 + 1);
+    if (version != "HTTP/1.1" && version != "HTTP/1.0") return -1;
+    req.keepAlive = version == "HTTP/1.1";
+
+    size_t q = target.find('?');
+    req.path = target.substr(0, q);
+    req.query = q == string_view::npos ? string_view() : target.substr(q + 1);
+
+    size_t contentLength = 0;
+    size_t pos = lineEnd == string_view::npos ? head.size() : lineEnd + 2;
+    req.headers = head.substr(pos);
+    while (pos < head.size()) {
+        size_t e = head.find("\r\n", pos);
+        if (e == string_view::npos) e = head.size();
+        string_view h = head.substr(pos, e - pos);
+        size_t colon = h.find(':');
+        if (colon != string_view::npos) {
+            string_view name = h.substr(0, colon);
+            string_view value = trim(h.substr(colon + 1));
+            if (iequals(name, "content-length")) {
+                if (value.empty()) return -1;
+                contentLength = 0;
+                for (char c : value) {
+                    if (c < '0' || c > '9' || contentLength > kMaxBodyBytes) return -1;
+                    contentLength = contentLength * 10 + (c - '0');
+                }
+            } else if (iequals(name, "connection")) {
+                if (iequals(value, "close")) req.keepAlive = false;
+                else if (iequals(value, "keep-alive")) req.keepAlive = true;
+            } else if (iequals(name, "transfer-encoding")) {
+                return -1; // chunked uploads are not supported
+            }
+        }
+        pos = e + 2;
+    }
+
+    if (contentLength > kMaxBodyBytes) return -1;
+    size_t total = headerEnd + 4 + contentLength;
+    if (buf.size() < total) return 0;
+    req.body = buf.substr(headerEnd + 4, contentLength);
+    return static_cast<long>(total);
+}
+
+static string_view httpHeader(string_view headers, string_view name) {
+    while (!headers.empty()) {
+        size_t e = headers.find("\r\n");
+        string_view h = headers.substr(0, e);
+        size_t colon = h.find(':');
+        if (colon != string_view::npos && iequals(h.substr(0, colon), name)) return trim(h.substr(colon + 1));
+        if (e == string_view::npos) break;
+        headers.remove_prefix(e + 2);
+    }
+    return {};
+}
+
+// `extraHeaders` holds complete header lines, each ending in CRLF.
+static void appendHttpResponse(string& out, int status, string_view reason, string_view body, bool keepAlive,
+                               string_view extraHeaders = {}) {
+    out += "HTTP/1.1 ";
+    out += to_string(status);
+    out += ' ';
+    out += reason;
+    out += "\r\n";
+    out += extraHeaders;
+    out += "Content-Type: application/json\r\nContent-Length: ";
+    out += to_string(body.size());
+    out += keepAlive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+    out += body;
+}
+
+// SendNotification payload parsing: simdjson-style two-stage scan.
+// Stage 1 indexes structural characters 64 bytes at a time, stage 2 walks
+// the index and hands out views into the request body.
+struct SendNotificationRequest {
+    string_view id;
+    string_view type;
+    string_view message; // raw JSON string contents, escapes not yet decoded
+    string_view priority;
+    string_view templateName; // rendered with `vars` instead of `message`
+    string_view locale;
+    uint64_t ttlMs = 0; // 0 never expires
+    vector<string_view> recipients;
+    vector<pair<string_view, bool>> preferences;
+    vector<pair<string_view, string_view>> vars; // values still JSON-escaped
+
+    void clear() {
+        id = type = message = priority = templateName = locale = {};
+        ttlMs = 0;
+        recipients.clear();
+        preferences.clear();
+        vars.clear();
+    }
+};
+
+static void appendUtf8(string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+static bool parseHex4(string_view s, size_t pos, uint32_t& value) {
+    if (pos + 4 > s.size()) return false;
+    value = 0;
+    for (size_t i = pos; i < pos + 4; i++) {
+        char c = s[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return false;
+    }
+    return true;
+}
+
+// Decodes the contents of a JSON string literal onto out.
+static bool appendJsonUnescaped(string& out, string_view raw) {
+    size_t start = 0;
+    while (true) {
+        size_t bs = raw.find('\\', start);
+        out.append(raw.substr(start, bs - start));
+        if (bs == string_view::npos) return true;
+        if (bs + 1 >= raw.size()) return false;
+        char c = raw[bs + 1];
+        start = bs + 2;
+        switch (c) {
+        case '"': out += '"'; break;
+        case '\\': out += '\\'; break;
+        case '/': out += '/'; break;
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+            uint32_t cp;
+            if (!parseHex4(raw, start, cp)) return false;
+            start += 4;
+            if (cp >= 0xD800 && cp < 0xDC00) {
+                uint32_t low;
+                if (raw.substr(start, 2) != "\\u" || !parseHex4(raw, start + 2, low) ||
+                    low < 0xDC00 || low >= 0xE000) return false;
+                start += 6;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            } else if (cp >= 0xDC00 && cp < 0xE000) {
+                return false;
+            }
+            appendUtf8(out, cp);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+}
+
+// General-purpose JSON document: a conventional recursive-descent parser
+// that builds a tree, one character at a time. Used for small requests off
+// the hot path and as the baseline the structural parser is measured against.
+struct JsonValue {
+    enum class Type : uint8_t { Null, Bool, Number, String, Array, Object };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    string text;
+    vector<JsonValue> items;
+    vector<pair<string, JsonValue>> fields;
+
+    const JsonValue* find(string_view key) const {
+        for (auto& field : fields) {
+            if (field.first == key) return &field.second;
+        }
+        return nullptr;
+    }
+
+    static bool parse(string_view json, JsonValue& out) {
+        size_t pos = 0;
+        if (!parseValue(json, pos, out, 0)) return false;
+        skipSpace(json, pos);
+        return pos == json.size();
+    }
+
+private:
+    static constexpr int kMaxDepth = 64;
+
+    static void skipSpace(string_view in, size_t& pos) {
+        while (pos < in.size() && (in[pos] == ' ' || in[pos] == '\t' || in[pos] == '\n' || in[pos] == '\r')) pos++;
+    }
+
+    static bool parseString(string_view in, size_t& pos, string& out) {
+        if (pos >= in.size() || in[pos] != '"') return false;
+        size_t start = ++pos;
+        while (pos < in.size() && in[pos] != '"') {
+            if (static_cast<unsigned char>(in[pos]) < 0x20) return false;
+            pos += in[pos] == '\\' ? 2 : 1;
+        }
+        if (pos >= in.size()) return false;
+        out.clear();
+        return appendJsonUnescaped(out, in.substr(start, pos++ - start));
+    }
+
+    static bool parseValue(string_view in, size_t& pos, JsonValue& out, int depth) {
+        if (depth > kMaxDepth) return false;
+        skipSpace(in, pos);
+        if (pos >= in.size()) return false;
+        char c = in[pos];
+        if (c == '"') {
+            out.type = Type::String;
+            return parseString(in, pos, out.text);
+        }
+        if (c == '{') {
+            out.type = Type::Object;
+            pos++;
+            skipSpace(in, pos);
+            if (pos < in.size() && in[pos] == '}') return ++pos, true;
+            while (true) {
+                out.fields.emplace_back();
+                skipSpace(in, pos);
+                if (!parseString(in, pos, out.fields.back().first)) return false;
+                skipSpace(in, pos);
+                if (pos >= in.size() || in[pos++] != ':') return false;
+                if (!parseValue(in, pos, out.fields.back().second, depth + 1)) return false;
+                skipSpace(in, pos);
+                if (pos >= in.size()) return false;
+                if (in[pos] == '}') return ++pos, true;
+                if (in[pos++] != ',') return false;
+            }
+        }
+        if (c == '[') {
+            out.type = Type::Array;
+            pos++;
+            skipSpace(in, pos);
+            if (pos < in.size() && in[pos] == ']') return ++pos, true;
+            while (true) {
+                out.items.emplace_back();
+                if (!parseValue(in, pos, out.items.back(), depth + 1)) return false;
+                skipSpace(in, pos);
+                if (pos >= in.size()) return false;
+                if (in[pos] == ']') return ++pos, true;
+                if (in[pos++] != ',') return false;
+            }
+        }
+        for (auto literal : {"true", "false", "null"}) {
+            string_view word(literal);
+            if (in.substr(pos, word.size()) == word) {
+                pos += word.size();
+                out.type = word == "null" ? Type::Null : Type::Bool;
+                out.boolean = word == "true";
+                return true;
+            }
+        }
+        size_t start = pos;
+        if (pos < in.size() && in[pos] == '-') pos++;
+        while (pos < in.size() && (isdigit(static_cast<unsigned char>(in[pos])) || in[pos] == '.' || in[pos] == 'e' ||
+                                   in[pos] == 'E' || in[pos] == '+' || in[pos] == '-')) pos++;
+        if (pos == start) return false;
+        string digits(in.substr(start, pos - start));
+        char* end = nullptr;
+        out.type = Type::Number;
+        out.number = strtod(digits.c_str(), &end);
+        return end == digits.c_str() + digits.size();
+    }
+};
+
+class SendNotificationParser {
+private:
+    struct BlockMasks {
+        uint64_t backslash;
+        uint64_t quote;
+        uint64_t op;
+    };
+
+    vector<uint32_t> structurals;
+    string_view input;
+    size_t cursor = 0;
+    size_t consumedTo = 0; // input before this offset has been accounted for
+    const char* error = nullptr;
+
+    static BlockMasks classify(const char* p) {
+        BlockMasks m{0, 0, 0};
+#ifdef __SSE2__
+        const __m128i bs = _mm_set1_epi8('\\');
+        const __m128i qt = _mm_set1_epi8('"');
+        const __m128i lb = _mm_set1_epi8('{');
+        const __m128i rb = _mm_set1_epi8('}');
+        const __m128i co = _mm_set1_epi8(':');
+        const __m128i cm = _mm_set1_epi8(',');
+        const __m128i lower = _mm_set1_epi8(0x20);
+        for (int i = 0; i < 4; i++) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+            // '[' and ']' differ from '{' and '}' only in bit 0x20.
+            __m128i folded = _mm_or_si128(v, lower);
+            __m128i op = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(folded, lb), _mm_cmpeq_epi8(folded, rb)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, co), _mm_cmpeq_epi8(v, cm)));
+            int shift = 16 * i;
+            m.backslash |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, bs)))) << shift;
+            m.quote |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, qt)))) << shift;
+            m.op |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(op))) << shift;
+        }
+#else
+        for (int i = 0; i < 64; i++) {
+            char c = p[i];
+            uint64_t bit = uint64_t(1) << i;
+            if (c == '\\') m.backslash |= bit;
+            else if (c == '"') m.quote |= bit;
+            else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') m.op |= bit;
+        }
+#endif
+        return m;
+    }
+
+    static uint64_t prefixXor(uint64_t x) {
+        x ^= x << 1;
+        x ^= x << 2;
+        x ^= x << 4;
+        x ^= x << 8;
+        x ^= x << 16;
+        x ^= x << 32;
+        return x;
+    }
+
+    // Characters preceded by an odd-length run of backslashes.
+    static uint64_t findEscaped(uint64_t backslash, uint64_t& prevEndsOdd) {
+        const uint64_t evenBits = 0x5555555555555555ULL;
+        const uint64_t oddBits = ~evenBits;
+        uint64_t startEdges = backslash & ~(backslash << 1);
+        uint64_t evenStartMask = evenBits ^ prevEndsOdd;
+        uint64_t evenStarts = startEdges & evenStartMask;
+        uint64_t oddStarts = startEdges & ~evenStartMask;
+        uint64_t evenCarries = backslash + evenStarts;
+        uint64_t oddCarries;
+        bool endsOdd = __builtin_add_overflow(backslash, oddStarts, &oddCarries);
+        oddCarries |= prevEndsOdd;
+        prevEndsOdd = endsOdd ? 1 : 0;
+        uint64_t evenCarryEnds = evenCarries & ~backslash;
+        uint64_t oddCarryEnds = oddCarries & ~backslash;
+        return (evenCarryEnds & oddBits) | (oddCarryEnds & evenBits);
+    }
+
+    bool indexStructurals(string_view json) {
+        structurals.clear();
+        uint64_t prevEndsOdd = 0;
+        uint64_t prevInString = 0;
+        char tail[64];
+        for (size_t pos = 0; pos < json.size(); pos += 64) {
+            const char* block = json.data() + pos;
+            if (json.size() - pos < 64) {
+                memset(tail, ' ', sizeof(tail));
+                memcpy(tail, block, json.size() - pos);
+                block = tail;
+            }
+            BlockMasks m = classify(block);
+            uint64_t quotes = m.quote & ~findEscaped(m.backslash, prevEndsOdd);
+            uint64_t inString = prefixXor(quotes) ^ prevInString;
+            prevInString = static_cast<uint64_t>(static_cast<int64_t>(inString) >> 63);
+            uint64_t structural = (m.op & ~inString) | quotes;
+            while (structural) {
+                structurals.push_back(static_cast<uint32_t>(pos + __builtin_ctzll(structural)));
+                structural &= structural - 1;
+            }
+        }
+        if (prevInString) return fail("unterminated string");
+        return true;
+    }
+
+    bool fail(const char* message) {
+        error = message;
+        return false;
+    }
+
+    char peek() const {
+        return cursor < structurals.size() ? input[structurals[cursor]] : '\0';
+    }
+
+    bool gapIsBlank(size_t from, size_t to) const {
+        for (size_t i = from; i < to; i++) {
+            char c = input[i];
+            if (c != ' ' && c != '\t' && c != '\n' && c != '\r') return false;
+        }
+        return true;
+    }
+
+    // Consumes the scalar (number, true, false, null) ending at the next structural.
+    string_view takeScalar() {
+        size_t to = cursor < structurals.size() ? structurals[cursor] : input.size();
+        string_view v = input.substr(consumedTo, to - consumedTo);
+        consumedTo = to;
+        while (!v.empty() && isspace(static_cast<unsigned char>(v.front()))) v.remove_prefix(1);
+        while (!v.empty() && isspace(static_cast<unsigned char>(v.back()))) v.remove_suffix(1);
+        return v;
+    }
+
+    bool expect(char c) {
+        if (peek() != c || !gapIsBlank(consumedTo, structurals[cursor])) return false;
+        consumedTo = structurals[cursor++] + 1;
+        return true;
+    }
+
+    bool parseString(string_view& out) {
+        if (!expect('"')) return fail("expected string");
+        if (cursor >= structurals.size()) return fail("unterminated string");
+        size_t open = structurals[cursor - 1];
+        size_t close = structurals[cursor++];
+        out = input.substr(open + 1, close - open - 1);
+        consumedTo = close + 1;
+        return true;
+    }
+
+    bool parseBool(bool& out) {
+        string_view v = takeScalar();
+        if (v == "true") out = true;
+        else if (v == "false") out = false;
+        else return fail("expected boolean");
+        return true;
+    }
+
+    bool parseUnsigned(uint64_t& out) {
+        string_view v = takeScalar();
+        if (v.empty() || v.size() > 15) return fail("expected non-negative integer");
+        out = 0;
+        for (char c : v) {
+            if (c < '0' || c > '9') return fail("expected non-negative integer");
+            out = out * 10 + static_cast<uint64_t>(c - '0');
+        }
+        return true;
+    }
+
+    bool parseStringArray(vector<string_view>& out) {
+        if (!expect('[')) return fail("expected array");
+        if (expect(']')) return true;
+        while (true) {
+            string_view item;
+            if (!parseString(item)) return false;
+            out.push_back(item);
+            if (expect(',')) continue;
+            if (expect(']')) return true;
+            return fail("expected ',' or ']'");
+        }
+    }
+
+    bool parseBoolObject(vector<pair<string_view, bool>>& out) {
+        if (!expect('{')) return fail("expected object");
+        if (expect('}')) return true;
+        while (true) {
+            string_view key;
+            bool value;
+            if (!parseString(key)) return false;
+            if (!expect(':')) return fail("expected ':'");
+            if (!parseBool(value)) return false;
+            out.emplace_back(key, value);
+            if (expect(',')) continue;
+            if (expect('}')) return true;
+            return fail("expected ',' or '}'");
+        }
+    }
+
+    bool parseStringObject(vector<pair<string_view, string_view>>& out) {
+        if (!expect('{')) return fail("expected object");
+        if (expect('}')) return true;
+        while (true) {
+            string_view key, value;
+            if (!parseString(key)) return false;
+            if (!expect(':')) return fail("expected ':'");
+            if (!parseString(value)) return false;
+            out.emplace_back(key, value);
+            if (expect(',')) continue;
+            if (expect('}')) return true;
+            return fail("expected ',' or '}'");
+        }
+    }
+
+    bool skipValue() {
+        char c = peek();
+        if (c == '"') {
+            string_view ignored;
+            return parseString(ignored);
+        }
+        if (c == '{' || c == '[') {
+            int depth = 0;
+            do {
+                char s = peek();
+                if (s == '{' || s == '[') depth++;
+                else if (s == '}' || s == ']') depth--;
+                else if (s == '\0') return fail("unbalanced brackets");
+                cursor += s == '"' ? 2 : 1;
+            } while (depth > 0);
+            consumedTo = structurals[cursor - 1] + 1;
+            return true;
+        }
+        string_view v = takeScalar();
+        bool number = !v.empty() && (v[0] == '-' || (v[0] >= '0' && v[0] <= '9'));
+        if (!number && v != "true" && v != "false" && v != "null") return fail("expected value");
+        return true;
+    }
+
+public:
+    SendNotificationParser() {
+        structurals.reserve(256);
+    }
+
+    const char* lastError() const {
+        return error ? error : "";
+    }
+
+    bool parse(string_view json, SendNotificationRequest& out) {
+        out.clear();
+        input = json;
+        cursor = 0;
+        consumedTo = 0;
+        error = nullptr;
+        if (json.size() > UINT32_MAX) return fail("payload too large");
+        if (!indexStructurals(json)) return false;
+
+        if (!expect('{')) return fail("expected object");
+        if (!expect('}')) {
+            while (true) {
+                string_view key;
+                if (!parseString(key)) return false;
+                if (!expect(':')) return fail("expected ':'");
+                bool ok;
+                if (key == "id") ok = parseString(out.id);
+                else if (key == "type") ok = parseString(out.type);
+                else if (key == "message") ok = parseString(out.message);
+                else if (key == "priority") ok = parseString(out.priority);
+                else if (key == "template") ok = parseString(out.templateName);
+                else if (key == "locale") ok = parseString(out.locale);
+                else if (key == "vars") ok = parseStringObject(out.vars);
+                else if (key == "ttlMs") ok = parseUnsigned(out.ttlMs);
+                else if (key == "recipients") ok = parseStringArray(out.recipients);
+                else if (key == "preferences") ok = parseBoolObject(out.preferences);
+                else ok = skipValue();
+                if (!ok) return false;
+                if (expect(',')) continue;
+                if (expect('}')) break;
+                return fail("expected ',' or '}'");
+            }
+        }
+        if (cursor != structurals.size() || !gapIsBlank(consumedTo, json.size()))
+            return fail("trailing content");
+        if (out.message.empty() && out.templateName.empty()) return fail("missing message");
+        if (!out.priority.empty() && out.priority != "low" && out.priority != "normal" && out.priority != "high")
+            return fail("unknown priority");
+        return true;
+    }
+};
+
+// Decodes a request's template variables once for all of its recipients.
+static shared_ptr<const TemplateVars> makeTemplateVars(const SendNotificationRequest& req) {
+    auto vars = make_shared<TemplateVars>();
+    vars->reserve(req.vars.size());
+    for (auto& v : req.vars) {
+        auto& var = vars->emplace_back();
+        if (!appendJsonUnescaped(var.first, v.first) || !appendJsonUnescaped(var.second, v.second)) return nullptr;
+    }
+    return vars;
+}
+
+// Builds the notification for one recipient straight from the parsed views.
+// With a compiled template the message is rendered from it and `vars` on delivery.
+static shared_ptr<INotification> makeNotification(const SendNotificationRequest& req, string_view recipient,
+                                                  string_view tenantId = {},
+                                                  shared_ptr<const CompiledTemplate> compiled = nullptr,
+                                                  shared_ptr<const TemplateVars> vars = nullptr) {
+    NotificationMeta meta;
+    meta.id.assign(req.id);
+    meta.type.assign(req.type);
+    meta.tenantId.assign(tenantId);
+    meta.locale.assign(req.locale);
+    if (req.ttlMs) meta.expiresAtMs = nowMs() + static_cast<int64_t>(req.ttlMs);
+    if (req.priority == "low") meta.priority = NotificationPriority::Low;
+    else if (req.priority == "high") meta.priority = NotificationPriority::High;
+    if (!appendJsonUnescaped(meta.userId, recipient)) return nullptr;
+    for (auto& pref : req.preferences) {
+        if (!pref.second) meta.mutedChannels.emplace_back(pref.first);
+    }
+    if (compiled) {
+        meta.templateName = compiled->getName();
+        return make_shared<TemplateNotification>(std::move(compiled), std::move(vars), std::move(meta));
+    }
+    string text;
+    text.reserve(req.message.size());
+    if (!appendJsonUnescaped(text, req.message)) return nullptr;
+    return make_shared<SimpleNotification>(std::move(text), std::move(meta));
+}
+
+// Non-blocking epoll server skeleton shared by the network front ends
+class EpollServer {
+protected:
+    struct Connection {
+        int fd = -1;
+        string in;
+        string out;
+        size_t outOffset = 0;
+        // Pre-encoded payloads shared with other connections, sent after `out`.
+        vector<shared_ptr<const string>> frames;
+        size_t frameHead = 0;
+        size_t frameOffset = 0;
+        bool closing = false;
+        bool wantWrite = false;
+        virtual ~Connection() = default;
+    };
+
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    atomic<bool> running{true};
+    unordered_map<int, unique_ptr<Connection>> connections;
+
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd, op, fd, &ev) < 0)
+            throw runtime_error(string("epoll_ctl: ") + strerror(errno));
+    }
+
+    void closeConnection(int fd) {
+        auto it = connections.find(fd);
+        if (it == connections.end()) return;
+        onClose(*it->second);
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections.erase(it);
+    }
+
+    // Returns false once the connection has been closed.
+    bool flush(Connection& conn) {
+        while (conn.outOffset < conn.out.size() || conn.frameHead < conn.frames.size()) {
+            iovec iov[16];
+            int count = 0;
+            if (conn.outOffset < conn.out.size())
+                iov[count++] = {conn.out.data() + conn.outOffset, conn.out.size() - conn.outOffset};
+            for (size_t i = conn.frameHead; i < conn.frames.size() && count < 16; i++) {
+                size_t skip = i == conn.frameHead ? conn.frameOffset : 0;
+                iov[count++] = {const_cast<char*>(conn.frames[i]->data()) + skip, conn.frames[i]->size() - skip};
+            }
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = static_cast<size_t>(count);
+            ssize_t n = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (!conn.wantWrite) {
+                        conn.wantWrite = true;
+                        watch(conn.fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, EPOLL_CTL_MOD);
+                    }
+                    return true;
+                }
+                if (errno == EINTR) continue;
+                closeConnection(conn.fd);
+                return false;
+            }
+            size_t sent = static_cast<size_t>(n);
+            size_t fromOut = min(sent, conn.out.size() - conn.outOffset);
+            conn.outOffset += fromOut;
+            sent -= fromOut;
+            while (sent > 0) {
+                size_t left = conn.frames[conn.frameHead]->size() - conn.frameOffset;
+                size_t used = min(sent, left);
+                conn.frameOffset += used;
+                sent -= used;
+                if (used == left) {
+                    conn.frames[conn.frameHead++].reset();
+                    conn.frameOffset = 0;
+                }
+            }
+        }
+        conn.out.clear();
+        conn.outOffset = 0;
+        conn.frames.clear();
+        conn.frameHead = 0;
+        if (conn.closing) {
+            closeConnection(conn.fd);
+            return false;
+        }
+        if (conn.wantWrite) {
+            conn.wantWrite = false;
+            watch(conn.fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+        }
+        return true;
+    }
+
+    virtual unique_ptr<Connection> makeConnection() {
+        return make_unique<Connection>();
+    }
+
+    virtual void onAccept(Connection&) {}
+    virtual void onClose(Connection&) {}
+    virtual void onWake() {}
+
+    // Servers with deadlines report how long the loop may sleep and get onTimer after each wait.
+    virtual int pollTimeoutMs() { return -1; }
+    virtual void onTimer() {}
+
+    // Consume whatever complete messages conn.in holds and queue replies on conn.out.
+    virtual void onInput(Connection& conn) = 0;
+
+private:
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            auto conn = makeConnection();
+            conn->fd = fd;
+            watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+            Connection& ref = *conn;
+            connections[fd] = std::move(conn);
+            onAccept(ref);
+            if (!ref.out.empty()) flush(ref);
+        }
+    }
+
+    void onReadable(Connection& conn) {
+        char buf[64 * 1024];
+        bool peerClosed = false;
+        while (true) {
+            ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                conn.in.append(buf, static_cast<size_t>(n));
+                if (static_cast<size_t>(n) < sizeof(buf)) break;
+                continue;
+            }
+            if (n == 0) { peerClosed = true; break; }
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) peerClosed = true;
+            break;
+        }
+
+        if (!conn.in.empty()) onInput(conn);
+        if (peerClosed) conn.closing = true;
+        flush(conn);
+    }
+
+public:
+    explicit EpollServer(int listeningSocket) : listenFd(listeningSocket) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) {
+            close(listenFd);
+            throw runtime_error(string("epoll setup: ") + strerror(errno));
+        }
+        watch(listenFd, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wakeFd, EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    virtual ~EpollServer() {
+        for (auto& entry : connections) close(entry.first);
+        if (wakeFd >= 0) close(wakeFd);
+        if (epollFd >= 0) close(epollFd);
+        if (listenFd >= 0) close(listenFd);
+    }
+
+    EpollServer(const EpollServer&) = delete;
+    EpollServer& operator=(const EpollServer&) = delete;
+
+    uint16_t port() const {
+        sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+        getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &len);
+        return ntohs(addr.sin_port);
+    }
+
+    void run() {
+        epoll_event events[256];
+        while (running) {
+            int n = epoll_wait(epollFd, events, 256, pollTimeoutMs());
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error(string("epoll_wait: ") + strerror(errno));
+            }
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    acceptAll();
+                    continue;
+                }
+                if (fd == wakeFd) {
+                    uint64_t value;
+                    while (read(wakeFd, &value, sizeof(value)) > 0) {}
+                    onWake();
+                    continue;
+                }
+                auto it = connections.find(fd);
+                if (it == connections.end()) continue;
+                Connection& conn = *it->second;
+                uint32_t ev = events[i].events;
+                if ((ev & EPOLLERR) || ((ev & EPOLLHUP) && !(ev & EPOLLIN))) {
+                    closeConnection(fd);
+                    continue;
+                }
+                if (ev & EPOLLOUT) {
+                    if (!flush(conn)) continue;
+                }
+                // Drain what the peer sent before its hangup.
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) onReadable(conn);
+            }
+            onTimer();
+        }
+    }
+
+    // Wakes the loop; safe to call from another thread or a signal handler.
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void stop() {
+        running = false;
+        wake();
+    }
+};
+
+// Per-user in-app mailbox: the most recent messages with per-user sequence numbers
+struct MailboxItem {
+    uint64_t seq;
+    shared_ptr<const string> content;
+    bool read = false;
+};
+
+// Read flags of one mailbox. Every seq up to readThrough is read; above it,
+// bit (seq - base) of `words` marks a read, with base a multiple of 64.
+// readAbove counts those bits, so the unread count needs no scan.
+class ReadBitmap {
+private:
+    uint64_t readThrough = 0;
+    uint64_t base = 0;
+    deque<uint64_t> words;
+    uint64_t readAbove = 0;
+
+public:
+    bool isRead(uint64_t seq) const {
+        if (seq <= readThrough) return true;
+        uint64_t bit = seq - base;
+        return bit / 64 < words.size() && (words[bit / 64] >> (bit % 64) & 1);
+    }
+
+    // Everything up to `through` counts as read; drops the words that covers.
+    void advance(uint64_t through) {
+        if (through <= readThrough) return;
+        readThrough = through;
+        while (!words.empty() && base + 64 <= through + 1) {
+            readAbove -= __builtin_popcountll(words.front());
+            words.pop_front();
+            base += 64;
+        }
+        if (words.empty()) {
+            base = (through + 1) / 64 * 64;
+            return;
+        }
+        uint64_t covered = through + 1 > base ? (uint64_t(1) << (through + 1 - base)) - 1 : 0;
+        readAbove -= __builtin_popcountll(words.front() & covered);
+        words.front() &= ~covered;
+    }
+
+    // Sets the bits for `seqs` (sorted in place) with one OR per touched word;
+    // seqs past lastSeq are ignored.
+    void markRead(vector<uint64_t>& seqs, uint64_t lastSeq) {
+        sort(seqs.begin(), seqs.end());
+        size_t i = 0;
+        while (i < seqs.size()) {
+            uint64_t seq = seqs[i];
+            if (seq <= readThrough || seq > lastSeq) {
+                i++;
+                continue;
+            }
+            size_t word = (seq - base) / 64;
+            uint64_t mask = 0;
+            for (; i < seqs.size() && seqs[i] <= lastSeq && (seqs[i] - base) / 64 == word; i++)
+                mask |= uint64_t(1) << ((seqs[i] - base) % 64);
+            if (word >= words.size()) words.resize(word + 1, 0);
+            readAbove += __builtin_popcountll(mask & ~words[word]);
+            words[word] |= mask;
+        }
+        // Fold fully read leading words into the watermark.
+        while (!words.empty() && base + 63 <= lastSeq) {
+            uint64_t bits = words.front();
+            if (readThrough >= base) bits |= (uint64_t(1) << (readThrough + 1 - base)) - 1;
+            if (~bits != 0) break;
+            advance(base + 63);
+        }
+    }
+
+    uint64_t unread(uint64_t lastSeq) const {
+        return lastSeq > readThrough ? lastSeq - readThrough - readAbove : 0;
+    }
+
+    // readThrough u64 | base u64 | words u32 + u64s
+    void saveState(string& out) const {
+        putLE64(out, readThrough);
+        putLE64(out, base);
+        putLE32(out, static_cast<uint32_t>(words.size()));
+        for (uint64_t w : words) putLE64(out, w);
+    }
+
+    bool loadState(string_view in, size_t& pos) {
+        uint32_t wordCount;
+        if (!readU64(in, pos, readThrough) || !readU64(in, pos, base) || !readU32(in, pos, wordCount)) return false;
+        words.resize(wordCount);
+        readAbove = 0;
+        for (auto& w : words) {
+            if (!readU64(in, pos, w)) return false;
+            readAbove += __builtin_popcountll(w);
+        }
+        return true;
+    }
+};
+
+class InAppMailbox : public IInAppPublisher {
+private:
+    struct Box {
+        vector<MailboxItem> items;
+        uint64_t nextSeq = 1;
+        ReadBitmap reads;
+    };
+
+    size_t capacity;
+    shared_ptr<BodyStore> bodies;
+    mutable mutex lock;
+    unordered_map<string, Box> boxes;
+    function<void(const string&, uint64_t, uint64_t)> listener;
+
+    void append(const string& userId, const string& content, uint64_t historySeq) {
+        auto shared = bodies ? bodies->intern(content) : make_shared<const string>(content);
+        lock_guard<mutex> guard(lock);
+        Box& box = boxes[userId];
+        uint64_t seq = box.nextSeq++;
+        box.items.push_back({seq, std::move(shared)});
+        // Trim in halves so the erase cost is amortized.
+        if (box.items.size() >= 2 * capacity) {
+            box.items.erase(box.items.begin(), box.items.end() - capacity);
+            // Evicted items can no longer be read, so they stop counting as unread.
+            box.reads.advance(box.items.front().seq - 1);
+        }
+        if (listener) listener(userId, seq, historySeq);
+    }
+
+public:
+    // With a body store, users sent the same message share one copy of it.
+    explicit InAppMailbox(size_t capacity = 256, shared_ptr<BodyStore> bodies = nullptr)
+        : capacity(capacity), bodies(std::move(bodies)) {}
+
+    // Called with the user ID, the item's seq and the notification's
+    // historySeq (0 if unknown) after every append, from the appending thread.
+    void setListener(function<void(const string& userId, uint64_t seq, uint64_t historySeq)> callback) {
+        lock_guard<mutex> guard(lock);
+        listener = std::move(callback);
+    }
+
+    void publish(const string& userId, const string& content) override {
+        append(userId, content, 0);
+    }
+
+    void publish(const string& userId, const string& content, const NotificationMeta& meta) override {
+        append(userId, content, meta.historySeq);
+    }
+
+    // Items with seq > cursor, oldest first; returns the cursor to resume from.
+    uint64_t readSince(const string& userId, uint64_t cursor, vector<MailboxItem>& out, size_t maxItems = 100) const {
+        lock_guard<mutex> guard(lock);
+        auto it = boxes.find(userId);
+        if (it == boxes.end()) return cursor;
+        const auto& items = it->second.items;
+        auto from = upper_bound(items.begin(), items.end(), cursor,
+                                [](uint64_t c, const MailboxItem& item) { return c < item.seq; });
+        for (; from != items.end() && maxItems > 0; ++from, --maxItems) {
+            out.push_back(*from);
+            out.back().read = it->second.reads.isRead(from->seq);
+            cursor = from->seq;
+        }
+        return cursor;
+    }
+
+    // Marks the given sequence numbers read as one batch; returns the new unread count.
+    uint64_t markRead(const string& userId, vector<uint64_t>& seqs) {
+        lock_guard<mutex> guard(lock);
+        auto it = boxes.find(userId);
+        if (it == boxes.end()) return 0;
+        Box& box = it->second;
+        box.reads.markRead(seqs, box.nextSeq - 1);
+        return box.reads.unread(box.nextSeq - 1);
+    }
+
+    void markAllRead(const string& userId) {
+        lock_guard<mutex> guard(lock);
+        auto it = boxes.find(userId);
+        if (it != boxes.end()) it->second.reads.advance(it->second.nextSeq - 1);
+    }
+
+    // Read flag of item `seq`, or nullopt if there is no such item or it has left the mailbox.
+    optional<bool> readStatus(const string& userId, uint64_t seq) const {
+        lock_guard<mutex> guard(lock);
+        auto it = boxes.find(userId);
+        if (it == boxes.end() || seq == 0 || it->second.items.empty() || seq < it->second.items.front().seq ||
+            seq >= it->second.nextSeq)
+            return nullopt;
+        return it->second.reads.isRead(seq);
+    }
+
+    uint64_t unreadCount(const string& userId) const {
+        lock_guard<mutex> guard(lock);
+        auto it = boxes.find(userId);
+        return it == boxes.end() ? 0 : it->second.reads.unread(it->second.nextSeq - 1);
+    }
+
+    // Holds off appends and reads while a snapshot is taken.
+    unique_lock<mutex> freeze() const {
+        return unique_lock<mutex>(lock);
+    }
+
+    // boxes u32 + (userId u16 string | nextSeq u64 | read flags | items u32 + (seq u64 | body u32));
+    // the caller holds freeze().
+    void saveState(string& out, SnapshotBodies& bodies) const {
+        putLE32(out, static_cast<uint32_t>(boxes.size()));
+        for (auto& entry : boxes) {
+            const Box& box = entry.second;
+            putString16(out, entry.first);
+            putLE64(out, box.nextSeq);
+            box.reads.saveState(out);
+            putLE32(out, static_cast<uint32_t>(box.items.size()));
+            for (auto& item : box.items) {
+                putLE64(out, item.seq);
+                putLE32(out, bodies.indexOf(item.content));
+            }
+        }
+    }
+
+    bool loadState(string_view in, size_t& pos, const vector<shared_ptr<const string>>& bodies) {
+        lock_guard<mutex> guard(lock);
+        uint32_t boxCount;
+        if (!readU32(in, pos, boxCount)) return false;
+        boxes.reserve(boxes.size() + min<size_t>(boxCount, in.size()));
+        string userId;
+        for (uint32_t i = 0; i < boxCount; i++) {
+            uint32_t itemCount;
+            if (!readString(in, pos, 2, userId)) return false;
+            Box& box = boxes[userId];
+            if (!readU64(in, pos, box.nextSeq) || !box.reads.loadState(in, pos) || !readU32(in, pos, itemCount))
+                return false;
+            box.items.resize(itemCount);
+            for (auto& item : box.items) {
+                uint32_t body;
+                if (!readU64(in, pos, item.seq) || !readU32(in, pos, body) || body >= bodies.size()) return false;
+                item.content = bodies[body];
+            }
+        }
+        return true;
+    }
+};
+
+// Publishes each in-app message to several sinks (live sessions, mailbox)
+class InAppFanout : public IInAppPublisher {
+private:
+    vector<shared_ptr<IInAppPublisher>> publishers;
+public:
+    explicit InAppFanout(vector<shared_ptr<IInAppPublisher>> publishers) : publishers(std::move(publishers)) {}
+
+    void publish(const string& userId, const string& content) override {
+        for (auto& p : publishers) p->publish(userId, content);
+    }
+
+    void publish(const string& userId, const string& content, const NotificationMeta& meta) override {
+        for (auto& p : publishers) p->publish(userId, content, meta);
+    }
+};
+
+// Periodic point-in-time snapshots of process state, driven by the thread that
+// owns that state
+class IStateSnapshotter {
+public:
+    // Milliseconds until tick() has work; -1 when nothing is scheduled.
+    virtual int64_t msUntilDue() const = 0;
+    virtual void tick() = 0;
+    virtual ~IStateSnapshotter() = default;
+};
+
+// HTTP API server: single-threaded epoll loop feeding NotificationService.
+// With a mailbox attached it also serves in-app messages to clients that cannot
+// use WebSockets: GET /events?user=<id> (Server-Sent Events, resumes from
+// Last-Event-ID) and GET /poll?user=<id>&cursor=<seq>&timeout=<ms> (long-poll).
+// Waiting requests are parked in a per-user index and woken by mailbox appends.
+class HttpApiServer : public EpollServer {
+private:
+    static constexpr int64_t kStreamHeartbeatMs = 15000;
+    // An event stream whose client lets this much pile up unsent is dropped;
+    // it reconnects with Last-Event-ID and resumes from the mailbox.
+    static constexpr size_t kMaxStreamBacklog = 256 * 1024;
+    static constexpr int64_t kMaxPollMs = 60000;
+    static constexpr size_t kDrainPerTurn = 256;
+    static constexpr int64_t kHoldRecheckMs = 10;
+    static constexpr int64_t kCatchUpMs = 10;
+
+    struct ApiConnection : Connection {
+        enum class Wait : uint8_t { None, Poll, Stream };
+        Wait wait = Wait::None;
+        bool keepAlive = true;
+        uint64_t cursor = 0;
+        int64_t deadlineMs = 0;
+        string userId;
+        bool behind = false; // a stream that stopped short of the mailbox's end
+    };
+
+    NotificationService& service;
+    string scratch;
+    string peeked; // a history body rendered for a query match
+    SendNotificationParser parser;
+    SendNotificationRequest parsed;
+
+    shared_ptr<InAppMailbox> mailbox;
+    shared_ptr<DeliveryAnalytics> analytics;
+    shared_ptr<TemplateRegistry> templates;
+    shared_ptr<IStateSnapshotter> snapshotter;
+    function<bool()> hold;
+    unordered_map<string, vector<ApiConnection*>> waiters;
+    priority_queue<pair<int64_t, int>, vector<pair<int64_t, int>>, greater<>> deadlines;
+    mutex wokenLock;
+    vector<string> woken;
+    vector<string> wokenDraining;
+    vector<pair<uint64_t, uint64_t>> published; // (historySeq, mailbox seq) not yet stored on history
+    vector<pair<uint64_t, uint64_t>> publishedDraining;
+    vector<MailboxItem> items;
+    vector<uint64_t> seqs;
+    vector<int> behindStreams;
+    vector<int> behindDraining;
+
+    static int64_t steadyMs() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    unique_ptr<Connection> makeConnection() override {
+        return make_unique<ApiConnection>();
+    }
+
+    void onClose(Connection& conn) override {
+        unpark(static_cast<ApiConnection&>(conn));
+    }
+
+    void park(ApiConnection& conn, ApiConnection::Wait wait, int64_t deadlineMs) {
+        conn.wait = wait;
+        conn.deadlineMs = deadlineMs;
+        waiters[conn.userId].push_back(&conn);
+        deadlines.emplace(deadlineMs, conn.fd);
+    }
+
+    void unpark(ApiConnection& conn) {
+        if (conn.wait == ApiConnection::Wait::None) return;
+        conn.wait = ApiConnection::Wait::None;
+        auto it = waiters.find(conn.userId);
+        if (it == waiters.end()) return;
+        auto& list = it->second;
+        auto pos = find(list.begin(), list.end(), &conn);
+        if (pos != list.end()) {
+            *pos = list.back();
+            list.pop_back();
+        }
+        if (list.empty()) waiters.erase(it);
+    }
+
+    void appendPollResponse(ApiConnection& conn) {
+        scratch.clear();
+        scratch += R"({"cursor":)";
+        scratch += to_string(conn.cursor);
+        scratch += R"(,"notifications":[)";
+        for (size_t i = 0; i < items.size(); i++) {
+            if (i) scratch += ',';
+            scratch += R"({"seq":)";
+            scratch += to_string(items[i].seq);
+            scratch += R"(,"message":)";
+            appendJsonString(scratch, *items[i].content);
+            scratch += items[i].read ? R"(,"readStatus":"read"})" : R"(,"readStatus":"unread"})";
+        }
+        scratch += "]}";
+        appendHttpResponse(conn.out, 200, "OK", scratch, conn.keepAlive);
+        if (!conn.keepAlive) conn.closing = true;
+    }
+
+    void appendStreamEvents(ApiConnection& conn) {
+        for (auto& item : items) {
+            conn.out += "id: ";
+            conn.out += to_string(item.seq);
+            string_view data = *item.content;
+            while (true) {
+                size_t nl = data.find('\n');
+                conn.out += "\ndata: ";
+                conn.out += data.substr(0, nl);
+                if (nl == string_view::npos) break;
+                data.remove_prefix(nl + 1);
+            }
+            conn.out += "\n\n";
+        }
+    }
+
+    // Closes an event stream that is too slow to keep up; true if it was closed.
+    bool streamBacklogged(ApiConnection& conn) {
+        if (conn.wait != ApiConnection::Wait::Stream || conn.out.size() - conn.outOffset <= kMaxStreamBacklog)
+            return false;
+        closeConnection(conn.fd);
+        return true;
+    }
+
+    // Sends whatever the mailbox holds past the connection's cursor.
+    // Returns true when a long-poll was answered and the connection unparked.
+    bool serveWaiter(ApiConnection& conn) {
+        items.clear();
+        conn.cursor = mailbox->readSince(conn.userId, conn.cursor, items);
+        if (items.empty()) return false;
+        if (conn.wait == ApiConnection::Wait::Stream) {
+            // A stream resuming far back is caught up in one go, up to the
+            // backlog limit; past that it continues once the client drains.
+            while (!items.empty()) {
+                appendStreamEvents(conn);
+                if (conn.out.size() - conn.outOffset > kMaxStreamBacklog / 2) {
+                    if (!conn.behind) behindStreams.push_back(conn.fd);
+                    conn.behind = true;
+                    break;
+                }
+                items.clear();
+                conn.cursor = mailbox->readSince(conn.userId, conn.cursor, items);
+            }
+            return false;
+        }
+        unpark(conn);
+        appendPollResponse(conn);
+        return true;
+    }
+
+    void startWaiting(const HttpRequest& req, ApiConnection& conn) {
+        string_view user = queryParam(req.query, "user");
+        if (!mailbox || user.empty()) {
+            appendHttpResponse(conn.out, mailbox ? 400 : 404, mailbox ? "Bad Request" : "Not Found",
+                               R"({"status":"error","message":"In-app delivery needs a user."})", req.keepAlive);
+            return;
+        }
+        conn.userId.assign(user);
+        conn.keepAlive = req.keepAlive;
+        string_view cursor = req.path == "/events" ? httpHeader(req.headers, "last-event-id")
+                                                   : queryParam(req.query, "cursor");
+        conn.cursor = 0;
+        for (char c : cursor) {
+            if (c < '0' || c > '9') break;
+            conn.cursor = conn.cursor * 10 + static_cast<uint64_t>(c - '0');
+        }
+
+        if (req.path == "/events") {
+            conn.out += "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                        "Connection: keep-alive\r\n\r\n";
+            park(conn, ApiConnection::Wait::Stream, steadyMs() + kStreamHeartbeatMs);
+            serveWaiter(conn);
+            return;
+        }
+
+        int64_t timeout = 30000;
+        string_view t = queryParam(req.query, "timeout");
+        if (!t.empty()) {
+            timeout = 0;
+            for (char c : t) {
+                if (c < '0' || c > '9' || timeout > kMaxPollMs) break;
+                timeout = timeout * 10 + (c - '0');
+            }
+            timeout = min(timeout, kMaxPollMs);
+        }
+        park(conn, ApiConnection::Wait::Poll, steadyMs() + timeout);
+        serveWaiter(conn);
+    }
+
+    void onWake() override {
+        {
+            lock_guard<mutex> guard(wokenLock);
+            wokenDraining.swap(woken);
+            publishedDraining.swap(published);
+        }
+        for (auto& [historySeq, seq] : publishedDraining) service.setMailboxSeq(historySeq, seq);
+        publishedDraining.clear();
+        for (auto& user : wokenDraining) {
+            auto it = waiters.find(user);
+            if (it == waiters.end()) continue;
+            vector<ApiConnection*> targets = it->second;
+            for (ApiConnection* conn : targets) {
+                if (streamBacklogged(*conn)) continue;
+                bool answered = serveWaiter(*conn);
+                if (!flush(*conn)) continue;
+                if (answered && !conn->in.empty()) onInput(*conn);
+            }
+        }
+        wokenDraining.clear();
+    }
+
+    // Streams held back by their backlog continue once it has drained.
+    void catchUpStreams() {
+        behindDraining.swap(behindStreams);
+        for (int fd : behindDraining) {
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            auto& conn = static_cast<ApiConnection&>(*it->second);
+            if (conn.wait != ApiConnection::Wait::Stream || !conn.behind) continue; // fd reused
+            if (conn.out.size() - conn.outOffset > kMaxStreamBacklog / 4) {
+                behindStreams.push_back(fd);
+                continue;
+            }
+            conn.behind = false;
+            serveWaiter(conn);
+            flush(conn);
+        }
+        behindDraining.clear();
+    }
+
+    int pollTimeoutMs() override {
+        // Held notifications are looked at again every kHoldRecheckMs, not in a spin.
+        bool held = service.pendingCount() && hold && hold();
+        if ((service.pendingCount() && !held) || service.uninternedCount()) return 0;
+        int64_t wait = snapshotter ? snapshotter->msUntilDue() : -1;
+        if (held) wait = wait < 0 ? kHoldRecheckMs : min(wait, kHoldRecheckMs);
+        if (!deadlines.empty()) {
+            int64_t deadline = max<int64_t>(0, deadlines.top().first - steadyMs());
+            wait = wait < 0 ? deadline : min(wait, deadline);
+        }
+        if (!behindStreams.empty()) wait = wait < 0 ? kCatchUpMs : min(wait, kCatchUpMs);
+        return static_cast<int>(wait);
+    }
+
+    void onTimer() override {
+        // Deliver a bounded slice per loop turn so new requests keep getting parsed
+        // and queued behind their tenant, not behind someone else's blast.
+        if (!hold || !hold()) service.drain(kDrainPerTurn);
+        if (!behindStreams.empty()) catchUpStreams();
+        // History bodies are interned once the queue is empty, a slice per turn.
+        if (!service.pendingCount()) service.internHistory(kDrainPerTurn);
+        // Snapshots start here, between requests, where this thread's state is consistent.
+        if (snapshotter) snapshotter->tick();
+        int64_t now = steadyMs();
+        while (!deadlines.empty() && deadlines.top().first <= now) {
+            auto [deadline, fd] = deadlines.top();
+            deadlines.pop();
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            auto& conn = static_cast<ApiConnection&>(*it->second);
+            if (conn.wait == ApiConnection::Wait::None || conn.deadlineMs != deadline) continue; // stale entry
+            if (conn.wait == ApiConnection::Wait::Stream) {
+                if (streamBacklogged(conn)) continue;
+                conn.out += ": keepalive\n\n";
+                conn.deadlineMs = now + kStreamHeartbeatMs;
+                deadlines.emplace(conn.deadlineMs, fd);
+                flush(conn);
+                continue;
+            }
+            unpark(conn);
+            items.clear();
+            appendPollResponse(conn);
+            if (flush(conn) && !conn.in.empty()) onInput(conn);
+        }
+    }
+
+    void onInput(Connection& base) override {
+        auto& conn = static_cast<ApiConnection&>(base);
+        // Answer every complete pipelined request; the base writes all responses at once.
+        // A parked request holds back whatever the client pipelined after it.
+        size_t offset = 0;
+        while (!conn.closing && conn.wait == ApiConnection::Wait::None && offset < conn.in.size()) {
+            HttpRequest req;
+            long n = parseHttpRequest(string_view(conn.in).substr(offset), req);
+            if (n == 0) break;
+            if (n < 0) {
+                appendHttpResponse(conn.out, 400, "Bad Request",
+                                   R"({"status":"error","message":"Malformed request."})", false);
+                conn.closing = true;
+                break;
+            }
+            offset += static_cast<size_t>(n);
+            if (req.method == "GET" && (req.path == "/events" || req.path == "/poll")) {
+                startWaiting(req, conn);
+                continue;
+            }
+            handle(req, conn.out);
+            if (!req.keepAlive) conn.closing = true;
+        }
+        conn.in.erase(0, offset);
+        // Streams and parked polls have nothing more to read from the client.
+        if (conn.wait == ApiConnection::Wait::Stream) conn.in.clear();
+    }
+
+    void appendNotificationJson(string& body, size_t index) {
+        const HistoryRecord& record = service.getHistory()[index];
+        const NotificationMeta& meta = record.meta;
+        body += R"({"id":)";
+        appendJsonString(body, meta.id.empty() ? to_string(service.historyOffset() + index) : meta.id);
+        if (!meta.type.empty()) {
+            body += R"(,"type":)";
+            appendJsonString(body, meta.type);
+        }
+        if (!meta.userId.empty()) {
+            body += R"(,"userId":)";
+            appendJsonString(body, meta.userId);
+        }
+        body += R"(,"message":)";
+        appendJsonString(body, service.historyBody(index));
+        // In-app notifications still in the user's mailbox report its read flag.
+        optional<bool> read = mailbox && record.mailboxSeq ? mailbox->readStatus(meta.userId, record.mailboxSeq) : nullopt;
+        if (read) body += *read ? R"(,"readStatus":"read")" : R"(,"readStatus":"unread")";
+        body += '}';
+    }
+
+    static void appendTopJson(string& body, const HeavyHitters& hitters) {
+        body += '[';
+        auto top = hitters.top(10);
+        for (size_t i = 0; i < top.size(); i++) {
+            if (i) body += ',';
+            body += R"({"key":)";
+            appendJsonString(body, top[i].first);
+            body += R"(,"count":)";
+            body += to_string(top[i].second);
+            body += '}';
+        }
+        body += ']';
+    }
+
+    static void appendAnalyticsJson(string& body, const AnalyticsSnapshot& snap) {
+        int64_t now = nowMs();
+        body += R"({"uniqueRecipients":{"lastHour":)";
+        body += to_string(llround(snap.recipients.estimate(now, 1)));
+        body += R"(,"last24h":)";
+        body += to_string(llround(snap.recipients.estimate(now, 24)));
+        body += R"(},"topTypes":)";
+        appendTopJson(body, snap.types);
+        body += R"(,"topSenders":)";
+        appendTopJson(body, snap.senders);
+        body += R"(,"channels":{)";
+        auto channels = snap.channelSends.keys();
+        for (size_t i = 0; i < channels.size(); i++) {
+            if (i) body += ',';
+            appendJsonString(body, channels[i]);
+            body += R"(:{"lastMinute":)";
+            body += to_string(snap.channelSends.total(channels[i], now, 1));
+            body += R"(,"lastHour":)";
+            body += to_string(snap.channelSends.total(channels[i], now, 60));
+            body += '}';
+        }
+        body += "}}";
+    }
+
+    void handle(const HttpRequest& req, string& out) {
+        constexpr size_t kMaxListed = 50;
+        const auto& all = service.getHistory();
+        scratch.clear();
+
+        if (req.path == "/SendNotification") {
+            if (req.method != "POST") {
+                appendHttpResponse(out, 405, "Method Not Allowed", R"({"status":"error","message":"Use POST."})", req.keepAlive);
+                return;
+            }
+            if (!parser.parse(req.body, parsed)) {
+                scratch += R"({"status":"error","message":)";
+                appendJsonString(scratch, parser.lastError());
+                scratch += '}';
+                appendHttpResponse(out, 400, "Bad Request", scratch, req.keepAlive);
+                return;
+            }
+            string_view tenant = httpHeader(req.headers, "x-tenant-id");
+            shared_ptr<const CompiledTemplate> compiled;
+            shared_ptr<const TemplateVars> vars;
+            if (!parsed.templateName.empty()) {
+                compiled = templates ? templates->find(parsed.templateName, parsed.locale) : nullptr;
+                vars = makeTemplateVars(parsed);
+                if (!compiled || !vars) {
+                    appendHttpResponse(out, 400, "Bad Request",
+                                       compiled ? R"({"status":"error","message":"invalid string escape"})"
+                                                : R"({"status":"error","message":"unknown template"})",
+                                       req.keepAlive);
+                    return;
+                }
+                string_view missing = compiled->missingVariable(*vars);
+                if (!missing.empty()) {
+                    scratch += R"({"status":"error","message":)";
+                    appendJsonString(scratch, "missing template variable " + string(missing));
+                    scratch += '}';
+                    appendHttpResponse(out, 400, "Bad Request", scratch, req.keepAlive);
+                    return;
+                }
+            }
+            vector<shared_ptr<INotification>> batch;
+            if (parsed.recipients.empty()) batch.push_back(makeNotification(parsed, {}, tenant, compiled, vars));
+            for (auto recipient : parsed.recipients)
+                batch.push_back(makeNotification(parsed, recipient, tenant, compiled, vars));
+            for (auto& n : batch) {
+                if (!n) {
+                    appendHttpResponse(out, 400, "Bad Request", R"({"status":"error","message":"invalid string escape"})", req.keepAlive);
+                    return;
+                }
+            }
+            AdmissionDecision decision = service.enqueue(batch);
+            if (!decision.admitted) {
+                // Retry-After is whole seconds; the body carries the precise hint.
+                string retryAfter = "Retry-After: " + to_string((decision.retryAfterMs + 999) / 1000) + "\r\n";
+                scratch += R"({"status":"overloaded","message":"Server busy: )";
+                scratch += decision.reason;
+                scratch += R"(.","retryAfterMs":)";
+                scratch += to_string(decision.retryAfterMs);
+                scratch += '}';
+                appendHttpResponse(out, 503, "Service Unavailable", scratch, req.keepAlive, retryAfter);
+                return;
+            }
+            appendHttpResponse(out, 200, "OK", R"({"status":"success","message":"Notification sent successfully."})", req.keepAlive);
+        } else if (req.path == "/FetchNotification" && req.method == "GET") {
+            scratch += R"({"notifications":[)";
+            size_t first = all.size() > kMaxListed ? all.size() - kMaxListed : 0;
+            for (size_t i = first; i < all.size(); i++) {
+                if (i != first) scratch += ',';
+                appendNotificationJson(scratch, i);
+            }
+            scratch += "]}";
+            appendHttpResponse(out, 200, "OK", scratch, req.keepAlive);
+        } else if (req.path == "/QueryNotifications" && req.method == "POST") {
+            // {"query": text in the message, "userId": ..., "type": ...}; every field is optional.
+            JsonValue filter;
+            bool valid = JsonValue::parse(req.body, filter) && filter.type == JsonValue::Type::Object;
+            const JsonValue* query = valid ? filter.find("query") : nullptr;
+            const JsonValue* userId = valid ? filter.find("userId") : nullptr;
+            const JsonValue* type = valid ? filter.find("type") : nullptr;
+            for (const JsonValue* field : {query, userId, type}) {
+                if (field && field->type != JsonValue::Type::String) valid = false;
+            }
+            if (!valid) {
+                appendHttpResponse(out, 400, "Bad Request",
+                                   R"({"status":"error","message":"Expected a JSON object of string filters."})",
+                                   req.keepAlive);
+                return;
+            }
+            scratch += R"({"notifications":[)";
+            size_t matched = 0;
+            for (size_t i = all.size(); i-- > 0 && matched < kMaxListed;) {
+                if (userId && all[i].meta.userId != userId->text) continue;
+                if (type && all[i].meta.type != type->text) continue;
+                // Only records that are listed get interned; the rest are matched as they stand.
+                if (query && service.peekHistoryBody(i, peeked).find(query->text) == string::npos) continue;
+                if (matched++) scratch += ',';
+                appendNotificationJson(scratch, i);
+            }
+            scratch += "]}";
+            appendHttpResponse(out, 200, "OK", scratch, req.keepAlive);
+        } else if (mailbox && (req.path == "/MarkRead" || req.path == "/UnreadCount")) {
+            string user(queryParam(req.query, "user"));
+            if (user.empty()) {
+                appendHttpResponse(out, 400, "Bad Request", R"({"status":"error","message":"Missing user."})", req.keepAlive);
+                return;
+            }
+            if (req.path == "/MarkRead") {
+                if (req.method != "POST") {
+                    appendHttpResponse(out, 405, "Method Not Allowed", R"({"status":"error","message":"Use POST."})", req.keepAlive);
+                    return;
+                }
+                // ?all=true, or ?seq=3,4,9 for specific items
+                if (queryParam(req.query, "all") == "true") {
+                    mailbox->markAllRead(user);
+                } else {
+                    seqs.clear();
+                    uint64_t value = 0;
+                    bool digits = false;
+                    for (char c : queryParam(req.query, "seq")) {
+                        if (c >= '0' && c <= '9') {
+                            value = value * 10 + static_cast<uint64_t>(c - '0');
+                            digits = true;
+                        } else if (c == ',' && digits) {
+                            seqs.push_back(value);
+                            value = 0;
+                            digits = false;
+                        } else {
+                            appendHttpResponse(out, 400, "Bad Request", R"({"status":"error","message":"Bad seq list."})", req.keepAlive);
+                            return;
+                        }
+                    }
+                    if (digits) seqs.push_back(value);
+                    mailbox->markRead(user, seqs);
+                }
+            }
+            scratch += R"({"unread":)";
+            scratch += to_string(mailbox->unreadCount(user));
+            scratch += '}';
+            appendHttpResponse(out, 200, "OK", scratch, req.keepAlive);
+        } else if (analytics && req.path == "/Analytics" && req.method == "GET") {
+            appendAnalyticsJson(scratch, analytics->snapshot());
+            appendHttpResponse(out, 200, "OK", scratch, req.keepAlive);
+        } else if (req.path == "/FetchUserData" && req.method == "GET") {
+            const UserProfile* user = service.findUser(string(queryParam(req.query, "id")));
+            if (!user) {
+                appendHttpResponse(out, 404, "Not Found", R"({"status":"error","message":"Unknown user."})", req.keepAlive);
+                return;
+            }
+            scratch += R"({"id":)";
+            appendJsonString(scratch, user->id);
+            scratch += R"(,"name":)";
+            appendJsonString(scratch, user->name);
+            scratch += R"(,"notificationPreferences":{"email":)";
+            scratch += user->emailEnabled ? "true" : "false";
+            scratch += R"(,"push":)";
+            scratch += user->pushEnabled ? "true" : "false";
+            scratch += "}}";
+            appendHttpResponse(out, 200, "OK", scratch, req.keepAlive);
+        } else {
+            appendHttpResponse(out, 404, "Not Found", R"({"status":"error","message":"Unknown endpoint."})", req.keepAlive);
+        }
+    }
+
+public:
+    explicit HttpApiServer(uint16_t port, shared_ptr<InAppMailbox> inbox = nullptr)
+        : EpollServer(listenTcp(port)), service(NotificationService::getInstance()), mailbox(std::move(inbox)) {
+        if (mailbox) {
+            mailbox->setListener([this](const string& userId, uint64_t seq, uint64_t historySeq) {
+                {
+                    lock_guard<mutex> guard(wokenLock);
+                    woken.push_back(userId);
+                    if (historySeq) published.push_back({historySeq, seq});
+                }
+                wake();
+            });
+        }
+    }
+
+    ~HttpApiServer() override {
+        if (mailbox) mailbox->setListener(nullptr);
+    }
+
+    // Serves GET /Analytics from the given sketches.
+    void setAnalytics(shared_ptr<DeliveryAnalytics> a) {
+        analytics = std::move(a);
+    }
+
+    // Resolves "template" in SendNotification requests.
+    void setTemplates(shared_ptr<TemplateRegistry> t) {
+        templates = std::move(t);
+    }
+
+    void setSnapshotter(shared_ptr<IStateSnapshotter> s) {
+        snapshotter = std::move(s);
+    }
+
+    // While this returns true, queued notifications stay queued (sync
+    // replication waiting on its standby); admission still sheds on depth.
+    void setHold(function<bool()> h) {
+        hold = std::move(h);
+    }
+};
+
+// SHA-1 and base64, only needed for the WebSocket handshake
+static array<uint8_t, 20> sha1(string_view data) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    string msg(data);
+    uint64_t bitLength = static_cast<uint64_t>(data.size()) * 8;
+    msg += static_cast<char>(0x80);
+    while (msg.size() % 64 != 56) msg += '\0';
+    for (int i = 7; i >= 0; i--) msg += static_cast<char>((bitLength >> (8 * i)) & 0xFF);
+
+    auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+    for (size_t block = 0; block < msg.size(); block += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            auto b = reinterpret_cast<const unsigned char*>(msg.data() + block + 4 * i);
+            w[i] = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | b[3];
+        }
+        for (int i = 16; i < 80; i++) w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t t = rotl(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rotl(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    array<uint8_t, 20> digest;
+    for (int i = 0; i < 20; i++) digest[i] = static_cast<uint8_t>(h[i / 4] >> (24 - 8 * (i % 4)));
+    return digest;
+}
+
+static string base64Encode(const uint8_t* data, size_t n) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string out;
+    out.reserve((n + 2) / 3 * 4);
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t v = uint32_t(data[i]) << 16;
+        if (i + 1 < n) v |= uint32_t(data[i + 1]) << 8;
+        if (i + 2 < n) v |= data[i + 2];
+        out += alphabet[(v >> 18) & 63];
+        out += alphabet[(v >> 12) & 63];
+        out += i + 1 < n ? alphabet[(v >> 6) & 63] : '=';
+        out += i + 2 < n ? alphabet[v & 63] : '=';
+    }
+    return out;
+}
+
+// WebSocket framing (RFC 6455); server frames are never masked
+enum class WsOpcode : uint8_t {
+    Text = 0x1,
+    Binary = 0x2,
+    Close = 0x8,
+    Ping = 0x9,
+    Pong = 0xA
+};
+
+static void appendWsFrame(string& out, WsOpcode opcode, string_view payload) {
+    out += static_cast<char>(0x80 | static_cast<uint8_t>(opcode));
+    if (payload.size() < 126) {
+        out += static_cast<char>(payload.size());
+    } else if (payload.size() <= UINT16_MAX) {
+        out += static_cast<char>(126);
+        out += static_cast<char>(payload.size() >> 8);
+        out += static_cast<char>(payload.size() & 0xFF);
+    } else {
+        out += static_cast<char>(127);
+        for (int i = 7; i >= 0; i--) out += static_cast<char>((static_cast<uint64_t>(payload.size()) >> (8 * i)) & 0xFF);
+    }
+    out += payload;
+}
+
+// In-app delivery gateway: WebSocket sessions indexed by user ID.
+// Clients connect to /ws?user=<id>. A published message is framed once and the
+// same buffer is queued on every session of that user.
+class PopUpGateway : public EpollServer, public IInAppPublisher {
+private:
+    static constexpr size_t kMaxClientFrame = 1024;
+    static constexpr size_t kMaxQueuedFrames = 256;
+
+    struct Session : Connection {
+        string userId;
+        bool upgraded = false;
+    };
+
+    unordered_map<string, vector<Session*>> sessionsByUser;
+    mutex pendingLock;
+    vector<pair<string, shared_ptr<const string>>> pending;
+    vector<pair<string, shared_ptr<const string>>> draining;
+    atomic<size_t> sessionCount{0};
+
+    unique_ptr<Connection> makeConnection() override {
+        return make_unique<Session>();
+    }
+
+    void onClose(Connection& conn) override {
+        auto& session = static_cast<Session&>(conn);
+        if (!session.upgraded) return;
+        auto it = sessionsByUser.find(session.userId);
+        if (it == sessionsByUser.end()) return;
+        auto& list = it->second;
+        auto pos = find(list.begin(), list.end(), &session);
+        if (pos != list.end()) {
+            *pos = list.back();
+            list.pop_back();
+        }
+        if (list.empty()) sessionsByUser.erase(it);
+        sessionCount--;
+    }
+
+    void rejectHandshake(Connection& conn, int status, string_view reason) {
+        appendHttpResponse(conn.out, status, reason, R"({"status":"error","message":"WebSocket upgrade required."})", false);
+        conn.closing = true;
+    }
+
+    void handshake(Session& session) {
+        HttpRequest req;
+        long n = parseHttpRequest(session.in, req);
+        if (n == 0) return;
+        if (n < 0 || req.method != "GET" || req.path != "/ws" ||
+            !iequals(httpHeader(req.headers, "upgrade"), "websocket")) {
+            rejectHandshake(session, 400, "Bad Request");
+            return;
+        }
+        string_view key = httpHeader(req.headers, "sec-websocket-key");
+        string_view user = queryParam(req.query, "user");
+        if (key.empty() || user.empty()) {
+            rejectHandshake(session, 400, "Bad Request");
+            return;
+        }
+
+        auto digest = sha1(string(key) + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+        session.out += "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: ";
+        session.out += base64Encode(digest.data(), digest.size());
+        session.out += "\r\n\r\n";
+
+        session.userId.assign(user);
+        session.upgraded = true;
+        sessionsByUser[session.userId].push_back(&session);
+        sessionCount++;
+        session.in.erase(0, static_cast<size_t>(n));
+        if (session.in.empty()) session.in.shrink_to_fit();
+    }
+
+    void onInput(Connection& conn) override {
+        auto& session = static_cast<Session&>(conn);
+        if (!session.upgraded) {
+            handshake(session);
+            if (!session.upgraded) return;
+        }
+
+        size_t offset = 0;
+        while (!conn.closing) {
+            string_view buf = string_view(conn.in).substr(offset);
+            if (buf.size() < 2) break;
+            uint8_t b0 = static_cast<uint8_t>(buf[0]);
+            uint8_t b1 = static_cast<uint8_t>(buf[1]);
+            auto opcode = static_cast<WsOpcode>(b0 & 0x0F);
+            size_t length = b1 & 0x7F;
+            size_t header = 2;
+            if (length == 126) {
+                if (buf.size() < 4) break;
+                length = (static_cast<uint8_t>(buf[2]) << 8) | static_cast<uint8_t>(buf[3]);
+                header = 4;
+            } else if (length == 127) {
+                length = kMaxClientFrame + 1;
+            }
+            if (!(b1 & 0x80) || length > kMaxClientFrame) {
+                string reason;
+                reason += static_cast<char>(1009 >> 8);
+                reason += static_cast<char>(1009 & 0xFF);
+                appendWsFrame(conn.out, WsOpcode::Close, reason);
+                conn.closing = true;
+                break;
+            }
+            if (buf.size() < header + 4 + length) break;
+
+            const char* mask = buf.data() + header;
+            string payload(buf.substr(header + 4, length));
+            for (size_t i = 0; i < payload.size(); i++) payload[i] ^= mask[i % 4];
+            offset += header + 4 + length;
+
+            if (opcode == WsOpcode::Ping) {
+                appendWsFrame(conn.out, WsOpcode::Pong, payload);
+            } else if (opcode == WsOpcode::Close) {
+                appendWsFrame(conn.out, WsOpcode::Close, payload.substr(0, 2));
+                conn.closing = true;
+            }
+            // Clients have nothing to say besides control frames; anything else is ignored.
+        }
+        conn.in.erase(0, offset);
+        if (conn.in.empty()) conn.in.shrink_to_fit();
+    }
+
+    void onWake() override {
+        {
+            lock_guard<mutex> guard(pendingLock);
+            draining.swap(pending);
+        }
+        for (auto& message : draining) {
+            auto it = sessionsByUser.find(message.first);
+            if (it == sessionsByUser.end()) continue;
+            // Copy: flushing may close a session and edit the list.
+            vector<Session*> targets = it->second;
+            for (Session* session : targets) {
+                if (session->frames.size() - session->frameHead >= kMaxQueuedFrames) {
+                    closeConnection(session->fd); // too slow to keep up
+                    continue;
+                }
+                session->frames.push_back(message.second);
+                if (!session->wantWrite) flush(*session);
+            }
+        }
+        draining.clear();
+    }
+
+public:
+    explicit PopUpGateway(uint16_t port) : EpollServer(listenTcp(port)) {}
+
+    size_t connectedSessions() const {
+        return sessionCount;
+    }
+
+    // Thread-safe; the frame is encoded here once and shared by every session.
+    void publish(const string& userId, const string& content) override {
+        auto frame = make_shared<string>();
+        frame->reserve(content.size() + 10);
+        appendWsFrame(*frame, WsOpcode::Text, content);
+        {
+            lock_guard<mutex> guard(pendingLock);
+            pending.emplace_back(userId, std::move(frame));
+        }
+        wake();
+    }
+};
+
+// HTTP/2 framing (RFC 7540) for the push-provider channel. TLS/ALPN is out of
+// scope here, so connections speak cleartext h2 with prior knowledge.
+enum class H2FrameType : uint8_t {
+    Data = 0x0,
+    Headers = 0x1,
+    RstStream = 0x3,
+    Settings = 0x4,
+    Ping = 0x6,
+    GoAway = 0x7,
+    WindowUpdate = 0x8,
+    Continuation = 0x9
+};
+
+constexpr uint8_t kH2EndStream = 0x1;
+constexpr uint8_t kH2Ack = 0x1;
+constexpr uint8_t kH2EndHeaders = 0x4;
+constexpr uint8_t kH2Padded = 0x8;
+constexpr uint8_t kH2Priority = 0x20;
+constexpr uint32_t kH2DefaultWindow = 65535;
+constexpr uint32_t kH2MaxFrame = 16384;
+static const string_view kH2Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+struct H2Frame {
+    H2FrameType type;
+    uint8_t flags;
+    uint32_t stream;
+    string_view payload;
+};
+
+static void appendH2Frame(string& out, H2FrameType type, uint8_t flags, uint32_t stream, string_view payload) {
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    out += static_cast<char>((length >> 16) & 0xFF);
+    out += static_cast<char>((length >> 8) & 0xFF);
+    out += static_cast<char>(length & 0xFF);
+    out += static_cast<char>(type);
+    out += static_cast<char>(flags);
+    for (int i = 3; i >= 0; i--) out += static_cast<char>(((stream & 0x7FFFFFFF) >> (8 * i)) & 0xFF);
+    out += payload;
+}
+
+static uint32_t readBE32(const char* p) {
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | b[3];
+}
+
+static void putBE32(string& out, uint32_t v) {
+    for (int i = 3; i >= 0; i--) out += static_cast<char>((v >> (8 * i)) & 0xFF);
+}
+
+static void appendH2WindowUpdate(string& out, uint32_t stream, uint32_t increment) {
+    string payload;
+    putBE32(payload, increment & 0x7FFFFFFF);
+    appendH2Frame(out, H2FrameType::WindowUpdate, 0, stream, payload);
+}
+
+static void appendH2Settings(string& out, const vector<pair<uint16_t, uint32_t>>& settings) {
+    string payload;
+    for (auto& s : settings) {
+        payload += static_cast<char>(s.first >> 8);
+        payload += static_cast<char>(s.first & 0xFF);
+        putBE32(payload, s.second);
+    }
+    appendH2Frame(out, H2FrameType::Settings, 0, 0, payload);
+}
+
+// Returns bytes consumed, 0 if incomplete, -1 if the frame is oversized.
+static long parseH2Frame(string_view buf, H2Frame& frame) {
+    if (buf.size() < 9) return 0;
+    auto b = reinterpret_cast<const unsigned char*>(buf.data());
+    size_t length = (size_t(b[0]) << 16) | (size_t(b[1]) << 8) | b[2];
+    if (length > kH2MaxFrame) return -1;
+    if (buf.size() < 9 + length) return 0;
+    frame.type = static_cast<H2FrameType>(b[3]);
+    frame.flags = b[4];
+    frame.stream = readBE32(buf.data() + 5) & 0x7FFFFFFF;
+    frame.payload = buf.substr(9, length);
+    return static_cast<long>(9 + length);
+}
+
+// Strips padding and priority fields from a HEADERS payload.
+static bool h2HeaderBlock(const H2Frame& frame, string_view& block) {
+    block = frame.payload;
+    size_t pad = 0;
+    if (frame.flags & kH2Padded) {
+        if (block.empty()) return false;
+        pad = static_cast<uint8_t>(block[0]);
+        block.remove_prefix(1);
+    }
+    if (frame.type == H2FrameType::Headers && (frame.flags & kH2Priority)) {
+        if (block.size() < 5) return false;
+        block.remove_prefix(5);
+    }
+    if (pad > block.size()) return false;
+    block.remove_suffix(pad);
+    return true;
+}
+
+// HPACK (RFC 7541) without Huffman coding: the encoder never emits it and the
+// decoder rejects it, which is enough to talk to the local mock provider.
+static const pair<const char*, const char*> kHpackStaticTable[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+constexpr size_t kHpackStaticCount = sizeof(kHpackStaticTable) / sizeof(kHpackStaticTable[0]);
+
+static void hpackInteger(string& out, uint8_t flags, int prefixBits, uint64_t value) {
+    uint64_t limit = (1u << prefixBits) - 1;
+    if (value < limit) {
+        out += static_cast<char>(flags | value);
+        return;
+    }
+    out += static_cast<char>(flags | limit);
+    value -= limit;
+    while (value >= 128) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+static bool hpackReadInteger(string_view in, size_t& pos, int prefixBits, uint64_t& value) {
+    if (pos >= in.size()) return false;
+    uint64_t limit = (1u << prefixBits) - 1;
+    value = static_cast<uint8_t>(in[pos++]) & limit;
+    if (value < limit) return true;
+    for (int shift = 0; shift < 56; shift += 7) {
+        if (pos >= in.size()) return false;
+        uint8_t b = static_cast<uint8_t>(in[pos++]);
+        value += uint64_t(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static void hpackString(string& out, string_view s) {
+    hpackInteger(out, 0, 7, s.size());
+    out += s;
+}
+
+static bool hpackReadString(string_view in, size_t& pos, string& out) {
+    if (pos >= in.size() || (static_cast<uint8_t>(in[pos]) & 0x80)) return false; // Huffman
+    uint64_t length;
+    if (!hpackReadInteger(in, pos, 7, length) || in.size() - pos < length) return false;
+    out.assign(in.substr(pos, length));
+    pos += length;
+    return true;
+}
+
+class HpackTable {
+private:
+    deque<pair<string, string>> entries; // newest first
+    size_t size = 0;
+    size_t maxSize = 4096;
+
+    void evict() {
+        while (size > maxSize && !entries.empty()) {
+            size -= entries.back().first.size() + entries.back().second.size() + 32;
+            entries.pop_back();
+        }
+    }
+
+public:
+    void add(string name, string value) {
+        size += name.size() + value.size() + 32;
+        entries.emplace_front(std::move(name), std::move(value));
+        evict();
+    }
+
+    void resize(size_t bytes) {
+        maxSize = bytes;
+        evict();
+    }
+
+    // 1-based HPACK index spanning the static and dynamic tables.
+    bool get(uint64_t index, string_view& name, string_view& value) const {
+        if (index == 0) return false;
+        if (index <= kHpackStaticCount) {
+            name = kHpackStaticTable[index - 1].first;
+            value = kHpackStaticTable[index - 1].second;
+            return true;
+        }
+        index -= kHpackStaticCount + 1;
+        if (index >= entries.size()) return false;
+        name = entries[index].first;
+        value = entries[index].second;
+        return true;
+    }
+
+    // Returns the index of an exact match, or of a name-only match in nameIndex.
+    uint64_t find(string_view name, string_view value, uint64_t& nameIndex) const {
+        nameIndex = 0;
+        for (size_t i = 0; i < kHpackStaticCount; i++) {
+            if (name != kHpackStaticTable[i].first) continue;
+            if (value == kHpackStaticTable[i].second) return i + 1;
+            if (!nameIndex) nameIndex = i + 1;
+        }
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].first != name) continue;
+            if (entries[i].second == value) return kHpackStaticCount + 1 + i;
+            if (!nameIndex) nameIndex = kHpackStaticCount + 1 + i;
+        }
+        return 0;
+    }
+};
+
+class HpackEncoder {
+private:
+    HpackTable table;
+public:
+    // Repeated headers (authority, path, content-type, auth) collapse to one byte each.
+    void encode(string& out, string_view name, string_view value) {
+        uint64_t nameIndex;
+        uint64_t index = table.find(name, value, nameIndex);
+        if (index) {
+            hpackInteger(out, 0x80, 7, index);
+            return;
+        }
+        if (nameIndex) {
+            hpackInteger(out, 0x40, 6, nameIndex);
+        } else {
+            out += static_cast<char>(0x40);
+            hpackString(out, name);
+        }
+        hpackString(out, value);
+        table.add(string(name), string(value));
+    }
+};
+
+class HpackDecoder {
+private:
+    HpackTable table;
+public:
+    bool decode(string_view block, vector<pair<string, string>>& headers) {
+        size_t pos = 0;
+        while (pos < block.size()) {
+            uint8_t b = static_cast<uint8_t>(block[pos]);
+            uint64_t index;
+            string_view name, value;
+            if (b & 0x80) {
+                if (!hpackReadInteger(block, pos, 7, index) || !table.get(index, name, value)) return false;
+                headers.emplace_back(name, value);
+            } else if ((b & 0xE0) == 0x20) {
+                if (!hpackReadInteger(block, pos, 5, index) || index > 4096) return false;
+                table.resize(index);
+            } else {
+                bool incremental = (b & 0xC0) == 0x40;
+                if (!hpackReadInteger(block, pos, incremental ? 6 : 4, index)) return false;
+                string literalName, literalValue;
+                if (index) {
+                    if (!table.get(index, name, value)) return false;
+                    literalName.assign(name);
+                } else if (!hpackReadString(block, pos, literalName)) {
+                    return false;
+                }
+                if (!hpackReadString(block, pos, literalValue)) return false;
+                if (incremental) table.add(literalName, literalValue);
+                headers.emplace_back(std::move(literalName), std::move(literalValue));
+            }
+        }
+        return true;
+    }
+};
+
+// Multiplexing HTTP/2 client for APNS/FCM-style push providers.
+// Requests are spread over a few connections by a single event-loop thread;
+// each connection carries up to the peer's MAX_CONCURRENT_STREAMS at once and
+// DATA respects both stream and connection send windows.
+struct PushResult {
+    int status;        // HTTP status, or -1 if the stream failed
+    int64_t latencyUs;
+};
+
+class Http2PushClient {
+public:
+    struct ConnectionStats {
+        uint64_t completed = 0;
+        uint64_t failed = 0;
+        uint64_t bytesSent = 0;
+        int64_t totalLatencyUs = 0;
+        double seconds = 0;
+
+        double requestsPerSecond() const { return seconds > 0 ? completed / seconds : 0; }
+        double meanLatencyUs() const { return completed ? double(totalLatencyUs) / completed : 0; }
+    };
+
+private:
+    struct Pending {
+        string path;
+        string body;
+        function<void(const PushResult&)> done;
+        int64_t submittedUs;
+    };
+
+    struct Stream {
+        Pending request;
+        size_t bodyOffset = 0;
+        int64_t sendWindow = kH2DefaultWindow;
+        int status = 0;
+        string headerBlock;
+    };
+
+    struct Conn {
+        int fd = -1;
+        string in;
+        string out;
+        size_t outOffset = 0;
+        bool wantWrite = false;
+        HpackEncoder encoder;
+        HpackDecoder decoder;
+        unordered_map<uint32_t, Stream> streams;
+        vector<uint32_t> sending; // streams with body left to send
+        uint32_t nextStreamId = 1;
+        int64_t sendWindow = kH2DefaultWindow;
+        int64_t peerInitialWindow = kH2DefaultWindow;
+        uint32_t peerMaxStreams = 100;
+        uint64_t unackedReceived = 0;
+        uint32_t continuationStream = 0;
+        ConnectionStats stats;
+        chrono::steady_clock::time_point opened;
+        bool connecting = false;
+        chrono::steady_clock::time_point retryAt; // no reconnect before this after a failure
+    };
+
+    // A request with no answer this long after submit() fails; a started
+    // stream is cancelled with RST_STREAM.
+    static constexpr int64_t kRequestTimeoutUs = 10'000'000;
+    static constexpr auto kReconnectDelay = chrono::milliseconds(100);
+
+    string host;
+    uint16_t port;
+    string authority;
+    vector<Conn> conns;
+    int epollFd = -1;
+    int wakeFd = -1;
+    atomic<bool> running{true};
+    thread loop;
+
+    mutable mutex lock;
+    condition_variable idle;
+    deque<Pending> pending;
+    size_t inFlight = 0;
+    vector<int64_t> latencySamples;
+    size_t sampleCursor = 0;
+    vector<ConnectionStats> closedStats;
+    int64_t nextSweepUs = 0;
+
+    static int64_t nowUs() {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Starts a non-blocking connect; the loop finishes it when the socket turns
+    // writable, and the preface and any streams wait in `out` until then.
+    void connectConn(Conn& c) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) throw runtime_error("bad address: " + host);
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS)) {
+            string err = strerror(errno);
+            if (fd >= 0) close(fd);
+            c.retryAt = chrono::steady_clock::now() + kReconnectDelay;
+            throw runtime_error("connect to push provider: " + err);
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        c = Conn();
+        c.fd = fd;
+        c.connecting = true;
+        c.wantWrite = true;
+        c.opened = chrono::steady_clock::now();
+        c.out += kH2Preface;
+        // No server push; a large receive window so responses never stall.
+        appendH2Settings(c.out, {{0x2, 0}, {0x4, 1u << 20}});
+        appendH2WindowUpdate(c.out, 0, (1u << 24) - kH2DefaultWindow);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u64 = static_cast<uint64_t>(&c - conns.data());
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    // Runs the callback and settles the in-flight count; streams and requests
+    // that never reached a stream both end here.
+    void finish(const function<void(const PushResult&)>& done, const PushResult& result) {
+        if (done) done(result);
+        lock_guard<mutex> guard(lock);
+        if (latencySamples.size() < 65536) latencySamples.push_back(result.latencyUs);
+        else latencySamples[sampleCursor++ % latencySamples.size()] = result.latencyUs;
+        if (--inFlight == 0) idle.notify_all();
+    }
+
+    void complete(Conn& c, uint32_t id, int status) {
+        auto it = c.streams.find(id);
+        if (it == c.streams.end()) return;
+        PushResult result{status, nowUs() - it->second.request.submittedUs};
+        if (status > 0) {
+            c.stats.completed++;
+            c.stats.totalLatencyUs += result.latencyUs;
+        } else {
+            c.stats.failed++;
+        }
+        auto done = std::move(it->second.request.done);
+        c.streams.erase(it);
+        finish(done, result);
+    }
+
+    void failConnection(Conn& c) {
+        vector<uint32_t> ids;
+        for (auto& s : c.streams) ids.push_back(s.first);
+        for (uint32_t id : ids) complete(c, id, -1);
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - c.opened).count();
+        if (!c.connecting || c.stats.failed) {
+            lock_guard<mutex> guard(lock);
+            closedStats.push_back(c.stats);
+        }
+        c.fd = -1;
+        c.retryAt = chrono::steady_clock::now() + kReconnectDelay;
+    }
+
+    // Called once the socket turns writable or reports an error mid-connect.
+    void finishConnect(Conn& c) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            failConnection(c);
+            return;
+        }
+        c.connecting = false;
+        c.opened = chrono::steady_clock::now();
+    }
+
+    void startStream(Conn& c, Pending request) {
+        uint32_t id = c.nextStreamId;
+        c.nextStreamId += 2;
+        string block;
+        c.encoder.encode(block, ":method", "POST");
+        c.encoder.encode(block, ":scheme", "http");
+        c.encoder.encode(block, ":authority", authority);
+        c.encoder.encode(block, ":path", request.path);
+        c.encoder.encode(block, "content-type", "application/json");
+        c.encoder.encode(block, "content-length", to_string(request.body.size()));
+        bool empty = request.body.empty();
+        appendH2Frame(c.out, H2FrameType::Headers, kH2EndHeaders | (empty ? kH2EndStream : 0), id, block);
+
+        Stream& stream = c.streams[id];
+        stream.request = std::move(request);
+        stream.sendWindow = c.peerInitialWindow;
+        if (!empty) c.sending.push_back(id);
+    }
+
+    // Emits DATA for every stream the windows allow.
+    void pump(Conn& c) {
+        for (size_t i = 0; i < c.sending.size();) {
+            auto it = c.streams.find(c.sending[i]);
+            if (it == c.streams.end()) {
+                c.sending[i] = c.sending.back();
+                c.sending.pop_back();
+                continue;
+            }
+            Stream& s = it->second;
+            while (s.bodyOffset < s.request.body.size() && c.sendWindow > 0 && s.sendWindow > 0) {
+                size_t chunk = min<size_t>({s.request.body.size() - s.bodyOffset, size_t(c.sendWindow),
+                                            size_t(s.sendWindow), kH2MaxFrame});
+                bool last = s.bodyOffset + chunk == s.request.body.size();
+                appendH2Frame(c.out, H2FrameType::Data, last ? kH2EndStream : 0, it->first,
+                              string_view(s.request.body).substr(s.bodyOffset, chunk));
+                s.bodyOffset += chunk;
+                s.sendWindow -= static_cast<int64_t>(chunk);
+                c.sendWindow -= static_cast<int64_t>(chunk);
+                c.stats.bytesSent += chunk;
+            }
+            if (s.bodyOffset == s.request.body.size()) {
+                c.sending[i] = c.sending.back();
+                c.sending.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+
+    void flushConn(Conn& c) {
+        if (c.connecting) return;
+        while (c.fd >= 0 && c.outOffset < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.outOffset, c.out.size() - c.outOffset, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                failConnection(c);
+                return;
+            }
+            c.outOffset += static_cast<size_t>(n);
+        }
+        if (c.fd < 0) return;
+        bool pendingWrite = c.outOffset < c.out.size();
+        if (!pendingWrite) {
+            c.out.clear();
+            c.outOffset = 0;
+        }
+        if (pendingWrite != c.wantWrite) {
+            c.wantWrite = pendingWrite;
+            epoll_event ev{};
+            ev.events = pendingWrite ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+            ev.data.u64 = static_cast<uint64_t>(&c - conns.data());
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &ev);
+        }
+    }
+
+    void onHeaders(Conn& c, uint32_t id, string_view block, bool endHeaders, bool endStream) {
+        auto it = c.streams.find(id);
+        if (it == c.streams.end()) return;
+        Stream& s = it->second;
+        s.headerBlock.append(block);
+        if (!endHeaders) {
+            c.continuationStream = id;
+            return;
+        }
+        c.continuationStream = 0;
+        vector<pair<string, string>> headers;
+        if (!c.decoder.decode(s.headerBlock, headers)) {
+            failConnection(c);
+            return;
+        }
+        s.headerBlock.clear();
+        for (auto& h : headers) {
+            if (h.first == ":status") s.status = atoi(h.second.c_str());
+        }
+        if (endStream) complete(c, id, s.status);
+    }
+
+    void onFrame(Conn& c, const H2Frame& f) {
+        switch (f.type) {
+        case H2FrameType::Settings:
+            if (f.flags & kH2Ack) return;
+            for (size_t i = 0; i + 6 <= f.payload.size(); i += 6) {
+                uint16_t key = static_cast<uint16_t>((static_cast<uint8_t>(f.payload[i]) << 8) | static_cast<uint8_t>(f.payload[i + 1]));
+                uint32_t value = readBE32(f.payload.data() + i + 2);
+                if (key == 0x3) {
+                    c.peerMaxStreams = value;
+                } else if (key == 0x4) {
+                    int64_t delta = int64_t(value) - c.peerInitialWindow;
+                    c.peerInitialWindow = value;
+                    for (auto& s : c.streams) s.second.sendWindow += delta;
+                }
+            }
+            appendH2Frame(c.out, H2FrameType::Settings, kH2Ack, 0, {});
+            pump(c);
+            break;
+        case H2FrameType::Ping:
+            if (!(f.flags & kH2Ack)) appendH2Frame(c.out, H2FrameType::Ping, kH2Ack, 0, f.payload);
+            break;
+        case H2FrameType::WindowUpdate: {
+            if (f.payload.size() != 4) return;
+            uint32_t increment = readBE32(f.payload.data()) & 0x7FFFFFFF;
+            if (f.stream == 0) {
+                c.sendWindow += increment;
+            } else {
+                auto it = c.streams.find(f.stream);
+                if (it != c.streams.end()) it->second.sendWindow += increment;
+            }
+            pump(c);
+            break;
+        }
+        case H2FrameType::Headers: {
+            string_view block;
+            if (!h2HeaderBlock(f, block)) {
+                failConnection(c);
+                return;
+            }
+            onHeaders(c, f.stream, block, f.flags & kH2EndHeaders, f.flags & kH2EndStream);
+            break;
+        }
+        case H2FrameType::Continuation:
+            if (f.stream != c.continuationStream) {
+                failConnection(c);
+                return;
+            }
+            onHeaders(c, f.stream, f.payload, f.flags & kH2EndHeaders, false);
+            break;
+        case H2FrameType::Data:
+            c.unackedReceived += f.payload.size();
+            if (c.unackedReceived >= (1u << 22)) {
+                appendH2WindowUpdate(c.out, 0, static_cast<uint32_t>(c.unackedReceived));
+                c.unackedReceived = 0;
+            }
+            if (f.flags & kH2EndStream) {
+                auto it = c.streams.find(f.stream);
+                if (it != c.streams.end()) complete(c, f.stream, it->second.status);
+            }
+            break;
+        case H2FrameType::RstStream:
+            complete(c, f.stream, -1);
+            break;
+        case H2FrameType::GoAway:
+            failConnection(c);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void onReadable(Conn& c) {
+        char buf[64 * 1024];
+        while (c.fd >= 0) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c.in.append(buf, static_cast<size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            failConnection(c);
+            return;
+        }
+        size_t offset = 0;
+        while (c.fd >= 0) {
+            H2Frame f;
+            long n = parseH2Frame(string_view(c.in).substr(offset), f);
+            if (n == 0) break;
+            if (n < 0) {
+                failConnection(c);
+                return;
+            }
+            offset += static_cast<size_t>(n);
+            onFrame(c, f);
+        }
+        if (c.fd >= 0) c.in.erase(0, offset);
+    }
+
+    // Hands queued requests to the least loaded connections with stream capacity.
+    void dispatch() {
+        deque<Pending> batch;
+        {
+            lock_guard<mutex> guard(lock);
+            batch.swap(pending);
+        }
+        if (!batch.empty()) {
+            auto now = chrono::steady_clock::now();
+            for (auto& c : conns) {
+                if (c.fd >= 0 || now < c.retryAt) continue;
+                try {
+                    connectConn(c);
+                } catch (const exception&) {
+                }
+            }
+        }
+        while (!batch.empty()) {
+            Conn* best = nullptr;
+            for (auto& c : conns) {
+                if (c.fd < 0 || c.streams.size() >= c.peerMaxStreams) continue;
+                if (!best || c.streams.size() < best->streams.size()) best = &c;
+            }
+            if (!best) break;
+            startStream(*best, std::move(batch.front()));
+            batch.pop_front();
+        }
+        for (auto& c : conns) {
+            if (c.fd < 0) continue;
+            pump(c);
+            flushConn(c);
+        }
+        // Requests are queued oldest first, so the expired ones are at the front.
+        int64_t now = nowUs();
+        while (!batch.empty() && now - batch.front().submittedUs > kRequestTimeoutUs) {
+            Pending request = std::move(batch.front());
+            batch.pop_front();
+            finish(request.done, {-1, now - request.submittedUs});
+        }
+        if (!batch.empty()) {
+            lock_guard<mutex> guard(lock);
+            for (auto it = batch.rbegin(); it != batch.rend(); ++it) pending.push_front(std::move(*it));
+        }
+        if (now >= nextSweepUs) {
+            nextSweepUs = now + 100'000;
+            for (auto& c : conns) {
+                if (c.fd >= 0) cancelExpired(c, now);
+            }
+        }
+    }
+
+    void cancelExpired(Conn& c, int64_t now) {
+        vector<uint32_t> ids;
+        for (auto& s : c.streams) {
+            if (now - s.second.request.submittedUs > kRequestTimeoutUs) ids.push_back(s.first);
+        }
+        if (ids.empty()) return;
+        string cancel;
+        putBE32(cancel, 0x8); // CANCEL
+        for (uint32_t id : ids) {
+            appendH2Frame(c.out, H2FrameType::RstStream, 0, id, cancel);
+            complete(c, id, -1);
+        }
+        flushConn(c);
+    }
+
+    void run() {
+        epoll_event events[64];
+        while (running) {
+            int n = epoll_wait(epollFd, events, 64, 100);
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.u64 == UINT64_MAX) {
+                    uint64_t value;
+                    while (read(wakeFd, &value, sizeof(value)) > 0) {}
+                    continue;
+                }
+                Conn& c = conns[events[i].data.u64];
+                if (c.fd < 0) continue;
+                if (c.connecting) finishConnect(c);
+                if (c.fd < 0) continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) onReadable(c);
+                if (c.fd >= 0) flushConn(c);
+            }
+            dispatch();
+        }
+        for (auto& c : conns) {
+            if (c.fd >= 0) failConnection(c);
+        }
+    }
+
+public:
+    Http2PushClient(string host, uint16_t port, size_t connections = 2, string authority = "")
+        : host(std::move(host)), port(port), authority(std::move(authority)), conns(max<size_t>(1, connections)) {
+        if (this->authority.empty()) this->authority = this->host + ":" + to_string(port);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        // The destructor does not run for a constructor that throws.
+        try {
+            if (epollFd < 0 || wakeFd < 0) throw runtime_error(string("epoll setup: ") + strerror(errno));
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = UINT64_MAX;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+            for (auto& c : conns) connectConn(c);
+            loop = thread([this] { run(); });
+        } catch (...) {
+            for (auto& c : conns) {
+                if (c.fd >= 0) close(c.fd);
+            }
+            if (wakeFd >= 0) close(wakeFd);
+            if (epollFd >= 0) close(epollFd);
+            throw;
+        }
+    }
+
+    ~Http2PushClient() {
+        running = false;
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+        loop.join();
+        close(wakeFd);
+        close(epollFd);
+    }
+
+    Http2PushClient(const Http2PushClient&) = delete;
+    Http2PushClient& operator=(const Http2PushClient&) = delete;
+
+    // Thread-safe; `done` runs on the client's event-loop thread.
+    void submit(string path, string body, function<void(const PushResult&)> done = nullptr) {
+        {
+            lock_guard<mutex> guard(lock);
+            pending.push_back({std::move(path), std::move(body), std::move(done), nowUs()});
+            inFlight++;
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void waitIdle() {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [&] { return inFlight == 0; });
+    }
+
+    // Per-connection counters; only meaningful once the client is idle.
+    vector<ConnectionStats> connectionStats() const {
+        lock_guard<mutex> guard(lock);
+        vector<ConnectionStats> out = closedStats;
+        for (auto& c : conns) {
+            if (c.fd < 0) continue;
+            ConnectionStats s = c.stats;
+            s.seconds = chrono::duration<double>(chrono::steady_clock::now() - c.opened).count();
+            out.push_back(s);
+        }
+        return out;
+    }
+
+    int64_t latencyPercentileUs(double p) const {
+        lock_guard<mutex> guard(lock);
+        if (latencySamples.empty()) return 0;
+        vector<int64_t> sorted = latencySamples;
+        size_t k = min(sorted.size() - 1, static_cast<size_t>(p / 100.0 * sorted.size()));
+        nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+    }
+};
+
+// Local stand-in for APNS/FCM: accepts h2c and answers every request with a fixed status.
+class MockPushProvider : public EpollServer {
+private:
+    struct H2Session : Connection {
+        bool prefaceSeen = false;
+        HpackDecoder decoder;
+        uint64_t unackedReceived = 0;
+        uint32_t continuationStream = 0;
+        string headerBlock;
+    };
+
+    int status;
+    atomic<uint64_t> received{0};
+
+    unique_ptr<Connection> makeConnection() override {
+        return make_unique<H2Session>();
+    }
+
+    void onAccept(Connection& conn) override {
+        appendH2Settings(conn.out, {{0x3, 1000}, {0x4, kH2DefaultWindow}});
+    }
+
+    void respond(H2Session& session, uint32_t stream) {
+        string block;
+        HpackEncoder().encode(block, ":status", to_string(status));
+        appendH2Frame(session.out, H2FrameType::Headers, kH2EndHeaders, stream, block);
+        appendH2Frame(session.out, H2FrameType::Data, kH2EndStream, stream, status == 200 ? R"({"name":"ok"})" : R"({"error":"mock"})");
+        received++;
+    }
+
+    bool onHeaderBlock(H2Session& session, uint32_t stream, string_view block, bool endHeaders, bool endStream) {
+        session.headerBlock.append(block);
+        if (!endHeaders) {
+            session.continuationStream = stream;
+            return true;
+        }
+        session.continuationStream = 0;
+        vector<pair<string, string>> headers;
+        bool ok = session.decoder.decode(session.headerBlock, headers);
+        session.headerBlock.clear();
+        if (ok && endStream) respond(session, stream);
+        return ok;
+    }
+
+    void onInput(Connection& conn) override {
+        auto& session = static_cast<H2Session&>(conn);
+        size_t offset = 0;
+        if (!session.prefaceSeen) {
+            if (conn.in.size() < kH2Preface.size()) return;
+            if (string_view(conn.in).substr(0, kH2Preface.size()) != kH2Preface) {
+                conn.closing = true;
+                return;
+            }
+            session.prefaceSeen = true;
+            offset = kH2Preface.size();
+        }
+        while (!conn.closing) {
+            H2Frame f;
+            long n = parseH2Frame(string_view(conn.in).substr(offset), f);
+            if (n == 0) break;
+            if (n < 0) {
+                conn.closing = true;
+                break;
+            }
+            offset += static_cast<size_t>(n);
+            string_view block;
+            switch (f.type) {
+            case H2FrameType::Settings:
+                if (!(f.flags & kH2Ack)) appendH2Frame(conn.out, H2FrameType::Settings, kH2Ack, 0, {});
+                break;
+            case H2FrameType::Ping:
+                if (!(f.flags & kH2Ack)) appendH2Frame(conn.out, H2FrameType::Ping, kH2Ack, 0, f.payload);
+                break;
+            case H2FrameType::Headers:
+                if (!h2HeaderBlock(f, block) ||
+                    !onHeaderBlock(session, f.stream, block, f.flags & kH2EndHeaders, f.flags & kH2EndStream))
+                    conn.closing = true;
+                break;
+            case H2FrameType::Continuation:
+                if (f.stream != session.continuationStream ||
+                    !onHeaderBlock(session, f.stream, f.payload, f.flags & kH2EndHeaders, false))
+                    conn.closing = true;
+                break;
+            case H2FrameType::Data:
+                session.unackedReceived += f.payload.size();
+                if (!f.payload.empty()) appendH2WindowUpdate(conn.out, f.stream, static_cast<uint32_t>(f.payload.size()));
+                if (session.unackedReceived >= kH2DefaultWindow / 2) {
+                    appendH2WindowUpdate(conn.out, 0, static_cast<uint32_t>(session.unackedReceived));
+                    session.unackedReceived = 0;
+                }
+                if (f.flags & kH2EndStream) respond(session, f.stream);
+                break;
+            default:
+                break;
+            }
+        }
+        conn.in.erase(0, offset);
+    }
+
+public:
+    explicit MockPushProvider(uint16_t port, int status = 200) : EpollServer(listenTcp(port)), status(status) {}
+
+    uint64_t requestsServed() const {
+        return received;
+    }
+};
+
+// Push channel: one JSON message per recipient, sent asynchronously over HTTP/2.
+// In the engine a send completes from the client's loop thread, so the number
+// of streams in flight is not bound by dispatcher threads; a non-2xx status, a
+// reset stream, a lost connection or the client's request timeout goes to the
+// tracker and the dead-letter path. deliver() waits for the answer instead.
+class PushStrategy : public INotificationStrategy {
+private:
+    shared_ptr<Http2PushClient> client;
+    string path;
+    chrono::milliseconds timeout;
+
+    static string makeBody(const string& content, const NotificationMeta& meta) {
+        string body = R"({"message":{"token":)";
+        appendJsonString(body, meta.userId);
+        body += R"(,"notification":{"body":)";
+        appendJsonString(body, content);
+        body += '}';
+        if (!meta.signature.empty()) {
+            body += R"(,"data":{"signature":")";
+            body += meta.signature;
+            body += "\"}";
+        }
+        body += "}}";
+        return body;
+    }
+
+    // Null for a 2xx answer; status is -1 for a failed stream, 0 for no answer in time.
+    static exception_ptr failureFor(int status, chrono::milliseconds timeout) {
+        string error;
+        if (status == 0) error = "push provider timed out after " + to_string(timeout.count()) + "ms";
+        else if (status < 0) error = "push stream failed";
+        else if (status < 200 || status >= 300) error = "push provider returned HTTP " + to_string(status);
+        else return nullptr;
+        return make_exception_ptr(
+            DeliveryFailure(error, status > 0 ? to_string(status) : "", {{"push", nowMs(), error}}));
+    }
+
+public:
+    PushStrategy(shared_ptr<Http2PushClient> client, string path = "/v1/projects/notifications/messages:send",
+                 chrono::milliseconds timeout = chrono::seconds(10))
+        : client(std::move(client)), path(std::move(path)), timeout(timeout) {}
+
+    string_view getChannel() const override { return "push"; }
+
+    void sendNotification(const string& content) override {
+        deliver(content, NotificationMeta());
+    }
+
+    void deliver(const string& content, const NotificationMeta& meta) override {
+        auto waiter = make_shared<StatusWaiter>();
+        client->submit(path, makeBody(content, meta), [waiter](const PushResult& result) { waiter->set(result.status); });
+        if (exception_ptr error = failureFor(waiter->wait(timeout).value_or(0), timeout)) rethrow_exception(error);
+    }
+
+    bool deliversAsync() const override { return true; }
+
+    void deliverAsync(const string& content, const NotificationMeta& meta,
+                      function<void(exception_ptr)> done) override {
+        chrono::milliseconds limit = timeout;
+        client->submit(path, makeBody(content, meta), [done = std::move(done), limit](const PushResult& result) {
+            done(failureFor(result.status, limit));
+        });
+    }
+};
+
+// SHA-256 and HMAC, used to sign webhook and push payloads. The block
+// function uses the SHA extensions when the CPU has them, and batches of
+// messages can be hashed eight at a time in AVX2 lanes; both are picked at
+// startup, so the binary still runs on CPUs without them.
+class Sha256 {
+public:
+    static constexpr uint32_t kInitial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    static constexpr size_t kLanes = 8;
+
+private:
+    alignas(16) static constexpr uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    uint32_t state[8] = {kInitial[0], kInitial[1], kInitial[2], kInitial[3],
+                         kInitial[4], kInitial[5], kInitial[6], kInitial[7]};
+    uint8_t buffer[64];
+    size_t buffered = 0;
+    uint64_t total = 0;
+
+    static uint32_t loadBE32(const uint8_t* p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+    }
+
+    static void compressPortable(uint32_t* h, const uint8_t* block, size_t blocks) {
+        auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+        for (; blocks > 0; blocks--, block += 64) {
+            uint32_t w[64];
+            for (int i = 0; i < 16; i++) w[i] = loadBE32(block + 4 * i);
+            for (int i = 16; i < 64; i++) {
+                uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+            for (int i = 0; i < 64; i++) {
+                uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+            }
+            h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+        }
+    }
+
+    // Lanes one after another; `h` is word-major (h[word][lane]).
+    static void compressLanesPortable(uint32_t (*h)[kLanes], const uint8_t* const* blocks) {
+        for (size_t lane = 0; lane < kLanes; lane++) {
+            uint32_t s[8];
+            for (int i = 0; i < 8; i++) s[i] = h[i][lane];
+            compressPortable(s, blocks[lane], 1);
+            for (int i = 0; i < 8; i++) h[i][lane] = s[i];
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sha,sse4.1")))
+    static void compressShaNi(uint32_t* h, const uint8_t* block, size_t blocks) {
+        const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        // The instructions want the state as ABEF and CDGH.
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h)), 0xB1);
+        __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h + 4)), 0x1B);
+        __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+        for (; blocks > 0; blocks--, block += 64) {
+            __m128i savedAbef = state0, savedCdgh = state1;
+            __m128i msg[4];
+            for (int i = 0; i < 4; i++)
+                msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * i)), byteSwap);
+            for (int r = 0; r < 16; r++) {
+                __m128i wk = _mm_add_epi32(msg[r & 3], _mm_load_si128(reinterpret_cast<const __m128i*>(k + 4 * r)));
+                state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+                state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+                if (r < 12) {
+                    // Schedule words 4r+16..4r+19 into the slot just consumed.
+                    __m128i next = _mm_sha256msg1_epu32(msg[r & 3], msg[(r + 1) & 3]);
+                    next = _mm_add_epi32(next, _mm_alignr_epi8(msg[(r + 3) & 3], msg[(r + 2) & 3], 4));
+                    msg[r & 3] = _mm_sha256msg2_epu32(next, msg[(r + 3) & 3]);
+                }
+            }
+            state0 = _mm_add_epi32(state0, savedAbef);
+            state1 = _mm_add_epi32(state1, savedCdgh);
+        }
+        tmp = _mm_shuffle_epi32(state0, 0x1B);
+        state1 = _mm_shuffle_epi32(state1, 0xB1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(h), _mm_blend_epi16(tmp, state1, 0xF0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(h + 4), _mm_alignr_epi8(state1, tmp, 8));
+    }
+
+    __attribute__((target("avx2"), always_inline))
+    static inline __m256i rotr(__m256i x, int n) {
+        return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+    }
+
+    // One block from each of eight independent messages, one per 32-bit lane.
+    __attribute__((target("avx2")))
+    static void compressLanesAvx2(uint32_t (*h)[kLanes], const uint8_t* const* blocks) {
+        __m256i s[8];
+        for (int i = 0; i < 8; i++) s[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h[i]));
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], hh = s[7];
+        __m256i w[16];
+        for (int i = 0; i < 64; i++) {
+            __m256i wi;
+            if (i < 16) {
+                wi = _mm256_setr_epi32(
+                    static_cast<int>(loadBE32(blocks[0] + 4 * i)), static_cast<int>(loadBE32(blocks[1] + 4 * i)),
+                    static_cast<int>(loadBE32(blocks[2] + 4 * i)), static_cast<int>(loadBE32(blocks[3] + 4 * i)),
+                    static_cast<int>(loadBE32(blocks[4] + 4 * i)), static_cast<int>(loadBE32(blocks[5] + 4 * i)),
+                    static_cast<int>(loadBE32(blocks[6] + 4 * i)), static_cast<int>(loadBE32(blocks[7] + 4 * i)));
+            } else {
+                __m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr(w15, 7), rotr(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr(w2, 17), rotr(w2, 19)), _mm256_srli_epi32(w2, 10));
+                wi = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+            }
+            w[i & 15] = wi;
+            __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(rotr(e, 6), rotr(e, 11)), rotr(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(hh, sigma1),
+                                          _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(k[i])), wi)));
+            __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(rotr(a, 2), rotr(a, 13)), rotr(a, 22));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            __m256i t2 = _mm256_add_epi32(sigma0, maj);
+            hh = g; g = f; f = e; e = _mm256_add_epi32(d, t1); d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+        }
+        __m256i out[8] = {a, b, c, d, e, f, g, hh};
+        for (int i = 0; i < 8; i++)
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(h[i]), _mm256_add_epi32(s[i], out[i]));
+    }
+
+    static bool cpuHasShaNi() {
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+        return (ebx & (1u << 29)) && __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3");
+    }
+#endif
+
+    using CompressFn = void (*)(uint32_t*, const uint8_t*, size_t);
+    using CompressLanesFn = void (*)(uint32_t (*)[kLanes], const uint8_t* const*);
+
+    static CompressFn pickCompress() {
+#if defined(__x86_64__) || defined(__i386__)
+        if (cpuHasShaNi()) return compressShaNi;
+#endif
+        return compressPortable;
+    }
+
+    static CompressLanesFn pickCompressLanes() {
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2")) return compressLanesAvx2;
+#endif
+        return compressLanesPortable;
+    }
+
+public:
+    static inline const CompressFn compressBlocks = pickCompress();
+    // Null unless lanes beat the single-message path on this CPU.
+    static inline const CompressLanesFn compressLanes =
+        compressBlocks == compressPortable ? pickCompressLanes() : nullptr;
+
+    static const char* implementation() {
+        if (compressBlocks != compressPortable) return "sha-ni";
+        return compressLanes == compressLanesPortable ? "portable" : "avx2 x8";
+    }
+
+    // Pads the final partial block of a message of `totalLength` bytes into
+    // `tail` (128 bytes) and returns how many blocks it spans (1 or 2).
+    static size_t padTail(uint8_t* tail, const uint8_t* rest, size_t restLength, uint64_t totalLength) {
+        memcpy(tail, rest, restLength);
+        tail[restLength] = 0x80;
+        size_t blocks = restLength < 56 ? 1 : 2;
+        memset(tail + restLength + 1, 0, blocks * 64 - restLength - 9);
+        uint64_t bitLength = totalLength * 8;
+        for (int i = 0; i < 8; i++) tail[blocks * 64 - 8 + i] = static_cast<uint8_t>(bitLength >> (56 - 8 * i));
+        return blocks;
+    }
+
+    static void storeDigest(const uint32_t* h, uint8_t* digest) {
+        for (int i = 0; i < 32; i++) digest[i] = static_cast<uint8_t>(h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+
+    void update(string_view data) {
+        auto p = reinterpret_cast<const uint8_t*>(data.data());
+        size_t n = data.size();
+        total += n;
+        if (buffered) {
+            size_t take = min(n, 64 - buffered);
+            memcpy(buffer + buffered, p, take);
+            buffered += take;
+            p += take;
+            n -= take;
+            if (buffered < 64) return;
+            compressBlocks(state, buffer, 1);
+            buffered = 0;
+        }
+        if (n >= 64) compressBlocks(state, p, n / 64);
+        p += n / 64 * 64;
+        n %= 64;
+        memcpy(buffer, p, n);
+        buffered = n;
+    }
+
+    array<uint8_t, 32> finish() {
+        uint8_t tail[128];
+        size_t blocks = padTail(tail, buffer, buffered, total);
+        compressBlocks(state, tail, blocks);
+        array<uint8_t, 32> digest;
+        storeDigest(state, digest.data());
+        return digest;
+    }
+};
+
+// Keeps the inner/outer key pads as hashed states, so each signature costs
+// the message's blocks plus one outer block, straight from the caller's memory.
+class HmacSha256 {
+private:
+    uint32_t innerState[8];
+    uint32_t outerState[8];
+
+    // The outer message is the inner digest: one block after the key pad.
+    static void outerBlock(const uint8_t* innerDigest, uint8_t* block) {
+        padTail(block, innerDigest, 32, 64 + 32);
+    }
+
+    static size_t padTail(uint8_t* tail, const uint8_t* rest, size_t restLength, uint64_t totalLength) {
+        return Sha256::padTail(tail, rest, restLength, totalLength);
+    }
+
+public:
+    explicit HmacSha256(string_view key) {
+        uint8_t block[64] = {};
+        if (key.size() > 64) {
+            Sha256 h;
+            h.update(key);
+            auto digest = h.finish();
+            memcpy(block, digest.data(), digest.size());
+        } else {
+            memcpy(block, key.data(), key.size());
+        }
+        uint8_t ipad[64], opad[64];
+        for (int i = 0; i < 64; i++) {
+            ipad[i] = static_cast<uint8_t>(block[i] ^ 0x36);
+            opad[i] = static_cast<uint8_t>(block[i] ^ 0x5c);
+        }
+        memcpy(innerState, Sha256::kInitial, sizeof(innerState));
+        memcpy(outerState, Sha256::kInitial, sizeof(outerState));
+        Sha256::compressBlocks(innerState, ipad, 1);
+        Sha256::compressBlocks(outerState, opad, 1);
+    }
+
+    array<uint8_t, 32> sign(string_view message) const {
+        auto p = reinterpret_cast<const uint8_t*>(message.data());
+        size_t full = message.size() / 64;
+        uint32_t h[8];
+        memcpy(h, innerState, sizeof(h));
+        if (full) Sha256::compressBlocks(h, p, full);
+        uint8_t tail[128];
+        size_t blocks = padTail(tail, p + full * 64, message.size() % 64, 64 + message.size());
+        Sha256::compressBlocks(h, tail, blocks);
+        uint8_t innerDigest[32], block[64];
+        Sha256::storeDigest(h, innerDigest);
+        outerBlock(innerDigest, block);
+        memcpy(h, outerState, sizeof(h));
+        Sha256::compressBlocks(h, block, 1);
+        array<uint8_t, 32> mac;
+        Sha256::storeDigest(h, mac.data());
+        return mac;
+    }
+
+    // Signs `count` messages. With AVX2 and no SHA extensions eight messages
+    // are hashed at once, one per lane; a lane that finishes its message
+    // takes the next, so lengths need not match.
+    void signBatch(const string_view* messages, size_t count, array<uint8_t, 32>* macs) const {
+        constexpr size_t kLanes = Sha256::kLanes;
+        if (!Sha256::compressLanes || count < kLanes) {
+            for (size_t i = 0; i < count; i++) macs[i] = sign(messages[i]);
+            return;
+        }
+        struct Lane {
+            size_t job = SIZE_MAX;
+            const uint8_t* next = nullptr; // next full block of the message
+            size_t fullLeft = 0;
+            size_t tailLeft = 0;
+            size_t tailUsed = 0;
+            uint8_t tail[128];
+        };
+        static const uint8_t idle[64] = {};
+        alignas(32) uint32_t h[8][kLanes];
+        Lane lanes[kLanes];
+        const uint8_t* blocks[kLanes];
+        size_t nextJob = 0, running = 0;
+
+        auto assign = [&](size_t lane) {
+            Lane& l = lanes[lane];
+            if (nextJob == count) {
+                l.job = SIZE_MAX;
+                return;
+            }
+            l.job = nextJob++;
+            string_view m = messages[l.job];
+            l.next = reinterpret_cast<const uint8_t*>(m.data());
+            l.fullLeft = m.size() / 64;
+            l.tailLeft = padTail(l.tail, l.next + l.fullLeft * 64, m.size() % 64, 64 + m.size());
+            l.tailUsed = 0;
+            for (int i = 0; i < 8; i++) h[i][lane] = innerState[i];
+            running++;
+        };
+        for (size_t lane = 0; lane < kLanes; lane++) assign(lane);
+
+        // Inner hashes: each message's own blocks.
+        while (running) {
+            for (size_t lane = 0; lane < kLanes; lane++) {
+                Lane& l = lanes[lane];
+                if (l.job == SIZE_MAX) blocks[lane] = idle;
+                else if (l.fullLeft) blocks[lane] = l.next;
+                else blocks[lane] = l.tail + 64 * l.tailUsed;
+            }
+            Sha256::compressLanes(h, blocks);
+            for (size_t lane = 0; lane < kLanes; lane++) {
+                Lane& l = lanes[lane];
+                if (l.job == SIZE_MAX) continue;
+                if (l.fullLeft) {
+                    l.fullLeft--;
+                    l.next += 64;
+                    continue;
+                }
+                if (++l.tailUsed < l.tailLeft) continue;
+                uint32_t digest[8];
+                for (int i = 0; i < 8; i++) digest[i] = h[i][lane];
+                Sha256::storeDigest(digest, macs[l.job].data()); // inner digest until the outer pass
+                running--;
+                assign(lane);
+            }
+        }
+
+        // Outer hashes: exactly one block each.
+        uint8_t outer[kLanes][64];
+        for (size_t first = 0; first < count; first += kLanes) {
+            size_t n = min(kLanes, count - first);
+            for (size_t lane = 0; lane < kLanes; lane++) {
+                for (int i = 0; i < 8; i++) h[i][lane] = outerState[i];
+                if (lane < n) {
+                    outerBlock(macs[first + lane].data(), outer[lane]);
+                    blocks[lane] = outer[lane];
+                } else {
+                    blocks[lane] = idle;
+                }
+            }
+            Sha256::compressLanes(h, blocks);
+            for (size_t lane = 0; lane < n; lane++) {
+                uint32_t digest[8];
+                for (int i = 0; i < 8; i++) digest[i] = h[i][lane];
+                Sha256::storeDigest(digest, macs[first + lane].data());
+            }
+        }
+    }
+};
+
+static string toHex(const uint8_t* data, size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    string out(n * 2, '0');
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 0xF];
+    }
+    return out;
+}
+
+// Strategy stage that signs each payload with its tenant's HMAC key and hands
+// the wrapped channel a copy of the metadata carrying the signature, so the
+// recipient can verify the content end to end. Key pads are hashed once per
+// tenant; notifications of tenants without a key pass through unsigned.
+class SigningStrategy : public INotificationStrategy {
+private:
+    // A signature from prepareBatch(), keyed by the address of the content it
+    // covers; holding the content keeps that address from being reused.
+    struct Prepared {
+        shared_ptr<const string> content;
+        const NotificationMeta* meta;
+        uint64_t batch;
+        string signature;
+    };
+    // Past this many unclaimed signatures, those more than kKeepBatches old are dropped.
+    static constexpr size_t kMaxPrepared = 65536;
+    static constexpr uint64_t kKeepBatches = 4;
+
+    unique_ptr<INotificationStrategy> inner;
+    unordered_map<string, HmacSha256> keys;
+    optional<HmacSha256> defaultKey;
+    atomic<uint64_t> signedCount{0};
+    atomic<uint64_t> batchSigned{0};
+    mutex preparedLock;
+    unordered_map<const string*, Prepared> prepared;
+    uint64_t batches = 0;
+
+    const HmacSha256* keyFor(const NotificationMeta& meta) const {
+        auto it = keys.find(meta.tenantId);
+        return it != keys.end() ? &it->second : defaultKey ? &*defaultKey : nullptr;
+    }
+
+    // `meta` itself without a key for its tenant, else `signedMeta` carrying the signature.
+    const NotificationMeta& sign(const string& content, const NotificationMeta& meta, NotificationMeta& signedMeta) {
+        const HmacSha256* key = keyFor(meta);
+        if (!key) return meta;
+        signedMeta = meta;
+        {
+            lock_guard<mutex> guard(preparedLock);
+            auto it = prepared.find(&content);
+            if (it != prepared.end() && it->second.meta == &meta) {
+                signedMeta.signature = std::move(it->second.signature);
+                prepared.erase(it);
+                batchSigned++;
+            }
+        }
+        // Not prepared: delivered outside an engine batch, or dropped as stale.
+        if (signedMeta.signature.empty()) {
+            auto mac = key->sign(content);
+            signedMeta.signature = toHex(mac.data(), mac.size());
+        }
+        signedCount++;
+        return signedMeta;
+    }
+
+public:
+    explicit SigningStrategy(unique_ptr<INotificationStrategy> inner, string_view defaultSecret = {})
+        : inner(std::move(inner)) {
+        if (!defaultSecret.empty()) defaultKey.emplace(defaultSecret);
+    }
+
+    // Call before notifications start flowing; keys are read without a lock.
+    void setTenantKey(const string& tenantId, string_view secret) {
+        keys.insert_or_assign(tenantId, HmacSha256(secret));
+    }
+
+    uint64_t signedNotifications() const {
+        return signedCount;
+    }
+
+    // Of those, the ones signed ahead of delivery by signBatch.
+    uint64_t batchSignedNotifications() const {
+        return batchSigned;
+    }
+
+    string_view getChannel() const override { return inner->getChannel(); }
+
+    bool preparesBatches() const override { return true; }
+
+    // Signs the batch per key with signBatch, so sends share the multi-lane path.
+    void prepareBatch(const vector<PreparedSend>& sends) override {
+        if (inner->preparesBatches()) inner->prepareBatch(sends);
+        unordered_map<const HmacSha256*, vector<size_t>> byKey;
+        for (size_t i = 0; i < sends.size(); i++) {
+            if (const HmacSha256* key = keyFor(*sends[i].meta)) byKey[key].push_back(i);
+        }
+        vector<string_view> views;
+        vector<array<uint8_t, 32>> macs;
+        vector<Prepared> signedSends;
+        for (auto& group : byKey) {
+            views.clear();
+            for (size_t i : group.second) views.push_back(*sends[i].content);
+            macs.resize(views.size());
+            group.first->signBatch(views.data(), views.size(), macs.data());
+            for (size_t j = 0; j < group.second.size(); j++) {
+                const PreparedSend& send = sends[group.second[j]];
+                signedSends.push_back({send.content, send.meta, 0, toHex(macs[j].data(), macs[j].size())});
+            }
+        }
+        lock_guard<mutex> guard(preparedLock);
+        batches++;
+        // Sends that were skipped (expired, say) never claim theirs; a dropped
+        // signature that is still wanted is just computed again at delivery.
+        if (prepared.size() > kMaxPrepared) {
+            for (auto it = prepared.begin(); it != prepared.end();) {
+                if (it->second.batch + kKeepBatches < batches) it = prepared.erase(it);
+                else ++it;
+            }
+        }
+        for (auto& entry : signedSends) {
+            entry.batch = batches;
+            const string* address = entry.content.get();
+            prepared.insert_or_assign(address, std::move(entry));
+        }
+    }
+
+    void sendNotification(const string& content) override {
+        deliver(content, NotificationMeta());
+    }
+
+    void deliver(const string& content, const NotificationMeta& meta) override {
+        NotificationMeta signedMeta;
+        inner->deliver(content, sign(content, meta, signedMeta));
+    }
+
+    bool deliversAsync() const override { return inner->deliversAsync(); }
+
+    void deliverAsync(const string& content, const NotificationMeta& meta,
+                      function<void(exception_ptr)> done) override {
+        NotificationMeta signedMeta;
+        inner->deliverAsync(content, sign(content, meta, signedMeta), std::move(done));
+    }
+
+};
+
+// Tenant-owned HTTP endpoint. Only plain http:// URLs are supported.
+struct WebhookEndpoint {
+    string host;
+    uint16_t port = 80;
+    string path = "/";
+    optional<HmacSha256> signer;
+
+    // nullopt unless the URL is http://host[:port][/path] with a port in 1..65535.
+    static optional<WebhookEndpoint> parse(string_view url, string_view secret = "") {
+        WebhookEndpoint endpoint;
+        if (url.substr(0, 7) != "http://") return nullopt;
+        url.remove_prefix(7);
+        size_t slash = url.find('/');
+        string_view authority = url.substr(0, slash);
+        if (slash != string_view::npos) endpoint.path = string(url.substr(slash));
+        size_t colon = authority.rfind(':');
+        if (colon != string_view::npos) {
+            string_view digits = authority.substr(colon + 1);
+            uint32_t port = 0;
+            if (digits.empty() || digits.size() > 5) return nullopt;
+            for (char c : digits) {
+                if (c < '0' || c > '9') return nullopt;
+                port = port * 10 + static_cast<uint32_t>(c - '0');
+            }
+            if (port == 0 || port > UINT16_MAX) return nullopt;
+            endpoint.port = static_cast<uint16_t>(port);
+            authority = authority.substr(0, colon);
+        }
+        if (authority.empty()) return nullopt;
+        endpoint.host = string(authority);
+        if (!secret.empty()) endpoint.signer.emplace(secret);
+        return endpoint;
+    }
+
+    string hostKey() const {
+        return host + ":" + to_string(port);
+    }
+};
+
+struct WebhookOptions {
+    size_t connectionsPerHost = 2;
+    size_t maxBatch = 1;       // >1 wraps events as {"events":[...]}
+    int lingerMs = 5;          // how long a worker waits to fill a batch
+    int timeoutMs = 5000;
+    size_t maxQueuedPerHost = 10000;
+};
+
+struct WebhookHostStats {
+    string host;
+    uint64_t delivered = 0;   // events acknowledged with a 2xx
+    uint64_t failed = 0;
+    uint64_t dropped = 0;     // rejected because the host queue was full
+    uint64_t requests = 0;
+    uint64_t connects = 0;
+    size_t queued = 0;
+};
+
+// Every host gets its own queue and worker threads, each holding one
+// keep-alive connection, so a slow tenant endpoint only backs up its own queue.
+class WebhookDispatcher {
+private:
+    struct Event {
+        shared_ptr<const WebhookEndpoint> endpoint;
+        string payload;
+        function<void(int status)> done; // runs on the worker with the HTTP status, or -1
+    };
+
+    struct HostPool {
+        mutex lock;
+        condition_variable ready;
+        deque<Event> queue;
+        bool stopping = false;
+        vector<thread> workers;
+        WebhookHostStats stats;
+    };
+
+    WebhookOptions options;
+    mutable mutex poolsLock;
+    unordered_map<string, unique_ptr<HostPool>> pools;
+
+    int connectTo(const WebhookEndpoint& endpoint) const {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(endpoint.host.c_str(), to_string(endpoint.port).c_str(), &hints, &result) != 0) return -1;
+        int fd = -1;
+        for (addrinfo* ai = result; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            pollfd p{fd, POLLOUT, 0};
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (poll(&p, 1, options.timeoutMs) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+        if (fd < 0) return -1;
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        timeval tv{options.timeoutMs / 1000, (options.timeoutMs % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    }
+
+    // Sends one request and reads the status line and headers. The body is
+    // drained only when Content-Length says how long it is; otherwise the
+    // connection is not reused. Returns the status, or -1 on transport errors.
+    static int exchange(int fd, const string& request, bool& reusable) {
+        reusable = false;
+        for (size_t sent = 0; sent < request.size();) {
+            ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            sent += static_cast<size_t>(n);
+        }
+
+        string response;
+        size_t headerEnd;
+        char buf[4096];
+        while ((headerEnd = response.find("\r\n\r\n")) == string::npos) {
+            if (response.size() > 64 * 1024) return -1;
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            response.append(buf, static_cast<size_t>(n));
+        }
+        if (response.compare(0, 5, "HTTP/") != 0 || response.size() < 12) return -1;
+        int status = atoi(response.c_str() + 9);
+
+        string_view head(response.data(), headerEnd);
+        optional<size_t> contentLength;
+        bool keepAlive = head.substr(0, 8) == "HTTP/1.1";
+        for (size_t pos = head.find("\r\n"); pos != string_view::npos;) {
+            size_t next = head.find("\r\n", pos + 2);
+            string_view line = head.substr(pos + 2, next == string_view::npos ? string_view::npos : next - pos - 2);
+            size_t colon = line.find(':');
+            if (colon != string_view::npos) {
+                string_view name = line.substr(0, colon);
+                string_view value = trim(line.substr(colon + 1));
+                if (iequals(name, "content-length")) contentLength = strtoull(string(value).c_str(), nullptr, 10);
+                else if (iequals(name, "connection")) keepAlive = !iequals(value, "close");
+            }
+            pos = next;
+        }
+
+        if (contentLength) {
+            size_t have = response.size() - headerEnd - 4;
+            while (have < *contentLength) {
+                ssize_t n = recv(fd, buf, min(sizeof(buf), *contentLength - have), 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return status;
+                have += static_cast<size_t>(n);
+            }
+            reusable = keepAlive && have == *contentLength;
+        }
+        return status;
+    }
+
+    static string buildRequest(const WebhookEndpoint& endpoint, const string& body) {
+        string request;
+        request.reserve(body.size() + 256);
+        request += "POST " + endpoint.path + " HTTP/1.1\r\nHost: " + endpoint.hostKey() +
+                   "\r\nContent-Type: application/json\r\nContent-Length: " + to_string(body.size()) + "\r\n";
+        if (endpoint.signer) {
+            // Signature covers "<timestamp>.<body>" so receivers can reject replays.
+            string timestamp = to_string(chrono::duration_cast<chrono::seconds>(
+                chrono::system_clock::now().time_since_epoch()).count());
+            string signedPart = timestamp + "." + body;
+            auto mac = endpoint.signer->sign(signedPart);
+            request += "X-Webhook-Timestamp: " + timestamp + "\r\nX-Webhook-Signature: sha256=" +
+                       toHex(mac.data(), mac.size()) + "\r\n";
+        }
+        request += "\r\n";
+        request += body;
+        return request;
+    }
+
+    void work(HostPool& pool) {
+        int fd = -1;
+        vector<Event> batch;
+        while (true) {
+            {
+                unique_lock<mutex> guard(pool.lock);
+                pool.ready.wait(guard, [&] { return pool.stopping || !pool.queue.empty(); });
+                if (pool.queue.empty()) break;
+                if (options.maxBatch > 1 && pool.queue.size() < options.maxBatch && !pool.stopping) {
+                    pool.ready.wait_for(guard, chrono::milliseconds(options.lingerMs),
+                                        [&] { return pool.stopping || pool.queue.size() >= options.maxBatch; });
+                    if (pool.queue.empty()) continue; // another worker took them while we lingered
+                }
+                // A batch only carries events for the same endpoint as its first event.
+                batch.clear();
+                batch.push_back(std::move(pool.queue.front()));
+                pool.queue.pop_front();
+                for (auto it = pool.queue.begin(); it != pool.queue.end() && batch.size() < options.maxBatch;) {
+                    if (it->endpoint == batch.front().endpoint) {
+                        batch.push_back(std::move(*it));
+                        it = pool.queue.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+
+            string body;
+            if (options.maxBatch > 1) {
+                body = "{\"events\":[";
+                for (size_t i = 0; i < batch.size(); i++) {
+                    if (i) body += ',';
+                    body += batch[i].payload;
+                }
+                body += "]}";
+            } else {
+                body = std::move(batch.front().payload);
+            }
+            string request = buildRequest(*batch.front().endpoint, body);
+
+            // A pooled connection may have been closed by the peer; retry once on a fresh one.
+            int status = -1;
+            uint64_t connects = 0;
+            for (int attempt = 0; attempt < 2 && status < 0; attempt++) {
+                bool fresh = fd < 0;
+                if (fresh) {
+                    fd = connectTo(*batch.front().endpoint);
+                    if (fd < 0) break;
+                    connects++;
+                }
+                bool reusable;
+                status = exchange(fd, request, reusable);
+                if (!reusable) {
+                    close(fd);
+                    fd = -1;
+                }
+                if (fresh) break;
+            }
+
+            {
+                lock_guard<mutex> guard(pool.lock);
+                pool.stats.requests++;
+                pool.stats.connects += connects;
+                if (status >= 200 && status < 300) pool.stats.delivered += batch.size();
+                else pool.stats.failed += batch.size();
+            }
+            for (auto& event : batch) {
+                if (event.done) event.done(status);
+            }
+        }
+        if (fd >= 0) close(fd);
+    }
+
+public:
+    explicit WebhookDispatcher(WebhookOptions options = {}) : options(options) {
+        this->options.connectionsPerHost = max<size_t>(1, options.connectionsPerHost);
+        this->options.maxBatch = max<size_t>(1, options.maxBatch);
+    }
+
+    // Workers drain what is already queued before exiting.
+    ~WebhookDispatcher() {
+        for (auto& entry : pools) {
+            {
+                lock_guard<mutex> guard(entry.second->lock);
+                entry.second->stopping = true;
+            }
+            entry.second->ready.notify_all();
+        }
+        for (auto& entry : pools) {
+            for (auto& worker : entry.second->workers) worker.join();
+        }
+    }
+
+    WebhookDispatcher(const WebhookDispatcher&) = delete;
+    WebhookDispatcher& operator=(const WebhookDispatcher&) = delete;
+
+    // False if the host queue is full; otherwise `done` gets the outcome.
+    bool enqueue(shared_ptr<const WebhookEndpoint> endpoint, string payload, function<void(int status)> done = nullptr) {
+        HostPool* pool;
+        {
+            lock_guard<mutex> guard(poolsLock);
+            auto& slot = pools[endpoint->hostKey()];
+            if (!slot) {
+                slot = make_unique<HostPool>();
+                slot->stats.host = endpoint->hostKey();
+                for (size_t i = 0; i < options.connectionsPerHost; i++) {
+                    slot->workers.emplace_back([this, p = slot.get()] { work(*p); });
+                }
+            }
+            pool = slot.get();
+        }
+        {
+            lock_guard<mutex> guard(pool->lock);
+            if (pool->queue.size() >= options.maxQueuedPerHost) {
+                pool->stats.dropped++;
+                return false;
+            }
+            pool->queue.push_back({std::move(endpoint), std::move(payload), std::move(done)});
+        }
+        pool->ready.notify_one();
+        return true;
+    }
+
+    vector<WebhookHostStats> stats() const {
+        vector<WebhookHostStats> out;
+        lock_guard<mutex> guard(poolsLock);
+        for (auto& entry : pools) {
+            lock_guard<mutex> poolGuard(entry.second->lock);
+            out.push_back(entry.second->stats);
+            out.back().queued = entry.second->queue.size();
+        }
+        return out;
+    }
+};
+
+// Webhook channel: POSTs each notification to the endpoint registered for its
+// recipient and waits for the answer, so a full host queue, a non-2xx status or
+// a transport error throws DeliveryFailure. Run the engine on an
+// OrderedDispatcher to keep several requests in flight.
+class WebhookStrategy : public INotificationStrategy {
+private:
+    shared_ptr<WebhookDispatcher> dispatcher;
+    shared_ptr<const WebhookEndpoint> fallback;
+    unordered_map<string, shared_ptr<const WebhookEndpoint>> endpoints;
+    chrono::milliseconds timeout;
+public:
+    explicit WebhookStrategy(shared_ptr<WebhookDispatcher> dispatcher, optional<WebhookEndpoint> fallback = nullopt,
+                             chrono::milliseconds timeout = chrono::seconds(30))
+        : dispatcher(std::move(dispatcher)), timeout(timeout) {
+        if (fallback) this->fallback = make_shared<const WebhookEndpoint>(std::move(*fallback));
+    }
+
+    // Call before notifications start flowing; routing is read without a lock.
+    void route(const string& userId, WebhookEndpoint endpoint) {
+        endpoints[userId] = make_shared<const WebhookEndpoint>(std::move(endpoint));
+    }
+
+    string_view getChannel() const override { return "webhook"; }
+
+    void sendNotification(const string& content) override {
+        deliver(content, NotificationMeta());
+    }
+
+    void deliver(const string& content, const NotificationMeta& meta) override {
+        auto it = endpoints.find(meta.userId);
+        const auto& endpoint = it != endpoints.end() ? it->second : fallback;
+        if (!endpoint) return;
+
+        string payload = "{\"id\":";
+        appendJsonString(payload, meta.id);
+        payload += ",\"type\":";
+        appendJsonString(payload, meta.type);
+        payload += ",\"userId\":";
+        appendJsonString(payload, meta.userId);
+        payload += ",\"content\":";
+        appendJsonString(payload, content);
+        if (!meta.signature.empty()) {
+            payload += ",\"signature\":\"";
+            payload += meta.signature;
+            payload += '"';
+        }
+        payload += '}';
+
+        auto waiter = make_shared<StatusWaiter>();
+        string error;
+        optional<int> status;
+        if (!dispatcher->enqueue(endpoint, std::move(payload), [waiter](int s) { waiter->set(s); })) {
+            error = "webhook queue for " + endpoint->hostKey() + " is full";
+        } else if (!(status = waiter->wait(timeout))) {
+            error = "webhook " + endpoint->hostKey() + " timed out after " + to_string(timeout.count()) + "ms";
+        } else if (*status < 0) {
+            error = "webhook " + endpoint->hostKey() + " unreachable";
+        } else if (*status < 200 || *status >= 300) {
+            error = "webhook " + endpoint->hostKey() + " returned HTTP " + to_string(*status);
+        } else {
+            return;
+        }
+        throw DeliveryFailure(error, status && *status > 0 ? to_string(*status) : "", {{"webhook", nowMs(), error}});
+    }
+};
+
+// Local stand-in for a tenant endpoint: answers every POST with a fixed status
+// and keeps the bodies it accepted.
+class MockWebhookReceiver : public EpollServer {
+private:
+    int status;
+    mutable mutex lock;
+    vector<string> bodies;
+
+    void onInput(Connection& conn) override {
+        size_t offset = 0;
+        while (!conn.closing) {
+            HttpRequest req;
+            long n = parseHttpRequest(string_view(conn.in).substr(offset), req);
+            if (n == 0) break;
+            if (n < 0) {
+                conn.closing = true;
+                break;
+            }
+            offset += static_cast<size_t>(n);
+            if (status >= 200 && status < 300) {
+                lock_guard<mutex> guard(lock);
+                bodies.emplace_back(req.body);
+            }
+            conn.out += "HTTP/1.1 " + to_string(status) + " Mock\r\nContent-Length: 0\r\n\r\n";
+        }
+        conn.in.erase(0, offset);
+    }
+
+public:
+    explicit MockWebhookReceiver(uint16_t port, int status = 200) : EpollServer(listenTcp(port)), status(status) {}
+
+    vector<string> received() const {
+        lock_guard<mutex> guard(lock);
+        return bodies;
+    }
+};
+
+// Binary ingestion protocol for internal producers.
+// Every frame starts with a fixed 16-byte little-endian header:
+//   magic "NTFY" | version u8 | type u8 | flags u16 | count u32 | length u32
+// A batch frame carries `count` records of
+//   idLen u16 | typeLen u16 | userLen u16 | flags u16 | messageLen u32 | [expiresAtMs u64] | id | type | user | message
+// and a compressed message is dictId u32 | rawLength u32 | LzCodec body.
+// The server grants credits (one per notification) and a producer may never
+// have more notifications in flight than it holds credits for.
+enum class IngestFrameType : uint8_t {
+    Batch = 1,
+    Credit = 2,
+    Error = 3
+};
+
+struct IngestFrameHeader {
+    static constexpr uint32_t kMagic = 0x5946544E; // "NTFY"
+    static constexpr uint8_t kVersion = 1;
+    static constexpr size_t kSize = 16;
+    static constexpr uint32_t kMaxLength = 16 * 1024 * 1024;
+
+    uint8_t version = kVersion;
+    IngestFrameType type = IngestFrameType::Batch;
+    uint16_t flags = 0;
+    uint32_t count = 0;
+    uint32_t length = 0;
+
+    void encode(string& out) const {
+        putLE32(out, kMagic);
+        out += static_cast<char>(version);
+        out += static_cast<char>(type);
+        putLE16(out, flags);
+        putLE32(out, count);
+        putLE32(out, length);
+    }
+
+    static bool decode(const char* p, IngestFrameHeader& h) {
+        if (readLE32(p) != kMagic) return false;
+        h.version = static_cast<uint8_t>(p[4]);
+        h.type = static_cast<IngestFrameType>(p[5]);
+        h.flags = readLE16(p + 6);
+        h.count = readLE32(p + 8);
+        h.length = readLE32(p + 12);
+        return true;
+    }
+};
+
+// Body compression: LZ77 in LZ4's block layout, with an optional preset
+// dictionary that matches may reach back into. A body is a run of sequences
+//   token u8 | [literal length bytes] | literals | offset u16 | [match length bytes]
+// where the token's high nibble is the literal length and the low nibble the
+// match length minus 4, each 15 meaning "add the following bytes until one is
+// not 255". The last sequence has literals only. Offsets count back from the
+// current output position; past its start they continue into the dictionary.
+struct CompressionDictionary {
+    static constexpr size_t kHashBits = 12;
+    static constexpr size_t kMaxSize = 32 * 1024;
+
+    uint32_t id = 0; // 0 means "no dictionary"
+    string bytes;
+    vector<int32_t> table; // hash of 4 bytes -> last position in `bytes`, or -1
+
+    static uint32_t hash4(const char* p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return (v * 2654435761u) >> (32 - kHashBits);
+    }
+
+    static shared_ptr<const CompressionDictionary> make(string bytes) {
+        auto dict = make_shared<CompressionDictionary>();
+        if (bytes.size() > kMaxSize) bytes.erase(0, bytes.size() - kMaxSize);
+        dict->id = static_cast<uint32_t>(fnv1a(bytes)) | 1;
+        dict->bytes = std::move(bytes);
+        dict->table.assign(size_t(1) << kHashBits, -1);
+        for (size_t i = 0; i + 4 <= dict->bytes.size(); i++)
+            dict->table[hash4(dict->bytes.data() + i)] = static_cast<int32_t>(i);
+        return dict;
+    }
+
+    // Picks the 32-byte segments whose 8-byte substrings recur across the most
+    // samples (a greedy cover, like zstd's trainer), best segment last so the
+    // most common text sits at the smallest offsets. Stops once what is left
+    // barely recurs.
+    static shared_ptr<const CompressionDictionary> train(const vector<string>& samples, size_t maxSize = 16 * 1024) {
+        constexpr size_t kGram = 8, kSegment = 32, kGrams = kSegment - kGram + 1;
+        // Every position's gram, interned, and the number of samples containing it.
+        unordered_map<uint64_t, uint32_t> ids;
+        vector<uint32_t> frequency;
+        vector<uint32_t> lastSample;
+        vector<vector<uint32_t>> grams(samples.size());
+        for (size_t s = 0; s < samples.size(); s++) {
+            const string& sample = samples[s];
+            for (size_t i = 0; i + kGram <= sample.size(); i++) {
+                uint64_t gram;
+                memcpy(&gram, sample.data() + i, kGram);
+                auto it = ids.emplace(gram, static_cast<uint32_t>(frequency.size())).first;
+                if (it->second == frequency.size()) {
+                    frequency.push_back(0);
+                    lastSample.push_back(UINT32_MAX);
+                }
+                if (lastSample[it->second] != s) {
+                    lastSample[it->second] = static_cast<uint32_t>(s);
+                    frequency[it->second]++;
+                }
+                grams[s].push_back(it->second);
+            }
+        }
+        auto windowScore = [&](size_t s, size_t start) {
+            uint64_t total = 0;
+            for (size_t i = 0; i < kGrams; i++) {
+                uint32_t f = frequency[grams[s][start + i]];
+                if (f > 1) total += f;
+            }
+            return total;
+        };
+
+        // Scores only fall as grams get covered, so a stale heap entry is an
+        // upper bound: rescore the top and take it only if it is still current.
+        struct Candidate {
+            uint64_t score;
+            uint32_t sample;
+            uint32_t start;
+            bool operator<(const Candidate& o) const { return score < o.score; }
+        };
+        // On average a segment's text must recur in at least two samples.
+        constexpr uint64_t kMinScore = 2 * kGrams;
+        priority_queue<Candidate> heap;
+        for (size_t s = 0; s < samples.size(); s++) {
+            for (size_t start = 0; start + kGrams <= grams[s].size(); start++) {
+                uint64_t score = windowScore(s, start);
+                if (score >= kMinScore) heap.push({score, static_cast<uint32_t>(s), static_cast<uint32_t>(start)});
+            }
+        }
+        vector<string_view> chosen;
+        size_t size = 0;
+        while (size + kSegment <= maxSize && !heap.empty()) {
+            Candidate top = heap.top();
+            heap.pop();
+            uint64_t current = windowScore(top.sample, top.start);
+            if (current != top.score) {
+                if (current >= kMinScore) heap.push({current, top.sample, top.start});
+                continue;
+            }
+            // Grams already covered stop counting, so the next pick adds new text.
+            for (size_t i = 0; i < kGrams; i++) frequency[grams[top.sample][top.start + i]] = 0;
+            chosen.push_back(string_view(samples[top.sample]).substr(top.start, kSegment));
+            size += kSegment;
+        }
+        string bytes;
+        bytes.reserve(size);
+        for (size_t i = chosen.size(); i-- > 0;) bytes.append(chosen[i]);
+        return make(std::move(bytes));
+    }
+};
+
+// Resolves the dictionary a compressed body names
+class IDictionarySource {
+public:
+    virtual shared_ptr<const CompressionDictionary> findDictionary(uint32_t id) = 0;
+    virtual ~IDictionarySource() = default;
+};
+
+class LzCodec {
+private:
+    static constexpr size_t kMinMatch = 4;
+    static constexpr size_t kMaxOffset = 65535;
+    static constexpr size_t kTailLiterals = 5; // the last bytes are always literals
+
+    static void putLength(string& out, size_t length) {
+        for (; length >= 255; length -= 255) out += static_cast<char>(255);
+        out += static_cast<char>(length);
+    }
+
+    static bool readLength(string_view in, size_t& pos, size_t& length) {
+        uint8_t b;
+        do {
+            if (pos >= in.size()) return false;
+            b = static_cast<uint8_t>(in[pos++]);
+            length += b;
+        } while (b == 255);
+        return true;
+    }
+
+    static void putSequence(string& out, const char* literals, size_t literalLength, size_t offset, size_t matchLength) {
+        size_t extraMatch = matchLength ? matchLength - kMinMatch : 0;
+        out += static_cast<char>((min<size_t>(literalLength, 15) << 4) | min<size_t>(extraMatch, 15));
+        if (literalLength >= 15) putLength(out, literalLength - 15);
+        out.append(literals, literalLength);
+        if (!matchLength) return;
+        putLE16(out, static_cast<uint16_t>(offset));
+        if (extraMatch >= 15) putLength(out, extraMatch - 15);
+    }
+
+public:
+    // Appends the compressed form of input to out.
+    static void compress(string_view input, const CompressionDictionary* dict, string& out) {
+        // The window is the dictionary followed by the input, so matches may
+        // span both; it is rebuilt only when the dictionary changes.
+        thread_local string window;
+        thread_local const CompressionDictionary* windowDict = nullptr;
+        thread_local uint32_t windowId = 0;
+        thread_local vector<int32_t> table;
+        size_t base = dict ? dict->bytes.size() : 0;
+        if (windowDict != dict || (dict && windowId != dict->id) || window.size() < base) {
+            window.assign(dict ? dict->bytes : string());
+            windowDict = dict;
+            windowId = dict ? dict->id : 0;
+        }
+        window.resize(base);
+        window.append(input);
+        table.assign(size_t(1) << CompressionDictionary::kHashBits, -1);
+
+        const char* w = window.data();
+        size_t end = window.size();
+        size_t anchor = base, pos = base;
+        while (input.size() > kTailLiterals + kMinMatch && pos + kMinMatch + kTailLiterals <= end) {
+            uint32_t h = CompressionDictionary::hash4(w + pos);
+            size_t candidate = SIZE_MAX;
+            int32_t recent = table[h];
+            table[h] = static_cast<int32_t>(pos);
+            if (recent >= 0 && pos - recent <= kMaxOffset && memcmp(w + recent, w + pos, kMinMatch) == 0) {
+                candidate = static_cast<size_t>(recent);
+            } else if (dict && dict->table[h] >= 0 && pos - dict->table[h] <= kMaxOffset &&
+                       memcmp(w + dict->table[h], w + pos, kMinMatch) == 0) {
+                candidate = static_cast<size_t>(dict->table[h]);
+            }
+            if (candidate == SIZE_MAX) {
+                // Skip faster through text that does not compress.
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+            size_t length = kMinMatch;
+            while (pos + length < end - kTailLiterals && w[candidate + length] == w[pos + length]) length++;
+            putSequence(out, w + anchor, pos - anchor, pos - candidate, length);
+            pos += length;
+            anchor = pos;
+        }
+        putSequence(out, w + anchor, end - anchor, 0, 0);
+    }
+
+    // Largest body `compressedSize` bytes can decode to: a match length byte of
+    // 255 is the densest encoding, so no byte yields more than 255 output bytes.
+    static constexpr size_t maxDecompressedSize(size_t compressedSize) {
+        return compressedSize * 255;
+    }
+
+    // Replaces out with the decompressed body; false if it is malformed or
+    // does not decompress to exactly rawLength bytes. A rawLength the input
+    // could not reach is refused before anything is allocated.
+    static bool decompress(string_view in, const CompressionDictionary* dict, size_t rawLength, string& out) {
+        if (rawLength > maxDecompressedSize(in.size())) return false;
+        string_view prefix = dict ? string_view(dict->bytes) : string_view();
+        out.resize(rawLength);
+        char* o = out.data();
+        size_t produced = 0, pos = 0;
+        while (pos < in.size()) {
+            uint8_t token = static_cast<uint8_t>(in[pos++]);
+            size_t literalLength = token >> 4;
+            if (literalLength == 15 && !readLength(in, pos, literalLength)) return false;
+            if (literalLength > in.size() - pos || literalLength > rawLength - produced) return false;
+            memcpy(o + produced, in.data() + pos, literalLength);
+            pos += literalLength;
+            produced += literalLength;
+            if (pos == in.size()) break;
+            if (in.size() - pos < 2) return false;
+            size_t offset = readLE16(in.data() + pos);
+            pos += 2;
+            size_t matchLength = (token & 15) + kMinMatch;
+            if ((token & 15) == 15 && !readLength(in, pos, matchLength)) return false;
+            if (offset == 0 || offset > produced + prefix.size() || matchLength > rawLength - produced) return false;
+            if (offset > produced) {
+                // Starts in the dictionary, possibly running on into the output.
+                size_t fromDict = min(matchLength, offset - produced);
+                memcpy(o + produced, prefix.data() + prefix.size() - (offset - produced), fromDict);
+                produced += fromDict;
+                matchLength -= fromDict;
+            }
+            // Overlapping copies repeat the last `offset` bytes, so go byte by byte.
+            for (; matchLength > 0; matchLength--, produced++) o[produced] = o[produced - offset];
+        }
+        return produced == rawLength;
+    }
+};
+
+// A body kept compressed until a channel needs the text
+class CompressedNotification : public INotification {
+private:
+    string compressed;
+    shared_ptr<const CompressionDictionary> dict;
+    size_t rawLength;
+    NotificationMeta meta;
+public:
+    CompressedNotification(string compressed, shared_ptr<const CompressionDictionary> dict, size_t rawLength,
+                           NotificationMeta meta)
+        : compressed(std::move(compressed)), dict(std::move(dict)), rawLength(rawLength), meta(std::move(meta)) {}
+
+    string getContent() const override {
+        string out;
+        renderTo(out);
+        return out;
+    }
+    void renderTo(string& out) const override {
+        if (!LzCodec::decompress(compressed, dict.get(), rawLength, out))
+            throw runtime_error("corrupt compressed body");
+    }
+    size_t contentSize() const override {
+        return rawLength;
+    }
+    const NotificationMeta& getMeta() const override {
+        return meta;
+    }
+    NotificationMeta* mutableMeta() override {
+        return &meta;
+    }
+};
+
+// Record flags: expiresAtMs is present; the message is compressed.
+constexpr uint16_t kIngestHasExpiry = 0x1;
+constexpr uint16_t kIngestCompressed = 0x2;
+
+static void appendIngestHeader(string& payload, const NotificationMeta& meta, size_t messageLen, uint16_t flags) {
+    if (meta.id.size() > UINT16_MAX || meta.type.size() > UINT16_MAX || meta.userId.size() > UINT16_MAX ||
+        messageLen > UINT32_MAX) throw length_error("notification field too long for ingest record");
+    if (meta.expiresAtMs) flags |= kIngestHasExpiry;
+    putLE16(payload, static_cast<uint16_t>(meta.id.size()));
+    putLE16(payload, static_cast<uint16_t>(meta.type.size()));
+    putLE16(payload, static_cast<uint16_t>(meta.userId.size()));
+    putLE16(payload, flags);
+    putLE32(payload, static_cast<uint32_t>(messageLen));
+    if (meta.expiresAtMs) putLE64(payload, static_cast<uint64_t>(meta.expiresAtMs));
+    payload += meta.id;
+    payload += meta.type;
+    payload += meta.userId;
+}
+
+static void appendIngestRecord(string& payload, const NotificationMeta& meta, string_view message) {
+    appendIngestHeader(payload, meta, message.size(), 0);
+    payload += message;
+}
+
+static void appendCompressedIngestRecord(string& payload, const NotificationMeta& meta, uint32_t dictId,
+                                         size_t rawLength, string_view compressed) {
+    if (rawLength > UINT32_MAX) throw length_error("notification field too long for ingest record");
+    appendIngestHeader(payload, meta, 8 + compressed.size(), kIngestCompressed);
+    putLE32(payload, dictId);
+    putLE32(payload, static_cast<uint32_t>(rawLength));
+    payload += compressed;
+}
+
+// Compressed records need `dictionaries` and are rejected without it, as are
+// ones claiming a body longer than `maxBodyBytes` or than their compressed
+// bytes can decode to; by default no longer than an ingest frame could carry.
+static bool readIngestRecord(string_view payload, size_t& pos, shared_ptr<INotification>& out,
+                             IDictionarySource* dictionaries = nullptr,
+                             size_t maxBodyBytes = IngestFrameHeader::kMaxLength) {
+    if (payload.size() - pos < 12) return false;
+    const char* p = payload.data() + pos;
+    size_t idLen = readLE16(p);
+    size_t typeLen = readLE16(p + 2);
+    size_t userLen = readLE16(p + 4);
+    uint16_t flags = readLE16(p + 6);
+    size_t messageLen = readLE32(p + 8);
+    size_t extra = (flags & kIngestHasExpiry) ? 8 : 0;
+    if (payload.size() - pos - 12 < extra + idLen + typeLen + userLen + messageLen) return false;
+    pos += 12;
+    NotificationMeta meta;
+    if (extra) {
+        meta.expiresAtMs = static_cast<int64_t>(readLE64(payload.data() + pos));
+        pos += 8;
+    }
+    meta.id.assign(payload.substr(pos, idLen));
+    pos += idLen;
+    meta.type.assign(payload.substr(pos, typeLen));
+    pos += typeLen;
+    meta.userId.assign(payload.substr(pos, userLen));
+    pos += userLen;
+    string_view message = payload.substr(pos, messageLen);
+    pos += messageLen;
+    if (!(flags & kIngestCompressed)) {
+        out = make_shared<SimpleNotification>(string(message), std::move(meta));
+        return true;
+    }
+    // Stays compressed until a channel renders it.
+    if (!dictionaries || message.size() < 8) return false;
+    uint32_t dictId = readLE32(message.data());
+    size_t rawLength = readLE32(message.data() + 4);
+    if (rawLength > maxBodyBytes || rawLength > LzCodec::maxDecompressedSize(message.size() - 8)) return false;
+    shared_ptr<const CompressionDictionary> dict;
+    if (dictId && !(dict = dictionaries->findDictionary(dictId))) return false;
+    out = make_shared<CompressedNotification>(string(message.substr(8)), std::move(dict), rawLength, std::move(meta));
+    return true;
+}
+
+static void appendIngestFrame(string& out, IngestFrameType type, uint32_t count, string_view payload) {
+    IngestFrameHeader h;
+    h.type = type;
+    h.count = count;
+    h.length = static_cast<uint32_t>(payload.size());
+    h.encode(out);
+    out += payload;
+}
+
+// Binary ingestion server. The event loop only decodes; a worker thread
+// feeds batches to NotificationService, and a batch's credits go back to its
+// producer once the engine has finished it, so the credit window tracks what
+// the engine absorbs and a slow batch never stalls the other connections.
+class BinaryIngestServer : public EpollServer {
+private:
+    struct IngestConnection : Connection {
+        uint64_t id = 0;
+        uint32_t credits = 0;
+    };
+
+    struct Job {
+        int fd;
+        uint64_t connection;
+        vector<shared_ptr<INotification>> batch;
+    };
+
+    struct Done {
+        int fd;
+        uint64_t connection;
+        uint32_t count;
+    };
+
+    NotificationService& service;
+    uint32_t creditWindow;
+    uint64_t nextConnectionId = 1;
+    vector<shared_ptr<INotification>> batch;
+
+    mutex jobLock;
+    condition_variable jobReady;
+    deque<Job> jobs;
+    vector<Done> done;
+    vector<Done> doneDraining;
+    bool stopping = false;
+    thread worker;
+
+    unique_ptr<Connection> makeConnection() override {
+        return make_unique<IngestConnection>();
+    }
+
+    void onAccept(Connection& conn) override {
+        auto& ingest = static_cast<IngestConnection&>(conn);
+        ingest.id = nextConnectionId++;
+        ingest.credits = creditWindow;
+        appendIngestFrame(conn.out, IngestFrameType::Credit, creditWindow, {});
+    }
+
+    void reject(Connection& conn, string_view reason) {
+        appendIngestFrame(conn.out, IngestFrameType::Error, 0, reason);
+        conn.closing = true;
+    }
+
+    bool decodeBatch(string_view payload, uint32_t count) {
+        batch.clear();
+        size_t pos = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            shared_ptr<INotification> notification;
+            if (!readIngestRecord(payload, pos, notification)) return false;
+            batch.push_back(std::move(notification));
+        }
+        return pos == payload.size();
+    }
+
+    void onInput(Connection& conn) override {
+        auto& ingest = static_cast<IngestConnection&>(conn);
+        size_t offset = 0;
+        while (!conn.closing && conn.in.size() - offset >= IngestFrameHeader::kSize) {
+            IngestFrameHeader h;
+            if (!IngestFrameHeader::decode(conn.in.data() + offset, h)) {
+                reject(conn, "bad magic");
+                break;
+            }
+            if (h.version == 0 || h.version > IngestFrameHeader::kVersion) {
+                reject(conn, "unsupported version");
+                break;
+            }
+            if (h.length > IngestFrameHeader::kMaxLength) {
+                reject(conn, "frame too large");
+                break;
+            }
+            if (conn.in.size() - offset - IngestFrameHeader::kSize < h.length) break;
+
+            string_view payload(conn.in.data() + offset + IngestFrameHeader::kSize, h.length);
+            offset += IngestFrameHeader::kSize + h.length;
+            if (h.type != IngestFrameType::Batch) {
+                reject(conn, "unexpected frame type");
+                break;
+            }
+            if (h.count > ingest.credits) {
+                reject(conn, "credit exceeded");
+                break;
+            }
+            if (!decodeBatch(payload, h.count)) {
+                reject(conn, "malformed batch");
+                break;
+            }
+            ingest.credits -= h.count;
+            {
+                lock_guard<mutex> guard(jobLock);
+                jobs.push_back({conn.fd, ingest.id, std::move(batch)});
+            }
+            jobReady.notify_one();
+            batch = {};
+        }
+        conn.in.erase(0, offset);
+    }
+
+    // Credits for finished batches go back to producers that are still connected.
+    void onWake() override {
+        {
+            lock_guard<mutex> guard(jobLock);
+            doneDraining.swap(done);
+        }
+        for (auto& d : doneDraining) {
+            auto it = connections.find(d.fd);
+            if (it == connections.end()) continue;
+            auto& ingest = static_cast<IngestConnection&>(*it->second);
+            if (ingest.id != d.connection || ingest.closing) continue;
+            ingest.credits += d.count;
+            appendIngestFrame(ingest.out, IngestFrameType::Credit, d.count, {});
+            flush(ingest);
+        }
+        doneDraining.clear();
+    }
+
+    void work() {
+        unique_lock<mutex> guard(jobLock);
+        while (true) {
+            jobReady.wait(guard, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            guard.unlock();
+            service.sendBatch(job.batch);
+            guard.lock();
+            done.push_back({job.fd, job.connection, static_cast<uint32_t>(job.batch.size())});
+            wake();
+        }
+    }
+
+public:
+    BinaryIngestServer(int listeningSocket, uint32_t creditWindow = 4096)
+        : EpollServer(listeningSocket), service(NotificationService::getInstance()), creditWindow(creditWindow) {
+        worker = thread([this] { work(); });
+    }
+
+    // Batches already accepted are still handed to the engine.
+    ~BinaryIngestServer() override {
+        {
+            lock_guard<mutex> guard(jobLock);
+            stopping = true;
+        }
+        jobReady.notify_one();
+        worker.join();
+    }
+};
+
+// Blocking producer for the binary ingestion protocol
+class BinaryIngestClient {
+private:
+    int fd = -1;
+    uint32_t credits = 0;
+    uint32_t batchSize;
+    uint32_t pendingCount = 0;
+    string pending;
+    string frame;
+    string inbound;
+
+    void readFrames() {
+        char buf[4096];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) return;
+        if (n <= 0) throw runtime_error("ingest server closed the connection");
+        inbound.append(buf, static_cast<size_t>(n));
+
+        size_t offset = 0;
+        IngestFrameHeader h;
+        while (inbound.size() - offset >= IngestFrameHeader::kSize) {
+            if (!IngestFrameHeader::decode(inbound.data() + offset, h)) throw runtime_error("bad frame from ingest server");
+            if (inbound.size() - offset - IngestFrameHeader::kSize < h.length) break;
+            string_view payload(inbound.data() + offset + IngestFrameHeader::kSize, h.length);
+            offset += IngestFrameHeader::kSize + h.length;
+            if (h.type == IngestFrameType::Credit) credits += h.count;
+            else if (h.type == IngestFrameType::Error) throw runtime_error("ingest server rejected batch: " + string(payload));
+        }
+        inbound.erase(0, offset);
+    }
+
+    explicit BinaryIngestClient(int connectedFd, uint32_t batchSize)
+        : fd(connectedFd), batchSize(batchSize) {}
+
+public:
+    static BinaryIngestClient connectUnix(const string& path, uint32_t batchSize = 256) {
+        sockaddr_un addr = unixAddress(path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            string err = strerror(errno);
+            if (fd >= 0) close(fd);
+            throw runtime_error("connect to " + path + ": " + err);
+        }
+        return BinaryIngestClient(fd, batchSize);
+    }
+
+    static BinaryIngestClient connectTcp(const string& host, uint16_t port, uint32_t batchSize = 256) {
+        return BinaryIngestClient(::connectTcp(host, port), batchSize);
+    }
+
+    BinaryIngestClient(BinaryIngestClient&& other) noexcept
+        : fd(other.fd), credits(other.credits), batchSize(other.batchSize), pendingCount(other.pendingCount),
+          pending(std::move(other.pending)), frame(std::move(other.frame)), inbound(std::move(other.inbound)) {
+        other.fd = -1;
+    }
+
+    ~BinaryIngestClient() {
+        if (fd >= 0) close(fd);
+    }
+
+    void add(const NotificationMeta& meta, string_view message) {
+        appendIngestRecord(pending, meta, message);
+        if (++pendingCount >= batchSize) flush();
+    }
+
+    // Waits for enough credits, then ships everything queued as one batch frame.
+    void flush() {
+        if (pendingCount == 0) return;
+        while (credits < pendingCount) readFrames();
+        frame.clear();
+        appendIngestFrame(frame, IngestFrameType::Batch, pendingCount, pending);
+        size_t sent = 0;
+        while (sent < frame.size()) {
+            ssize_t n = send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error(string("send: ") + strerror(errno));
+            }
+            sent += static_cast<size_t>(n);
+        }
+        credits -= pendingCount;
+        pendingCount = 0;
+        pending.clear();
+    }
+};
+
+// Durable partitioned log: a local stand-in for the Kafka/RabbitMQ hop.
+// Each partition is a directory of append-only segments named by base offset.
+// A record is
+//   length u32 | crc32c u32 | offset u64 | timestampMs u64 | keyLen u16 | key | value
+// where length counts the bytes after the crc and the crc covers them.
+static uint32_t crc32cPortable(const char* data, size_t n) {
+    static const auto table = [] {
+        array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0x82F63B78 ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < n; i++) crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+#if defined(__x86_64__)
+// SSE4.2 has CRC32C as an instruction, 8 bytes per step.
+__attribute__((target("sse4.2"))) static uint32_t crc32cSse42(const char* data, size_t n) {
+    uint64_t crc = 0xFFFFFFFF;
+    for (; n >= 8; data += 8, n -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = _mm_crc32_u64(crc, word);
+    }
+    uint32_t c = static_cast<uint32_t>(crc);
+    for (; n > 0; data++, n--) c = _mm_crc32_u8(c, static_cast<uint8_t>(*data));
+    return c ^ 0xFFFFFFFF;
+}
+#endif
+
+static uint32_t crc32c(const char* data, size_t n) {
+    using CrcFn = uint32_t (*)(const char*, size_t);
+    static const CrcFn impl = [] {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2")) return static_cast<CrcFn>(crc32cSse42);
+#endif
+        return static_cast<CrcFn>(crc32cPortable);
+    }();
+    return impl(data, n);
+}
+
+static void makeDirectory(const string& path) {
+    if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST)
+        throw runtime_error("mkdir " + path + ": " + strerror(errno));
+}
+
+// Writes a small file atomically: temp file, fsync, rename.
+static void writeFileAtomically(const string& path, string_view contents) {
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw runtime_error("open " + tmp + ": " + strerror(errno));
+    bool ok = write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size()) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) throw runtime_error("write " + path + ": " + strerror(errno));
+}
+
+static bool readWholeFile(const string& path, string& out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    out.clear();
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) out.append(buf, static_cast<size_t>(n));
+    close(fd);
+    return n == 0;
+}
+
+struct LogMapping {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    LogMapping(const string& path, size_t length) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw runtime_error("open " + path + ": " + strerror(errno));
+        void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) throw runtime_error("mmap " + path + ": " + strerror(errno));
+        madvise(addr, length, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(addr);
+        size = length;
+    }
+
+    ~LogMapping() {
+        munmap(const_cast<char*>(data), size);
+    }
+
+    LogMapping(const LogMapping&) = delete;
+    LogMapping& operator=(const LogMapping&) = delete;
+};
+
+struct LogRecord {
+    uint32_t partition;
+    uint64_t offset;
+    int64_t timestampMs;
+    string_view key;
+    string_view value;
+};
+
+// Records point into mapped segments; pins keep those mappings alive.
+struct LogFetch {
+    vector<LogRecord> records;
+    vector<shared_ptr<LogMapping>> pins;
+
+    void clear() {
+        records.clear();
+        pins.clear();
+    }
+};
+
+class LogPartition {
+private:
+    static constexpr size_t kRecordHeader = 4 + 4 + 8 + 8 + 2;
+    static constexpr uint64_t kIndexInterval = 4096;
+
+    struct Segment {
+        uint64_t baseOffset = 0;
+        string path;
+        uint64_t validBytes = 0;  // verified prefix of the file
+        uint64_t nextOffset = 0;  // offset after the last verified record
+        int64_t lastTimestampMs = 0;
+        vector<pair<uint64_t, uint64_t>> index; // sparse (offset, file position)
+        shared_ptr<LogMapping> mapping;
+    };
+
+    uint32_t id;
+    string dir;
+    bool writable;
+    uint64_t segmentBytes;
+    vector<Segment> segments;
+    int activeFd = -1;
+    string buffer;
+    mutable mutex lock;
+
+    static string segmentName(uint64_t baseOffset) {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.log", static_cast<unsigned long long>(baseOffset));
+        return name;
+    }
+
+    static uint64_t fileSize(const string& path) {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+    }
+
+    void mapAtLeast(Segment& seg, uint64_t bytes) {
+        if (bytes == 0 || (seg.mapping && seg.mapping->size >= bytes)) return;
+        seg.mapping = make_shared<LogMapping>(seg.path, fileSize(seg.path));
+    }
+
+    // Extends the verified prefix over whatever complete records follow it.
+    void scan(Segment& seg) {
+        uint64_t size = fileSize(seg.path);
+        if (size <= seg.validBytes) return;
+        mapAtLeast(seg, size);
+        const char* base = seg.mapping->data;
+        uint64_t pos = seg.validBytes;
+        size = seg.mapping->size;
+        while (size - pos >= kRecordHeader) {
+            uint32_t length = readLE32(base + pos);
+            if (length < kRecordHeader - 8 || size - pos - 8 < length) break;
+            if (crc32c(base + pos + 8, length) != readLE32(base + pos + 4)) break;
+            uint64_t offset = readLE64(base + pos + 8);
+            if (offset != seg.nextOffset) break;
+            if (seg.index.empty() || pos - seg.index.back().second >= kIndexInterval) seg.index.emplace_back(offset, pos);
+            seg.lastTimestampMs = static_cast<int64_t>(readLE64(base + pos + 16));
+            seg.nextOffset = offset + 1;
+            pos += 8 + length;
+        }
+        seg.validBytes = pos;
+    }
+
+    // Rebuilds the segment list, reusing scan state for segments seen before.
+    void loadSegments(vector<Segment> previous = {}) {
+        vector<Segment> fresh;
+        DIR* d = opendir(dir.c_str());
+        if (!d) {
+            segments.swap(previous);
+            return;
+        }
+        while (dirent* entry = readdir(d)) {
+            string name = entry->d_name;
+            if (name.size() != 24 || name.compare(20, 4, ".log") != 0) continue;
+            uint64_t base = stoull(name.substr(0, 20));
+            auto known = find_if(previous.begin(), previous.end(),
+                                 [&](const Segment& seg) { return seg.baseOffset == base; });
+            if (known != previous.end()) {
+                fresh.push_back(std::move(*known));
+            } else {
+                Segment seg;
+                seg.baseOffset = base;
+                seg.nextOffset = base;
+                seg.path = dir + "/" + name;
+                fresh.push_back(std::move(seg));
+            }
+        }
+        closedir(d);
+        sort(fresh.begin(), fresh.end(),
+             [](const Segment& a, const Segment& b) { return a.baseOffset < b.baseOffset; });
+        for (auto& seg : fresh) scan(seg);
+        segments.swap(fresh);
+    }
+
+    void openActive() {
+        if (segments.empty()) {
+            Segment seg;
+            seg.path = dir + "/" + segmentName(0);
+            segments.push_back(std::move(seg));
+        }
+        Segment& last = segments.back();
+        activeFd = open(last.path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (activeFd < 0) throw runtime_error("open " + last.path + ": " + strerror(errno));
+        // Drop a torn tail left by a crash mid-append.
+        if (ftruncate(activeFd, static_cast<off_t>(last.validBytes)) < 0 ||
+            lseek(activeFd, 0, SEEK_END) < 0)
+            throw runtime_error("truncate " + last.path + ": " + strerror(errno));
+        if (last.mapping && last.mapping->size > last.validBytes) last.mapping.reset();
+    }
+
+    void roll(uint64_t baseOffset) {
+        fdatasync(activeFd);
+        close(activeFd);
+        Segment seg;
+        seg.baseOffset = baseOffset;
+        seg.nextOffset = seg.baseOffset;
+        seg.path = dir + "/" + segmentName(seg.baseOffset);
+        segments.push_back(std::move(seg));
+        activeFd = open(segments.back().path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (activeFd < 0) throw runtime_error("open " + segments.back().path + ": " + strerror(errno));
+    }
+
+    // Encodes one record at the segment's next offset into `buffer`.
+    void encode(Segment& seg, int64_t ts, string_view key, string_view value) {
+        if (key.size() > UINT16_MAX) throw length_error("log record key too long");
+        size_t start = buffer.size();
+        uint32_t length = static_cast<uint32_t>(kRecordHeader - 8 + key.size() + value.size());
+        putLE32(buffer, length);
+        putLE32(buffer, 0);
+        putLE64(buffer, seg.nextOffset);
+        putLE64(buffer, static_cast<uint64_t>(ts));
+        putLE16(buffer, static_cast<uint16_t>(key.size()));
+        buffer += key;
+        buffer += value;
+        uint32_t crc = crc32c(buffer.data() + start + 8, length);
+        for (int i = 0; i < 4; i++) buffer[start + 4 + i] = static_cast<char>((crc >> (8 * i)) & 0xFF);
+        if (seg.index.empty() || seg.validBytes + start - seg.index.back().second >= kIndexInterval)
+            seg.index.emplace_back(seg.nextOffset, seg.validBytes + start);
+        seg.nextOffset++;
+        seg.lastTimestampMs = ts;
+    }
+
+    // Writes `buffer` to the end of the active segment.
+    void writeBuffer(Segment& seg) {
+        size_t written = 0;
+        while (written < buffer.size()) {
+            ssize_t n = write(activeFd, buffer.data() + written, buffer.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("append " + seg.path + ": " + strerror(errno));
+            }
+            written += static_cast<size_t>(n);
+        }
+        seg.validBytes += buffer.size();
+    }
+
+public:
+    LogPartition(uint32_t id, string directory, bool writable, uint64_t segmentBytes)
+        : id(id), dir(std::move(directory)), writable(writable), segmentBytes(segmentBytes) {
+        if (writable) makeDirectory(dir);
+        loadSegments();
+        if (writable) openActive();
+    }
+
+    ~LogPartition() {
+        if (activeFd >= 0) close(activeFd);
+    }
+
+    LogPartition(const LogPartition&) = delete;
+    LogPartition& operator=(const LogPartition&) = delete;
+
+    // Appends the records as one write; returns the offset of the first.
+    uint64_t append(const vector<pair<string_view, string_view>>& records) {
+        if (!writable) throw logic_error("append on a read-only log partition");
+        lock_guard<mutex> guard(lock);
+        if (segments.back().validBytes >= segmentBytes) roll(segments.back().nextOffset);
+        Segment& seg = segments.back();
+        uint64_t first = seg.nextOffset;
+        int64_t ts = nowMs();
+        buffer.clear();
+        for (auto& record : records) encode(seg, ts, record.first, record.second);
+        writeBuffer(seg);
+        return first;
+    }
+
+    // Appends records copied from another log (a replica's primary) at their
+    // original offsets and timestamps, so both logs hold the same bytes.
+    // Offsets already present are skipped; a gap, left when the source
+    // dropped segments this log never saw, starts a new segment.
+    void appendReplicated(const vector<LogRecord>& records) {
+        if (!writable) throw logic_error("append on a read-only log partition");
+        lock_guard<mutex> guard(lock);
+        buffer.clear();
+        for (auto& record : records) {
+            Segment* seg = &segments.back();
+            if (record.offset < seg->nextOffset) continue;
+            if (record.offset > seg->nextOffset || seg->validBytes + buffer.size() >= segmentBytes) {
+                writeBuffer(*seg);
+                buffer.clear();
+                if (seg->validBytes == 0 && segments.size() == 1) {
+                    // Nothing was ever written here; start over at the source's offset.
+                    close(activeFd);
+                    unlink(seg->path.c_str());
+                    segments.clear();
+                    Segment fresh;
+                    fresh.baseOffset = fresh.nextOffset = record.offset;
+                    fresh.path = dir + "/" + segmentName(record.offset);
+                    segments.push_back(std::move(fresh));
+                    openActive();
+                } else {
+                    roll(record.offset);
+                }
+                seg = &segments.back();
+            }
+            encode(*seg, record.timestampMs, record.key, record.value);
+        }
+        writeBuffer(segments.back());
+    }
+
+    void sync() {
+        lock_guard<mutex> guard(lock);
+        if (activeFd >= 0) fdatasync(activeFd);
+    }
+
+    // Readers pick up segments and records appended by the writer process.
+    void refresh() {
+        lock_guard<mutex> guard(lock);
+        if (writable) return;
+        vector<Segment> previous;
+        previous.swap(segments);
+        loadSegments(std::move(previous));
+    }
+
+    uint64_t earliestOffset() const {
+        lock_guard<mutex> guard(lock);
+        return segments.empty() ? 0 : segments.front().baseOffset;
+    }
+
+    uint64_t endOffset() const {
+        lock_guard<mutex> guard(lock);
+        return segments.empty() ? 0 : segments.back().nextOffset;
+    }
+
+    // Appends up to maxRecords records starting at offset; returns how many were added.
+    size_t fetch(uint64_t offset, size_t maxRecords, LogFetch& out) {
+        lock_guard<mutex> guard(lock);
+        size_t added = 0;
+        if (segments.empty()) return 0;
+        offset = max(offset, segments.front().baseOffset);
+
+        auto it = upper_bound(segments.begin(), segments.end(), offset,
+                              [](uint64_t o, const Segment& seg) { return o < seg.baseOffset; });
+        for (it = it == segments.begin() ? it : prev(it); it != segments.end() && added < maxRecords; ++it) {
+            Segment& seg = *it;
+            if (offset >= seg.nextOffset) continue;
+            mapAtLeast(seg, seg.validBytes);
+            const char* base = seg.mapping->data;
+
+            auto hint = upper_bound(seg.index.begin(), seg.index.end(), offset,
+                                    [](uint64_t o, const pair<uint64_t, uint64_t>& e) { return o < e.first; });
+            uint64_t pos = hint == seg.index.begin() ? 0 : prev(hint)->second;
+            while (pos < seg.validBytes && added < maxRecords) {
+                uint32_t length = readLE32(base + pos);
+                uint64_t recordOffset = readLE64(base + pos + 8);
+                if (recordOffset >= offset) {
+                    size_t keyLen = readLE16(base + pos + 24);
+                    LogRecord record;
+                    record.partition = id;
+                    record.offset = recordOffset;
+                    record.timestampMs = static_cast<int64_t>(readLE64(base + pos + 16));
+                    record.key = string_view(base + pos + kRecordHeader, keyLen);
+                    record.value = string_view(base + pos + kRecordHeader + keyLen, length - (kRecordHeader - 8) - keyLen);
+                    out.records.push_back(record);
+                    offset = recordOffset + 1;
+                    added++;
+                }
+                pos += 8 + length;
+            }
+            if (out.pins.empty() || out.pins.back() != seg.mapping) out.pins.push_back(seg.mapping);
+        }
+        return added;
+    }
+
+    // Deletes whole sealed segments once the partition exceeds maxBytes or they are older than maxAgeMs.
+    void enforceRetention(uint64_t maxBytes, int64_t maxAgeMs) {
+        lock_guard<mutex> guard(lock);
+        uint64_t total = 0;
+        for (auto& seg : segments) total += seg.validBytes;
+        int64_t cutoff = nowMs() - maxAgeMs;
+        while (segments.size() > 1) {
+            Segment& oldest = segments.front();
+            bool tooBig = maxBytes && total > maxBytes;
+            bool tooOld = maxAgeMs && oldest.lastTimestampMs < cutoff;
+            if (!tooBig && !tooOld) break;
+            unlink(oldest.path.c_str());
+            total -= oldest.validBytes;
+            segments.erase(segments.begin());
+        }
+    }
+};
+
+// Exclusive membership of a consumer group, or of a queue's writer. A group's
+// offsets and delivery ledger are shared state, so one member consumes at a
+// time; a second member of the group waits for the lease and takes over when
+// the holder exits or dies (it is a flock, so the kernel releases it with the
+// process).
+class GroupLease {
+private:
+    int fd = -1;
+
+public:
+    explicit GroupLease(const string& path) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) throw runtime_error("open " + path + ": " + strerror(errno));
+    }
+
+    ~GroupLease() {
+        close(fd);
+    }
+
+    GroupLease(const GroupLease&) = delete;
+    GroupLease& operator=(const GroupLease&) = delete;
+
+    bool tryAcquire() {
+        return flock(fd, LOCK_EX | LOCK_NB) == 0;
+    }
+};
+
+struct LogQueueOptions {
+    uint32_t partitions = 8;
+    uint64_t segmentBytes = 64 * 1024 * 1024;
+    uint64_t retentionBytes = 0; // per partition, 0 keeps everything
+    int64_t retentionMs = 0;     // 0 keeps everything
+    bool writable = true;
+};
+
+class PartitionedLogQueue {
+private:
+    string dir;
+    LogQueueOptions options;
+    optional<GroupLease> writerLock; // held while open for writing
+    vector<unique_ptr<LogPartition>> partitions;
+    mutex groupLock;
+
+    string groupPath(const string& group) const {
+        return dir + "/groups/" + group + ".offsets";
+    }
+
+public:
+    PartitionedLogQueue(string directory, LogQueueOptions opts = {})
+        : dir(std::move(directory)), options(opts) {
+        // Two writers would each keep their own next offset and overwrite each
+        // other's records, so a second one fails here instead.
+        if (options.writable) {
+            makeDirectory(dir);
+            writerLock.emplace(dir + "/writer.lock");
+            if (!writerLock->tryAcquire())
+                throw runtime_error("queue " + dir + " is already open for writing by another process");
+        }
+        string metaPath = dir + "/queue.meta";
+        string meta;
+        if (readWholeFile(metaPath, meta)) {
+            options.partitions = static_cast<uint32_t>(stoul(meta.substr(meta.find('=') + 1)));
+        } else if (options.writable) {
+            writeFileAtomically(metaPath, "partitions=" + to_string(options.partitions) + "\n");
+        } else {
+            throw runtime_error("no queue at " + dir);
+        }
+        if (options.writable) makeDirectory(dir + "/groups");
+        for (uint32_t p = 0; p < options.partitions; p++) {
+            partitions.push_back(make_unique<LogPartition>(
+                p, dir + "/p" + to_string(p), options.writable, options.segmentBytes));
+        }
+    }
+
+    const string& directory() const {
+        return dir;
+    }
+
+    uint32_t partitionCount() const {
+        return static_cast<uint32_t>(partitions.size());
+    }
+
+    uint32_t partitionFor(string_view key) const {
+        return static_cast<uint32_t>(fnv1a(key) % partitions.size());
+    }
+
+    uint64_t append(string_view key, string_view value) {
+        return partitions[partitionFor(key)]->append({{key, value}});
+    }
+
+    LogPartition& partition(uint32_t p) {
+        return *partitions.at(p);
+    }
+
+    void sync() {
+        for (auto& p : partitions) p->sync();
+    }
+
+    void refresh() {
+        for (auto& p : partitions) p->refresh();
+    }
+
+    void enforceRetention() {
+        for (auto& p : partitions) p->enforceRetention(options.retentionBytes, options.retentionMs);
+    }
+
+    vector<uint64_t> committedOffsets(const string& group) {
+        lock_guard<mutex> guard(groupLock);
+        vector<uint64_t> offsets(partitions.size(), 0);
+        string data;
+        if (readWholeFile(groupPath(group), data) && data.size() >= 4) {
+            size_t n = min<size_t>(readLE32(data.data()), (data.size() - 4) / 8);
+            for (size_t i = 0; i < n && i < offsets.size(); i++) offsets[i] = readLE64(data.data() + 4 + 8 * i);
+        }
+        return offsets;
+    }
+
+    void commit(const string& group, const vector<uint64_t>& offsets) {
+        lock_guard<mutex> guard(groupLock);
+        string data;
+        putLE32(data, static_cast<uint32_t>(offsets.size()));
+        for (uint64_t o : offsets) putLE64(data, o);
+        writeFileAtomically(groupPath(group), data);
+    }
+
+    // Consumer groups that have committed offsets.
+    vector<string> groups() const {
+        vector<string> names;
+        DIR* d = opendir((dir + "/groups").c_str());
+        if (!d) return names;
+        while (dirent* entry = readdir(d)) {
+            string name = entry->d_name;
+            if (name.size() > 8 && name.compare(name.size() - 8, 8, ".offsets") == 0)
+                names.push_back(name.substr(0, name.size() - 8));
+        }
+        closedir(d);
+        return names;
+    }
+
+    vector<uint64_t> endOffsets() const {
+        vector<uint64_t> ends;
+        for (auto& p : partitions) ends.push_back(p->endOffset());
+        return ends;
+    }
+};
+
+// Consumer group member reading every partition from the group's committed offsets
+class LogConsumer {
+private:
+    PartitionedLogQueue& queue;
+    string group;
+    vector<uint64_t> positions;
+    vector<uint64_t> committed;
+    uint32_t nextPartition = 0;
+
+public:
+    LogConsumer(PartitionedLogQueue& queue, string group)
+        : queue(queue), group(std::move(group)) {
+        positions = this->queue.committedOffsets(this->group);
+        committed = positions;
+    }
+
+    size_t poll(size_t maxRecords, LogFetch& out) {
+        out.clear();
+        uint32_t count = queue.partitionCount();
+        for (uint32_t i = 0; i < count && out.records.size() < maxRecords; i++) {
+            uint32_t p = (nextPartition + i) % count;
+            LogPartition& partition = queue.partition(p);
+            positions[p] = max(positions[p], partition.earliestOffset());
+            size_t before = out.records.size();
+            partition.fetch(positions[p], maxRecords - before, out);
+            if (out.records.size() > before) positions[p] = out.records.back().offset + 1;
+        }
+        nextPartition = (nextPartition + 1) % count;
+        return out.records.size();
+    }
+
+    void commit() {
+        if (positions == committed) return;
+        queue.commit(group, positions);
+        committed = positions;
+    }
+};
+
+// Persistent delivery state log (the outbox side of exactly-once).
+// Each (id, recipient, channel) is reduced to a 64-bit key, and state changes
+// are appended as frames of
+//   count u32 | crc32c u32 | count x (key u64 | state u8)
+// Changes are buffered and a background thread writes and syncs them in
+// groups, so sends never wait on the disk; sync() makes everything recorded
+// so far durable and is called before queue offsets are committed. On open
+// the log is replayed (a torn tail is dropped) and rewritten compactly when
+// most of its frames are superseded.
+//
+// committed() is called after each offset commit. A state recorded before a
+// commit belongs to a record that will not be replayed, so once that commit
+// is older than the retention (to within a second) the state is dropped, and
+// the writer rewrites the log when most of it is dropped or superseded. A
+// failed write or sync is kept and thrown from every later sync(), so offsets
+// are never committed past states that did not reach the disk.
+class DeliveryLedger : public IDeliveryTracker {
+private:
+    static constexpr size_t kRecordBytes = 9;
+    static constexpr int64_t kFlushIntervalMs = 20;
+    static constexpr size_t kFlushBytes = 64 * 1024;
+    static constexpr int64_t kMarkIntervalMs = 1000;
+
+    struct Entry {
+        DeliveryState state;
+        uint32_t epoch; // commits seen before it was recorded
+    };
+
+    // States recorded in epochs before `epoch` were committed at `atMs`.
+    struct CommitMark {
+        uint32_t epoch;
+        int64_t atMs;
+    };
+
+    string path;
+    int fd = -1;
+    int64_t retentionMs;
+    mutex lock;
+    condition_variable flushNeeded;
+    condition_variable flushed;
+    unordered_map<uint64_t, Entry> states;
+    uint32_t epoch = 0;
+    deque<CommitMark> marks;
+    size_t logRecords = 0;    // records in the file, superseded and dropped ones included
+    bool compactRequested = false;
+    string buffer;     // records not yet handed to the writer
+    size_t buffered = 0;
+    uint64_t appendedSeq = 0; // records handed to record()
+    uint64_t durableSeq = 0;  // records synced to disk
+    bool syncRequested = false;
+    bool stopping = false;
+    string writeError;        // first write or sync failure; the ledger stops writing after it
+    thread writer;
+
+    static uint64_t keyFor(const NotificationMeta& meta, string_view channel) {
+        string key;
+        key.reserve(meta.id.size() + meta.userId.size() + channel.size() + 2);
+        key += meta.id;
+        key += '\0';
+        key += meta.userId;
+        key += '\0';
+        key += channel;
+        return fnv1a(key);
+    }
+
+    static void appendFrame(string& out, string_view records, size_t count) {
+        putLE32(out, static_cast<uint32_t>(count));
+        putLE32(out, crc32c(records.data(), records.size()));
+        out += records;
+    }
+
+    void writeAll(string_view data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = write(fd, data.data() + written, data.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("append " + path + ": " + strerror(errno));
+            }
+            written += static_cast<size_t>(n);
+        }
+    }
+
+    // Returns the byte length of the valid prefix and the number of records it holds.
+    size_t load(const string& data, size_t& records) {
+        size_t pos = 0;
+        records = 0;
+        while (data.size() - pos >= 8) {
+            size_t count = readLE32(data.data() + pos);
+            uint32_t crc = readLE32(data.data() + pos + 4);
+            if (count == 0 || (data.size() - pos - 8) / kRecordBytes < count) break;
+            const char* p = data.data() + pos + 8;
+            if (crc32c(p, count * kRecordBytes) != crc) break;
+            for (size_t i = 0; i < count; i++, p += kRecordBytes) {
+                states[readLE64(p)] = {static_cast<DeliveryState>(p[8]), 0};
+            }
+            records += count;
+            pos += 8 + count * kRecordBytes;
+        }
+        return pos;
+    }
+
+    // Caller holds `lock` or is the constructor.
+    string compactImage() const {
+        string records;
+        records.reserve(states.size() * kRecordBytes);
+        for (auto& entry : states) {
+            putLE64(records, entry.first);
+            records += static_cast<char>(entry.second.state);
+        }
+        string data;
+        if (!states.empty()) appendFrame(data, records, states.size());
+        return data;
+    }
+
+    // Caller holds `lock`.
+    void prune(int64_t now) {
+        uint32_t before = 0;
+        while (!marks.empty() && now - marks.front().atMs >= retentionMs) {
+            before = marks.front().epoch;
+            marks.pop_front();
+        }
+        if (before == 0) return;
+        for (auto it = states.begin(); it != states.end();) {
+            if (it->second.epoch < before) it = states.erase(it);
+            else ++it;
+        }
+        if (logRecords > 1024 && logRecords > 2 * states.size()) {
+            compactRequested = true;
+            flushNeeded.notify_one();
+        }
+    }
+
+    void writeLoop() {
+        string pendingFrame;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            flushNeeded.wait_for(guard, chrono::milliseconds(kFlushIntervalMs), [&] {
+                return stopping || syncRequested || compactRequested || buffer.size() >= kFlushBytes;
+            });
+            syncRequested = false;
+            if (!writeError.empty()) {
+                // Nothing more reaches the disk; sync() reports why.
+                buffer.clear();
+                buffered = 0;
+                compactRequested = false;
+                flushed.notify_all();
+                if (stopping) return;
+                continue;
+            }
+            bool compacting = compactRequested;
+            compactRequested = false;
+            if (buffer.empty() && !compacting) {
+                if (stopping) return;
+                continue;
+            }
+            // The rewrite holds every state, those still buffered included.
+            pendingFrame = compacting ? compactImage() : string();
+            if (!compacting) appendFrame(pendingFrame, buffer, buffered);
+            size_t frameRecords = compacting ? states.size() : buffered;
+            uint64_t seq = appendedSeq;
+            buffer.clear();
+            buffered = 0;
+            guard.unlock();
+            string error;
+            try {
+                if (compacting) {
+                    writeFileAtomically(path, pendingFrame);
+                    int reopened = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+                    if (reopened < 0) throw runtime_error("open " + path + ": " + strerror(errno));
+                    close(fd);
+                    fd = reopened;
+                } else {
+                    writeAll(pendingFrame);
+                    if (fdatasync(fd) < 0) throw runtime_error("sync " + path + ": " + strerror(errno));
+                }
+            } catch (const exception& e) {
+                error = e.what();
+            }
+            guard.lock();
+            if (!error.empty()) {
+                writeError = error;
+                cerr << "[Ledger] " << error << "; offsets will not be committed" << endl;
+            } else {
+                durableSeq = seq;
+                logRecords = compacting ? frameRecords : logRecords + frameRecords;
+            }
+            flushed.notify_all();
+        }
+    }
+
+public:
+    // States stay `retentionMs` past the commit that covered them.
+    explicit DeliveryLedger(string file, int64_t retentionMs = 10 * 60 * 1000)
+        : path(std::move(file)), retentionMs(retentionMs) {
+        string data;
+        size_t records = 0;
+        size_t valid = readWholeFile(path, data) ? load(data, records) : 0;
+        logRecords = records;
+        if (records > 1024 && records > 2 * states.size()) {
+            writeFileAtomically(path, compactImage());
+            logRecords = states.size();
+        } else if (valid < data.size()) {
+            if (truncate(path.c_str(), static_cast<off_t>(valid)) < 0)
+                throw runtime_error("truncate " + path + ": " + strerror(errno));
+        }
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) throw runtime_error("open " + path + ": " + strerror(errno));
+        writer = thread([this] { writeLoop(); });
+    }
+
+    ~DeliveryLedger() override {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        flushNeeded.notify_all();
+        writer.join();
+        close(fd);
+    }
+
+    DeliveryLedger(const DeliveryLedger&) = delete;
+    DeliveryLedger& operator=(const DeliveryLedger&) = delete;
+
+    bool isDelivered(const NotificationMeta& meta, string_view channel) override {
+        uint64_t key = keyFor(meta, channel);
+        lock_guard<mutex> guard(lock);
+        auto it = states.find(key);
+        return it != states.end() && it->second.state == DeliveryState::Delivered;
+    }
+
+    void record(const NotificationMeta& meta, string_view channel, DeliveryState state) override {
+        uint64_t key = keyFor(meta, channel);
+        lock_guard<mutex> guard(lock);
+        states[key] = {state, epoch};
+        putLE64(buffer, key);
+        buffer += static_cast<char>(state);
+        buffered++;
+        appendedSeq++;
+        if (buffer.size() >= kFlushBytes) flushNeeded.notify_one();
+    }
+
+    // Blocks until every state recorded so far is on disk; throws if the
+    // ledger failed to write or sync.
+    void sync() {
+        unique_lock<mutex> guard(lock);
+        uint64_t target = appendedSeq;
+        if (durableSeq < target && writeError.empty()) {
+            syncRequested = true;
+            flushNeeded.notify_one();
+            flushed.wait(guard, [&] { return durableSeq >= target || !writeError.empty(); });
+        }
+        if (!writeError.empty()) throw runtime_error("delivery ledger: " + writeError);
+    }
+
+    // Call after committing the offsets of everything recorded so far.
+    void committed() {
+        int64_t now = nowMs();
+        lock_guard<mutex> guard(lock);
+        epoch++;
+        if (marks.empty() || now - marks.back().atMs >= kMarkIntervalMs) marks.push_back({epoch, now});
+        else marks.back().epoch = epoch;
+        prune(now);
+    }
+
+    size_t size() {
+        lock_guard<mutex> guard(lock);
+        return states.size();
+    }
+};
+
+struct DeadLetterFilter {
+    string channel;        // empty matches every channel
+    int64_t sinceMs = 0;
+    int64_t untilMs = 0;   // 0 has no upper bound
+    bool includeRedriven = false;
+    size_t limit = 0;      // 0 has no limit
+};
+
+// Dead-letter store: an append-only data file of CRC-framed letters
+//   length u32 | crc32c u32 | letter
+// and an index of fixed 24-byte entries, one per letter in order,
+//   offset u64 | failedAtMs u64 | channelHash u32 | flags u32
+// so selecting by channel and time reads only the index. The index is derived
+// data: on open its tail is checked against the data file and rebuilt from it.
+// Re-driving a letter sets a flag in its index entry; the data is never rewritten.
+class DeadLetterStore : public IDeadLetterSink {
+private:
+    static constexpr size_t kIndexEntry = 24;
+    static constexpr uint32_t kRedriven = 0x1;
+
+    struct IndexEntry {
+        uint64_t offset;
+        int64_t failedAtMs;
+        uint32_t channelHash;
+        uint32_t flags;
+    };
+
+    string dataPath;
+    string indexPath;
+    int dataFd = -1;
+    int indexFd = -1;
+    uint64_t dataSize = 0;
+    vector<IndexEntry> index;
+    mutex lock;
+
+    static uint32_t channelHash(string_view channel) {
+        return static_cast<uint32_t>(fnv1a(channel));
+    }
+
+    // failedAtMs u64 | expiresAtMs u64 | priority u8 | channel, id, type, userId, tenantId, reason (u16 strings) |
+    // content, providerResponse (u32 strings) | muted u16 + u16 strings | attempts u16 + (atMs u64, provider, error)
+    static string encode(const DeadLetter& l) {
+        string out;
+        putLE64(out, static_cast<uint64_t>(l.failedAtMs));
+        putLE64(out, static_cast<uint64_t>(l.meta.expiresAtMs));
+        out += static_cast<char>(l.meta.priority);
+        for (const string* f : {&l.channel, &l.meta.id, &l.meta.type, &l.meta.userId, &l.meta.tenantId, &l.reason})
+            putString16(out, *f);
+        putString32(out, l.content);
+        putString32(out, l.providerResponse);
+        size_t muted = min<size_t>(l.meta.mutedChannels.size(), UINT16_MAX);
+        putLE16(out, static_cast<uint16_t>(muted));
+        for (size_t i = 0; i < muted; i++) putString16(out, l.meta.mutedChannels[i]);
+        size_t attempts = min<size_t>(l.attempts.size(), UINT16_MAX);
+        putLE16(out, static_cast<uint16_t>(attempts));
+        for (size_t i = 0; i < attempts; i++) {
+            putLE64(out, static_cast<uint64_t>(l.attempts[i].atMs));
+            putString16(out, l.attempts[i].provider);
+            putString16(out, l.attempts[i].error);
+        }
+        return out;
+    }
+
+    static bool decode(string_view in, DeadLetter& l) {
+        if (in.size() < 17) return false;
+        l.failedAtMs = static_cast<int64_t>(readLE64(in.data()));
+        l.meta.expiresAtMs = static_cast<int64_t>(readLE64(in.data() + 8));
+        l.meta.priority = static_cast<NotificationPriority>(in[16]);
+        size_t pos = 17;
+        for (string* f : {&l.channel, &l.meta.id, &l.meta.type, &l.meta.userId, &l.meta.tenantId, &l.reason})
+            if (!readString(in, pos, 2, *f)) return false;
+        if (!readString(in, pos, 4, l.content) || !readString(in, pos, 4, l.providerResponse)) return false;
+        if (in.size() - pos < 2) return false;
+        l.meta.mutedChannels.resize(readLE16(in.data() + pos));
+        pos += 2;
+        for (auto& c : l.meta.mutedChannels)
+            if (!readString(in, pos, 2, c)) return false;
+        if (in.size() - pos < 2) return false;
+        l.attempts.resize(readLE16(in.data() + pos));
+        pos += 2;
+        for (auto& a : l.attempts) {
+            if (in.size() - pos < 8) return false;
+            a.atMs = static_cast<int64_t>(readLE64(in.data() + pos));
+            pos += 8;
+            if (!readString(in, pos, 2, a.provider) || !readString(in, pos, 2, a.error)) return false;
+        }
+        return pos == in.size();
+    }
+
+    static string encodeIndexEntry(const IndexEntry& e) {
+        string out;
+        putLE64(out, e.offset);
+        putLE64(out, static_cast<uint64_t>(e.failedAtMs));
+        putLE32(out, e.channelHash);
+        putLE32(out, e.flags);
+        return out;
+    }
+
+    static void writeAt(int fd, string_view data, uint64_t offset, const string& path) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = pwrite(fd, data.data() + written, data.size() - written, static_cast<off_t>(offset + written));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("write " + path + ": " + strerror(errno));
+            }
+            written += static_cast<size_t>(n);
+        }
+    }
+
+    // Reads the framed letter at offset; false if it is torn or corrupt.
+    bool readRecord(uint64_t offset, string& body) const {
+        char header[8];
+        if (offset + 8 > dataSize || pread(dataFd, header, 8, static_cast<off_t>(offset)) != 8) return false;
+        uint32_t length = readLE32(header);
+        if (offset + 8 + length > dataSize) return false;
+        body.resize(length);
+        if (pread(dataFd, body.data(), length, static_cast<off_t>(offset + 8)) != static_cast<ssize_t>(length))
+            return false;
+        return crc32c(body.data(), body.size()) == readLE32(header + 4);
+    }
+
+    void recover() {
+        string raw;
+        readWholeFile(indexPath, raw);
+        size_t stored = raw.size() / kIndexEntry;
+        for (size_t i = 0; i < stored; i++) {
+            const char* p = raw.data() + i * kIndexEntry;
+            index.push_back({readLE64(p), static_cast<int64_t>(readLE64(p + 8)), readLE32(p + 16), readLE32(p + 20)});
+        }
+
+        string body;
+        while (!index.empty() && !readRecord(index.back().offset, body)) index.pop_back();
+        uint64_t pos = index.empty() ? 0 : index.back().offset + 8 + body.size();
+        size_t verified = index.size();
+        DeadLetter letter;
+        while (readRecord(pos, body) && decode(body, letter)) {
+            index.push_back({pos, letter.failedAtMs, channelHash(letter.channel), 0});
+            pos += 8 + body.size();
+            letter = DeadLetter();
+        }
+        // Drop a torn letter left by a crash mid-append.
+        if (pos < dataSize) {
+            if (ftruncate(dataFd, static_cast<off_t>(pos)) < 0)
+                throw runtime_error("truncate " + dataPath + ": " + strerror(errno));
+            dataSize = pos;
+        }
+        if (verified != stored || index.size() != verified || raw.size() % kIndexEntry) {
+            string rebuilt;
+            for (auto& e : index) rebuilt += encodeIndexEntry(e);
+            writeFileAtomically(indexPath, rebuilt);
+        }
+    }
+
+public:
+    explicit DeadLetterStore(const string& dir)
+        : dataPath(dir + "/deadletters.log"), indexPath(dir + "/deadletters.idx") {
+        makeDirectory(dir);
+        dataFd = open(dataPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (dataFd < 0) throw runtime_error("open " + dataPath + ": " + strerror(errno));
+        struct stat st;
+        dataSize = fstat(dataFd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+        recover();
+        indexFd = open(indexPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (indexFd < 0) throw runtime_error("open " + indexPath + ": " + strerror(errno));
+    }
+
+    ~DeadLetterStore() override {
+        if (indexFd >= 0) close(indexFd);
+        if (dataFd >= 0) close(dataFd);
+    }
+
+    DeadLetterStore(const DeadLetterStore&) = delete;
+    DeadLetterStore& operator=(const DeadLetterStore&) = delete;
+
+    // Dead letters are rare, so each one is synced before the call returns.
+    void deadLetter(const DeadLetter& letter) override {
+        string body = encode(letter);
+        string frame;
+        putLE32(frame, static_cast<uint32_t>(body.size()));
+        putLE32(frame, crc32c(body.data(), body.size()));
+        frame += body;
+
+        lock_guard<mutex> guard(lock);
+        IndexEntry entry{dataSize, letter.failedAtMs, channelHash(letter.channel), 0};
+        writeAt(dataFd, frame, dataSize, dataPath);
+        fdatasync(dataFd);
+        dataSize += frame.size();
+        writeAt(indexFd, encodeIndexEntry(entry), index.size() * kIndexEntry, indexPath);
+        index.push_back(entry);
+    }
+
+    size_t size() {
+        lock_guard<mutex> guard(lock);
+        return index.size();
+    }
+
+    // Sequence numbers (positions in the store) of the matching letters, oldest first.
+    vector<uint64_t> select(const DeadLetterFilter& filter) {
+        uint32_t hash = channelHash(filter.channel);
+        vector<uint64_t> out;
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < index.size() && (!filter.limit || out.size() < filter.limit); i++) {
+            const IndexEntry& e = index[i];
+            if (!filter.channel.empty() && e.channelHash != hash) continue;
+            if (e.failedAtMs < filter.sinceMs || (filter.untilMs && e.failedAtMs >= filter.untilMs)) continue;
+            if ((e.flags & kRedriven) && !filter.includeRedriven) continue;
+            out.push_back(i);
+        }
+        return out;
+    }
+
+    bool read(uint64_t seq, DeadLetter& out) {
+        string body;
+        lock_guard<mutex> guard(lock);
+        if (seq >= index.size() || !readRecord(index[seq].offset, body)) return false;
+        out = DeadLetter();
+        return decode(body, out);
+    }
+
+    bool isRedriven(uint64_t seq) {
+        lock_guard<mutex> guard(lock);
+        return seq < index.size() && (index[seq].flags & kRedriven);
+    }
+
+    void markRedriven(uint64_t seq) {
+        lock_guard<mutex> guard(lock);
+        if (seq >= index.size()) return;
+        index[seq].flags |= kRedriven;
+        writeAt(indexFd, encodeIndexEntry(index[seq]), seq * kIndexEntry, indexPath);
+    }
+
+    // Hands the selected letters to `send` at no more than perSecond, marking each
+    // as re-driven once sent; returns how many went out. A letter whose send
+    // throws stays pending and the re-drive stops there.
+    size_t redrive(const DeadLetterFilter& filter, double perSecond, const function<void(const DeadLetter&)>& send) {
+        auto start = chrono::steady_clock::now();
+        size_t sent = 0;
+        DeadLetter letter;
+        for (uint64_t seq : select(filter)) {
+            if (!read(seq, letter)) continue;
+            if (perSecond > 0)
+                this_thread::sleep_until(start + chrono::microseconds(static_cast<int64_t>(sent * 1e6 / perSecond)));
+            send(letter);
+            markRedriven(seq);
+            sent++;
+        }
+        return sent;
+    }
+};
+
+// Point-in-time snapshot of the API process's in-memory state, so a restart
+// resumes where the last process stopped: users, history, queued notifications
+// with their tenants' round-robin credit, in-app mailboxes with read flags, and
+// the analytics sketches. The file is
+//   magic "NSNP" u32 | version u32 | takenAtMs u64 | length u64 | crc32c u32 | body
+// and the body is the shared body table followed by sections of
+//   tag u8 | length u64 | data
+// where readers skip tags they do not know.
+//
+// tick() forks; the child serializes its copy-on-write view of the parent and
+// exits, so the serving thread only pauses for the fork itself. Startup and
+// graceful shutdown snapshot in-process instead.
+class EngineSnapshotter : public IStateSnapshotter {
+public:
+    struct Stats {
+        uint64_t taken = 0;
+        uint64_t failed = 0;
+        int64_t lastForkUs = 0;     // time the serving thread spent in fork()
+        int64_t lastWriteMs = 0;    // fork to child exit
+        uint64_t lastBytes = 0;
+    };
+
+private:
+    static constexpr uint32_t kMagic = 0x504E534E; // "NSNP"
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kHeaderSize = 32;
+    static constexpr uint8_t kServiceSection = 1;
+    static constexpr uint8_t kMailboxSection = 2;
+    static constexpr uint8_t kAnalyticsSection = 3;
+    // While a child is writing, the loop checks on it this often.
+    static constexpr int64_t kReapPollMs = 50;
+
+    string path;
+    NotificationService& service;
+    shared_ptr<InAppMailbox> mailbox;
+    shared_ptr<DeliveryAnalytics> analytics;
+    int64_t intervalMs;
+    int64_t nextDueMs;
+    pid_t child = -1;
+    int64_t childStartedMs = 0;
+    Stats stats;
+
+    static int64_t steadyMs() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static size_t beginSection(string& out, uint8_t tag) {
+        out += static_cast<char>(tag);
+        putLE64(out, 0);
+        return out.size();
+    }
+
+    static void endSection(string& out, size_t start) {
+        uint64_t length = out.size() - start;
+        for (int i = 0; i < 8; i++) out[start - 8 + i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+    }
+
+    // Serializes the state; the caller holds the mailbox frozen or is the forked child.
+    string capture(const AnalyticsSnapshot* sketches) const {
+        SnapshotBodies bodies;
+        string sections;
+        size_t start = beginSection(sections, kServiceSection);
+        service.saveState(sections, bodies);
+        endSection(sections, start);
+        if (mailbox) {
+            start = beginSection(sections, kMailboxSection);
+            mailbox->saveState(sections, bodies);
+            endSection(sections, start);
+        }
+        if (sketches) {
+            start = beginSection(sections, kAnalyticsSection);
+            sketches->saveState(sections);
+            endSection(sections, start);
+        }
+        string out;
+        out.reserve(kHeaderSize + sections.size() + 4096);
+        putLE32(out, kMagic);
+        putLE32(out, kVersion);
+        putLE64(out, static_cast<uint64_t>(nowMs()));
+        putLE64(out, 0);
+        putLE32(out, 0);
+        putLE32(out, 0); // reserved
+        bodies.saveState(out);
+        out += sections;
+        string length;
+        putLE64(length, out.size() - kHeaderSize);
+        putLE32(length, crc32c(out.data() + kHeaderSize, out.size() - kHeaderSize));
+        out.replace(16, 12, length);
+        return out;
+    }
+
+    void reap(bool wait) {
+        if (child < 0) return;
+        int status = 0;
+        pid_t done = waitpid(child, &status, wait ? 0 : WNOHANG);
+        if (done == 0) return;
+        child = -1;
+        stats.lastWriteMs = steadyMs() - childStartedMs;
+        struct stat st;
+        if (done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 && stat(path.c_str(), &st) == 0) {
+            stats.taken++;
+            stats.lastBytes = static_cast<uint64_t>(st.st_size);
+        } else {
+            stats.failed++;
+            cerr << "[Snapshot] background write of " << path << " failed" << endl;
+        }
+    }
+
+public:
+    EngineSnapshotter(string path, NotificationService& service, shared_ptr<InAppMailbox> mailbox,
+                      shared_ptr<DeliveryAnalytics> analytics, int64_t intervalMs = 10000)
+        : path(std::move(path)), service(service), mailbox(std::move(mailbox)), analytics(std::move(analytics)),
+          intervalMs(intervalMs), nextDueMs(steadyMs() + intervalMs) {}
+
+    ~EngineSnapshotter() override {
+        reap(true);
+    }
+
+    // Loads the last snapshot, if any, into the (still empty) components.
+    // A missing file is a first start; a damaged one is reported and skipped.
+    bool restore() {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0 || st.st_size < static_cast<off_t>(kHeaderSize)) return false;
+        auto started = chrono::steady_clock::now();
+        LogMapping file(path, static_cast<size_t>(st.st_size));
+        string_view in(file.data, file.size);
+        uint64_t length = readLE64(in.data() + 16);
+        const char* problem = nullptr;
+        if (readLE32(in.data()) != kMagic || readLE32(in.data() + 4) != kVersion) problem = "unknown format";
+        else if (length != in.size() - kHeaderSize) problem = "truncated";
+        else if (crc32c(in.data() + kHeaderSize, length) != readLE32(in.data() + 24)) problem = "checksum mismatch";
+        if (problem) {
+            cerr << "[Snapshot] ignoring " << path << ": " << problem << endl;
+            return false;
+        }
+        int64_t takenAtMs = static_cast<int64_t>(readLE64(in.data() + 8));
+        size_t pos = kHeaderSize;
+        vector<shared_ptr<const string>> bodies;
+        bool ok = SnapshotBodies::loadState(in, pos, *service.getBodyStore(), bodies);
+        while (ok && pos < in.size()) {
+            uint8_t tag;
+            uint64_t sectionLength;
+            ok = readU8(in, pos, tag) && readU64(in, pos, sectionLength) && sectionLength <= in.size() - pos;
+            if (!ok) break;
+            string_view section = in.substr(pos, sectionLength);
+            size_t at = 0;
+            if (tag == kServiceSection) {
+                ok = service.loadState(section, at, bodies);
+            } else if (tag == kMailboxSection && mailbox) {
+                ok = mailbox->loadState(section, at, bodies);
+            } else if (tag == kAnalyticsSection && analytics) {
+                AnalyticsSnapshot sketches;
+                ok = sketches.loadState(section, at);
+                if (ok) analytics->restore(std::move(sketches));
+            }
+            pos += sectionLength;
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        if (!ok) {
+            cerr << "[Snapshot] " << path << " is damaged; restored what preceded the damage" << endl;
+            return false;
+        }
+        cerr << "[Snapshot] restored " << service.getHistory().size() << " history records and "
+             << service.pendingCount() << " queued notifications from " << (nowMs() - takenAtMs) / 1000
+             << "s ago (" << st.st_size << " bytes) in " << ms << "ms" << endl;
+        return true;
+    }
+
+    // Writes a snapshot from this thread; used at shutdown, once nothing else is delivering.
+    void saveNow() {
+        reap(true);
+        AnalyticsSnapshot sketches;
+        if (analytics) sketches = analytics->snapshot();
+        unique_lock<mutex> frozen;
+        if (mailbox) frozen = mailbox->freeze();
+        string data = capture(analytics ? &sketches : nullptr);
+        frozen = unique_lock<mutex>();
+        writeFileAtomically(path, data);
+        stats.taken++;
+        stats.lastBytes = data.size();
+    }
+
+    int64_t msUntilDue() const override {
+        if (child >= 0) return kReapPollMs;
+        return max<int64_t>(0, nextDueMs - steadyMs());
+    }
+
+    void tick() override {
+        reap(false);
+        int64_t now = steadyMs();
+        if (child >= 0 || now < nextDueMs) return;
+        nextDueMs = now + intervalMs;
+        // The sketches are small and copied here; the mailbox lock is held across
+        // fork() so the child sees no append half done. Nothing else the child
+        // reads is touched by other threads.
+        AnalyticsSnapshot sketches;
+        if (analytics) sketches = analytics->snapshot();
+        unique_lock<mutex> frozen;
+        if (mailbox) frozen = mailbox->freeze();
+        auto started = chrono::steady_clock::now();
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Only this thread exists in the child, and its locks are never released.
+            int rc = 0;
+            try {
+                writeFileAtomically(path, capture(analytics ? &sketches : nullptr));
+            } catch (...) {
+                rc = 1;
+            }
+            _exit(rc);
+        }
+        frozen = unique_lock<mutex>();
+        stats.lastForkUs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+        if (pid < 0) {
+            stats.failed++;
+            cerr << "[Snapshot] fork: " << strerror(errno) << endl;
+            return;
+        }
+        child = pid;
+        childStartedMs = steadyMs();
+    }
+
+    const Stats& getStats() const {
+        return stats;
+    }
+};
+
+// Hot reload of a template directory. Files are named <name>.tmpl for the
+// default locale or <name>.<locale>.tmpl; reload() republishes the ones whose
+// size or mtime changed since the last scan. A file that fails to compile is
+// reported and the version already published keeps serving.
+class TemplateLoader {
+private:
+    string dir;
+    shared_ptr<TemplateRegistry> registry;
+    unordered_map<string, pair<int64_t, int64_t>> seen; // file -> (size, mtime ns)
+
+public:
+    TemplateLoader(string dir, shared_ptr<TemplateRegistry> registry)
+        : dir(std::move(dir)), registry(std::move(registry)) {}
+
+    // Returns the number of templates (re)published.
+    size_t reload() {
+        DIR* d = opendir(dir.c_str());
+        if (!d) return 0;
+        vector<string> files;
+        while (dirent* e = readdir(d)) {
+            string file = e->d_name;
+            if (file.size() > 5 && file.compare(file.size() - 5, 5, ".tmpl") == 0) files.push_back(std::move(file));
+        }
+        closedir(d);
+        size_t published = 0;
+        for (auto& file : files) {
+            string path = dir + "/" + file;
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) continue;
+            pair<int64_t, int64_t> stamp{st.st_size, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec};
+            auto it = seen.find(file);
+            if (it != seen.end() && it->second == stamp) continue;
+            seen[file] = stamp;
+            string stem = file.substr(0, file.size() - 5);
+            size_t dot = stem.find('.');
+            string name = stem.substr(0, dot);
+            string locale = dot == string::npos ? "" : stem.substr(dot + 1);
+            string source;
+            if (!readWholeFile(path, source)) continue;
+            // Editors save with a trailing newline that is not part of the message.
+            while (!source.empty() && (source.back() == '\n' || source.back() == '\r')) source.pop_back();
+            try {
+                uint64_t version = registry->publish(name, locale, source);
+                cout << "[Templates] " << name << (locale.empty() ? "" : "." + locale) << " v" << version << endl;
+                published++;
+            } catch (const invalid_argument& e) {
+                cerr << "[Templates] " << file << ": " << e.what() << endl;
+            }
+        }
+        return published;
+    }
+};
+
+// Compression dictionaries shared through the queue directory as
+// <dir>/<id>.dict, so executors can decode what the API compressed. A
+// dictionary never changes once written; retraining writes a new id.
+class DictionaryStore : public IDictionarySource {
+private:
+    string dir;
+    mutex lock;
+    unordered_map<uint32_t, shared_ptr<const CompressionDictionary>> cache;
+    atomic<uint64_t> saves{0};
+
+    string pathFor(uint32_t id) const {
+        char name[16];
+        snprintf(name, sizeof(name), "%08x", id);
+        return dir + "/" + name + ".dict";
+    }
+
+public:
+    explicit DictionaryStore(string dir) : dir(std::move(dir)) {
+        makeDirectory(this->dir);
+    }
+
+    void save(const shared_ptr<const CompressionDictionary>& dict) {
+        writeFileAtomically(pathFor(dict->id), dict->bytes);
+        lock_guard<mutex> guard(lock);
+        cache[dict->id] = dict;
+        saves++;
+    }
+
+    // Changes whenever a dictionary is saved, so watchers know when to rescan.
+    uint64_t saveCount() const {
+        return saves;
+    }
+
+    const string& directory() const {
+        return dir;
+    }
+
+    shared_ptr<const CompressionDictionary> findDictionary(uint32_t id) override {
+        lock_guard<mutex> guard(lock);
+        auto it = cache.find(id);
+        if (it != cache.end()) return it->second;
+        string bytes;
+        if (!readWholeFile(pathFor(id), bytes)) return nullptr;
+        auto dict = CompressionDictionary::make(std::move(bytes));
+        if (dict->id != id) return nullptr;
+        cache[id] = dict;
+        return dict;
+    }
+};
+
+struct CompressionStats {
+    uint64_t bodies = 0;     // bodies offered
+    uint64_t compressed = 0; // stored compressed
+    uint64_t encodes = 0;    // codec runs
+    uint64_t reused = 0;     // same body as the previous recipient, not compressed again
+    uint64_t rawBytes = 0;   // of the compressed bodies
+    uint64_t storedBytes = 0;
+    uint64_t dictionaries = 0;
+    double compressSeconds = 0;
+    double trainSeconds = 0;
+
+    double ratio() const {
+        return storedBytes ? static_cast<double>(rawBytes) / storedBytes : 0;
+    }
+};
+
+// Compresses message bodies for the queue. Each template (or notification
+// type when there is none) gets a dictionary trained from its first bodies;
+// until then bodies are compressed without one. A send to many recipients
+// renders the same body for each, so the previous result is reused when the
+// body repeats. Small bodies and bodies that do not shrink are stored raw.
+class PayloadCompressor {
+private:
+    static constexpr size_t kTrainSamples = 32;
+    static constexpr size_t kTrainBytes = 256 * 1024;
+    static constexpr size_t kMaxTrainingKeys = 256;
+
+    struct Training {
+        vector<string> samples;
+        size_t bytes = 0;
+        shared_ptr<const CompressionDictionary> dict;
+    };
+
+    DictionaryStore& store;
+    size_t minSize;
+    unordered_map<string, Training> keys;
+    string lastBody;
+    string lastKey;
+    uint32_t lastDictId = 0;
+    bool lastCompressed = false;
+    string output;
+    CompressionStats stats;
+
+    const CompressionDictionary* dictionaryFor(const string& key, string_view body) {
+        auto it = keys.find(key);
+        if (it == keys.end()) {
+            if (keys.size() >= kMaxTrainingKeys) return nullptr;
+            it = keys.emplace(key, Training()).first;
+        }
+        Training& t = it->second;
+        if (t.dict) return t.dict.get();
+        t.samples.emplace_back(body);
+        t.bytes += body.size();
+        if (t.samples.size() < kTrainSamples && t.bytes < kTrainBytes) return nullptr;
+        auto start = chrono::steady_clock::now();
+        t.dict = CompressionDictionary::train(t.samples);
+        stats.trainSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        t.samples = {};
+        if (t.dict->bytes.empty()) return nullptr; // nothing recurs; keep compressing without one
+        store.save(t.dict);
+        stats.dictionaries++;
+        return t.dict.get();
+    }
+
+public:
+    explicit PayloadCompressor(DictionaryStore& store, size_t minSize = 256) : store(store), minSize(minSize) {}
+
+    // Appends the queue record for meta and body, compressed when that pays.
+    void appendRecord(string& record, const NotificationMeta& meta, string_view body) {
+        stats.bodies++;
+        if (body.size() < minSize) {
+            appendIngestRecord(record, meta, body);
+            return;
+        }
+        const string& key = meta.templateName.empty() ? meta.type : meta.templateName;
+        if (body == lastBody && key == lastKey) {
+            stats.reused++;
+        } else {
+            const CompressionDictionary* dict = dictionaryFor(key, body);
+            auto start = chrono::steady_clock::now();
+            output.clear();
+            LzCodec::compress(body, dict, output);
+            stats.encodes++;
+            stats.compressSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            lastBody.assign(body);
+            lastKey = key;
+            lastDictId = dict ? dict->id : 0;
+            lastCompressed = output.size() + 8 < body.size();
+        }
+        if (!lastCompressed) {
+            appendIngestRecord(record, meta, body);
+            return;
+        }
+        stats.compressed++;
+        stats.rawBytes += body.size();
+        stats.storedBytes += output.size() + 8;
+        appendCompressedIngestRecord(record, meta, lastDictId, body.size(), output);
+    }
+
+    const CompressionStats& getStats() const {
+        return stats;
+    }
+};
+
+// Log shipping to a standby. The standby listens; the primary connects and
+// both sides exchange frames with a 16-byte little-endian header:
+//   magic "NREP" | version u8 | type u8 | flags u16 | count u32 | length u32
+// Hello (standby -> primary): count partitions x end offset u64, where the
+//   standby's log ends and shipping resumes.
+// Records: count x (partition u32 | offset u64 | timestampMs u64 | keyLen u16 | valueLen u32 | key | value)
+// Groups: nameLen u16 | name | the group's offsets file (count u32 | count x u64)
+// Dictionary: the bytes of one compression dictionary
+// Ack (standby -> primary): count frames taken since the last Ack, then
+//   partitions x durable end offset u64.
+enum class ReplicationFrameType : uint8_t {
+    Hello = 1,
+    Records = 2,
+    Groups = 3,
+    Dictionary = 4,
+    Ack = 5
+};
+
+struct ReplicationFrameHeader {
+    static constexpr uint32_t kMagic = 0x5045524E; // "NREP"
+    static constexpr uint8_t kVersion = 1;
+    static constexpr size_t kSize = 16;
+    static constexpr uint32_t kMaxLength = 64 * 1024 * 1024;
+
+    uint8_t version = kVersion;
+    ReplicationFrameType type = ReplicationFrameType::Records;
+    uint16_t flags = 0;
+    uint32_t count = 0;
+    uint32_t length = 0;
+
+    void encode(string& out) const {
+        putLE32(out, kMagic);
+        out += static_cast<char>(version);
+        out += static_cast<char>(type);
+        putLE16(out, flags);
+        putLE32(out, count);
+        putLE32(out, length);
+    }
+
+    static bool decode(const char* p, ReplicationFrameHeader& h) {
+        if (readLE32(p) != kMagic) return false;
+        h.version = static_cast<uint8_t>(p[4]);
+        h.type = static_cast<ReplicationFrameType>(p[5]);
+        h.flags = readLE16(p + 6);
+        h.count = readLE32(p + 8);
+        h.length = readLE32(p + 12);
+        return true;
+    }
+};
+
+static void appendReplicationFrame(string& out, ReplicationFrameType type, uint32_t count, string_view payload) {
+    ReplicationFrameHeader h;
+    h.type = type;
+    h.count = count;
+    h.length = static_cast<uint32_t>(payload.size());
+    h.encode(out);
+    out += payload;
+}
+
+// Takes the next complete frame starting at `offset`; false when more bytes are needed.
+static bool takeReplicationFrame(const string& in, size_t& offset, ReplicationFrameHeader& h, string_view& payload) {
+    if (in.size() - offset < ReplicationFrameHeader::kSize) return false;
+    if (!ReplicationFrameHeader::decode(in.data() + offset, h) || h.version != ReplicationFrameHeader::kVersion)
+        throw runtime_error("bad replication frame");
+    if (h.length > ReplicationFrameHeader::kMaxLength) throw runtime_error("replication frame too large");
+    if (in.size() - offset - ReplicationFrameHeader::kSize < h.length) return false;
+    payload = string_view(in.data() + offset + ReplicationFrameHeader::kSize, h.length);
+    offset += ReplicationFrameHeader::kSize + h.length;
+    return true;
+}
+
+static void appendEndOffsets(string& out, const vector<uint64_t>& ends) {
+    for (uint64_t end : ends) putLE64(out, end);
+}
+
+static bool readEndOffsets(string_view payload, uint32_t count, vector<uint64_t>& ends) {
+    if (payload.size() != size_t(count) * 8) return false;
+    ends.resize(count);
+    for (uint32_t i = 0; i < count; i++) ends[i] = readLE64(payload.data() + 8 * i);
+    return true;
+}
+
+struct ReplicationStats {
+    uint64_t sessions = 0;
+    uint64_t frames = 0;
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t syncWaits = 0;
+    uint64_t syncMisses = 0; // waits that gave up: timed out or no standby connected
+};
+
+// Primary side of log shipping. A background thread connects to the
+// standby, reads where its log ends, and streams every partition from there,
+// keeping up to kWindow frames unacknowledged so shipping is not bound by
+// the round trip. The standby acknowledges cumulatively once records are
+// durable on its disk. Dictionaries are shipped before the records that use
+// them, and consumer group commits follow every kGroupIntervalMs, so a
+// promoted standby resumes delivery close to where the executors stopped.
+// In sync mode the queue writer waits at the end of each batch until the
+// standby holds it, and holds further writes while it does not.
+class LogShipper {
+private:
+    static constexpr size_t kFrameRecords = 1024;
+    static constexpr size_t kFrameBytes = 1024 * 1024;
+    static constexpr uint32_t kWindow = 8;
+    static constexpr int64_t kGroupIntervalMs = 200;
+    static constexpr int kRetryMs = 500;
+
+    PartitionedLogQueue& queue;
+    DictionaryStore* dictionaries;
+    string host;
+    uint16_t port;
+    int wakeFd = -1;
+    atomic<bool> running{true};
+    thread worker;
+
+    mutex lock;
+    condition_variable replicated;
+    vector<uint64_t> acked; // durable on the standby
+    bool connected = false;
+    ReplicationStats stats;
+
+    // Session state, owned by the worker.
+    vector<uint64_t> sent;
+    uint32_t nextPartition = 0;
+    uint64_t dictionarySaves = UINT64_MAX;
+    unordered_set<string> shippedDictionaries;
+    unordered_map<string, string> shippedGroups;
+    int64_t nextGroupScanMs = 0;
+    LogFetch fetched;
+    string payload;
+
+    int connectToStandby() {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) throw runtime_error("bad address: " + host);
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    }
+
+    // Sleeps before reconnecting; only stop() cuts it short, appends do not.
+    void waitToRetry() {
+        int64_t deadline = nowMs() + kRetryMs;
+        for (int64_t now = nowMs(); running && now < deadline; now = nowMs()) {
+            pollfd p{wakeFd, POLLIN, 0};
+            if (poll(&p, 1, static_cast<int>(deadline - now)) > 0) {
+                uint64_t value;
+                while (read(wakeFd, &value, sizeof(value)) > 0) {}
+            }
+        }
+    }
+
+    // Appends one Records frame to `out`; false when every partition is shipped.
+    bool addRecordsFrame(string& out) {
+        payload.clear();
+        uint32_t count = 0;
+        uint32_t partitions = queue.partitionCount();
+        for (uint32_t i = 0; i < partitions && count < kFrameRecords && payload.size() < kFrameBytes; i++) {
+            uint32_t p = (nextPartition + i) % partitions;
+            LogPartition& partition = queue.partition(p);
+            fetched.clear();
+            partition.fetch(max(sent[p], partition.earliestOffset()), kFrameRecords - count, fetched);
+            for (auto& record : fetched.records) {
+                putLE32(payload, record.partition);
+                putLE64(payload, record.offset);
+                putLE64(payload, static_cast<uint64_t>(record.timestampMs));
+                putLE16(payload, static_cast<uint16_t>(record.key.size()));
+                putLE32(payload, static_cast<uint32_t>(record.value.size()));
+                payload += record.key;
+                payload += record.value;
+                sent[p] = record.offset + 1;
+            }
+            count += static_cast<uint32_t>(fetched.records.size());
+        }
+        nextPartition = (nextPartition + 1) % partitions;
+        if (count == 0) return false;
+        appendReplicationFrame(out, ReplicationFrameType::Records, count, payload);
+        stats.frames++;
+        stats.records += count;
+        return true;
+    }
+
+    // Ships dictionaries this session has not sent yet; returns how many frames were added.
+    uint32_t addDictionaryFrames(string& out) {
+        if (!dictionaries || dictionaries->saveCount() == dictionarySaves) return 0;
+        dictionarySaves = dictionaries->saveCount();
+        uint32_t frames = 0;
+        DIR* d = opendir(dictionaries->directory().c_str());
+        if (!d) return 0;
+        while (dirent* entry = readdir(d)) {
+            string name = entry->d_name;
+            if (name.size() < 5 || name.compare(name.size() - 5, 5, ".dict") != 0) continue;
+            if (shippedDictionaries.count(name)) continue;
+            string bytes;
+            if (!readWholeFile(dictionaries->directory() + "/" + name, bytes)) continue;
+            appendReplicationFrame(out, ReplicationFrameType::Dictionary, 0, bytes);
+            shippedDictionaries.insert(name);
+            frames++;
+        }
+        closedir(d);
+        return frames;
+    }
+
+    uint32_t addGroupFrames(string& out) {
+        int64_t now = nowMs();
+        if (now < nextGroupScanMs) return 0;
+        nextGroupScanMs = now + kGroupIntervalMs;
+        uint32_t frames = 0;
+        string offsets;
+        for (auto& group : queue.groups()) {
+            offsets.clear();
+            putLE32(offsets, queue.partitionCount());
+            for (uint64_t o : queue.committedOffsets(group)) putLE64(offsets, o);
+            auto& last = shippedGroups[group];
+            if (last == offsets) continue;
+            last = offsets;
+            payload.clear();
+            putString16(payload, group);
+            payload += offsets;
+            appendReplicationFrame(out, ReplicationFrameType::Groups, 1, payload);
+            frames++;
+        }
+        return frames;
+    }
+
+    void readHello(int fd, string& in) {
+        ReplicationFrameHeader h;
+        string_view body;
+        size_t offset = 0;
+        while (!takeReplicationFrame(in, offset, h, body)) {
+            pollfd p{fd, POLLIN, 0};
+            if (poll(&p, 1, 5000) <= 0) throw runtime_error("no hello from standby");
+            char buf[4096];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) throw runtime_error("standby closed the connection");
+            in.append(buf, static_cast<size_t>(n));
+        }
+        if (h.type != ReplicationFrameType::Hello || h.count != queue.partitionCount() ||
+            !readEndOffsets(body, h.count, sent))
+            throw runtime_error("standby log does not match this queue's partitions");
+        vector<uint64_t> ends = queue.endOffsets();
+        for (uint32_t p = 0; p < h.count; p++) {
+            if (sent[p] > ends[p]) throw runtime_error("standby log is ahead of this one");
+        }
+        in.erase(0, offset);
+    }
+
+    void session(int fd) {
+        string in;
+        readHello(fd, in);
+        {
+            lock_guard<mutex> guard(lock);
+            acked = sent;
+            connected = true;
+            stats.sessions++;
+        }
+        replicated.notify_all();
+        cerr << "[Replication] Streaming to standby " << host << ":" << port << endl;
+        dictionarySaves = UINT64_MAX;
+        shippedDictionaries.clear();
+        shippedGroups.clear();
+        nextGroupScanMs = 0;
+
+        string out;
+        size_t outOffset = 0;
+        uint32_t inflight = 0;
+        vector<uint64_t> ends;
+        while (running) {
+            if (outOffset == out.size()) {
+                out.clear();
+                outOffset = 0;
+            }
+            // Dictionaries go first: records compressed with one must never arrive before it.
+            inflight += addDictionaryFrames(out);
+            while (inflight < kWindow && addRecordsFrame(out)) inflight++;
+            inflight += addGroupFrames(out);
+
+            pollfd fds[2] = {{fd, static_cast<short>(POLLIN | (outOffset < out.size() ? POLLOUT : 0)), 0},
+                             {wakeFd, POLLIN, 0}};
+            if (poll(fds, 2, static_cast<int>(kGroupIntervalMs)) < 0 && errno != EINTR)
+                throw runtime_error(string("poll: ") + strerror(errno));
+            if (fds[1].revents & POLLIN) {
+                uint64_t value;
+                while (read(wakeFd, &value, sizeof(value)) > 0) {}
+            }
+            if (fds[0].revents & POLLOUT) {
+                ssize_t n = send(fd, out.data() + outOffset, out.size() - outOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n < 0 && errno != EAGAIN && errno != EINTR) throw runtime_error(string("send: ") + strerror(errno));
+                if (n > 0) {
+                    outOffset += static_cast<size_t>(n);
+                    stats.bytes += static_cast<uint64_t>(n);
+                }
+            }
+            if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buf[4096];
+                ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) throw runtime_error("standby disconnected");
+                if (n > 0) in.append(buf, static_cast<size_t>(n));
+                size_t offset = 0;
+                ReplicationFrameHeader h;
+                string_view body;
+                bool advanced = false;
+                while (takeReplicationFrame(in, offset, h, body)) {
+                    if (h.type != ReplicationFrameType::Ack || !readEndOffsets(body, queue.partitionCount(), ends))
+                        throw runtime_error("unexpected frame from standby");
+                    inflight -= min(inflight, h.count);
+                    advanced = true;
+                }
+                in.erase(0, offset);
+                if (advanced) {
+                    {
+                        lock_guard<mutex> guard(lock);
+                        acked = ends;
+                    }
+                    replicated.notify_all();
+                }
+            }
+        }
+    }
+
+    void run() {
+        string lastError;
+        while (running) {
+            string error = "standby unreachable";
+            int fd = connectToStandby();
+            if (fd >= 0) {
+                uint64_t sessions = stats.sessions;
+                try {
+                    session(fd);
+                } catch (const exception& e) {
+                    error = e.what();
+                }
+                close(fd);
+                {
+                    lock_guard<mutex> guard(lock);
+                    connected = false;
+                }
+                replicated.notify_all();
+                if (stats.sessions != sessions) lastError.clear();
+            }
+            // A standby that stays down is reported once, not on every retry.
+            if (running && error != lastError) cerr << "[Replication] " << error << endl;
+            lastError = error;
+            waitToRetry();
+        }
+    }
+
+public:
+    LogShipper(PartitionedLogQueue& queue, DictionaryStore* dictionaries, string host, uint16_t port)
+        : queue(queue), dictionaries(dictionaries), host(std::move(host)), port(port) {
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd < 0) throw runtime_error(string("eventfd: ") + strerror(errno));
+        worker = thread([this] { run(); });
+    }
+
+    ~LogShipper() {
+        stop();
+        close(wakeFd);
+    }
+
+    LogShipper(const LogShipper&) = delete;
+    LogShipper& operator=(const LogShipper&) = delete;
+
+    // Called after local appends so they ship without waiting for the next poll.
+    void notifyAppended() {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    // Waits until the standby holds every partition up to `ends`. Returns
+    // false on timeout, or at once while no standby is connected.
+    bool waitReplicated(const vector<uint64_t>& ends, int64_t timeoutMs) {
+        unique_lock<mutex> guard(lock);
+        stats.syncWaits++;
+        auto done = [&] {
+            if (!connected) return true;
+            for (size_t p = 0; p < ends.size(); p++) {
+                if (acked[p] < ends[p]) return false;
+            }
+            return true;
+        };
+        bool ok = connected && replicated.wait_for(guard, chrono::milliseconds(timeoutMs), done) && connected;
+        if (!ok) stats.syncMisses++;
+        return ok;
+    }
+
+    // Whether the standby already holds every partition up to `ends`; does not wait.
+    bool isReplicated(const vector<uint64_t>& ends) {
+        lock_guard<mutex> guard(lock);
+        if (!connected) return false;
+        for (size_t p = 0; p < ends.size(); p++) {
+            if (acked[p] < ends[p]) return false;
+        }
+        return true;
+    }
+
+    // Whether a standby session is up right now.
+    bool isConnected() {
+        lock_guard<mutex> guard(lock);
+        return connected;
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        notifyAppended();
+        worker.join();
+    }
+
+    // Valid once stopped.
+    const ReplicationStats& getStats() const {
+        return stats;
+    }
+};
+
+// Standby side of log shipping: appends what the primary ships at the
+// primary's offsets, so both logs hold the same records. Everything taken
+// from one read is synced with one fdatasync per touched partition and
+// covered by a single cumulative Ack.
+class LogReceiver : public EpollServer {
+private:
+    PartitionedLogQueue& queue;
+    DictionaryStore dictionaries;
+    vector<vector<LogRecord>> staged; // per partition, pointing into the connection's input
+    vector<uint64_t> ends;
+    string ack;
+    ReplicationStats stats;
+
+    void onAccept(Connection& conn) override {
+        ends = queue.endOffsets();
+        ack.clear();
+        appendEndOffsets(ack, ends);
+        appendReplicationFrame(conn.out, ReplicationFrameType::Hello, queue.partitionCount(), ack);
+        cerr << "[Standby] Primary connected" << endl;
+    }
+
+    bool stageRecords(string_view body, uint32_t count) {
+        size_t pos = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (body.size() - pos < 26) return false;
+            LogRecord record;
+            record.partition = readLE32(body.data() + pos);
+            record.offset = readLE64(body.data() + pos + 4);
+            record.timestampMs = static_cast<int64_t>(readLE64(body.data() + pos + 12));
+            size_t keyLen = readLE16(body.data() + pos + 20);
+            size_t valueLen = readLE32(body.data() + pos + 22);
+            pos += 26;
+            if (record.partition >= staged.size() || body.size() - pos < keyLen + valueLen) return false;
+            record.key = body.substr(pos, keyLen);
+            record.value = body.substr(pos + keyLen, valueLen);
+            pos += keyLen + valueLen;
+            staged[record.partition].push_back(record);
+        }
+        stats.records += count;
+        return pos == body.size();
+    }
+
+    bool applyGroups(string_view body) {
+        size_t pos = 0;
+        string group;
+        uint32_t count;
+        if (!readString(body, pos, 2, group) || !readU32(body, pos, count) || body.size() - pos != size_t(count) * 8)
+            return false;
+        if (group.empty() || group.find('/') != string::npos || count != queue.partitionCount()) return false;
+        vector<uint64_t> offsets(count);
+        for (uint32_t i = 0; i < count; i++) offsets[i] = readLE64(body.data() + pos + 8 * i);
+        queue.commit(group, offsets);
+        return true;
+    }
+
+    void onInput(Connection& conn) override {
+        size_t offset = 0;
+        uint32_t frames = 0;
+        ReplicationFrameHeader h;
+        string_view body;
+        try {
+            while (takeReplicationFrame(conn.in, offset, h, body)) {
+                bool ok = false;
+                if (h.type == ReplicationFrameType::Records) ok = stageRecords(body, h.count);
+                else if (h.type == ReplicationFrameType::Groups) ok = applyGroups(body);
+                else if (h.type == ReplicationFrameType::Dictionary) {
+                    dictionaries.save(CompressionDictionary::make(string(body)));
+                    ok = true;
+                }
+                if (!ok) throw runtime_error("malformed replication frame");
+                frames++;
+            }
+        } catch (const exception& e) {
+            cerr << "[Standby] " << e.what() << "; dropping the primary" << endl;
+            conn.closing = true;
+        }
+        // Records are durable before they are acknowledged.
+        for (uint32_t p = 0; p < staged.size(); p++) {
+            if (staged[p].empty()) continue;
+            queue.partition(p).appendReplicated(staged[p]);
+            queue.partition(p).sync();
+            staged[p].clear();
+        }
+        conn.in.erase(0, offset);
+        if (frames == 0 || conn.closing) return;
+        stats.frames += frames;
+        ends = queue.endOffsets();
+        ack.clear();
+        appendEndOffsets(ack, ends);
+        appendReplicationFrame(conn.out, ReplicationFrameType::Ack, frames, ack);
+    }
+
+    void onClose(Connection&) override {
+        cerr << "[Standby] Primary disconnected" << endl;
+    }
+
+public:
+    LogReceiver(int listeningSocket, PartitionedLogQueue& queue)
+        : EpollServer(listeningSocket), queue(queue), dictionaries(queue.directory() + "/dictionaries"),
+          staged(queue.partitionCount()) {}
+
+    const ReplicationStats& getStats() const {
+        return stats;
+    }
+};
+
+// Producer side: appends every published notification to the queue, keyed by recipient
+class LogQueueWriter : public IObserver, public enable_shared_from_this<LogQueueWriter> {
+private:
+    static constexpr int64_t kReplicationTimeoutMs = 1000;
+
+    NotificationObservable* observable;
+    PartitionedLogQueue& queue;
+    bool syncEachBatch;
+    string record;
+    string body;
+    uint64_t appends = 0;
+    shared_ptr<PayloadCompressor> compressor;
+    shared_ptr<LogShipper> shipper;
+    bool waitForStandby = false;
+    bool fallBack = false; // sync mode carries on without the standby rather than hold
+    bool held = false;     // the last batch is not on the standby yet
+    bool warned = false;
+    uint64_t holds = 0;
+    vector<uint64_t> batchEnds; // per partition, past this batch's appends
+    vector<uint32_t> touched;
+
+public:
+    LogQueueWriter(PartitionedLogQueue& queue, bool syncEachBatch = false)
+        : queue(queue), syncEachBatch(syncEachBatch), batchEnds(queue.partitionCount(), 0) {
+        observable = NotificationService::getInstance().getObservable();
+    }
+
+    void subscribe() {
+        observable->addObserver(shared_from_this());
+    }
+
+    // Bodies are then written compressed where that pays.
+    void setCompressor(shared_ptr<PayloadCompressor> c) {
+        compressor = std::move(c);
+    }
+
+    // Appends are shipped to a standby. With `waitForAck` each batch waits for
+    // the standby's ack (synchronous replication); a batch it has not acked
+    // holds further writes until it has, see holding(). `fallBackToAsync`
+    // instead warns and carries on without the standby.
+    void setReplication(shared_ptr<LogShipper> s, bool waitForAck, bool fallBackToAsync = false) {
+        shipper = std::move(s);
+        waitForStandby = waitForAck;
+        fallBack = fallBackToAsync;
+    }
+
+    // True while sync replication holds writes; publishers should leave
+    // notifications queued until it clears.
+    bool holding() {
+        if (!held) return false;
+        if (!shipper->isReplicated(batchEnds)) return true;
+        held = false;
+        cerr << "[Replication] Standby caught up; writes resume" << endl;
+        return false;
+    }
+
+    uint64_t heldBatches() const {
+        return holds;
+    }
+
+    void update() override {
+        auto notification = observable->getNotification();
+        const NotificationMeta& meta = notification->getMeta();
+        record.clear();
+        notification->renderTo(body);
+        if (compressor) compressor->appendRecord(record, meta, body);
+        else appendIngestRecord(record, meta, body);
+        uint32_t p = queue.partitionFor(meta.userId);
+        uint64_t offset = queue.partition(p).append({{meta.userId, record}});
+        if (batchEnds[p] <= offset) {
+            if (find(touched.begin(), touched.end(), p) == touched.end()) touched.push_back(p);
+            batchEnds[p] = offset + 1;
+        }
+        if (++appends % 4096 == 0) queue.enforceRetention();
+    }
+
+    void batchEnd() override {
+        if (touched.empty()) return;
+        if (syncEachBatch) {
+            for (uint32_t p : touched) queue.partition(p).sync();
+        }
+        touched.clear();
+        if (!shipper) return;
+        shipper->notifyAppended();
+        if (!waitForStandby) return;
+        if (shipper->waitReplicated(batchEnds, kReplicationTimeoutMs)) {
+            warned = false;
+            return;
+        }
+        const char* why = shipper->isConnected() ? "is not keeping up" : "unavailable";
+        if (fallBack) {
+            if (!warned) cerr << "[Replication] Standby " << why << "; acknowledging writes without it" << endl;
+            warned = true;
+            return;
+        }
+        held = true;
+        holds++;
+        cerr << "[Replication] Standby " << why << "; holding writes until it has the last batch" << endl;
+    }
+};
+
+// Executor side: drains the queue into NotificationService, committing after each batch
+class QueueExecutor {
+private:
+    PartitionedLogQueue& queue;
+    LogConsumer consumer;
+    NotificationService& service;
+    OrderedDispatcher* dispatcher;
+    DeliveryLedger* ledger;
+    IDictionarySource* dictionaries;
+    IDeadLetterSink* deadLetters;
+    LogFetch fetched;
+    vector<shared_ptr<INotification>> batch;
+    uint64_t undecodable = 0;
+
+    // A record the executor cannot read (e.g. its dictionary is missing) is
+    // set aside whole rather than skipped, so re-driving it can succeed later.
+    void setAside(const LogRecord& record) {
+        undecodable++;
+        cerr << "[Executor] Cannot decode record " << record.offset << " of partition " << record.partition
+             << (deadLetters ? "; dead-lettered" : "; skipped") << endl;
+        if (!deadLetters) return;
+        DeadLetter letter;
+        letter.failedAtMs = nowMs();
+        letter.channel = "queue";
+        letter.meta.id = "p" + to_string(record.partition) + "@" + to_string(record.offset);
+        letter.meta.userId.assign(record.key);
+        letter.content.assign(record.value);
+        letter.reason = "undecodable queue record";
+        deadLetters->deadLetter(letter);
+    }
+
+public:
+    // With a dispatcher, offsets are committed only once the batch's deliveries have run;
+    // with a ledger, only once their outcomes are durable.
+    // Compressed bodies stay compressed in memory until their delivery renders them.
+    QueueExecutor(PartitionedLogQueue& queue, string group, OrderedDispatcher* dispatcher = nullptr,
+                  DeliveryLedger* ledger = nullptr, IDictionarySource* dictionaries = nullptr,
+                  IDeadLetterSink* deadLetters = nullptr)
+        : queue(queue), consumer(queue, std::move(group)), service(NotificationService::getInstance()),
+          dispatcher(dispatcher), ledger(ledger), dictionaries(dictionaries), deadLetters(deadLetters) {}
+
+    size_t runOnce(size_t maxRecords = 512) {
+        if (consumer.poll(maxRecords, fetched) == 0) {
+            queue.refresh();
+            return 0;
+        }
+        batch.clear();
+        for (auto& record : fetched.records) {
+            size_t pos = 0;
+            shared_ptr<INotification> notification;
+            if (readIngestRecord(record.value, pos, notification, dictionaries)) batch.push_back(std::move(notification));
+            else setAside(record);
+        }
+        service.sendBatch(batch);
+        if (dispatcher) dispatcher->waitIdle();
+        if (ledger) ledger->sync();
+        consumer.commit();
+        if (ledger) ledger->committed();
+        return fetched.records.size();
+    }
+
+    void run(const atomic<bool>& running) {
+        while (running) {
+            if (runOnce() == 0) this_thread::sleep_for(chrono::milliseconds(5));
+        }
+    }
+
+    uint64_t undecodableCount() const {
+        return undecodable;
+    }
+};
+
+// Bounded blocking queue used to hand work between pipeline stages
+template <typename T>
+class BoundedQueue {
+private:
+    mutex lock;
+    condition_variable notEmpty;
+    condition_variable notFull;
+    deque<T> items;
+    size_t capacity;
+    bool closed = false;
+
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    bool push(T item) {
+        unique_lock<mutex> guard(lock);
+        notFull.wait(guard, [&] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and drained.
+    bool pop(T& out) {
+        unique_lock<mutex> guard(lock);
+        notEmpty.wait(guard, [&] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        out = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+// Bulk import of campaign files (NDJSON or CSV: id,type,recipient,message).
+// The file is mapped and cut into chunks at line boundaries; workers parse and
+// validate chunks in parallel while the caller's thread feeds the service.
+enum class BulkFormat {
+    Ndjson,
+    Csv
+};
+
+struct BulkImportStats {
+    uint64_t rows = 0;
+    uint64_t notifications = 0;
+    uint64_t rejected = 0;
+    double seconds = 0;
+    uint64_t peakRssBytes = 0;
+
+    double rowsPerSecond() const {
+        return seconds > 0 ? rows / seconds : 0;
+    }
+};
+
+class BulkImporter {
+private:
+    struct ParsedChunk {
+        vector<shared_ptr<INotification>> notifications;
+        uint64_t rows = 0;
+        uint64_t rejected = 0;
+    };
+
+    static constexpr size_t kFaultAround = 64 * 1024;
+
+    NotificationService& service;
+    size_t workers;
+    size_t chunkBytes;
+
+    // Splits one CSV record; quoted fields may contain commas and doubled quotes.
+    static bool splitCsv(string_view line, array<string, 4>& fields) {
+        size_t field = 0;
+        size_t pos = 0;
+        for (auto& f : fields) f.clear();
+        while (true) {
+            if (field >= fields.size()) return false;
+            string& out = fields[field];
+            if (pos < line.size() && line[pos] == '"') {
+                pos++;
+                while (true) {
+                    size_t q = line.find('"', pos);
+                    if (q == string_view::npos) return false;
+                    out.append(line.substr(pos, q - pos));
+                    pos = q + 1;
+                    if (pos < line.size() && line[pos] == '"') {
+                        out += '"';
+                        pos++;
+                        continue;
+                    }
+                    break;
+                }
+                if (pos < line.size() && line[pos] != ',') return false;
+            } else {
+                size_t comma = line.find(',', pos);
+                out.assign(line.substr(pos, comma - pos));
+                pos = comma == string_view::npos ? line.size() : comma;
+            }
+            field++;
+            if (pos >= line.size()) break;
+            pos++; // skip the comma
+        }
+        return field == fields.size();
+    }
+
+    static void parseChunk(string_view data, size_t begin, size_t end, BulkFormat format,
+                           SendNotificationParser& parser, SendNotificationRequest& request, ParsedChunk& out) {
+        // A line belongs to the chunk holding its first byte.
+        if (begin > 0) {
+            size_t nl = data.find('\n', begin - 1);
+            begin = nl == string_view::npos ? data.size() : nl + 1;
+        }
+        array<string, 4> fields;
+        while (begin < end && begin < data.size()) {
+            size_t nl = data.find('\n', begin);
+            size_t lineEnd = nl == string_view::npos ? data.size() : nl;
+            string_view line = data.substr(begin, lineEnd - begin);
+            begin = lineEnd + 1;
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (trim(line).empty()) continue;
+
+            out.rows++;
+            if (format == BulkFormat::Ndjson) {
+                if (!parser.parse(line, request)) {
+                    out.rejected++;
+                    continue;
+                }
+                size_t before = out.notifications.size();
+                bool ok = true;
+                if (request.recipients.empty()) request.recipients.push_back({});
+                for (auto recipient : request.recipients) {
+                    auto n = makeNotification(request, recipient);
+                    if (!n) {
+                        ok = false;
+                        break;
+                    }
+                    out.notifications.push_back(std::move(n));
+                }
+                if (!ok) {
+                    out.notifications.resize(before);
+                    out.rejected++;
+                }
+            } else {
+                if (!splitCsv(line, fields) || fields[3].empty() || fields[0] == "id") {
+                    if (fields[0] == "id") out.rows--; // header row
+                    else out.rejected++;
+                    continue;
+                }
+                NotificationMeta meta;
+                meta.id = std::move(fields[0]);
+                meta.type = std::move(fields[1]);
+                meta.userId = std::move(fields[2]);
+                out.notifications.push_back(make_shared<SimpleNotification>(std::move(fields[3]), std::move(meta)));
+            }
+        }
+    }
+
+public:
+    explicit BulkImporter(size_t workers = max(1u, thread::hardware_concurrency()), size_t chunkBytes = 1 << 20)
+        : service(NotificationService::getInstance()), workers(workers), chunkBytes(chunkBytes) {}
+
+    BulkImportStats run(const string& path, BulkFormat format) {
+        BulkImportStats stats;
+        auto start = chrono::steady_clock::now();
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0) throw runtime_error("stat " + path + ": " + strerror(errno));
+        if (st.st_size == 0) return stats;
+
+        LogMapping file(path, static_cast<size_t>(st.st_size));
+        string_view data(file.data, file.size);
+        size_t chunks = (data.size() + chunkBytes - 1) / chunkBytes;
+        size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+        // Memory stays bounded by the queue depth, whatever the file size.
+        BoundedQueue<ParsedChunk> parsed(workers * 2);
+        atomic<size_t> nextChunk{0};
+        atomic<size_t> running{workers};
+        vector<thread> pool;
+        for (size_t w = 0; w < workers; w++) {
+            pool.emplace_back([&] {
+                SendNotificationParser parser;
+                SendNotificationRequest request;
+                for (size_t c; (c = nextChunk++) < chunks;) {
+                    ParsedChunk chunk;
+                    size_t begin = c * chunkBytes;
+                    size_t end = min(begin + chunkBytes, data.size());
+                    parseChunk(data, begin, end, format, parser, request, chunk);
+                    // Parsed rows own their strings, so the chunk's pages can go. Peeking at
+                    // the byte before the chunk faults in the kernel's fault-around window
+                    // (64 KB) of the previous one, so that goes too; these are clean file
+                    // pages, and a worker still reading them just faults them back.
+                    size_t alignedBegin = begin > kFaultAround ? (begin - kFaultAround) / pageSize * pageSize : 0;
+                    size_t alignedEnd = end / pageSize * pageSize;
+                    if (alignedEnd > alignedBegin)
+                        madvise(const_cast<char*>(file.data) + alignedBegin, alignedEnd - alignedBegin, MADV_DONTNEED);
+                    parsed.push(std::move(chunk));
+                }
+                if (--running == 0) parsed.close();
+            });
+        }
+
+        ParsedChunk chunk;
+        while (parsed.pop(chunk)) {
+            service.publishBatch(chunk.notifications);
+            stats.rows += chunk.rows;
+            stats.rejected += chunk.rejected;
+            stats.notifications += chunk.notifications.size();
+            chunk.notifications.clear();
+        }
+        for (auto& t : pool) t.join();
+
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        stats.peakRssBytes = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+        return stats;
+    }
+};
+
+static EpollServer* activeServer = nullptr;
+
+static int runUntilSignalled(EpollServer& server) {
+    activeServer = &server;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, [](int) { if (activeServer) activeServer->stop(); });
+    signal(SIGTERM, [](int) { if (activeServer) activeServer->stop(); });
+    server.run();
+    activeServer = nullptr;
+    return 0;
+}
+
+// With a queue directory the API only produces; `execute` runs the engine side.
+static int runApiServer(uint16_t port, const string& queueDir, const string& templatesDir, const string& snapshotPath,
+                        const string& standbyAddress, bool syncReplication, bool syncFallback) {
+    auto& notificationService = NotificationService::getInstance();
+    notificationService.upsertUser({"6767", "Sayan Singh", true, false});
+    AdmissionLimits limits;
+    limits.maxPending = 1000000;
+    limits.maxPendingBytes = 512ULL * 1024 * 1024;
+    limits.maxHeapBytes = 2ULL * 1024 * 1024 * 1024;
+    limits.maxQueueDelayMs = 10000;
+    notificationService.setAdmissionLimits(limits);
+
+    auto mailbox = queueDir.empty() ? make_shared<InAppMailbox>(256, notificationService.getBodyStore()) : nullptr;
+    HttpApiServer server(port, mailbox);
+    auto analytics = make_shared<DeliveryAnalytics>();
+    analytics->subscribe();
+    server.setAnalytics(analytics);
+    auto templates = make_shared<TemplateRegistry>();
+    server.setTemplates(templates);
+    // State from the previous process is loaded before the first request is accepted.
+    shared_ptr<EngineSnapshotter> snapshotter;
+    if (!snapshotPath.empty()) {
+        snapshotter = make_shared<EngineSnapshotter>(snapshotPath, notificationService, mailbox, analytics);
+        snapshotter->restore();
+        server.setSnapshotter(snapshotter);
+    }
+    // Template files are rescanned every second, so edits go live without a restart.
+    atomic<bool> watching{!templatesDir.empty()};
+    thread templateWatcher;
+    if (watching) {
+        auto loader = make_shared<TemplateLoader>(templatesDir, templates);
+        loader->reload();
+        templateWatcher = thread([loader, &watching] {
+            while (watching) {
+                this_thread::sleep_for(chrono::seconds(1));
+                loader->reload();
+            }
+        });
+    }
+    unique_ptr<PartitionedLogQueue> queue;
+    shared_ptr<LogQueueWriter> writer;
+    unique_ptr<DictionaryStore> dictionaries;
+    shared_ptr<PayloadCompressor> compressor;
+    shared_ptr<LogShipper> shipper;
+    shared_ptr<NotificationEngine> engine;
+    shared_ptr<PopUpGateway> gateway;
+    thread gatewayThread;
+    if (!queueDir.empty()) {
+        LogQueueOptions options;
+        options.retentionMs = 7LL * 24 * 60 * 60 * 1000;
+        try {
+            queue = make_unique<PartitionedLogQueue>(queueDir, options);
+        } catch (const exception& e) {
+            cerr << "[API] " << e.what() << endl;
+            if (watching) {
+                watching = false;
+                templateWatcher.join();
+            }
+            return 1;
+        }
+        writer = make_shared<LogQueueWriter>(*queue, true);
+        dictionaries = make_unique<DictionaryStore>(queueDir + "/dictionaries");
+        compressor = make_shared<PayloadCompressor>(*dictionaries);
+        writer->setCompressor(compressor);
+        if (!standbyAddress.empty()) {
+            size_t colon = standbyAddress.rfind(':');
+            if (colon == string::npos) throw runtime_error("standby address must be host:port");
+            shipper = make_shared<LogShipper>(*queue, dictionaries.get(), standbyAddress.substr(0, colon),
+                                              static_cast<uint16_t>(stoi(standbyAddress.substr(colon + 1))));
+            writer->setReplication(shipper, syncReplication, syncFallback);
+            server.setHold([writer] { return writer->holding(); });
+        }
+        writer->subscribe();
+    } else {
+        // In-app sessions connect to the gateway on the next port up.
+        gateway = make_shared<PopUpGateway>(static_cast<uint16_t>(port + 1));
+        gatewayThread = thread([gateway] { gateway->run(); });
+        engine = make_shared<NotificationEngine>();
+        engine->subscribe();
+        engine->addNotificationStrategy(make_unique<PopUpStrategy>(
+            make_shared<InAppFanout>(vector<shared_ptr<IInAppPublisher>>{gateway, mailbox})));
+        engine->setAnalytics(analytics);
+    }
+
+    cout << "[API] Listening on port " << server.port() << endl;
+    if (gateway) cout << "[Popup] Gateway listening on port " << gateway->port() << endl;
+    int rc = runUntilSignalled(server);
+    if (gateway) {
+        gateway->stop();
+        gatewayThread.join();
+    }
+    if (watching) {
+        watching = false;
+        templateWatcher.join();
+    }
+    if (shipper) {
+        shipper->stop();
+        const ReplicationStats& stats = shipper->getStats();
+        cerr << "[Replication] " << stats.records << " records in " << stats.frames << " frames (" << stats.bytes
+             << " bytes) over " << stats.sessions << " sessions; " << stats.syncMisses << " of " << stats.syncWaits
+             << " sync waits gave up, " << writer->heldBatches() << " held writes" << endl;
+    }
+    if (snapshotter) {
+        snapshotter->saveNow();
+        const EngineSnapshotter::Stats& stats = snapshotter->getStats();
+        cerr << "[Snapshot] " << stats.taken << " written (" << stats.failed << " failed), last " << stats.lastBytes
+             << " bytes; last fork paused the loop " << stats.lastForkUs << "us" << endl;
+    }
+    BodyStore::Stats history = notificationService.getBodyStore()->stats();
+    cerr << "[History] " << history.interned << " bodies held as " << history.bodies << " distinct ("
+         << history.storedBytes << " of " << history.internedBytes << " bytes), " << history.deduplicated
+         << " deduplicated" << endl;
+    if (compressor) {
+        const CompressionStats& stats = compressor->getStats();
+        cerr << "[Compression] " << stats.compressed << "/" << stats.bodies << " bodies compressed ("
+             << stats.reused << " reused), ratio " << stats.ratio() << ", "
+             << stats.compressSeconds * 1e6 / max<uint64_t>(1, stats.encodes) << "us per body, "
+             << stats.dictionaries << " dictionaries trained in " << stats.trainSeconds << "s" << endl;
+    }
+    return rc;
+}
+
+static int runIngestServer(const string& socketPath) {
+    auto engine = make_shared<NotificationEngine>();
+    engine->subscribe();
+    engine->addNotificationStrategy(make_unique<PopUpStrategy>());
+
+    BinaryIngestServer server(listenUnix(socketPath));
+    cout << "[Ingest] Listening on " << socketPath << endl;
+    int rc = runUntilSignalled(server);
+    unlink(socketPath.c_str());
+    return rc;
+}
+
+static atomic<bool> executorRunning{true};
+
+static int runQueueExecutor(const string& queueDir, const string& group, uint32_t partitions) {
+    signal(SIGINT, [](int) { executorRunning = false; });
+    signal(SIGTERM, [](int) { executorRunning = false; });
+    GroupLease lease(queueDir + "/groups/" + group + ".lock");
+    if (!lease.tryAcquire()) {
+        cout << "[Executor] Another member is consuming group " << group << "; waiting to take over" << endl;
+        while (executorRunning && !lease.tryAcquire()) this_thread::sleep_for(chrono::milliseconds(200));
+        if (!executorRunning) return 0;
+    }
+
+    auto gateway = make_shared<PopUpGateway>(8081);
+    thread gatewayThread([&] { gateway->run(); });
+
+    // Deliveries fan out over the dispatcher, still in order per recipient.
+    auto dispatcher = make_shared<OrderedDispatcher>(partitions);
+    // Records that were delivered but not yet committed are skipped when the group replays them.
+    auto ledger = make_shared<DeliveryLedger>(queueDir + "/groups/" + group + ".deliveries");
+    auto engine = make_shared<NotificationEngine>();
+    engine->subscribe();
+    engine->addNotificationStrategy(make_unique<PopUpStrategy>(gateway));
+    engine->setDispatcher(dispatcher);
+    engine->setDeliveryTracker(ledger);
+    auto deadLetters = make_shared<DeadLetterStore>(queueDir + "/deadletters");
+    engine->setDeadLetterSink(deadLetters);
+
+    LogQueueOptions options;
+    options.writable = false;
+    PartitionedLogQueue queue(queueDir, options);
+    DictionaryStore dictionaries(queueDir + "/dictionaries");
+    QueueExecutor executor(queue, group, dispatcher.get(), ledger.get(), &dictionaries, deadLetters.get());
+    cout << "[Executor] Consuming " << queueDir << " as group " << group << " over " << partitions
+         << " dispatch partitions" << endl;
+    int rc = 0;
+    try {
+        executor.run(executorRunning);
+    } catch (const exception& e) {
+        // Offsets stay where they were; the next member replays from there.
+        cerr << "[Executor] Stopping: " << e.what() << endl;
+        rc = 1;
+    }
+    if (executor.undecodableCount())
+        cerr << "[Executor] " << executor.undecodableCount() << " undecodable records dead-lettered" << endl;
+    for (auto& hot : dispatcher->hotPartitions()) {
+        cerr << "[Executor] hot partition " << hot.partition << ": " << hot.dispatched << " dispatched, max depth "
+             << hot.maxDepth << endl;
+    }
+    gateway->stop();
+    gatewayThread.join();
+    return rc;
+}
+
+static volatile sig_atomic_t standbyPromoted = 0;
+
+// Receives the primary's log until SIGUSR1 promotes this process, then runs
+// the executors on the replicated queue from the replicated group offsets.
+// Once promoted, `serve` can take over producing into the same directory.
+static int runStandby(uint16_t port, const string& queueDir, const string& group) {
+    uint64_t backlog = 0;
+    {
+        // Closed before promotion, so the queue's writer lock passes to `serve`.
+        PartitionedLogQueue queue(queueDir);
+        LogReceiver receiver(listenTcp(port), queue);
+        signal(SIGUSR1, [](int) {
+            standbyPromoted = 1;
+            if (activeServer) activeServer->stop();
+        });
+        cout << "[Standby] Receiving " << queueDir << " on port " << receiver.port() << endl;
+        int rc = runUntilSignalled(receiver);
+        const ReplicationStats& stats = receiver.getStats();
+        cerr << "[Standby] " << stats.records << " records in " << stats.frames << " frames" << endl;
+        if (!standbyPromoted) return rc;
+        vector<uint64_t> ends = queue.endOffsets();
+        vector<uint64_t> committed = queue.committedOffsets(group);
+        for (size_t p = 0; p < ends.size(); p++) backlog += ends[p] - min(ends[p], committed[p]);
+    }
+    cerr << "[Standby] Promoted; group " << group << " resumes with " << backlog << " records to deliver" << endl;
+    return runQueueExecutor(queueDir, group, 64);
+}
+
+// Two-process check of sync replication: this process is the primary and a
+// `standby` child of the same binary receives. Covers shipping, holding writes
+// while the standby is down, catching up once it is back, and the explicit
+// fallback mode. Exits non-zero on any mismatch.
+static int runReplicationCheck(size_t count) {
+    bool ok = true;
+    auto expect = [&](bool condition, const string& what) {
+        cerr << "[Replication] " << (condition ? "ok   " : "FAIL ") << what << endl;
+        ok = ok && condition;
+    };
+    auto waitUntil = [](const function<bool()>& condition, int64_t timeoutMs) {
+        for (int64_t deadline = nowMs() + timeoutMs; !condition(); this_thread::sleep_for(chrono::milliseconds(10))) {
+            if (nowMs() >= deadline) return false;
+        }
+        return true;
+    };
+
+    char base[] = "/tmp/replication-check-XXXXXX";
+    if (!mkdtemp(base)) throw runtime_error(string("mkdtemp: ") + strerror(errno));
+    string primaryDir = string(base) + "/primary", standbyDir = string(base) + "/standby";
+    int probe = listenTcp(0);
+    sockaddr_in bound{};
+    socklen_t boundLen = sizeof(bound);
+    getsockname(probe, reinterpret_cast<sockaddr*>(&bound), &boundLen);
+    string port = to_string(ntohs(bound.sin_port));
+    close(probe);
+
+    pid_t standby = -1;
+    auto startStandby = [&] {
+        standby = fork();
+        if (standby < 0) throw runtime_error(string("fork: ") + strerror(errno));
+        if (standby == 0) {
+            execl("/proc/self/exe", "notificationSystem", "standby", port.c_str(), standbyDir.c_str(),
+                  static_cast<char*>(nullptr));
+            _exit(127);
+        }
+    };
+    auto killStandby = [&] {
+        kill(standby, SIGKILL);
+        waitpid(standby, nullptr, 0);
+    };
+
+    auto& notificationService = NotificationService::getInstance();
+    size_t published = 0;
+    auto publish = [&](size_t n) {
+        vector<shared_ptr<INotification>> batch;
+        for (size_t i = 0; i < n; i++, published++) {
+            NotificationMeta meta;
+            meta.id = "replica-" + to_string(published);
+            meta.userId = "user-" + to_string(published % 97);
+            batch.push_back(make_shared<SimpleNotification>("Replicated message " + to_string(published), meta));
+        }
+        notificationService.publishBatch(batch);
+    };
+
+    vector<uint64_t> replicatedEnds;
+    {
+        PartitionedLogQueue queue(primaryDir);
+        auto shipper = make_shared<LogShipper>(queue, nullptr, "127.0.0.1", static_cast<uint16_t>(stoi(port)));
+        auto writer = make_shared<LogQueueWriter>(queue, true);
+        writer->setReplication(shipper, true);
+        writer->subscribe();
+
+        startStandby();
+        expect(waitUntil([&] { return shipper->isConnected(); }, 5000), "primary connects to the standby");
+        for (size_t sent = 0; sent < count; sent += 100) publish(min<size_t>(100, count - sent));
+        expect(!writer->holding() && writer->heldBatches() == 0 && shipper->isReplicated(queue.endOffsets()),
+               to_string(count) + " records acknowledged by the standby in sync mode");
+
+        killStandby();
+        expect(waitUntil([&] { return !shipper->isConnected(); }, 5000), "primary sees the standby go away");
+        publish(10);
+        expect(writer->holding(), "a batch the standby missed holds further writes");
+
+        startStandby();
+        expect(waitUntil([&] { return !writer->holding(); }, 10000), "writes resume once the restarted standby has the batch");
+        replicatedEnds = queue.endOffsets();
+        expect(shipper->isReplicated(replicatedEnds), "the restarted standby holds every record");
+
+        writer->setReplication(shipper, true, true);
+        killStandby();
+        waitUntil([&] { return !shipper->isConnected(); }, 5000);
+        publish(10);
+        expect(!writer->holding(), "sync-fallback carries on without the standby");
+        shipper->stop();
+        const ReplicationStats& stats = shipper->getStats();
+        expect(stats.syncMisses == 2, to_string(stats.syncMisses) + " of " + to_string(stats.syncWaits) + " sync waits gave up");
+    }
+
+    {
+        LogQueueOptions options;
+        options.writable = false;
+        PartitionedLogQueue copy(standbyDir, options);
+        expect(copy.endOffsets() == replicatedEnds, "the standby's log on disk matches the primary's");
+    }
+    nftw(base, [](const char* path, const struct stat*, int, FTW*) { return remove(path); }, 16, FTW_DEPTH | FTW_PHYS);
+    return ok ? 0 : 1;
+}
+
+// Lists dead letters, optionally for one channel.
+static int runListDeadLetters(const string& queueDir, const string& channel) {
+    DeadLetterStore store(queueDir + "/deadletters");
+    DeadLetterFilter filter;
+    filter.channel = channel;
+    filter.includeRedriven = true;
+    DeadLetter letter;
+    for (uint64_t seq : store.select(filter)) {
+        if (!store.read(seq, letter)) continue;
+        cout << seq << (store.isRedriven(seq) ? " [redriven] " : " ") << letter.channel << " id=" << letter.meta.id
+             << " user=" << letter.meta.userId << " at " << letter.failedAtMs << ": " << letter.reason << "\n";
+        if (!letter.providerResponse.empty()) cout << "  response: " << letter.providerResponse << "\n";
+        for (auto& a : letter.attempts) cout << "  " << a.atMs << " " << a.provider << ": " << a.error << "\n";
+    }
+    return 0;
+}
+
+// Re-drives pending dead letters back onto the queue at a fixed rate. The
+// executors deliver them again; their delivery ledger skips the channels that
+// already succeeded, so only the failed channel is retried. The queue must not
+// have another writer, so this refuses to run beside `serve` on the same queue.
+static int runRedrive(const string& queueDir, const string& channel, double perSecond) {
+    unique_ptr<PartitionedLogQueue> opened;
+    try {
+        opened = make_unique<PartitionedLogQueue>(queueDir);
+    } catch (const exception& e) {
+        cerr << "[Redrive] " << e.what() << endl;
+        return 1;
+    }
+    PartitionedLogQueue& queue = *opened;
+    DeadLetterStore store(queueDir + "/deadletters");
+    DeadLetterFilter filter;
+    filter.channel = channel;
+    string record;
+    size_t sent = store.redrive(filter, perSecond, [&](const DeadLetter& letter) {
+        record.clear();
+        // A record the executor could not decode goes back exactly as it was.
+        if (letter.channel == "queue") record = letter.content;
+        else appendIngestRecord(record, letter.meta, letter.content);
+        queue.partition(queue.partitionFor(letter.meta.userId)).append({{letter.meta.userId, record}});
+    });
+    queue.sync();
+    cerr << "[Redrive] " << sent << " dead letters re-queued" << endl;
+    return 0;
+}
+
+// Imports a campaign file; with a queue directory rows are enqueued for the executors.
+static int runBulkImport(const string& path, const string& queueDir) {
+    unique_ptr<PartitionedLogQueue> queue;
+    shared_ptr<LogQueueWriter> writer;
+    shared_ptr<NotificationEngine> engine;
+    if (!queueDir.empty()) {
+        try {
+            queue = make_unique<PartitionedLogQueue>(queueDir);
+        } catch (const exception& e) {
+            cerr << "[Import] " << e.what() << endl;
+            return 1;
+        }
+        writer = make_shared<LogQueueWriter>(*queue);
+        writer->subscribe();
+    } else {
+        engine = make_shared<NotificationEngine>();
+        engine->subscribe();
+        engine->addNotificationStrategy(make_unique<PopUpStrategy>());
+    }
+
+    bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    BulkImportStats stats = BulkImporter().run(path, csv ? BulkFormat::Csv : BulkFormat::Ndjson);
+    if (queue) queue->sync();
+
+    cerr << "[Import] " << stats.rows << " rows, " << stats.notifications << " notifications, "
+         << stats.rejected << " rejected in " << stats.seconds << "s ("
+         << static_cast<uint64_t>(stats.rowsPerSecond()) << " rows/s), peak RSS "
+         << stats.peakRssBytes / (1024 * 1024) << " MB" << endl;
+    return stats.rejected ? 1 : 0;
+}
+
+// Counts the complete HTTP responses at the front of `in` and erases them.
+static size_t takeHttpResponses(string& in, vector<int>* statuses = nullptr) {
+    size_t pos = 0;
+    size_t count = 0;
+    while (true) {
+        size_t end = in.find("\r\n\r\n", pos);
+        if (end == string::npos) break;
+        size_t length = in.find("Content-Length: ", pos);
+        size_t bodyLen = length != string::npos && length < end ? stoul(in.substr(length + 16, 12)) : 0;
+        if (in.size() < end + 4 + bodyLen) break;
+        if (statuses) statuses->push_back(stoi(in.substr(pos + 9, 3)));
+        pos = end + 4 + bodyLen;
+        count++;
+    }
+    in.erase(0, pos);
+    return count;
+}
+
+// Drives SendNotification with pipelined keep-alive connections and reports
+// req/s and per-window latency. Without a port it serves in-process.
+static int runHttpBenchmark(size_t count, size_t connections, size_t pipeline, uint16_t targetPort) {
+    unique_ptr<HttpApiServer> server;
+    thread serverThread;
+    if (!targetPort) {
+        server = make_unique<HttpApiServer>(0);
+        targetPort = server->port();
+        serverThread = thread([&] { server->run(); });
+    }
+
+    const string body = R"({"id":"bench","type":"bench","message":"Bench message","recipients":["u1"]})";
+    string request = "POST /SendNotification HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\n"
+                     "Content-Length: " + to_string(body.size()) + "\r\n\r\n" + body;
+    string window;
+    for (size_t i = 0; i < pipeline; i++) window += request;
+
+    atomic<size_t> errors{0};
+    vector<vector<double>> latencies(connections);
+    size_t perConnection = count / connections / pipeline;
+    auto start = chrono::steady_clock::now();
+    vector<thread> clients;
+    for (size_t c = 0; c < connections; c++) {
+        clients.emplace_back([&, c] {
+            int fd = connectTcp("127.0.0.1", targetPort);
+            string in;
+            vector<int> statuses;
+            char buf[65536];
+            for (size_t w = 0; w < perConnection; w++) {
+                auto sent = chrono::steady_clock::now();
+                if (send(fd, window.data(), window.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(window.size())) break;
+                size_t received = 0;
+                while (received < pipeline) {
+                    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+                    if (n <= 0) break;
+                    in.append(buf, static_cast<size_t>(n));
+                    received += takeHttpResponses(in, &statuses);
+                }
+                if (received < pipeline) break;
+                latencies[c].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - sent).count());
+            }
+            for (int status : statuses) {
+                if (status != 200) errors++;
+            }
+            close(fd);
+        });
+    }
+    for (auto& t : clients) t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<double> all;
+    for (auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    sort(all.begin(), all.end());
+    size_t done = all.size() * pipeline;
+    auto percentile = [&](double p) { return all.empty() ? 0.0 : all[min(all.size() - 1, static_cast<size_t>(all.size() * p / 100))]; };
+    cerr << "[HTTP] " << done << " requests over " << connections << " connections, " << pipeline
+         << " pipelined, in " << seconds << "s (" << static_cast<uint64_t>(done / seconds) << " req/s), window p50 "
+         << static_cast<uint64_t>(percentile(50)) << "us, p99 " << static_cast<uint64_t>(percentile(99))
+         << "us, " << errors << " non-200" << endl;
+
+    if (server) {
+        server->stop();
+        serverThread.join();
+    }
+    return errors ? 1 : 0;
+}
+
+// Compares the structural SendNotification parser with the general JSON
+// document parser on small, medium and large payloads.
+static int runParseBenchmark(size_t count) {
+    auto payload = [](size_t recipients) {
+        string json = R"({"id":"order-48213","type":"shipping","priority":"high","message":"Your order \"48213\" has shipped and will arrive on Tuesday.","ttlMs":3600000,"recipients":[)";
+        for (size_t i = 0; i < recipients; i++) json += (i ? ",\"user-" : "\"user-") + to_string(i) + "\"";
+        json += R"(],"preferences":{"email":true,"sms":false,"push":true}})";
+        return json;
+    };
+    int rc = 0;
+    for (size_t recipients : {1, 20, 1000}) {
+        string json = payload(recipients);
+        size_t rounds = max<size_t>(1, count / recipients);
+
+        SendNotificationParser parser;
+        SendNotificationRequest request;
+        auto start = chrono::steady_clock::now();
+        size_t structuralSeen = 0;
+        for (size_t i = 0; i < rounds; i++) {
+            if (!parser.parse(json, request)) return 1;
+            structuralSeen += request.recipients.size();
+        }
+        double structural = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        size_t documentSeen = 0;
+        for (size_t i = 0; i < rounds; i++) {
+            JsonValue doc;
+            if (!JsonValue::parse(json, doc)) return 1;
+            const JsonValue* list = doc.find("recipients");
+            documentSeen += list ? list->items.size() : 0;
+        }
+        double document = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (structuralSeen != documentSeen) rc = 1;
+        double mb = static_cast<double>(json.size()) * rounds / (1024 * 1024);
+        cerr << "[Parse] " << json.size() << "-byte payload, " << recipients << " recipients: structural "
+             << static_cast<uint64_t>(structural * 1e9 / rounds) << "ns (" << static_cast<uint64_t>(mb / structural)
+             << " MB/s), document " << static_cast<uint64_t>(document * 1e9 / rounds) << "ns ("
+             << static_cast<uint64_t>(mb / document) << " MB/s), " << document / structural << "x"
+             << (structuralSeen == documentSeen ? "" : ", RESULTS DIFFER") << endl;
+    }
+    return rc;
+}
+
+static uint64_t anonymousRssBytes() {
+    string status;
+    if (!readWholeFile("/proc/self/status", status)) return 0;
+    size_t pos = status.find("RssAnon:");
+    return pos == string::npos ? 0 : stoull(status.substr(pos + 8, 20)) * 1024;
+}
+
+// Opens many WebSocket sessions against an in-process gateway, reports the
+// gateway's heap per connection, then fans messages out to random users and
+// reports delivery latency at a paced publish rate. Fails if a connection
+// costs 4 KB or more.
+static int runGatewayBenchmark(size_t connections, size_t messages, double perSecond) {
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    connections = min<size_t>(connections, (limit.rlim_cur - 64) / 2);
+
+    auto gateway = make_shared<PopUpGateway>(0);
+    thread gatewayThread([&] { gateway->run(); });
+    uint16_t port = gateway->port();
+    vector<int> clients;
+    clients.reserve(connections);
+    this_thread::sleep_for(chrono::milliseconds(50));
+    uint64_t before = anonymousRssBytes();
+
+    char buf[65536];
+    for (size_t i = 0; i < connections; i++) {
+        int fd = connectTcp("127.0.0.1", port);
+        string handshake = "GET /ws?user=user-" + to_string(i) + " HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                           "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                           "Sec-WebSocket-Version: 13\r\n\r\n";
+        send(fd, handshake.data(), handshake.size(), MSG_NOSIGNAL);
+        string response;
+        while (response.find("\r\n\r\n") == string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) throw runtime_error("gateway closed a session during the handshake");
+            response.append(buf, static_cast<size_t>(n));
+        }
+        if (response.compare(0, 12, "HTTP/1.1 101") != 0) throw runtime_error("gateway refused the upgrade");
+        clients.push_back(fd);
+    }
+    while (gateway->connectedSessions() < connections) this_thread::sleep_for(chrono::milliseconds(1));
+    this_thread::sleep_for(chrono::milliseconds(50));
+    uint64_t after = anonymousRssBytes();
+    // The client side only holds the socket descriptors, so the growth is the gateway's.
+    double perConnection = static_cast<double>(after > before ? after - before : 0) / max<size_t>(1, connections);
+
+    int poller = epoll_create1(EPOLL_CLOEXEC);
+    for (int fd : clients) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(poller, EPOLL_CTL_ADD, fd, &ev);
+    }
+    vector<double> latencies;
+    latencies.reserve(messages);
+    thread reader([&] {
+        epoll_event events[256];
+        unordered_map<int, string> partial;
+        while (latencies.size() < messages) {
+            int n = epoll_wait(poller, events, 256, 1000);
+            if (n <= 0) break;
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                string& in = partial[fd];
+                ssize_t got;
+                while ((got = recv(fd, buf, sizeof(buf), 0)) > 0) in.append(buf, static_cast<size_t>(got));
+                size_t pos = 0;
+                while (in.size() - pos >= 2 && in.size() - pos >= 2 + static_cast<size_t>(in[pos + 1] & 0x7F)) {
+                    size_t length = in[pos + 1] & 0x7F;
+                    int64_t sentNs = stoll(in.substr(pos + 2, length));
+                    int64_t nowNs = chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::steady_clock::now().time_since_epoch()).count();
+                    latencies.push_back((nowNs - sentNs) / 1000.0);
+                    pos += 2 + length;
+                }
+                in.erase(0, pos);
+            }
+        }
+    });
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < messages; i++) {
+        string content = to_string(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count());
+        gateway->publish("user-" + to_string(mix64(i) % connections), content);
+        if (i % 64 == 63) this_thread::sleep_until(start + chrono::duration<double>((i + 1) / perSecond));
+    }
+    reader.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies.empty() ? 0.0 : latencies[min(latencies.size() - 1, static_cast<size_t>(latencies.size() * p / 100))];
+    };
+    cerr << "[Gateway] " << connections << " sessions, " << static_cast<uint64_t>(perConnection)
+         << " bytes of gateway heap per connection; " << latencies.size() << "/" << messages << " messages at "
+         << static_cast<uint64_t>(perSecond) << "/s in " << seconds << "s, p50 " << static_cast<uint64_t>(percentile(50)) << "us, p99 "
+         << static_cast<uint64_t>(percentile(99)) << "us" << endl;
+
+    close(poller);
+    for (int fd : clients) close(fd);
+    gateway->stop();
+    gatewayThread.join();
+    return perConnection < 4096 && latencies.size() == messages ? 0 : 1;
+}
+
+// Drives the push channel against the local mock provider and reports
+// latency/throughput, then checks that a provider answering 503 and one that
+// refuses connections both end up in the dead-letter sink.
+static int runPushBenchmark(size_t count, size_t connections) {
+    struct CountingSink : IDeadLetterSink {
+        atomic<uint64_t> letters{0};
+        void deadLetter(const DeadLetter&) override { letters++; }
+    };
+    auto& notificationService = NotificationService::getInstance();
+    auto sendAll = [&](const shared_ptr<Http2PushClient>& client, size_t n, const shared_ptr<CountingSink>& sink) {
+        auto engine = make_shared<NotificationEngine>();
+        // Sends complete on the client's loop thread, so streams in flight are not bound by these threads.
+        engine->setDispatcher(make_shared<OrderedDispatcher>(256));
+        engine->setDeadLetterSink(sink);
+        engine->subscribe();
+        engine->addNotificationStrategy(make_unique<PushStrategy>(client));
+        for (size_t i = 0; i < n; i++) {
+            NotificationMeta meta;
+            meta.id = to_string(i);
+            meta.type = "push";
+            meta.userId = "device-" + to_string(i % 1000);
+            notificationService.publishBatch({make_shared<SimpleNotification>("Bench message " + to_string(i), meta)});
+        }
+        engine.reset();
+        client->waitIdle();
+    };
+
+    MockPushProvider provider(0);
+    thread providerThread([&] { provider.run(); });
+    auto client = make_shared<Http2PushClient>("127.0.0.1", provider.port(), connections);
+    auto sink = make_shared<CountingSink>();
+    auto start = chrono::steady_clock::now();
+    sendAll(client, count, sink);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    auto stats = client->connectionStats();
+    for (size_t i = 0; i < stats.size(); i++) {
+        cerr << "[Push] conn " << i << ": " << stats[i].completed << " ok, " << stats[i].failed << " failed, "
+             << static_cast<uint64_t>(stats[i].meanLatencyUs()) << "us mean" << endl;
+    }
+    cerr << "[Push] " << count << " requests in " << seconds << "s (" << static_cast<uint64_t>(count / seconds)
+         << " req/s), p50 " << client->latencyPercentileUs(50) << "us, p99 "
+         << client->latencyPercentileUs(99) << "us, provider saw " << provider.requestsServed()
+         << ", dead-lettered " << sink->letters << endl;
+    bool ok = sink->letters == 0 && provider.requestsServed() == count;
+    client.reset();
+    provider.stop();
+    providerThread.join();
+
+    size_t failures = min<size_t>(count, 1000);
+    auto rejected = make_shared<CountingSink>();
+    uint16_t failingPort;
+    {
+        MockPushProvider failing(0, 503);
+        thread failingThread([&] { failing.run(); });
+        failingPort = failing.port();
+        sendAll(make_shared<Http2PushClient>("127.0.0.1", failingPort, connections), failures, rejected);
+        failing.stop();
+        failingThread.join();
+    }
+
+    // The provider has closed its listener, so nothing takes the port any more.
+    auto refused = make_shared<CountingSink>();
+    sendAll(make_shared<Http2PushClient>("127.0.0.1", failingPort, connections), failures, refused);
+
+    cerr << "[Push] " << rejected->letters << "/" << failures << " dead-lettered on HTTP 503, "
+         << refused->letters << "/" << failures << " on a refused connection" << endl;
+    return ok && rejected->letters == failures && refused->letters == failures ? 0 : 1;
+}
+
+// Wires SigningStrategy over FailoverStrategy over two WebhookStrategy
+// providers against local HTTP stubs, one answering 500 and one 200, and
+// checks routing, signatures and the dead-letter path. Exits non-zero on any
+// mismatch.
+static int runWebhookCheck(size_t count) {
+    struct CountingSink : IDeadLetterSink {
+        atomic<uint64_t> letters{0};
+        void deadLetter(const DeadLetter&) override { letters++; }
+    };
+    bool ok = true;
+    auto expect = [&](bool condition, const string& what) {
+        cerr << "[Webhook] " << (condition ? "ok   " : "FAIL ") << what << endl;
+        ok = ok && condition;
+    };
+
+    for (const char* bad : {"http://host:70000/x", "http://host:0/", "http://host:80a/", "http://host:/",
+                            "http://:8080/", "https://host/", "http://host:999999999999/"})
+        expect(!WebhookEndpoint::parse(bad), string("rejects ") + bad);
+    auto parsed = WebhookEndpoint::parse("http://127.0.0.1:65535/hook");
+    expect(parsed && parsed->port == 65535 && parsed->path == "/hook", "parses http://127.0.0.1:65535/hook");
+
+    auto failing = make_unique<MockWebhookReceiver>(0, 500);
+    auto healthy = make_unique<MockWebhookReceiver>(0, 200);
+    thread failingThread([&] { failing->run(); });
+    thread healthyThread([&] { healthy->run(); });
+    string failingUrl = "http://127.0.0.1:" + to_string(failing->port()) + "/hook";
+    string healthyUrl = "http://127.0.0.1:" + to_string(healthy->port()) + "/hook";
+
+    auto& notificationService = NotificationService::getInstance();
+    auto webhooks = make_shared<WebhookDispatcher>();
+    auto failover = make_unique<FailoverStrategy>();
+    FailoverStrategy* failoverView = failover.get();
+    failover->addProvider(make_unique<WebhookStrategy>(webhooks, WebhookEndpoint::parse(failingUrl)));
+    failover->addProvider(make_unique<WebhookStrategy>(webhooks, WebhookEndpoint::parse(healthyUrl)));
+    auto signing = make_unique<SigningStrategy>(std::move(failover));
+    signing->setTenantKey("acme", "acme-secret");
+    SigningStrategy* signingView = signing.get();
+
+    auto sink = make_shared<CountingSink>();
+    auto send = [&](INotificationStrategy* strategy, size_t n) {
+        auto engine = make_shared<NotificationEngine>();
+        engine->setDeadLetterSink(sink);
+        engine->subscribe();
+        engine->addNotificationStrategy(unique_ptr<INotificationStrategy>(strategy));
+        vector<shared_ptr<INotification>> batch;
+        for (size_t i = 0; i < n; i++) {
+            NotificationMeta meta;
+            meta.id = "hook-" + to_string(i);
+            meta.type = "webhook";
+            meta.userId = "user-" + to_string(i);
+            meta.tenantId = "acme";
+            batch.push_back(make_shared<SimpleNotification>("Webhook message " + to_string(i), meta));
+        }
+        notificationService.publishBatch(batch);
+        return engine;
+    };
+
+    auto engine = send(signing.release(), count);
+    auto bodies = healthy->received();
+    expect(sink->letters == 0, "every send delivered through failover (" + to_string(sink->letters) + " dead-lettered)");
+    expect(bodies.size() == count, to_string(bodies.size()) + "/" + to_string(count) + " bodies at the healthy stub");
+    HmacSha256 key("acme-secret");
+    size_t verified = 0;
+    for (auto& body : bodies) {
+        JsonValue doc;
+        if (!JsonValue::parse(body, doc)) continue;
+        const JsonValue* content = doc.find("content");
+        const JsonValue* signature = doc.find("signature");
+        if (!content || !signature) continue;
+        auto mac = key.sign(content->text);
+        if (signature->text == toHex(mac.data(), mac.size())) verified++;
+    }
+    expect(verified == count && signingView->signedNotifications() == count,
+           to_string(verified) + "/" + to_string(count) + " signatures verify");
+    expect(signingView->batchSignedNotifications() == count,
+           to_string(signingView->batchSignedNotifications()) + "/" + to_string(count) + " signed ahead as one batch");
+    auto stats = failoverView->stats();
+    expect(stats.size() == 2 && stats[0].failed > 0 && stats[0].sent == 0 && stats[1].sent == count,
+           "the 500 provider failed over to the 200 one");
+    engine.reset();
+
+    // With both stubs gone (listeners closed) every send must reach the dead-letter sink.
+    healthy->stop();
+    healthyThread.join();
+    healthy.reset();
+    failing->stop();
+    failingThread.join();
+    failing.reset();
+    auto downFailover = make_unique<FailoverStrategy>();
+    downFailover->addProvider(make_unique<WebhookStrategy>(webhooks, WebhookEndpoint::parse(failingUrl)));
+    downFailover->addProvider(make_unique<WebhookStrategy>(webhooks, WebhookEndpoint::parse(healthyUrl)));
+    sink->letters = 0;
+    engine = send(downFailover.release(), 20);
+    expect(sink->letters == 20, to_string(sink->letters) + "/20 dead-lettered with both endpoints down");
+    engine.reset();
+
+    // A full host queue is a failed send, not a silent drop.
+    WebhookOptions options;
+    options.maxQueuedPerHost = 0;
+    auto fullQueue = make_unique<WebhookStrategy>(make_shared<WebhookDispatcher>(options), WebhookEndpoint::parse(healthyUrl));
+    sink->letters = 0;
+    engine = send(fullQueue.release(), 5);
+    expect(sink->letters == 5, to_string(sink->letters) + "/5 dead-lettered on a full queue");
+    return ok ? 0 : 1;
+}
+
+// Measures HMAC-SHA256 signing on one core, one message at a time and in batches.
+static int runSignBenchmark(size_t count, size_t bytes) {
+    HmacSha256 key("bench-tenant-secret");
+    vector<string> payloads(count);
+    for (size_t i = 0; i < count; i++) {
+        payloads[i] = string(bytes, 'x');
+        snprintf(payloads[i].data(), payloads[i].size(), "%zu", i);
+    }
+    vector<string_view> views(payloads.begin(), payloads.end());
+    vector<array<uint8_t, 32>> macs(count);
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) macs[i] = key.sign(views[i]);
+    double single = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    key.signBatch(views.data(), count, macs.data());
+    double batch = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cerr << "[Sign] " << Sha256::implementation() << ", " << bytes << "-byte payloads: "
+         << static_cast<uint64_t>(count / single) << " sig/s single, "
+         << static_cast<uint64_t>(count / batch) << " sig/s batched" << endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "serve") {
+        // "-" skips an optional directory: no queue, no templates.
+        string queueDir = argc > 3 && string(argv[3]) != "-" ? argv[3] : "";
+        string templatesDir = argc > 4 && string(argv[4]) != "-" ? argv[4] : "";
+        string snapshotPath = argc > 5 && string(argv[5]) != "-" ? argv[5] : "";
+        // A standby address ships the queue there. "sync" waits for it on every
+        // batch and holds writes while it lags; "sync-fallback" carries on without it.
+        string replication = argc > 7 ? argv[7] : "async";
+        if (replication != "async" && replication != "sync" && replication != "sync-fallback") {
+            cerr << "replication mode must be async, sync or sync-fallback" << endl;
+            return 2;
+        }
+        return runApiServer(static_cast<uint16_t>(argc > 2 ? stoi(argv[2]) : 8080), queueDir, templatesDir,
+                            snapshotPath, argc > 6 ? argv[6] : "", replication != "async",
+                            replication == "sync-fallback");
+    }
+    if (argc > 1 && string(argv[1]) == "standby" && argc > 3) {
+        return runStandby(static_cast<uint16_t>(stoi(argv[2])), argv[3], argc > 4 ? argv[4] : "executors");
+    }
+    if (argc > 1 && string(argv[1]) == "import" && argc > 2) {
+        return runBulkImport(argv[2], argc > 3 ? argv[3] : "");
+    }
+    if (argc > 1 && string(argv[1]) == "execute" && argc > 2) {
+        return runQueueExecutor(argv[2], argc > 3 ? argv[3] : "executors",
+                                static_cast<uint32_t>(argc > 4 ? stoul(argv[4]) : 64));
+    }
+    if (argc > 1 && string(argv[1]) == "dead-letters" && argc > 2) {
+        return runListDeadLetters(argv[2], argc > 3 ? argv[3] : "");
+    }
+    if (argc > 1 && string(argv[1]) == "redrive" && argc > 2) {
+        return runRedrive(argv[2], argc > 3 ? argv[3] : "", argc > 4 ? stod(argv[4]) : 100);
+    }
+    if (argc > 1 && string(argv[1]) == "ingest") {
+        return runIngestServer(argc > 2 ? argv[2] : "/tmp/notifications.sock");
+    }
+    if (argc > 1 && string(argv[1]) == "http-bench") {
+        return runHttpBenchmark(argc > 2 ? stoul(argv[2]) : 1000000, argc > 3 ? stoul(argv[3]) : 4,
+                                argc > 4 ? stoul(argv[4]) : 32, static_cast<uint16_t>(argc > 5 ? stoi(argv[5]) : 0));
+    }
+    if (argc > 1 && string(argv[1]) == "parse-bench") {
+        return runParseBenchmark(argc > 2 ? stoul(argv[2]) : 1000000);
+    }
+    if (argc > 1 && string(argv[1]) == "gateway-bench") {
+        return runGatewayBenchmark(argc > 2 ? stoul(argv[2]) : 5000, argc > 3 ? stoul(argv[3]) : 100000,
+                                   argc > 4 ? stod(argv[4]) : 20000);
+    }
+    if (argc > 1 && string(argv[1]) == "push-bench") {
+        return runPushBenchmark(argc > 2 ? stoul(argv[2]) : 100000, argc > 3 ? stoul(argv[3]) : 4);
+    }
+    if (argc > 1 && string(argv[1]) == "replication-check") {
+        return runReplicationCheck(argc > 2 ? stoul(argv[2]) : 10000);
+    }
+    if (argc > 1 && string(argv[1]) == "webhook-check") {
+        return runWebhookCheck(argc > 2 ? stoul(argv[2]) : 200);
+    }
+    if (argc > 1 && string(argv[1]) == "sign-bench") {
+        return runSignBenchmark(argc > 2 ? stoul(argv[2]) : 1000000, argc > 3 ? stoul(argv[3]) : 200);
     }
-};
 
-int main() {
     auto& notificationService = NotificationService::getInstance();
 
     auto logger = make_shared<Logger>();